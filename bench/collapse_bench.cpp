@@ -0,0 +1,125 @@
+// Output of progress bars through the line_collapser of the agent, as when the
+// connection has a backlog: the bytes held back are taken at random points,
+// like sends when the queue drains. Checks that a terminal fed what is sent
+// ends up with the same screen as one fed everything, and prints what is left
+// of the bytes and the CPU it takes.
+//
+// collapse_bench [updates] [sends]
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <random>
+
+#include "../client/line_collapser.hpp"
+
+using namespace rterm;
+
+struct stream {
+  const char* name;
+  std::string bytes;
+};
+
+// curl: a plain status line rewritten after CR
+static std::string curlLike(int updates) {
+  std::string out = "  % Total    % Received % Xferd  Average Speed   Time    Time     Time  Current\r\n";
+  char line[128];
+  for (int i = 0; i < updates; ++i) {
+    snprintf(line, sizeof(line), "\r%3d  512M  %3d %4dM    0     0  %5dk      0  0:00:%02d  0:00:%02d --:--:-- %5dk", i * 100 / updates,
+             i * 100 / updates, i * 512 / updates, 9000 + i % 1000, i % 60, i % 60, 9000 + i % 997);
+    out += line;
+  }
+  return out + "\r\n";
+}
+
+// pip / rich: a colored bar, erase to the end of the line
+static std::string pipLike(int updates) {
+  std::string out = "Downloading torch-2.3.0-cp311-cp311-manylinux1_x86_64.whl (779.1 MB)\r\n";
+  for (int i = 0; i < updates; ++i) {
+    int done = i * 40 / updates;
+    out += "\r   \x1b[38;5;197m" + std::string((size_t)done, '-') + "\x1b[38;5;237m" + std::string((size_t)(40 - done), '-') +
+           "\x1b[0m \x1b[32m" + std::to_string(i * 779 / updates) + ".1/779.1 MB\x1b[0m \x1b[31m" + std::to_string(40 + i % 60) +
+           ".2 MB/s\x1b[0m eta \x1b[36m0:00:" + std::to_string(10 + i % 50) + "\x1b[0m\x1b[K";
+  }
+  return out + "\r\n";
+}
+
+// docker pull: several lines, each reached with a cursor up, which the collapser leaves alone
+static std::string dockerLike(int updates) {
+  std::string out;
+  const int layers = 5;
+  for (int l = 0; l < layers; ++l) out += "a1b2c3d4e5f" + std::to_string(l) + ": Pulling fs layer\r\n";
+  for (int i = 0; i < updates; ++i) {
+    int l = i % layers;
+    int up = layers - l;
+    out += "\x1b[" + std::to_string(up) + "A\x1b[2K\ra1b2c3d4e5f" + std::to_string(l) + ": Downloading [" + std::string((size_t)(i * 50 / updates), '=') +
+           ">]  " + std::to_string(i) + "kB/100MB\r\x1b[" + std::to_string(up) + "B";
+  }
+  return out;
+}
+
+// apt / wget style, a spinner and a shrinking line
+static std::string spinnerLike(int updates) {
+  std::string out;
+  const char spin[] = "|/-\\";
+  for (int i = 0; i < updates; ++i) {
+    out += "\r";
+    out += spin[i % 4];
+    out += " Reading package lists... " + std::to_string(i * 100 / updates) + "%";
+    if (i % 100 == 99) out += "\r\n";
+  }
+  return out + "\r\nDone\r\n";
+}
+
+static bool sameScreen(const screen& a, const screen& b) {
+  for (int y = 0; y < a.rows(); ++y) {
+    for (int x = 0; x < a.cols(); ++x) {
+      if (a.at(x, y) != b.at(x, y)) return false;
+    }
+  }
+  return a.cursor_x() == b.cursor_x() && a.cursor_y() == b.cursor_y() && a.pen() == b.pen();
+}
+
+int main(int argc, char* argv[]) {
+  int updates = argc > 1 ? atoi(argv[1]) : 100000;
+  size_t sends = argc > 2 ? strtoul(argv[2], nullptr, 10) : 200;
+
+  stream streams[] = {
+      {"curl", curlLike(updates)},
+      {"pip", pipLike(updates)},
+      {"docker", dockerLike(updates)},
+      {"spinner", spinnerLike(updates)},
+  };
+  std::mt19937 rng(1);
+  bool ok = true;
+  for (auto& s : streams) {
+    // PTY reads of up to 4 KB, taken after about size / sends bytes
+    line_collapser collapser;
+    std::string sent;
+    std::clock_t cpu = std::clock();
+    std::uniform_int_distribution<size_t> read(1, 4096);
+    size_t every = std::max<size_t>(1, s.bytes.size() / sends);
+    size_t held = 0;
+    for (size_t pos = 0; pos < s.bytes.size();) {
+      size_t n = std::min(read(rng), s.bytes.size() - pos);
+      collapser.append(s.bytes.data() + pos, n);
+      pos += n;
+      held += n;
+      if (held >= every) {
+        sent += collapser.take();
+        held = 0;
+      }
+    }
+    sent += collapser.take();
+    double seconds = (double)(std::clock() - cpu) / CLOCKS_PER_SEC;
+
+    screen all(pty_cols, pty_rows), squeezed(pty_cols, pty_rows);
+    all.feed(s.bytes);
+    squeezed.feed(sent);
+    bool same = sameScreen(all, squeezed);
+    ok = ok && same;
+    printf("%-8s: %9zu bytes, %8zu sent (%5.1f%%) in %3zu sends, %7.1f MB/s, screen %s\n", s.name, s.bytes.size(), sent.size(),
+           100.0 * sent.size() / s.bytes.size(), sends, s.bytes.size() / 1e6 / seconds, same ? "same" : "DIFFERS");
+  }
+  return ok ? 0 : 1;
+}
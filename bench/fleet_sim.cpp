@@ -0,0 +1,121 @@
+// Many agents and one hub inside one process, to see how the hub copes with
+// a fleet without needing the machines. Agents answer exec with a canned
+// output instead of forking, so this measures the hub and the protocol.
+//
+// fleet_sim [count] [fanout] [port] [shards] [lines]: with shards > 1 the hub
+// is a sharded_hub and the agents run on as many threads of their own, every
+// agent streams lines of log output.
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "../client/agent.hpp"
+#include "../server/fleet.hpp"
+#include "../server/shard.hpp"
+
+using namespace rterm;
+
+class sim_exec : public channel {
+ public:
+  sim_exec(agent& agent, uint32_t id, int kind, size_t lines) : agent_(agent), id_(id), kind_(kind), lines_(lines) {}
+
+  void on_frame(const frame& f) override {
+    if (f.type != msg::exec) return;
+    std::string line = "output of kind " + std::to_string(kind_) + ", compiling something with a long enough command line\n";
+    for (size_t i = 0; i < lines_; ++i) {
+      agent_.send(msg::exec_out, id_, line);
+    }
+    agent_.send(pack_i32(msg::exit, id_, kind_ == 2 ? 1 : 0));
+    agent_.remove(id_);
+  }
+
+ private:
+  agent& agent_;
+  uint32_t id_;
+  int kind_;
+  size_t lines_;
+};
+
+int main(int argc, char* argv[]) {
+  size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000;
+  size_t fanout = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+  uint16_t port = argc > 3 ? (uint16_t)strtoul(argv[3], nullptr, 10) : 16666;
+  size_t shards = argc > 4 ? strtoul(argv[4], nullptr, 10) : 1;
+  size_t lines = argc > 5 ? strtoul(argv[5], nullptr, 10) : 1;
+
+  // every agent costs two descriptors in this process
+  rlimit rl{};
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  asio::io_context io_context;
+  sharded_hub server(io_context, port, shards);
+  server.start();
+
+  // agents share the hub io_context, or run on their own threads next to the shards
+  std::vector<std::unique_ptr<asio::io_context>> agent_contexts;
+  for (size_t i = 1; i < shards; ++i) {
+    agent_contexts.emplace_back(new asio::io_context(1));
+  }
+  std::vector<std::unique_ptr<agent>> agents;
+  for (size_t i = 0; i < count; ++i) {
+    auto& context = agent_contexts.empty() ? io_context : *agent_contexts[i % agent_contexts.size()];
+    auto a = std::make_unique<agent>(context, "127.0.0.1", port, "sim" + std::to_string(i));
+    auto* raw = a.get();
+    // a fleet is remote, and 5 descriptors an agent for an shm_link would not fit
+    raw->use_local = false;
+    int kind = (int)(i * 3 / count);
+    a->handle(msg::exec, [raw, kind, lines](uint32_t id) {
+      return std::make_shared<sim_exec>(*raw, id, kind, lines);
+    });
+    a->start();
+    agents.push_back(std::move(a));
+  }
+  std::vector<std::thread> agent_threads;
+  for (auto& context : agent_contexts) {
+    auto* c = context.get();
+    agent_threads.emplace_back([c] {
+      asio::executor_work_guard<asio::io_context::executor_type> work(c->get_executor());
+      c->run();
+    });
+  }
+
+  using clock = std::chrono::steady_clock;
+  auto t0 = clock::now();
+  auto t1 = t0;
+  size_t ready = 0;
+  std::unique_ptr<fleet_run> run;
+  server.on_agent = [&](const std::shared_ptr<agent_session>&) {
+    if (++ready != count) return;
+    t1 = clock::now();
+    fleet_options options;
+    options.command = "true";
+    options.fanout = fanout;
+    options.gather = true;
+    run = std::make_unique<fleet_run>(server.agents(), options);
+    run->on_done = [&] {
+      io_context.stop();
+    };
+    run->start();
+  };
+  io_context.run();
+  auto t2 = clock::now();
+  server.stop();
+  for (auto& context : agent_contexts) {
+    context->stop();
+  }
+  for (auto& t : agent_threads) {
+    t.join();
+  }
+
+  auto ms = [](clock::duration d) {
+    return (long long)std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+  };
+  printf("agents: %zu, shards: %zu, fanout: %zu, connect: %lld ms, run: %lld ms, status: %d\n", count, shards, fanout, ms(t1 - t0), ms(t2 - t1),
+         run ? run->status() : -1);
+  return 0;
+}
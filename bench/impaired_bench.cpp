@@ -0,0 +1,168 @@
+// Sessions over impaired networks: a hub, an impair_proxy in front of it and
+// an agent dialing the proxy, all in this process on one thread. For each
+// scenario and transport, keystroke latency (a byte echoed by the agent, one
+// at a time) and the time to stream a burst of command output. The proxy is
+// seeded, so a scenario drops and delays the same way in every run and the
+// numbers of two builds compare.
+//
+// impaired_bench [scenario|all|delay_ms,jitter_ms,rate_kbit,loss_percent] [tcp|udp|both] [keystrokes] [output_kb] [port]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include "../client/agent.hpp"
+#include "../server/hub.hpp"
+#include "../server/impair_proxy.hpp"
+
+using namespace rterm;
+
+using clock_type = std::chrono::steady_clock;
+
+struct scenario {
+  const char* name;
+  impairment how;  // each way
+};
+
+static const scenario scenarios[] = {
+    {"lan", {0.5, 0.1, 0, 0}},
+    {"wifi", {5, 3, 50000, 0.005}},
+    {"dsl", {20, 2, 8000, 0.002}},
+    {"mobile", {60, 20, 4000, 0.02}},
+    {"lossy", {30, 5, 10000, 0.05}},
+    {"satellite", {300, 10, 10000, 0.005}},
+};
+
+/// echoes keystrokes, or streams output when opened with "output:<bytes>"
+class echo_pty : public channel, public std::enable_shared_from_this<echo_pty> {
+ public:
+  echo_pty(agent& agent, uint32_t id) : agent_(agent), id_(id) {}
+
+  void on_frame(const frame& f) override {
+    if (f.type == msg::pty_open && f.body().compare(0, 7, "output:") == 0) {
+      left_ = strtoul(f.body().c_str() + 7, nullptr, 10);
+      line_ = "\x1b[32m[ 42%]\x1b[0m Building CXX object src/CMakeFiles/module.dir/file.cpp.o\r\n";
+      pump();
+    } else if (f.type == msg::pty_data) {
+      agent_.send(msg::pty_data, id_, f.data, f.size);
+    }
+  }
+
+ private:
+  void pump() {
+    while (left_ > 0 && agent_.writable()) {
+      size_t n = std::min(left_, line_.size());
+      agent_.send(msg::pty_data, id_, line_.data(), n);
+      left_ -= n;
+    }
+    if (left_ == 0) return;
+    auto self = shared_from_this();
+    agent_.when_writable([self] {
+      self->pump();
+    });
+  }
+
+  agent& agent_;
+  uint32_t id_;
+  size_t left_ = 0;
+  std::string line_;
+};
+
+static void runScenario(const scenario& s, const std::string& transportName, size_t keystrokes, size_t output, uint16_t port) {
+  asio::io_context io_context(1);
+  hub server(io_context, port);
+  server.serve_udp(transportName == "udp");
+  impair_proxy proxy(io_context, (uint16_t)(port + 1), "127.0.0.1", std::to_string(port), s.how, s.how);
+  agent a(io_context, "127.0.0.1", (uint16_t)(port + 1), "bench");
+  if (transportName == "udp") {
+    a.use_transport(std::unique_ptr<transport>(new udp_transport(io_context, "127.0.0.1", (uint16_t)(port + 1))));
+  } else {
+    a.use_transport(std::unique_ptr<transport>(new tcp_transport(io_context, "127.0.0.1", (uint16_t)(port + 1))));
+  }
+  a.handle(msg::pty_open, [&](uint32_t id) {
+    return std::make_shared<echo_pty>(a, id);
+  });
+
+  std::vector<double> rtts;
+  rtts.reserve(keystrokes);
+  size_t received = 0;
+  clock_type::time_point sentAt, outputStart, outputEnd;
+  bool done = false;
+  std::shared_ptr<agent_session> session;
+  uint32_t echo = 0;
+
+  server.on_agent = [&](const std::shared_ptr<agent_session>& as) {
+    if (session) return;
+    session = as;
+    auto output_phase = [&] {
+      outputStart = clock_type::now();
+      session->open(msg::pty_open, "output:" + std::to_string(output), [&](const frame& f) {
+        if (f.type != msg::pty_data) return;
+        received += f.size;
+        if (received < output) return;
+        outputEnd = clock_type::now();
+        done = true;
+        io_context.stop();
+      });
+    };
+    echo = as->open(msg::pty_open, "", [&, output_phase](const frame& f) {
+      if (f.type != msg::pty_data) return;
+      rtts.push_back(std::chrono::duration<double, std::milli>(clock_type::now() - sentAt).count());
+      if (rtts.size() == keystrokes) return output_phase();
+      sentAt = clock_type::now();
+      session->send(msg::pty_data, echo, "k");
+    });
+    sentAt = clock_type::now();
+    session->send(msg::pty_data, echo, "k");
+  };
+
+  asio::steady_timer deadline(io_context);
+  deadline.expires_after(std::chrono::seconds(120));
+  deadline.async_wait([&](const std::error_code& ec) {
+    if (!ec) io_context.stop();
+  });
+  server.start();
+  proxy.start();
+  a.start();
+  io_context.run();
+
+  char label[64];
+  snprintf(label, sizeof(label), "%s/%s", s.name, transportName.c_str());
+  if (!done) {
+    printf("%-16s: timed out after %zu keystrokes and %zu bytes of output\n", label, rtts.size(), received);
+    return;
+  }
+  std::sort(rtts.begin(), rtts.end());
+  double seconds = std::chrono::duration<double>(outputEnd - outputStart).count();
+  printf("%-16s: keystroke rtt p50 %7.1f ms, p99 %7.1f ms, max %7.1f ms; %zu KB of output in %6.2f s, %7.0f KB/s; %zu impaired\n", label,
+         rtts[rtts.size() / 2], rtts[rtts.size() * 99 / 100], rtts.back(), output / 1024, seconds, output / 1024 / seconds, proxy.impaired());
+}
+
+int main(int argc, char* argv[]) {
+  std::string which = argc > 1 ? argv[1] : "all";
+  std::string transportName = argc > 2 ? argv[2] : "both";
+  size_t keystrokes = std::max<size_t>(1, argc > 3 ? strtoul(argv[3], nullptr, 10) : 50);
+  size_t output = std::max<size_t>(1, argc > 4 ? strtoul(argv[4], nullptr, 10) : 512) * 1024;
+  uint16_t port = argc > 5 ? (uint16_t)strtoul(argv[5], nullptr, 10) : 19666;
+
+  std::vector<scenario> run;
+  for (auto& s : scenarios) {
+    if (which == "all" || which == s.name) run.push_back(s);
+  }
+  if (run.empty()) {
+    // delay_ms,jitter_ms,rate_kbit,loss_percent
+    scenario custom{"custom", {}};
+    if (sscanf(which.c_str(), "%lf,%lf,%lf,%lf", &custom.how.delay_ms, &custom.how.jitter_ms, &custom.how.rate_kbit, &custom.how.loss) < 1) {
+      printf("%s: no such scenario\n", which.c_str());
+      return 2;
+    }
+    custom.how.loss /= 100;
+    run.push_back(custom);
+  }
+  for (auto& s : run) {
+    for (const char* t : {"tcp", "udp"}) {
+      if (transportName == "both" || transportName == t) runScenario(s, t, keystrokes, output, port);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,147 @@
+// Pipe mode, the local stdin streamed into a remote command, against plain
+// loopback TCP. A producer thread writes into a pipe, the hub in this process
+// reads it with pipe_sender and an agent, a forked process, writes it into
+// `cat > /dev/null`. With 1 KB reads, what the keystroke path of the
+// interactive hub does, and with the 256 KB of pipe mode. The TCP line is the
+// same pipe relayed into a loopback socket whose far end, a forked process,
+// only reads.
+//
+// pipe_bench [total_mb] [port]
+
+#include <sys/wait.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <thread>
+
+#include "../client/agent.hpp"
+#include "../client/exec_channel.hpp"
+#include "../server/pipe.hpp"
+
+using namespace rterm;
+
+using clock_type = std::chrono::steady_clock;
+
+/// a thread writing size bytes into a new pipe, returns the read end
+static int produce(size_t size, std::thread& producer) {
+  int fds[2];
+  if (pipe(fds) != 0) return -1;
+  producer = std::thread([fd = fds[1], size] {
+    std::string chunk(1024 * 1024, 'x');
+    for (size_t left = size; left > 0;) {
+      ssize_t n = write(fd, chunk.data(), std::min(left, chunk.size()));
+      if (n <= 0) break;
+      left -= (size_t)n;
+    }
+    ::close(fd);
+  });
+  return fds[0];
+}
+
+static pid_t spawnAgent(uint16_t port) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+  asio::io_context io_context;
+  child_reaper reaper(io_context);
+  agent a(io_context, "127.0.0.1", port, "bench");
+  a.use_local = false;  // TCP, as against the TCP line
+  a.handle(msg::pipe, [&](uint32_t id) {
+    return std::make_shared<exec_channel>(io_context, a, reaper, id);
+  });
+  a.on_connect = [&] {
+    a.on_connect = nullptr;
+    a.retry_min_ms = 60000;
+  };
+  a.start();
+  io_context.run();
+  _exit(0);
+}
+
+static double runPipe(size_t total, size_t readSize, uint16_t port) {
+  asio::io_context io_context(1);
+  hub server(io_context, port);
+  pid_t child = spawnAgent(port);
+  std::thread producer;
+  std::unique_ptr<pipe_sender> sender;
+  clock_type::time_point start, end;
+  int status = -1;
+
+  server.on_agent = [&](const std::shared_ptr<agent_session>& as) {
+    uint32_t channel = as->open(msg::pipe, "cat > /dev/null", [&](const frame& f) {
+      switch (f.type) {
+        case msg::exec_ack:
+          if (f.size >= 4) sender->on_ack(get_u32(f.data));
+          break;
+        case msg::exit:
+          end = clock_type::now();
+          status = f.size >= 4 ? (int32_t)get_u32(f.data) : 255;
+          io_context.stop();
+          break;
+        case msg::close:
+          io_context.stop();
+          break;
+        default:
+          break;
+      }
+    });
+    start = clock_type::now();
+    int fd = produce(total, producer);
+    sender = std::make_unique<pipe_sender>(io_context, as, channel, fd, readSize);
+    sender->start();
+  };
+  server.start();
+  io_context.run();
+  sender.reset();
+  if (producer.joinable()) producer.join();
+  kill(child, SIGTERM);
+  waitpid(child, nullptr, 0);
+  if (status != 0) return 0;
+  return total / 1e6 / std::chrono::duration<double>(end - start).count();
+}
+
+static double runTcp(size_t total, uint16_t port) {
+  asio::io_context io_context(1);
+  asio::ip::tcp::acceptor acceptor(io_context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port));
+  pid_t child = fork();
+  if (child == 0) {
+    asio::ip::tcp::socket socket(io_context);
+    acceptor.accept(socket);
+    std::string buffer(256 * 1024, '\0');
+    while (::read(socket.native_handle(), &buffer[0], buffer.size()) > 0) {
+    }
+    _exit(0);
+  }
+  acceptor.close();
+  asio::ip::tcp::socket socket(io_context);
+  socket.connect(asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port));
+  std::thread producer;
+  auto start = clock_type::now();
+  int fd = produce(total, producer);
+  std::string buffer(256 * 1024, '\0');
+  for (ssize_t n; (n = ::read(fd, &buffer[0], buffer.size())) > 0;) {
+    std::error_code ec;
+    asio::write(socket, asio::buffer(buffer.data(), (size_t)n), ec);
+  }
+  socket.shutdown(asio::ip::tcp::socket::shutdown_send);
+  waitpid(child, nullptr, 0);
+  auto end = clock_type::now();
+  producer.join();
+  ::close(fd);
+  return total / 1e6 / std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char* argv[]) {
+  size_t total = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 1024) * 1024 * 1024;
+  uint16_t port = argc > 2 ? (uint16_t)strtoul(argv[2], nullptr, 10) : 17667;
+
+  signal(SIGPIPE, SIG_IGN);
+  printf("%zu MB each\n", total >> 20);
+  double tcp = runTcp(total, port);
+  printf("loopback tcp     : %6.0f MB/s\n", tcp);
+  for (size_t readSize : {(size_t)1024, (size_t)256 * 1024}) {
+    double rate = runPipe(total, readSize, port);
+    printf("pipe, %3zu KB reads: %6.0f MB/s, %3.0f%% of tcp\n", readSize / 1024, rate, 100 * rate / tcp);
+  }
+  return 0;
+}
@@ -0,0 +1,211 @@
+// The interactive shell of a local agent, with its PTY relayed through the
+// agent as pty_data frames and with the PTY master passed to the hub, which
+// then reads and writes it directly. Measured are keystroke latency (a byte
+// echoed by cat in raw mode, one at a time) and the throughput of command
+// output. The hub is in this process, the agent is a forked one.
+//
+// pty_fd_bench [keystrokes] [output_mb] [relay|direct] [shm|unix] [port]
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+
+#include "../client/pty_channel.hpp"
+#include "../server/hub.hpp"
+
+using namespace rterm;
+
+using clock_type = std::chrono::steady_clock;
+
+static double cpuSeconds(const rusage& ru) {
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static pid_t spawnAgent(uint16_t port, bool useShm) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+  asio::io_context io_context;
+  child_reaper reaper(io_context);
+  agent a(io_context, "127.0.0.1", port, "bench");
+  a.use_shm = useShm;
+  a.retry_min_ms = 20;
+  a.retry_max_ms = 100;
+  a.handle(msg::pty_open, [&](uint32_t id) {
+    return std::make_shared<pty_channel>(io_context, a, reaper, id);
+  });
+  // the hub going away ends it, not a reconnect
+  a.on_connect = [&] {
+    a.on_connect = nullptr;
+    a.retry_min_ms = 60000;
+  };
+  a.start();
+  io_context.run();
+  _exit(0);
+}
+
+static void runMode(bool passFd, bool useShm, size_t keystrokes, size_t output, uint16_t port) {
+  const char* name = passFd ? (useShm ? "direct/shm" : "direct/unix") : (useShm ? "relay/shm" : "relay/unix");
+  asio::io_context io_context(1);
+  hub server(io_context, port);
+  pid_t child = spawnAgent(port, useShm);
+
+  std::shared_ptr<agent_session> session;
+  uint32_t channel = 0;
+  asio::posix::stream_descriptor direct(io_context);
+  std::string directBuffer(64 * 1024, '\0');
+  bool passed = false;
+
+  // input to the shell, through the agent or straight into the PTY
+  auto type = [&](const std::string& keys) {
+    if (direct.is_open()) {
+      std::error_code ec;
+      asio::write(direct, asio::buffer(keys), ec);
+    } else {
+      session->send(msg::pty_data, channel, keys);
+    }
+  };
+
+  enum { settling, bulk, entering_cat, typing, done } phase = settling;
+  asio::steady_timer settle(io_context);
+  size_t bulkBytes = 0;
+  std::string tail;
+  clock_type::time_point bulkStart, bulkEnd, sentAt;
+  std::vector<double> rtts;
+  rtts.reserve(keystrokes);
+
+  std::function<void()> settled = [&] {
+    if (phase == settling) {
+      phase = bulk;
+      bulkStart = clock_type::now();
+      type("stty -echo; head -c " + std::to_string(output) + " /dev/zero | tr '\\0' x; echo; echo END-$((40+2))\n");
+    } else if (phase == entering_cat) {
+      phase = typing;
+      sentAt = clock_type::now();
+      type("k");
+    }
+  };
+  // the shell has said what it had to say when it is quiet for a while
+  auto quietLater = [&] {
+    settle.expires_after(std::chrono::milliseconds(300));
+    settle.async_wait([&](const std::error_code& ec) {
+      if (!ec) settled();
+    });
+  };
+
+  auto output_of_shell = [&](const char* data, size_t size) {
+    switch (phase) {
+      case settling:
+      case entering_cat:
+        quietLater();
+        break;
+      case bulk:
+        bulkBytes += size;
+        tail.append(data, size);
+        if (tail.find("END-42") != std::string::npos) {
+          bulkEnd = clock_type::now();
+          phase = entering_cat;
+          type("stty raw; exec cat\n");
+          quietLater();
+        }
+        if (tail.size() > 16) tail.erase(0, tail.size() - 16);
+        break;
+      case typing:
+        rtts.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - sentAt).count());
+        if (rtts.size() == keystrokes) {
+          phase = done;
+          io_context.stop();
+          return;
+        }
+        sentAt = clock_type::now();
+        type("k");
+        break;
+      case done:
+        break;
+    }
+  };
+
+  std::function<void()> readDirect = [&] {
+    direct.async_read_some(asio::buffer(directBuffer), [&](const std::error_code& ec, std::size_t length) {
+      if (ec) return;
+      output_of_shell(directBuffer.data(), length);
+      readDirect();
+    });
+  };
+
+  server.on_agent = [&](const std::shared_ptr<agent_session>& as) {
+    session = as;
+    channel = as->open(msg::pty_open, passFd ? "fd" : "", [&](const frame& f) {
+      switch (f.type) {
+        case msg::pty_data:
+          output_of_shell(f.data, f.size);
+          break;
+        case msg::pty_fd: {
+          int fd = (int)get_u32(f.data);
+          if (fd < 0) break;
+          passed = true;
+          direct.assign(fd);
+          readDirect();
+          break;
+        }
+        case msg::close:
+          io_context.stop();
+          break;
+        default:
+          break;
+      }
+    });
+  };
+  server.start();
+
+  rusage self0{};
+  getrusage(RUSAGE_SELF, &self0);
+  io_context.run();
+  rusage self{};
+  getrusage(RUSAGE_SELF, &self);
+
+  std::error_code ec;
+  direct.close(ec);
+  kill(child, SIGTERM);
+  rusage agentUsage{};
+  int status = 0;
+  wait4(child, &status, 0, &agentUsage);
+
+  if (phase != done) {
+    printf("%s: the shell went away\n", name);
+    return;
+  }
+  if (passFd && !passed) {
+    printf("%s: the PTY was not passed\n", name);
+    return;
+  }
+  std::sort(rtts.begin(), rtts.end());
+  double sum = 0;
+  for (double r : rtts) {
+    sum += r;
+  }
+  double mb = (double)bulkBytes / (1024 * 1024);
+  double seconds = std::chrono::duration<double>(bulkEnd - bulkStart).count();
+  printf("%s: keystroke rtt avg %.1f us, p50 %.1f us, p99 %.1f us; %.0f MB of output in %.2f s, %.0f MB/s; cpu hub %.2f s, agent %.2f s\n",
+         name, sum / rtts.size(), rtts[rtts.size() / 2], rtts[rtts.size() * 99 / 100], mb, seconds, mb / seconds, cpuSeconds(self) - cpuSeconds(self0),
+         cpuSeconds(agentUsage));
+}
+
+int main(int argc, char* argv[]) {
+  size_t keystrokes = std::max<size_t>(1, argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000);
+  size_t output = (argc > 2 ? strtoul(argv[2], nullptr, 10) : 256) * 1024 * 1024;
+  std::string mode = argc > 3 ? argv[3] : "";
+  std::string transport = argc > 4 ? argv[4] : "";
+  uint16_t port = argc > 5 ? (uint16_t)strtoul(argv[5], nullptr, 10) : 17666;
+
+  signal(SIGPIPE, SIG_IGN);
+  for (bool useShm : {false, true}) {
+    if (!transport.empty() && transport != (useShm ? "shm" : "unix")) continue;
+    if (mode.empty() || mode == "relay") runMode(false, useShm, keystrokes, output, port);
+    if (mode.empty() || mode == "direct") runMode(true, useShm, keystrokes, output, port);
+  }
+  return 0;
+}
@@ -0,0 +1,145 @@
+// A fleet losing its hub at once: count agents in this process connect to a
+// terminal_server run, which exits when the command is done on all of them,
+// and a second one is started right away. Reported is how long the fleet
+// takes to be back and what that cost the new hub in CPU.
+//
+// reconnect_storm [count] [admit_rate] [retry_min_ms] [retry_max_ms] [terminal_server]
+//
+// admit_rate goes to `run -a`, 0 for no limit. retry_min_ms 0 reconnects
+// right away, without backoff.
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <chrono>
+#include <cstdio>
+
+#include "../client/agent.hpp"
+
+using namespace rterm;
+
+extern char** environ;
+
+class sim_exec : public channel {
+ public:
+  sim_exec(agent& agent, uint32_t id) : agent_(agent), id_(id) {}
+
+  void on_frame(const frame& f) override {
+    if (f.type != msg::exec) return;
+    agent_.send(pack_i32(msg::exit, id_, 0));
+    agent_.remove(id_);
+  }
+
+ private:
+  agent& agent_;
+  uint32_t id_;
+};
+
+static pid_t spawnHub(const std::string& path, size_t count, const std::string& admitRate) {
+  std::string n = std::to_string(count);
+  const char* argv[] = {path.c_str(), "run", "-n", n.c_str(), "-t", "600000", "-a", admitRate.c_str(), "true", nullptr};
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+  pid_t pid = -1;
+  if (posix_spawn(&pid, path.c_str(), &actions, nullptr, (char* const*)argv, environ) != 0) {
+    perror(path.c_str());
+    exit(1);
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  return pid;
+}
+
+static double cpuSeconds(const rusage& ru) {
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+  size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000;
+  std::string admitRate = argc > 2 ? argv[2] : "2000";
+  uint32_t retryMin = argc > 3 ? (uint32_t)strtoul(argv[3], nullptr, 10) : 500;
+  uint32_t retryMax = argc > 4 ? (uint32_t)strtoul(argv[4], nullptr, 10) : 30000;
+  std::string hubPath;
+  if (argc > 5) {
+    hubPath = argv[5];
+  } else {
+    std::string self = argv[0];
+    auto slash = self.rfind('/');
+    hubPath = (slash == std::string::npos ? std::string(".") : self.substr(0, slash)) + "/../server/terminal_server";
+  }
+
+  rlimit rl{};
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  asio::io_context io_context;
+  std::vector<std::unique_ptr<agent>> agents;
+  size_t connects = 0;
+  for (size_t i = 0; i < count; ++i) {
+    auto a = std::make_unique<agent>(io_context, "127.0.0.1", 6666, "storm" + std::to_string(i));
+    auto* raw = a.get();
+    raw->retry_min_ms = retryMin;
+    raw->retry_max_ms = retryMax;
+    // a fleet is remote, and 5 descriptors an agent for an shm_link would not fit
+    raw->use_local = false;
+    raw->handle(msg::exec, [raw](uint32_t id) {
+      return std::make_shared<sim_exec>(*raw, id);
+    });
+    raw->on_connect = [&connects] {
+      ++connects;
+    };
+    agents.push_back(std::move(a));
+  }
+
+  using clock = std::chrono::steady_clock;
+  pid_t hub = spawnHub(hubPath, count, admitRate);
+  bool restarted = false;
+  clock::time_point t0;
+  rusage self0{};
+  size_t connects0 = 0;
+  int status = 0;
+
+  // the hubs are watched by polling, agents and hub run concurrently
+  asio::steady_timer poll(io_context);
+  std::function<void()> watch = [&] {
+    poll.expires_after(std::chrono::milliseconds(5));
+    poll.async_wait([&](const std::error_code& ec) {
+      if (ec) return;
+      rusage ru{};
+      int wstatus = 0;
+      if (wait4(hub, &wstatus, WNOHANG, &ru) != hub) return watch();
+      if (!restarted) {
+        // every agent has lost the hub this very moment
+        restarted = true;
+        t0 = clock::now();
+        getrusage(RUSAGE_SELF, &self0);
+        connects0 = connects;
+        hub = spawnHub(hubPath, count, admitRate);
+        return watch();
+      }
+      auto elapsed = std::chrono::duration<double>(clock::now() - t0).count();
+      rusage self{};
+      getrusage(RUSAGE_SELF, &self);
+      status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+      printf("agents: %zu, admit_rate: %s, retry: %u..%u ms, back in %.2f s, hub cpu %.2f s, agents cpu %.2f s, connects %zu, status: %d\n",
+             count, admitRate.c_str(), retryMin, retryMax, elapsed, cpuSeconds(ru), cpuSeconds(self) - cpuSeconds(self0), connects - connects0,
+             status);
+      io_context.stop();
+    });
+  };
+
+  // let the hub listen first, the first round is not measured
+  poll.expires_after(std::chrono::milliseconds(200));
+  poll.async_wait([&](const std::error_code&) {
+    for (auto& a : agents) {
+      a->start();
+    }
+    watch();
+  });
+  io_context.run();
+  return status;
+}
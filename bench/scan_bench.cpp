@@ -0,0 +1,107 @@
+// The byte scanner of byte_scan.hpp, each implementation this CPU has: over
+// plain text without a control, which is the speed of the scan itself, and
+// over terminal output, colored and with a line feed every line, where it
+// stops at every sequence. Checks each against the scalar one first, at all
+// alignments and lengths around the vector sizes.
+//
+// scan_bench [size_kb] [rounds]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "byte_scan.hpp"
+
+using namespace rterm;
+
+using scanner = size_t (*)(const char*, size_t);
+
+struct impl {
+  const char* name;
+  scanner control;
+  scanner special;
+};
+
+// every stop of f in data, as a parser walking the runs between them would
+static size_t stops(scanner f, const std::string& data) {
+  size_t n = 0;
+  for (size_t pos = f(data.data(), data.size()); pos < data.size(); pos += 1 + f(data.data() + pos + 1, data.size() - pos - 1)) ++n;
+  return n;
+}
+
+static bool check(const impl& m, std::mt19937& rng) {
+  std::string buffer(256, 'a');
+  for (int round = 0; round < 20000; ++round) {
+    for (auto& c : buffer) c = (char)(' ' + rng() % 95);
+    size_t at = rng() % 64;
+    size_t size = rng() % 192;
+    // nothing, or one of the bytes at a random place, or a few
+    for (int k = (int)(rng() % 4); k > 0; --k) {
+      static const uint8_t picks[] = {0x00, 0x03, 0x07, 0x0a, 0x0d, 0x1b, 0x1f, 0x7f, 0x80, 0xc3, 0xff, 0x20, 0x7e};
+      buffer[at + rng() % (size + 1)] = (char)picks[rng() % sizeof(picks)];
+    }
+    if (m.control(&buffer[at], size) != scan::scalar<false>(&buffer[at], size)) return false;
+    if (m.special(&buffer[at], size) != scan::scalar<true>(&buffer[at], size)) return false;
+  }
+  return true;
+}
+
+static double gbPerSecond(scanner f, const std::string& data, int rounds, bool walk) {
+  size_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; ++r) sink += walk ? stops(f, data) : f(data.data(), data.size());
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (sink == 1) printf(" ");  // keep the loop
+  return (double)data.size() * rounds / 1e9 / seconds;
+}
+
+int main(int argc, char* argv[]) {
+  size_t size = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 64) * 1024;
+  int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+
+  std::mt19937 rng(7);
+  std::string plain(size, ' ');
+  for (auto& c : plain) c = (char)(' ' + rng() % 95);
+
+  // like ls --color or a compiler: colored words, a line feed every 40 to 120 columns
+  std::string output;
+  while (output.size() < size) {
+    size_t line = 40 + rng() % 80;
+    for (size_t col = 0; col < line;) {
+      size_t word = 1 + rng() % 12;
+      if (rng() % 4 == 0) output += "\x1b[01;3" + std::to_string(1 + rng() % 6) + "m";
+      for (size_t i = 0; i < word; ++i) output += (char)('a' + rng() % 26);
+      if (output.back() != 'm' && rng() % 4 == 0) output += "\x1b[0m";
+      output += ' ';
+      col += word + 1;
+    }
+    output += "\r\n";
+  }
+  output.resize(size);
+
+  std::vector<impl> impls = {{"scalar", scan::scalar<false>, scan::scalar<true>}};
+#ifdef __SSE2__
+  impls.push_back({"sse2", scan::sse2<false>, scan::sse2<true>});
+#endif
+#ifdef RTERM_SCAN_AVX2
+  if (scan::has_avx2()) impls.push_back({"avx2", scan::avx2<false>, scan::avx2<true>});
+#endif
+  impls.push_back({"find", find_control, find_special});
+
+  printf("%zu KB, %d rounds, %zu stops in the output\n", size / 1024, rounds, stops(find_special, output));
+  bool ok = true;
+  for (auto& m : impls) {
+    if (!check(m, rng)) {
+      fprintf(stderr, "%s differs from scalar\n", m.name);
+      ok = false;
+      continue;
+    }
+    // the walk over output stops often, fewer rounds
+    printf("%-7s: plain control %6.1f GB/s, special %6.1f GB/s; output walk %5.2f GB/s\n", m.name, gbPerSecond(m.control, plain, rounds, false),
+           gbPerSecond(m.special, plain, rounds, false), gbPerSecond(m.special, output, std::max(1, rounds / 20), true));
+  }
+  return ok ? 0 : 1;
+}
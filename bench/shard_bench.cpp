@@ -0,0 +1,134 @@
+// Output throughput of a fleet as the hub gets more shards: every agent
+// streams lines of build log through a fleet_run printing them, prefixed, to
+// /dev/null. The lines are parsed and split on the shard of their session,
+// only the exits go through the user io_context. The agents run on as many
+// threads as the hub has shards.
+//
+// On a machine with fewer cores than shards the threads only take turns,
+// expect a flat line there.
+//
+// shard_bench [count] [lines] [max_shards] [port]
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "../client/agent.hpp"
+#include "../server/fleet.hpp"
+#include "../server/shard.hpp"
+
+using namespace rterm;
+
+static const std::string logLine = "[ 42%] Building CXX object server/CMakeFiles/terminal_server.dir/main.cpp.o\n";
+
+class log_exec : public channel {
+ public:
+  log_exec(agent& agent, uint32_t id, size_t lines) : agent_(agent), id_(id), lines_(lines) {}
+
+  void on_frame(const frame& f) override {
+    if (f.type != msg::exec) return;
+    for (size_t i = 0; i < lines_; ++i) {
+      agent_.send(msg::exec_out, id_, logLine);
+    }
+    agent_.send(pack_i32(msg::exit, id_, 0));
+    agent_.remove(id_);
+  }
+
+ private:
+  agent& agent_;
+  uint32_t id_;
+  size_t lines_;
+};
+
+/// seconds from the start of the run to its end, 0 if it failed
+static double runFleet(size_t shards, size_t count, size_t lines, uint16_t port) {
+  std::vector<std::unique_ptr<asio::io_context>> agentContexts;
+  for (size_t i = 0; i < shards; ++i) {
+    agentContexts.emplace_back(new asio::io_context(1));
+  }
+  asio::io_context io_context;
+  sharded_hub server(io_context, port, shards);
+  server.start();
+
+  std::vector<std::unique_ptr<agent>> agents;
+  for (size_t i = 0; i < count; ++i) {
+    auto a = std::make_unique<agent>(*agentContexts[i % shards], "127.0.0.1", port, "log" + std::to_string(i));
+    auto* raw = a.get();
+    raw->use_local = false;
+    a->handle(msg::exec, [raw, lines](uint32_t id) {
+      return std::make_shared<log_exec>(*raw, id, lines);
+    });
+    a->start();
+    agents.push_back(std::move(a));
+  }
+  std::vector<std::thread> agentThreads;
+  for (auto& context : agentContexts) {
+    auto* c = context.get();
+    agentThreads.emplace_back([c] {
+      asio::executor_work_guard<asio::io_context::executor_type> work(c->get_executor());
+      c->run();
+    });
+  }
+
+  FILE* sink = fopen("/dev/null", "w");
+  using clock = std::chrono::steady_clock;
+  auto start = clock::now();
+  auto end = start;
+  size_t ready = 0;
+  std::unique_ptr<fleet_run> run;
+  server.on_agent = [&](const std::shared_ptr<agent_session>&) {
+    if (++ready != count) return;
+    fleet_options options;
+    options.command = "make";
+    options.fanout = count;
+    run = std::make_unique<fleet_run>(server.agents(), options, sink);
+    run->on_done = [&] {
+      end = clock::now();
+      io_context.stop();
+    };
+    start = clock::now();
+    run->start();
+  };
+  io_context.run();
+  server.stop();
+  for (auto& context : agentContexts) {
+    context->stop();
+  }
+  for (auto& t : agentThreads) {
+    t.join();
+  }
+  agents.clear();
+  fclose(sink);
+  if (!run || run->status() != 0) return 0;
+  return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char* argv[]) {
+  size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 256;
+  size_t lines = argc > 2 ? strtoul(argv[2], nullptr, 10) : 4000;
+  size_t maxShards = argc > 3 ? strtoul(argv[3], nullptr, 10) : std::max(1u, std::thread::hardware_concurrency());
+  uint16_t port = argc > 4 ? (uint16_t)strtoul(argv[4], nullptr, 10) : 16766;
+
+  rlimit rl{};
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  double total = (double)count * lines;
+  printf("%zu agents, %zu lines each, %u cores\n", count, lines, std::thread::hardware_concurrency());
+  double base = 0;
+  for (size_t shards = 1; shards <= maxShards; shards *= 2) {
+    // a port of its own each round, the last one's connections may linger
+    double seconds = runFleet(shards, count, lines, (uint16_t)(port + shards));
+    if (seconds <= 0) {
+      fprintf(stderr, "%zu shards: the run failed\n", shards);
+      return 1;
+    }
+    double rate = total / seconds;
+    if (shards == 1) base = rate;
+    printf("shards %3zu: %8.0f k lines/s, %7.1f MB/s, x%.2f\n", shards, rate / 1000, rate * logLine.size() / 1e6, rate / base);
+  }
+  return 0;
+}
@@ -0,0 +1,159 @@
+// A hub and an agent on one host, over loopback TCP and over an shm_link:
+// keystroke latency (one byte echoed back, one at a time) and bulk throughput
+// (chunks echoed back while more are in flight). The agent is a forked
+// process which echoes whatever comes in, both ends use connection.
+//
+// shm_bench [keystrokes] [total_mb] [chunk_kb] [tcp|shm]
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include "connection.hpp"
+#include "streams.hpp"
+
+using namespace rterm;
+
+using clock_type = std::chrono::steady_clock;
+
+static double cpuSeconds(const rusage& ru) {
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/// the agent side, until the hub goes away
+static void echo(asio::io_context& io_context, socket_stream::socket_type socket, std::unique_ptr<shm_link> link) {
+  auto conn = link ? connection::make<shm_stream>(std::move(socket), std::move(link)) : connection::make<socket_stream>(std::move(socket));
+  std::weak_ptr<connection> weak = conn;
+  conn->on_data = [weak](const char* data, size_t size) {
+    auto c = weak.lock();
+    if (c) c->send(std::string(data, size));
+  };
+  conn->start();
+  conn.reset();
+  io_context.run();
+}
+
+static void runMode(bool useShm, size_t keystrokes, size_t total, size_t chunk) {
+  asio::io_context io_context(1);
+  int sv[2] = {-1, -1};
+  asio::ip::tcp::acceptor acceptor(io_context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  auto endpoint = acceptor.local_endpoint();
+  std::unique_ptr<shm_link> link;
+  if (useShm) {
+    link = shm_link::create();
+    if (!link || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0 || !link->send_to(sv[0])) {
+      printf("shm: not available\n");
+      return;
+    }
+  }
+
+  io_context.notify_fork(asio::io_context::fork_prepare);
+  pid_t pid = fork();
+  if (pid == 0) {
+    io_context.notify_fork(asio::io_context::fork_child);
+    acceptor.close();
+    link.reset();
+    asio::io_context agent_io(1);
+    if (useShm) {
+      ::close(sv[0]);
+      socket_stream::socket_type socket(agent_io, asio::generic::stream_protocol(AF_UNIX, SOCK_STREAM), sv[1]);
+      echo(agent_io, std::move(socket), shm_link::receive_from(sv[1]));
+    } else {
+      asio::ip::tcp::socket socket(agent_io);
+      socket.connect(endpoint);
+      socket.set_option(asio::ip::tcp::no_delay(true));
+      echo(agent_io, socket_stream::socket_type(std::move(socket)), nullptr);
+    }
+    _exit(0);
+  }
+  io_context.notify_fork(asio::io_context::fork_parent);
+
+  std::shared_ptr<connection> conn;
+  if (useShm) {
+    ::close(sv[1]);
+    socket_stream::socket_type socket(io_context, asio::generic::stream_protocol(AF_UNIX, SOCK_STREAM), sv[0]);
+    conn = connection::make<shm_stream>(std::move(socket), std::move(link));
+  } else {
+    asio::ip::tcp::socket socket(io_context);
+    acceptor.accept(socket);
+    socket.set_option(asio::ip::tcp::no_delay(true));
+    conn = connection::make<socket_stream>(socket_stream::socket_type(std::move(socket)));
+  }
+  acceptor.close();
+
+  // keystrokes: the next one goes out when the echo of the last is back
+  std::vector<double> rtts;
+  rtts.reserve(keystrokes);
+  size_t received = 0;
+  size_t sent = 0;
+  size_t bulkTotal = std::max(chunk, total / chunk * chunk);
+  clock_type::time_point sentAt;
+  clock_type::time_point bulkStart;
+  clock_type::time_point bulkEnd;
+  std::string data(chunk, 'x');
+  std::function<void()> pump = [&] {
+    while (sent < bulkTotal && conn->writable()) {
+      conn->send(data);
+      sent += chunk;
+    }
+  };
+  conn->on_data = [&](const char*, size_t size) {
+    if (rtts.size() < keystrokes) {
+      rtts.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - sentAt).count());
+      if (rtts.size() < keystrokes) {
+        sentAt = clock_type::now();
+        conn->send(std::string(1, 'k'));
+        return;
+      }
+      bulkStart = clock_type::now();
+      return pump();
+    }
+    received += size;
+    if (received == bulkTotal) {
+      bulkEnd = clock_type::now();
+      conn->close();
+    }
+  };
+  conn->on_writable = pump;
+  conn->start();
+  sentAt = clock_type::now();
+  conn->send(std::string(1, 'k'));
+
+  rusage self0{};
+  getrusage(RUSAGE_SELF, &self0);
+  io_context.run();
+  rusage self{};
+  getrusage(RUSAGE_SELF, &self);
+  rusage agent{};
+  int status = 0;
+  wait4(pid, &status, 0, &agent);
+
+  if (received != bulkTotal) {
+    printf("%s: agent went away\n", useShm ? "shm" : "tcp");
+    return;
+  }
+  std::sort(rtts.begin(), rtts.end());
+  double sum = 0;
+  for (double r : rtts) {
+    sum += r;
+  }
+  double mb = (double)bulkTotal / (1024 * 1024);
+  double seconds = std::chrono::duration<double>(bulkEnd - bulkStart).count();
+  printf("%s: keystroke rtt avg %.1f us, p50 %.1f us, p99 %.1f us; %.0f MB echoed in %.2f s, %.0f MB/s; cpu hub %.2f s, agent %.2f s\n",
+         useShm ? "shm" : "tcp", sum / rtts.size(), rtts[rtts.size() / 2], rtts[rtts.size() * 99 / 100], mb, seconds, mb / seconds, cpuSeconds(self) - cpuSeconds(self0), cpuSeconds(agent));
+}
+
+int main(int argc, char* argv[]) {
+  size_t keystrokes = std::max<size_t>(1, argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000);
+  size_t total = (argc > 2 ? strtoul(argv[2], nullptr, 10) : 1024) * 1024 * 1024;
+  size_t chunk = std::max<size_t>(1, argc > 3 ? strtoul(argv[3], nullptr, 10) : 64) * 1024;
+  std::string mode = argc > 4 ? argv[4] : "";
+
+  if (mode.empty() || mode == "tcp") runMode(false, keystrokes, total, chunk);
+  if (mode.empty() || mode == "shm") runMode(true, keystrokes, total, chunk);
+  return 0;
+}
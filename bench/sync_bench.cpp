@@ -0,0 +1,137 @@
+// Delta sync of a large file with a small part of it changed: what goes over
+// the wire and what it costs in CPU, without the network. The old version is
+// the basis on the agent, the new one is pushed by the hub.
+//
+// sync_bench [size_mb] [changed_percent]
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <random>
+
+#include "delta.hpp"
+
+using namespace rterm;
+
+static double cpuSeconds(std::clock_t since) {
+  return (double)(std::clock() - since) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char* argv[]) {
+  size_t size = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 256) * 1024 * 1024;
+  double percent = argc > 2 ? strtod(argv[2], nullptr) : 1.0;
+
+  std::mt19937_64 rng(42);
+  std::string basis(size, '\0');
+  for (size_t i = 0; i + 8 <= size; i += 8) {
+    uint64_t v = rng();
+    memcpy(&basis[i], &v, 8);
+  }
+
+  // scattered edits of 16 B to 4 KiB, some overwrite, some insert or delete and shift the rest
+  std::string target;
+  target.reserve(size + size / 50);
+  size_t changed = 0;
+  size_t budget = (size_t)(size * percent / 100);
+  size_t pos = 0;
+  std::uniform_int_distribution<size_t> edit(16, 4096);
+  size_t gap = budget ? size / (budget / 2048 + 1) : size;
+  std::uniform_int_distribution<size_t> skip(gap / 2, gap * 3 / 2);
+  while (pos < size) {
+    size_t n = std::min(skip(rng), size - pos);
+    target.append(basis, pos, n);
+    pos += n;
+    if (pos >= size || changed >= budget) continue;
+    size_t len = edit(rng);
+    std::string noise(len, '\0');
+    for (auto& c : noise) c = (char)rng();
+    switch (rng() % 3) {
+      case 0:  // overwrite
+        target += noise;
+        pos += len;
+        break;
+      case 1:  // insert
+        target += noise;
+        break;
+      default:  // delete
+        pos += len;
+        break;
+    }
+    changed += len;
+  }
+  if (target.size() > size + size / 50) target.resize(size);
+
+  // weak checksum over whole blocks, the vectorized part
+  uint32_t bs = sync_block_size(basis.size());
+  uint32_t check = 0;
+  auto t = std::clock();
+  for (size_t i = 0; i + bs <= basis.size(); i += bs) check += weak_sum_scalar(&basis[i], bs).value();
+  double scalar = cpuSeconds(t);
+  t = std::clock();
+  for (size_t i = 0; i + bs <= basis.size(); i += bs) check -= weak_sum(&basis[i], bs).value();
+  double simd = cpuSeconds(t);
+  if (check != 0) {
+    fprintf(stderr, "weak_sum mismatch\n");
+    return 1;
+  }
+
+  // agent: signatures of the basis
+  t = std::clock();
+  std::vector<block_sig> sigs;
+  for (size_t i = 0; i < basis.size(); i += bs) {
+    sigs.push_back(block_signature(&basis[i], std::min<size_t>(bs, basis.size() - i)));
+  }
+  double sigTime = cpuSeconds(t);
+  size_t sigBytes = sigs.size() * block_sig_size;
+
+  // hub: delta, in frames of about file_chunk_size like the real thing
+  t = std::clock();
+  delta_encoder encoder(bs, basis.size(), sigs);
+  std::vector<std::string> frames;
+  size_t deltaBytes = 0;
+  for (size_t p = 0; p < target.size();) {
+    std::string out;
+    p = encoder.encode(target.data(), target.size(), p, out, file_chunk_size, 16 * file_chunk_size);
+    deltaBytes += frame_header_size + out.size();
+    frames.push_back(std::move(out));
+  }
+  double deltaTime = cpuSeconds(t);
+
+  // agent: rebuild
+  t = std::clock();
+  std::string rebuilt;
+  rebuilt.reserve(target.size());
+  for (const auto& f : frames) {
+    bool ok = parse_delta(
+        f.data(), f.size(),
+        [&](uint32_t first, uint32_t count) {
+          uint64_t offset = (uint64_t)first * bs;
+          if (offset > basis.size()) return false;
+          rebuilt.append(basis, offset, (size_t)std::min<uint64_t>((uint64_t)count * bs, basis.size() - offset));
+          return true;
+        },
+        [&](const char* data, size_t n) {
+          rebuilt.append(data, n);
+          return true;
+        });
+    if (!ok) {
+      fprintf(stderr, "malformed delta\n");
+      return 1;
+    }
+  }
+  double applyTime = cpuSeconds(t);
+  if (rebuilt != target || hash64::of(rebuilt.data(), rebuilt.size()) != hash64::of(target.data(), target.size())) {
+    fprintf(stderr, "rebuilt file differs\n");
+    return 1;
+  }
+
+  auto mb = [](double bytes) {
+    return bytes / 1e6;
+  };
+  printf("file: %.1f MB, changed: %.1f MB in edits, block: %u\n", mb(target.size()), mb(changed), bs);
+  printf("wire: signatures %.2f MB + delta %.2f MB = %.2f%% of the file\n", mb(sigBytes), mb(deltaBytes),
+         100.0 * (sigBytes + deltaBytes) / target.size());
+  printf("cpu: signatures %.3f s, delta %.3f s, apply %.3f s\n", sigTime, deltaTime, applyTime);
+  printf("weak_sum: scalar %.0f MB/s, vectorized %.0f MB/s\n", mb(basis.size()) / scalar, mb(basis.size()) / simd);
+  return 0;
+}
@@ -0,0 +1,152 @@
+// The session logic over each transport, hub and agent in this process on
+// one thread: an agent streams terminal output on a PTY channel as fast as
+// the hub takes it, the hub parses the frames and, with `screen`, models the
+// terminal like for its viewers. Over the loopback no syscall is made for the
+// bytes, so that is the cost of the protocol and the terminal processing
+// alone, the other transports add the kernel's share to it.
+//
+// transport_bench [total_mb] [chunk_kb] [loopback|tcp|unix|shm|udp] [raw|screen] [port]
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdio>
+
+#include "../client/agent.hpp"
+#include "../server/hub.hpp"
+#include "screen.hpp"
+
+using namespace rterm;
+
+/// terminal output as a build prints it, with colors
+static std::string sampleOutput(size_t size) {
+  std::string out;
+  for (size_t i = 0; out.size() < size; ++i) {
+    out += "\x1b[32m[" + std::to_string(i % 100) + "%]\x1b[0m Building CXX object src/CMakeFiles/module_" + std::to_string(i) +
+           ".dir/file.cpp.o\r\n";
+  }
+  out.resize(size);
+  return out;
+}
+
+/// streams total bytes as pty_data as fast as the connection drains
+class sim_pty : public channel, public std::enable_shared_from_this<sim_pty> {
+ public:
+  sim_pty(agent& agent, uint32_t id, const std::string& chunk, size_t total) : agent_(agent), id_(id), chunk_(chunk), left_(total) {}
+
+  void on_frame(const frame& f) override {
+    if (f.type == msg::pty_open) pump();
+  }
+
+ private:
+  void pump() {
+    while (left_ > 0 && agent_.writable()) {
+      size_t n = std::min(left_, chunk_.size());
+      agent_.send(msg::pty_data, id_, chunk_.data(), n);
+      left_ -= n;
+    }
+    if (left_ == 0) return;
+    auto self = shared_from_this();
+    agent_.when_writable([self] {
+      self->pump();
+    });
+  }
+
+  agent& agent_;
+  uint32_t id_;
+  const std::string& chunk_;
+  size_t left_;
+};
+
+static double cpuSeconds() {
+  rusage ru{};
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void runTransport(const std::string& name, size_t total, size_t chunkSize, bool model, uint16_t port) {
+  asio::io_context io_context(1);
+  hub server(io_context, port);
+  server.serve_udp(name == "udp");
+  agent a(io_context, "127.0.0.1", port, "bench");
+  if (name == "loopback") {
+    a.use_transport(std::unique_ptr<transport>(new loopback_transport([&] {
+      return server.connect_loopback(io_context.get_executor());
+    })));
+  } else if (name == "tcp") {
+    a.use_transport(std::unique_ptr<transport>(new tcp_transport(io_context, "127.0.0.1", port)));
+  } else if (name == "udp") {
+    a.use_transport(std::unique_ptr<transport>(new udp_transport(io_context, "127.0.0.1", port)));
+#ifdef __linux__
+  } else if (name == "unix" || name == "shm") {
+    a.use_transport(std::unique_ptr<transport>(new unix_transport(io_context, shm_link_address(port), name == "shm")));
+#endif
+  } else {
+    printf("%s: no such transport\n", name.c_str());
+    return;
+  }
+  std::string chunk = sampleOutput(chunkSize);
+  a.handle(msg::pty_open, [&](uint32_t id) {
+    return std::make_shared<sim_pty>(a, id, chunk, total);
+  });
+
+  screen term(pty_cols, pty_rows);
+  size_t received = 0;
+  size_t frames = 0;
+  using clock = std::chrono::steady_clock;
+  clock::time_point t0;
+  double cpu0 = 0;
+  // a datagram lost mid frame leaves the parser waiting for the rest of it
+  asio::steady_timer idle(io_context);
+  size_t seen = 0;
+  std::function<void()> watch = [&] {
+    idle.expires_after(std::chrono::seconds(1));
+    idle.async_wait([&](const std::error_code& ec) {
+      if (ec) return;
+      if (received == seen) return io_context.stop();
+      seen = received;
+      watch();
+    });
+  };
+  watch();
+  server.on_agent = [&](const std::shared_ptr<agent_session>& as) {
+    t0 = clock::now();
+    cpu0 = cpuSeconds();
+    as->open(msg::pty_open, "", [&](const frame& f) {
+      if (f.type != msg::pty_data) {
+        io_context.stop();
+        return;
+      }
+      ++frames;
+      received += f.size;
+      if (model) term.feed(f.data, f.size);
+      if (received == total) io_context.stop();
+    });
+  };
+  server.start();
+  a.start();
+  io_context.run();
+
+  double seconds = std::chrono::duration<double>(clock::now() - t0).count();
+  double cpu = cpuSeconds() - cpu0;
+  double mb = (double)received / (1024 * 1024);
+  if (received != total) {
+    printf("%-8s: stalled after %.1f MB\n", name.c_str(), mb);
+    return;
+  }
+  printf("%-8s: %.0f MB in %zu frames, %.2f s, %.0f MB/s, cpu %.2f s (%.2f ms/MB, %.2f us/frame)%s\n", name.c_str(), mb, frames, seconds, mb / seconds, cpu,
+         cpu * 1000 / mb, cpu * 1e6 / frames, model ? ", screen modeled" : "");
+}
+
+int main(int argc, char* argv[]) {
+  size_t total = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 256) * 1024 * 1024;
+  size_t chunk = std::max<size_t>(1, argc > 2 ? strtoul(argv[2], nullptr, 10) : 4) * 1024;
+  std::string only = argc > 3 ? argv[3] : "";
+  bool model = argc > 4 && std::string(argv[4]) == "screen";
+  uint16_t port = argc > 5 ? (uint16_t)strtoul(argv[5], nullptr, 10) : 18666;
+
+  for (const char* name : {"loopback", "tcp", "unix", "shm", "udp"}) {
+    if (only.empty() || only == name) runTransport(name, total, chunk, model, port);
+  }
+  return 0;
+}
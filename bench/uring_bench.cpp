@@ -0,0 +1,191 @@
+// Many agent connections echoed by one io_context thread, with the reactor
+// (epoll) and with io_uring: syscalls and CPU of that thread per MB moved.
+// A peer thread writes a chunk to every session in turn and reads it back,
+// the sessions are socketpairs so no network stack is involved.
+//
+// uring_bench [sessions] [total_mb] [chunk_kb] [epoll|uring]
+//
+// Syscalls are counted with the raw_syscalls:sys_enter tracepoint, which needs
+// tracefs (mount -t tracefs nodev /sys/kernel/tracing) and perf_event_paranoid
+// low enough, otherwise they are reported as n/a.
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
+#include "connection.hpp"
+#include "streams.hpp"
+
+using namespace rterm;
+
+/// counts the syscalls of the calling thread, -1 if that can not be done
+class syscall_counter {
+ public:
+  syscall_counter() {
+    long id = -1;
+    for (const char* path : {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id", "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"}) {
+      std::ifstream in(path);
+      if (in >> id) break;
+    }
+    if (id < 0) return;
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = (uint64_t)id;
+    attr.sample_period = 0;
+    fd_ = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  ~syscall_counter() {
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  long long count() const {
+    uint64_t n = 0;
+    if (fd_ < 0 || ::read(fd_, &n, sizeof(n)) != sizeof(n)) return -1;
+    return (long long)n;
+  }
+
+ private:
+  int fd_ = -1;
+};
+
+static double threadCpuSeconds() {
+  rusage ru{};
+  getrusage(RUSAGE_THREAD, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static double processCpuSeconds() {
+  rusage ru{};
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void runMode(bool useUring, size_t sessions, size_t total, size_t chunk) {
+  asio::io_context io_context(1);
+  std::unique_ptr<uring> ring;
+  if (useUring) {
+    ring.reset(new uring(io_context));
+    if (!ring->ok()) {
+      printf("uring:  not available\n");
+      return;
+    }
+  }
+
+  std::vector<std::shared_ptr<connection>> conns;
+  std::vector<int> peers;
+  for (size_t i = 0; i < sessions; ++i) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    socket_stream::socket_type socket(io_context, asio::generic::stream_protocol(AF_UNIX, SOCK_STREAM), sv[0]);
+    auto conn = connection::make<socket_stream>(std::move(socket));
+    // the connection owns itself through its pending read, the callback must not keep it alive too
+    std::weak_ptr<connection> weak = conn;
+    conn->on_data = [weak](const char* data, size_t size) {
+      auto c = weak.lock();
+      if (c) c->send(std::string(data, size));
+    };
+    if (ring) conn->use_uring(*ring);
+    conn->start();
+    conns.push_back(std::move(conn));
+    peers.push_back(sv[1]);
+  }
+
+  size_t rounds = std::max<size_t>(1, total / (sessions * chunk));
+  double peerCpu = 0;
+  std::thread peer([&] {
+    std::string out(chunk, 'x');
+    std::string in(chunk, '\0');
+    for (size_t r = 0; r < rounds; ++r) {
+      for (int fd : peers) {
+        if (::write(fd, out.data(), chunk) != (ssize_t)chunk) perror("write");
+      }
+      for (int fd : peers) {
+        size_t got = 0;
+        while (got < chunk) {
+          ssize_t n = ::read(fd, &in[got], chunk - got);
+          if (n <= 0) {
+            perror("read");
+            exit(1);
+          }
+          got += (size_t)n;
+        }
+      }
+    }
+    peerCpu = threadCpuSeconds();
+    for (int fd : peers) {
+      ::close(fd);
+    }
+    asio::post(io_context, [&] {
+      io_context.stop();
+    });
+  });
+
+  syscall_counter counter;
+  long long syscalls0 = counter.count();
+  double cpu0 = threadCpuSeconds();
+  double process0 = processCpuSeconds();
+  auto t0 = std::chrono::steady_clock::now();
+  io_context.run();
+  auto t1 = std::chrono::steady_clock::now();
+  long long syscalls = counter.count() - syscalls0;
+  double cpu = threadCpuSeconds() - cpu0;
+  peer.join();
+  // kernel workers of io_uring, if any, are in the process time but not in the thread's
+  double others = processCpuSeconds() - process0 - cpu - peerCpu;
+
+  double mb = (double)(rounds * sessions * chunk) / (1024 * 1024);
+  double seconds = std::chrono::duration<double>(t1 - t0).count();
+  printf("%s: %zu sessions, %.0f MB echoed in %.2f s, io thread cpu %.2f s (%.1f ms/MB), other cpu %.2f s", useUring ? "uring" : "epoll",
+         sessions, mb, seconds, cpu, cpu * 1000 / mb, std::max(0.0, others));
+  if (syscalls0 >= 0) {
+    printf(", syscalls %lld (%.0f/MB)", syscalls, syscalls / mb);
+  } else {
+    printf(", syscalls n/a");
+  }
+  if (ring) {
+    printf(", io_uring_enter %llu, wakeups %llu, completions %llu", (unsigned long long)ring->enters, (unsigned long long)ring->wakeups,
+           (unsigned long long)ring->completions);
+  }
+  printf("\n");
+
+  for (auto& c : conns) {
+    c->close();
+  }
+  conns.clear();
+  // let the cancelled reads complete and drop their references
+  io_context.restart();
+  io_context.run_for(std::chrono::milliseconds(100));
+}
+
+int main(int argc, char* argv[]) {
+  size_t sessions = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000;
+  size_t total = (argc > 2 ? strtoul(argv[2], nullptr, 10) : 1024) * 1024 * 1024;
+  size_t chunk = (argc > 3 ? strtoul(argv[3], nullptr, 10) : 4) * 1024;
+  std::string mode = argc > 4 ? argv[4] : "";
+
+  // two descriptors per session, root may go past the hard limit
+  rlimit rl{};
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rl.rlim_max = std::max<rlim_t>(rl.rlim_max, sessions * 2 + 64);
+  rl.rlim_cur = rl.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  if (mode.empty() || mode == "epoll") runMode(false, sessions, total, chunk);
+  if (mode.empty() || mode == "uring") runMode(true, sessions, total, chunk);
+  return 0;
+}
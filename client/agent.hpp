@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <random>
+#include <utility>
+
+#include "connection.hpp"
+#include "log.h"
+#include "proto.hpp"
+#include "transport.hpp"
+
+namespace rterm {
+
+/**
+ * One multiplexed stream inside the agent connection, opened by the hub.
+ */
+class channel {
+ public:
+  virtual ~channel() = default;
+
+  /// the first frame is the one which opened the channel
+  virtual void on_frame(const frame& f) {}
+
+  /// connection to hub lost, release resources
+  virtual void on_disconnect() {}
+};
+
+/**
+ * Agent side of the connection: dials out to the hub, announces itself and
+ * dispatches frames to channels. Reconnects when the hub goes away, after an
+ * exponential backoff with full jitter: a fleet which lost its hub at once
+ * comes back spread out, not in waves.
+ *
+ * A hub on this host is reached through its Unix socket where it offers one,
+ * with shared memory rings unless use_shm is off, see shm_link, and through
+ * TCP otherwise. Descriptors can be passed to it then, see send_fd(). Other
+ * transports can be given instead, see use_transport().
+ *
+ * The hub pings every heartbeat_interval_ms. Once it has, a hub which stays
+ * silent for agent_dead_after_ms is taken for gone, so a half-dead
+ * connection does not keep the agent away until the kernel gives up.
+ */
+class agent {
+ public:
+  using channel_factory = std::function<std::shared_ptr<channel>(uint32_t id)>;
+
+  agent(asio::io_context& io_context, std::string host, uint16_t port, std::string name)
+      : io_context_(io_context), host_(std::move(host)), port_(port), name_(std::move(name)), retry_timer_(io_context) {}
+
+  void start() {
+    connect();
+  }
+
+  void send(std::string packed) {
+    if (conn_) conn_->send(std::move(packed));
+  }
+
+  void send(msg type, uint32_t channel, const std::string& body = std::string()) {
+    send(pack(type, channel, body));
+  }
+
+  void send(msg type, uint32_t channel, const char* data, size_t size) {
+    send(pack(type, channel, data, size));
+  }
+
+  /// a frame whose body is length bytes of the file, fewer if it shrank by then, sent with sendfile where possible
+  void send_file(msg type, uint32_t channel, std::shared_ptr<file_handle> file, off_t offset, size_t length) {
+    if (conn_) conn_->send_file(type, channel, std::move(file), offset, length);
+  }
+
+#ifdef __linux__
+  /// a frame with fd attached, which is closed here. false if the connection can not pass it, nothing is sent then
+  bool send_fd(msg type, uint32_t channel, int fd) {
+    if (!conn_) {
+      ::close(fd);
+      return false;
+    }
+    return conn_->send_fd(pack(type, channel), fd);
+  }
+#endif
+
+  /// channel finished, forget it
+  void remove(uint32_t id) {
+    channels_.erase(id);
+  }
+
+  bool connected() const {
+    return conn_ != nullptr;
+  }
+
+  /// the current connection to the hub, for channels which write to it directly
+  std::weak_ptr<connection> conn() const {
+    return conn_;
+  }
+
+  bool writable() const {
+    return conn_ && conn_->writable();
+  }
+
+  /// bytes sent but not on the way to the hub yet, 0 if disconnected, see connection::backlog()
+  size_t backlog() const {
+    return conn_ ? conn_->backlog() : 0;
+  }
+
+  /**
+   * Run cb once the connection has room for more, right away if it has.
+   * Producers like command output use it so a slow hub holds back the
+   * producer instead of growing the send queue. Never runs if disconnected.
+   */
+  void when_writable(std::function<void()> cb) {
+    if (!conn_) return;
+    if (conn_->writable()) {
+      cb();
+      return;
+    }
+    writable_waiters_.push_back(std::move(cb));
+  }
+
+  const std::string& name() const {
+    return name_;
+  }
+
+#ifdef __linux__
+  /// do the reads and writes of the hub connection, and of PTYs, with io_uring
+  void use_uring(uring& ring) {
+    if (ring.ok()) uring_ = &ring;
+  }
+
+  /// nullptr without io_uring
+  uring* ring() const {
+    return uring_;
+  }
+#endif
+
+  /// before start(): dial with this instead of the default ones, several are tried in the order given
+  void use_transport(std::unique_ptr<transport> t) {
+    transports_.push_back(std::move(t));
+  }
+
+  /// register how to create a channel for the message which opens it
+  void handle(msg type, channel_factory factory) {
+    factories_[type] = std::move(factory);
+  }
+
+ public:
+  std::function<void()> on_connect;
+
+  /// try the Unix socket first when the hub is on this host, and ask it for an shm_link there
+  bool use_local = true;
+  bool use_shm = true;
+
+  /// the first retry waits up to retry_min_ms, every failed one doubles that up to retry_max_ms
+  uint32_t retry_min_ms = 500;
+  uint32_t retry_max_ms = 30000;
+
+ private:
+  void connect() {
+    if (transports_.empty()) {
+#ifdef __linux__
+      if (use_local && (host_ == "localhost" || host_ == "::1" || host_.compare(0, 4, "127.") == 0)) {
+        transports_.emplace_back(new unix_transport(io_context_, shm_link_address(port_), use_shm));
+      }
+#endif
+      transports_.emplace_back(new tcp_transport(io_context_, host_, port_));
+    }
+    dial(0);
+  }
+
+  /// the next transport when one fails, the backoff when all have
+  void dial(size_t i) {
+    transports_[i]->connect([this, i](std::shared_ptr<connection> conn) {
+      if (conn) return opened(std::move(conn));
+      if (i + 1 < transports_.size()) return dial(i + 1);
+      retry();
+    });
+  }
+
+  void opened(std::shared_ptr<connection> conn) {
+    LOGD("on_open");
+    conn_ = std::move(conn);
+    opened_at_ = std::chrono::steady_clock::now();
+    parser_ = std::make_unique<frame_parser>();
+    parser_->on_frame = [this](const frame& f) {
+      dispatch(f);
+    };
+    conn_->on_data = [this](const char* data, size_t size) {
+      last_seen_ = std::chrono::steady_clock::now();
+      if (!parser_->feed(data, size)) {
+        LOGE("protocol error, drop connection");
+        conn_->close();
+      }
+    };
+    conn_->on_writable = [this] {
+      auto waiters = std::move(writable_waiters_);
+      writable_waiters_.clear();
+      for (auto& cb : waiters) {
+        cb();
+      }
+    };
+    conn_->on_close = [this] {
+      LOGD("on_close");
+      disconnected();
+    };
+#ifdef __linux__
+    if (uring_) conn_->use_uring(*uring_);
+#endif
+    conn_->start();
+    pinged_ = false;
+    last_seen_ = std::chrono::steady_clock::now();
+    watch_hub();
+
+    send(msg::hello, 0, name_);
+    if (on_connect) on_connect();
+  }
+
+  void watch_hub() {
+    alive_timer_.expires_after(std::chrono::milliseconds(agent_dead_after_ms / 4));
+    alive_timer_.async_wait([this](const std::error_code& ec) {
+      if (ec || !conn_) return;
+      if (pinged_ && std::chrono::steady_clock::now() - last_seen_ > std::chrono::milliseconds(agent_dead_after_ms)) {
+        LOGW("hub silent, reconnect");
+        conn_->close();
+        return;
+      }
+      watch_hub();
+    });
+  }
+
+  void disconnected() {
+    alive_timer_.cancel();
+    // a connection which held for a while starts the backoff over, one dropped right away does not
+    if (std::chrono::steady_clock::now() - opened_at_ >= std::chrono::milliseconds(retry_max_ms)) retries_ = 0;
+    conn_ = nullptr;
+    writable_waiters_.clear();
+    auto channels = std::move(channels_);
+    channels_.clear();
+    for (auto& c : channels) {
+      c.second->on_disconnect();
+    }
+    retry();
+  }
+
+  void retry() {
+    uint64_t bound = std::min<uint64_t>((uint64_t)retry_min_ms << std::min(retries_, 20u), retry_max_ms);
+    ++retries_;
+    std::uniform_int_distribution<uint64_t> delay(0, bound);
+    auto ms = delay(rng_);
+    LOGD("retry in %u ms", (unsigned)ms);
+    retry_timer_.expires_after(std::chrono::milliseconds(ms));
+    retry_timer_.async_wait([this](const std::error_code& ec) {
+      if (ec) return;
+      connect();
+    });
+  }
+
+  void dispatch(const frame& f) {
+    if (!conn_) return;  // lost while parsing a batch
+    if (f.type == msg::ping && f.channel == 0) {
+      pinged_ = true;
+      send(msg::pong, 0, f.data, f.size);
+      return;
+    }
+    auto it = channels_.find(f.channel);
+    if (it != channels_.end()) {
+      auto ch = it->second;
+      ch->on_frame(f);
+      return;
+    }
+    auto factory = factories_.find(f.type);
+    if (factory == factories_.end()) {
+      LOGD("drop frame: type: %d, channel: %u", (int)f.type, f.channel);
+      return;
+    }
+    auto ch = factory->second(f.channel);
+    if (!ch) return;
+    channels_[f.channel] = ch;
+    ch->on_frame(f);  // the opening frame
+  }
+
+ private:
+  asio::io_context& io_context_;
+  std::string host_;
+  uint16_t port_;
+  std::string name_;
+
+  std::vector<std::unique_ptr<transport>> transports_;
+  std::shared_ptr<connection> conn_;
+  std::unique_ptr<frame_parser> parser_;
+  std::vector<std::function<void()>> writable_waiters_;
+  asio::steady_timer retry_timer_;
+  unsigned retries_ = 0;  // in a row, since the last connection which held
+  std::chrono::steady_clock::time_point opened_at_;
+  asio::steady_timer alive_timer_{io_context_};
+  std::chrono::steady_clock::time_point last_seen_;  // data from the hub
+  bool pinged_ = false;  // the hub does heartbeats
+  std::minstd_rand rng_{std::random_device()()};
+
+  std::map<msg, channel_factory> factories_;
+  std::map<uint32_t, std::shared_ptr<channel>> channels_;
+#ifdef __linux__
+  uring* uring_ = nullptr;
+#endif
+};
+
+}  // namespace rterm
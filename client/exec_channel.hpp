@@ -0,0 +1,197 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <deque>
+
+#include "agent.hpp"
+#include "process.hpp"
+
+namespace rterm {
+
+/**
+ * Run a non-interactive command through `sh -c` with plain pipes, no PTY:
+ * no line discipline, no CRLF translation or echo, bytes pass unchanged.
+ * stdout and stderr go to exec_out and exec_err, followed by the exit status.
+ *
+ * Opened by msg::pipe, the command stdin is fed by exec_in until exec_eof.
+ * Every byte written to the command is acknowledged with exec_ack, so the
+ * hub holds back its producer while the command is slow. Output is read
+ * only while the connection to the hub has room, see agent::when_writable.
+ */
+class exec_channel : public channel, public std::enable_shared_from_this<exec_channel> {
+ public:
+  exec_channel(asio::io_context& io_context, agent& agent, child_reaper& reaper, uint32_t id)
+      : io_context_(io_context), agent_(agent), reaper_(reaper), id_(id), in_(io_context), out_(io_context), err_(io_context) {}
+
+  void on_frame(const frame& f) override {
+    switch (f.type) {
+      case msg::exec:
+        start(f.body(), false);
+        break;
+      case msg::pipe:
+        start(f.body(), true);
+        break;
+      case msg::exec_in:
+        if (in_.is_open()) {
+          in_queue_.push_back(f.body());
+          if (in_queue_.size() == 1) write_in();
+        } else {
+          ack(f.size);  // nobody reads it, do not stall the sender
+        }
+        break;
+      case msg::exec_eof:
+        in_eof_ = true;
+        if (in_queue_.empty()) close_in();
+        break;
+      case msg::close:
+        on_disconnect();
+        break;
+      default:
+        break;
+    }
+  }
+
+  void on_disconnect() override {
+    if (pid_ > 0) kill(pid_, SIGKILL);
+    std::error_code ec;
+    in_.close(ec);
+    out_.close(ec);
+    err_.close(ec);
+  }
+
+ private:
+  void start(const std::string& cmd, bool with_stdin) {
+    int in[2] = {-1, -1};
+    int out[2] = {-1, -1};
+    int err[2] = {-1, -1};
+    auto close_all = [&] {
+      for (int fd : {in[0], in[1], out[0], out[1], err[0], err[1]}) {
+        if (fd >= 0) close(fd);
+      }
+    };
+    if ((with_stdin && pipe2(in, O_CLOEXEC) != 0) || pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0) {
+      LOGE("pipe error: %d, %s", errno, strerror(errno));
+      close_all();
+      finish(127);
+      return;
+    }
+
+    pid_ = fork_exec(io_context_, [&] {
+      int null = with_stdin ? in[0] : open("/dev/null", O_RDONLY);
+      dup2(null, STDIN_FILENO);
+      dup2(out[1], STDOUT_FILENO);
+      dup2(err[1], STDERR_FILENO);
+      execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*)nullptr);
+    });
+    if (pid_ < 0) {
+      close_all();
+      finish(127);
+      return;
+    }
+    if (with_stdin) {
+      close(in[0]);
+      in_.assign(in[1]);
+    }
+    close(out[1]);
+    close(err[1]);
+
+    out_.assign(out[0]);
+    err_.assign(err[0]);
+    out_buffer_.resize(256 * 1024);
+    err_buffer_.resize(16 * 1024);
+    read(out_, out_buffer_, msg::exec_out);
+    read(err_, err_buffer_, msg::exec_err);
+
+    auto self = shared_from_this();
+    reaper_.watch(pid_, [self](int status) {
+      self->pid_ = -1;
+      self->status_ = status;
+      self->try_finish();
+    });
+  }
+
+  void read(asio::posix::stream_descriptor& pipe, std::string& buffer, msg type) {
+    auto self = shared_from_this();
+    pipe.async_read_some(asio::buffer(buffer), [self, &pipe, &buffer, type](const std::error_code& ec, std::size_t length) {
+      if (ec) {
+        ++self->eof_;
+        self->try_finish();
+        return;
+      }
+      self->agent_.send(type, self->id_, buffer.data(), length);
+      self->agent_.when_writable([self, &pipe, &buffer, type] {
+        self->read(pipe, buffer, type);
+      });
+    });
+  }
+
+  void write_in() {
+    auto self = shared_from_this();
+    asio::async_write(in_, asio::buffer(in_queue_.front()), [self](const std::error_code& ec, std::size_t length) {
+      size_t size = self->in_queue_.front().size();
+      self->in_queue_.pop_front();
+      self->unacked_ += size;
+      if (ec) {
+        // the command stopped reading, drop what is left but keep the sender going
+        for (auto& s : self->in_queue_) self->unacked_ += s.size();
+        self->in_queue_.clear();
+        self->close_in();
+      }
+      if (self->in_queue_.empty() || self->unacked_ >= 256 * 1024) self->ack(0);
+      if (!self->in_queue_.empty()) {
+        self->write_in();
+      } else if (self->in_eof_) {
+        self->close_in();
+      }
+    });
+  }
+
+  void ack(size_t more) {
+    unacked_ += more;
+    if (unacked_ == 0) return;
+    char v[4];
+    put_u32(v, (uint32_t)unacked_);
+    agent_.send(msg::exec_ack, id_, v, sizeof(v));
+    unacked_ = 0;
+  }
+
+  void close_in() {
+    std::error_code ec;
+    in_.close(ec);
+  }
+
+  void try_finish() {
+    // output may still be buffered in the pipes when the child is reaped
+    if (eof_ == 2 && pid_ < 0 && status_ >= 0) finish(status_);
+  }
+
+  void finish(int status) {
+    close_in();
+    agent_.send(pack_i32(msg::exit, id_, status));
+    agent_.remove(id_);
+  }
+
+ private:
+  asio::io_context& io_context_;
+  agent& agent_;
+  child_reaper& reaper_;
+  uint32_t id_;
+
+  pid_t pid_ = -1;
+  int status_ = -1;
+  int eof_ = 0;
+  asio::posix::stream_descriptor in_;
+  asio::posix::stream_descriptor out_;
+  asio::posix::stream_descriptor err_;
+  std::string out_buffer_;
+  std::string err_buffer_;
+
+  std::deque<std::string> in_queue_;
+  bool in_eof_ = false;
+  size_t unacked_ = 0;
+};
+
+}  // namespace rterm
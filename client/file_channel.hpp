@@ -0,0 +1,183 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "agent.hpp"
+
+namespace rterm {
+
+/**
+ * File transfer without the PTY.
+ *
+ * file_get: the file is sent from the requested offset in 1 MiB file_data
+ * frames straight from the page cache (sendfile), as fast as the connection
+ * takes them.
+ *
+ * file_put: data goes to "<path>.part", whose size is reported back in
+ * file_info so an interrupted upload resumes where it stopped. The hub
+ * pipelines file_data within pipe_window, file_ack returns the credit.
+ * The part file is renamed once complete.
+ *
+ * Both end with exit, the status is 0 or an errno value.
+ */
+class file_channel : public channel, public std::enable_shared_from_this<file_channel> {
+ public:
+  file_channel(agent& agent, uint32_t id) : agent_(agent), id_(id) {}
+
+  void on_frame(const frame& f) override {
+    if (done_) return;
+    switch (f.type) {
+      case msg::file_get:
+        if (f.size < 8) return finish(EINVAL);
+        get(get_u64(f.data), std::string(f.data + 8, f.size - 8));
+        break;
+      case msg::file_put:
+        if (f.size < 12) return finish(EINVAL);
+        put(get_u64(f.data), get_u32(f.data + 8), std::string(f.data + 12, f.size - 12));
+        break;
+      case msg::file_data:
+        store(f.data, f.size);
+        break;
+      case msg::file_end:
+        end();
+        break;
+      case msg::close:
+        done_ = true;
+        agent_.remove(id_);
+        break;
+      default:
+        break;
+    }
+  }
+
+  void on_disconnect() override {
+    done_ = true;
+  }
+
+ private:
+  void get(uint64_t offset, const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return finish(errno);
+    file_ = std::make_shared<file_handle>(fd);
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0) return finish(errno);
+    if (!S_ISREG(st.st_mode)) return finish(EISDIR);
+    size_ = (uint64_t)st.st_size;
+    info(size_, st.st_mode & 07777);
+
+    offset_ = std::min(offset, size_);
+    pump();
+  }
+
+  void pump() {
+    if (done_) return;
+    struct stat st {};
+    if (offset_ < size_ && fstat(file_->fd, &st) == 0 && (uint64_t)st.st_size < size_) {
+      // it shrank (logrotate's copytruncate), what is queued goes out short
+      size_ = std::max((uint64_t)st.st_size, offset_);
+      shrank_ = true;
+    }
+    while (offset_ < size_) {
+      size_t n = (size_t)std::min<uint64_t>(file_chunk_size, size_ - offset_);
+      agent_.send_file(msg::file_data, id_, file_, (off_t)offset_, n);
+      offset_ += n;
+      if (!agent_.writable()) {
+        auto self = shared_from_this();
+        agent_.when_writable([self] {
+          self->pump();
+        });
+        return;
+      }
+    }
+    finish(shrank_ ? EIO : 0);
+  }
+
+  void put(uint64_t size, uint32_t mode, const std::string& path) {
+    path_ = path;
+    size_ = size;
+    mode_ = mode & 07777;
+    int fd = open(part().c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return finish(errno);
+    file_ = std::make_shared<file_handle>(fd);
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0) return finish(errno);
+    offset_ = (uint64_t)st.st_size;
+    if (offset_ > size_) {
+      // not a part of this file, start over
+      if (ftruncate(fd, 0) != 0) return finish(errno);
+      offset_ = 0;
+    }
+    info(offset_, mode_);
+  }
+
+  void store(const char* data, size_t size) {
+    if (!file_) return;
+    // a short one is the last, or the file shrank on the hub, which only looks again when credit comes back
+    bool last = size < file_chunk_size;
+    while (size > 0) {
+      ssize_t n = pwrite(file_->fd, data, size, (off_t)offset_);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return finish(errno);
+      }
+      data += n;
+      size -= (size_t)n;
+      offset_ += (uint64_t)n;
+      unacked_ += (size_t)n;
+    }
+    if (unacked_ >= file_chunk_size || last) ack(last);
+  }
+
+  void end() {
+    ack();
+    if (offset_ != size_) return finish(EIO);
+    if (fchmod(file_->fd, mode_) != 0) return finish(errno);
+    if (rename(part().c_str(), path_.c_str()) != 0) return finish(errno);
+    finish(0);
+  }
+
+  void info(uint64_t size, uint32_t mode) {
+    char v[12];
+    put_u64(v, size);
+    put_u32(v + 8, mode);
+    agent_.send(msg::file_info, id_, v, sizeof(v));
+  }
+
+  void ack(bool always = false) {
+    if (unacked_ == 0 && !always) return;
+    char v[4];
+    put_u32(v, (uint32_t)unacked_);
+    agent_.send(msg::file_ack, id_, v, sizeof(v));
+    unacked_ = 0;
+  }
+
+  void finish(int status) {
+    if (done_) return;
+    done_ = true;
+    agent_.send(pack_i32(msg::exit, id_, status));
+    agent_.remove(id_);
+  }
+
+  std::string part() const {
+    return path_ + ".part";
+  }
+
+ private:
+  agent& agent_;
+  uint32_t id_;
+  bool done_ = false;
+
+  std::shared_ptr<file_handle> file_;
+  std::string path_;
+  uint64_t size_ = 0;
+  uint32_t mode_ = 0;
+  uint64_t offset_ = 0;
+  size_t unacked_ = 0;
+  bool shrank_ = false;
+};
+
+}  // namespace rterm
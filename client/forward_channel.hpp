@@ -0,0 +1,169 @@
+#pragma once
+
+#include <map>
+
+#include "agent.hpp"
+#include "forward.hpp"
+
+namespace rterm {
+
+/**
+ * Agent end of port forwarding, see tcp_stream.
+ *
+ * tcp_open: connect to a service next to the agent (ssh -L).
+ * tcp_listen: listen on the agent, each accepted connection is announced with
+ * tcp_accept and waits here until the hub opens a channel for it with
+ * tcp_attach (ssh -R). Channel ids are always allocated by the hub.
+ */
+class forwarder {
+ public:
+  forwarder(asio::io_context& io_context, agent& agent) : io_context_(io_context), agent_(agent) {}
+
+  /// for tcp_open and tcp_attach
+  std::shared_ptr<channel> stream(uint32_t id) {
+    return std::make_shared<stream_channel>(*this, id);
+  }
+
+  /// for tcp_listen
+  std::shared_ptr<channel> listener(uint32_t id) {
+    return std::make_shared<listen_channel>(*this, id);
+  }
+
+ private:
+  class stream_channel : public channel {
+   public:
+    stream_channel(forwarder& owner, uint32_t id) : owner_(owner), id_(id) {}
+
+    void on_frame(const frame& f) override {
+      switch (f.type) {
+        case msg::tcp_open: {
+          std::string target = f.body();
+          size_t colon = target.rfind(':');
+          if (colon == std::string::npos) return fail();
+          create(asio::ip::tcp::socket(owner_.io_context_));
+          stream_->connect(target.substr(0, colon), target.substr(colon + 1));
+          break;
+        }
+        case msg::tcp_attach: {
+          auto it = f.size >= 4 ? owner_.accepted_.find(get_u32(f.data)) : owner_.accepted_.end();
+          if (it == owner_.accepted_.end()) return fail();
+          auto socket = std::move(it->second);
+          owner_.accepted_.erase(it);
+          create(std::move(socket));
+          stream_->start();
+          break;
+        }
+        default:
+          if (stream_) {
+            stream_->on_frame(f);
+          } else if (f.type == msg::close) {
+            owner_.agent_.remove(id_);
+          }
+          break;
+      }
+    }
+
+    void on_disconnect() override {
+      if (stream_) stream_->abort();
+    }
+
+   private:
+    void create(asio::ip::tcp::socket socket) {
+      stream_ = std::make_shared<tcp_stream>(std::move(socket), owner_.agent_.conn(), id_);
+      auto& agent = owner_.agent_;
+      uint32_t id = id_;
+      stream_->on_done = [&agent, id](bool graceful) {
+        if (graceful) agent.send(pack_i32(msg::exit, id, 0));
+        agent.remove(id);
+      };
+    }
+
+    void fail() {
+      owner_.agent_.send(msg::close, id_);
+      owner_.agent_.remove(id_);
+    }
+
+   private:
+    forwarder& owner_;
+    uint32_t id_;
+    std::shared_ptr<tcp_stream> stream_;
+  };
+
+  class listen_channel : public channel, public std::enable_shared_from_this<listen_channel> {
+   public:
+    listen_channel(forwarder& owner, uint32_t id) : owner_(owner), id_(id), acceptor_(owner.io_context_) {}
+
+    void on_frame(const frame& f) override {
+      switch (f.type) {
+        case msg::tcp_listen:
+          listen(f.body());
+          break;
+        case msg::close:
+          close();
+          owner_.agent_.remove(id_);
+          break;
+        default:
+          break;
+      }
+    }
+
+    void on_disconnect() override {
+      close();
+      owner_.accepted_.clear();  // their tcp_attach will never come
+    }
+
+   private:
+    void listen(const std::string& spec) {
+      size_t colon = spec.rfind(':');
+      std::string address = colon == std::string::npos ? "127.0.0.1" : spec.substr(0, colon);
+      auto port = (uint16_t)strtoul(spec.c_str() + (colon == std::string::npos ? 0 : colon + 1), nullptr, 10);
+      std::error_code ec;
+      asio::ip::tcp::endpoint endpoint(asio::ip::make_address(address, ec), port);
+      if (!ec) acceptor_.open(endpoint.protocol(), ec);
+      if (!ec) acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true), ec);
+      if (!ec) acceptor_.bind(endpoint, ec);
+      if (!ec) acceptor_.listen(asio::socket_base::max_listen_connections, ec);
+      if (ec) {
+        LOGW("listen %s: %s", spec.c_str(), ec.message().c_str());
+        owner_.agent_.send(pack_i32(msg::exit, id_, ec.value()));
+        owner_.agent_.remove(id_);
+        return;
+      }
+      accept();
+    }
+
+    void accept() {
+      auto self = shared_from_this();
+      acceptor_.async_accept([self](const std::error_code& ec, asio::ip::tcp::socket socket) {
+        if (ec == asio::error::operation_aborted || !self->acceptor_.is_open()) return;
+        if (!ec) {
+          socket.set_option(asio::ip::tcp::no_delay(true));
+          uint32_t token = self->owner_.next_token_++;
+          self->owner_.accepted_.emplace(token, std::move(socket));
+          char v[4];
+          put_u32(v, token);
+          self->owner_.agent_.send(msg::tcp_accept, self->id_, v, sizeof(v));
+        }
+        self->accept();
+      });
+    }
+
+    void close() {
+      std::error_code ec;
+      acceptor_.close(ec);
+    }
+
+   private:
+    forwarder& owner_;
+    uint32_t id_;
+    asio::ip::tcp::acceptor acceptor_;
+  };
+
+ private:
+  asio::io_context& io_context_;
+  agent& agent_;
+  uint32_t next_token_ = 1;
+  std::map<uint32_t, asio::ip::tcp::socket> accepted_;  // waiting for tcp_attach
+};
+
+}  // namespace rterm
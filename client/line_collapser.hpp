@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "byte_scan.hpp"
+#include "proto.hpp"
+#include "screen.hpp"
+
+namespace rterm {
+
+/**
+ * Holds back terminal output and drops the states of a line which are
+ * overwritten before they are sent: progress bars of pip, curl or docker pull
+ * write the same line again and again after a CR. Of "\r 10%\r 11%\r 12%" only
+ * "\r 12%" is left, and the screen ends up the same.
+ *
+ * The line from a CR up to the next CR is a state, made of printable chars,
+ * SGR and EL only. The next state overwrites it when it starts at column 0
+ * too and is at least as wide, or erases the rest of the line; the text of the
+ * older one is dropped then, its SGR and EL are kept for the pen and the
+ * erase as far as a later reset or EL does not make them moot. A line feed,
+ * any other control or sequence, and a state wider than the terminal, which
+ * wraps, end the run.
+ */
+class line_collapser {
+ public:
+  explicit line_collapser(int cols = pty_cols) : cols_(cols) {}
+
+  /// the width of the terminal changed, a state as wide as the old one may wrap now
+  void set_cols(int cols) {
+    cols_ = cols;
+  }
+
+  bool empty() const {
+    return out_.empty();
+  }
+  size_t size() const {
+    return out_.size();
+  }
+  /// bytes dropped so far
+  size_t collapsed() const {
+    return collapsed_;
+  }
+
+  void append(const char* data, size_t size) {
+    // what came before was sent as it is, or taken, start over
+    if (out_.empty()) {
+      state_ = state::ground;
+      prev_.valid = false;
+      cur_ = segment();
+    }
+    for (size_t i = 0; i < size;) {
+      // plain ASCII up to the next control, sequence or UTF-8 char only takes columns
+      if (state_ == state::ground) {
+        size_t run = find_special(data + i, size - i);
+        out_.append(data + i, run);
+        cur_.cols += (int)std::min(run, (size_t)cols_ + 1);
+        i += run;
+        if (i == size) break;
+      }
+      auto b = (uint8_t)data[i++];
+      out_ += (char)b;
+      feed(b);
+    }
+  }
+
+  /// what is left to send, the collapser is empty then
+  std::string take() {
+    std::string out;
+    out.swap(out_);
+    return out;
+  }
+
+ private:
+  enum class state { ground, esc, csi, utf8 };
+
+  struct segment {
+    size_t start = 0;  // in out_
+    int cols = 0;
+    bool erases = false;
+    bool at_zero = false;  // starts at column 0
+    bool valid = false;    // printable chars, SGR and EL only
+  };
+
+  void feed(uint8_t b) {
+    switch (state_) {
+      case state::ground:
+        if (b == '\r') {
+          carriage_return();
+        } else if (b == '\n' || b == '\v' || b == '\f') {
+          // the same column on the next line
+          bool zero = cur_.valid && cur_.at_zero && cur_.cols == 0;
+          prev_.valid = false;
+          begin(zero);
+        } else if (b == 0x1b) {
+          state_ = state::esc;
+        } else if (b < 0x20 || b == 0x7f) {
+          barrier();
+        } else if (b < 0x80) {
+          cur_.cols += 1;
+        } else if ((b & 0xe0) == 0xc0 || (b & 0xf0) == 0xe0 || (b & 0xf8) == 0xf0) {
+          cp_ = b & ((b & 0xe0) == 0xc0 ? 0x1f : (b & 0xf0) == 0xe0 ? 0x0f : 0x07);
+          utf8_left_ = (b & 0xe0) == 0xc0 ? 1 : (b & 0xf0) == 0xe0 ? 2 : 3;
+          state_ = state::utf8;
+        } else {
+          barrier();
+        }
+        break;
+      case state::utf8:
+        if ((b & 0xc0) != 0x80) {
+          barrier();
+          state_ = state::ground;
+          feed(b);
+          break;
+        }
+        cp_ = (cp_ << 6) | (b & 0x3f);
+        if (--utf8_left_ == 0) {
+          cur_.cols += char_width(cp_);
+          state_ = state::ground;
+        }
+        break;
+      case state::esc:
+        if (b == '[') {
+          params_.clear();
+          state_ = state::csi;
+        } else {
+          barrier();
+          state_ = state::ground;
+        }
+        break;
+      case state::csi:
+        if (b >= 0x40 && b <= 0x7e) {
+          state_ = state::ground;
+          if (b == 'm' && params_.find_first_of("?<=>") == std::string::npos) break;
+          if (b == 'K' && (params_.empty() || params_ == "0" || params_ == "2")) {
+            cur_.erases = true;
+            break;
+          }
+          barrier();
+        } else if (b == 0x1b) {
+          barrier();
+          state_ = state::esc;
+        } else if (b < 0x20) {
+          barrier();
+        } else if (params_.size() < 16) {
+          params_ += (char)b;
+        }
+        break;
+    }
+  }
+
+  void carriage_return() {
+    // out_ ends with the CR, cur_ is what came after the one before
+    bool fits = cur_.valid && cur_.at_zero && cur_.cols <= cols_;
+    if (fits && prev_.valid && (cur_.erases || cur_.cols >= prev_.cols)) {
+      // the older state is overwritten, keep its sequences, drop its text and the CR after it,
+      // the sequences go with the newer state, which may be dropped in turn
+      size_t end = cur_.start;
+      std::string kept = sequences(prev_.start, end - 1);
+      collapsed_ += end - prev_.start - kept.size();
+      out_.replace(prev_.start, end - prev_.start, kept);
+      cur_.start = prev_.start;
+    }
+    prev_ = cur_;
+    prev_.valid = fits;
+    begin(true);
+  }
+
+  /**
+   * The CSI sequences in out_[begin, end) which still matter at column 0: an
+   * EL there erases the whole line, so only the last one does, and an SGR
+   * only when no reset follows before it.
+   */
+  std::string sequences(size_t begin, size_t end) {
+    seqs_.clear();
+    size_t last_erase = (size_t)-1;
+    for (size_t i = begin; i < end; ++i) {
+      if (out_[i] != 0x1b) continue;
+      size_t j = i + 2;
+      while (j < end && !(out_[j] >= 0x40 && out_[j] <= 0x7e)) ++j;
+      if (out_[j] == 'K') last_erase = seqs_.size();
+      seqs_.push_back({i, j + 1 - i});
+      i = j;
+    }
+    std::string kept;
+    bool reset_after = false;
+    for (size_t k = seqs_.size(); k-- > 0;) {
+      size_t at = seqs_[k].first;
+      size_t size = seqs_[k].second;
+      if (out_[at + size - 1] == 'K') {
+        if (k != last_erase) seqs_[k].second = 0;
+        reset_after = false;
+      } else if (reset_after) {
+        seqs_[k].second = 0;
+      } else {
+        reset_after = size == 3 || (size == 4 && out_[at + 2] == '0');
+      }
+    }
+    for (auto& s : seqs_) kept.append(out_, s.first, s.second);
+    return kept;
+  }
+
+  void begin(bool at_zero) {
+    cur_ = segment();
+    cur_.start = out_.size();
+    cur_.at_zero = at_zero;
+    cur_.valid = true;
+  }
+
+  void barrier() {
+    prev_.valid = false;
+    cur_.valid = false;
+  }
+
+  int cols_;
+  std::string out_;
+  size_t collapsed_ = 0;
+  state state_ = state::ground;
+  std::string params_;
+  uint32_t cp_ = 0;
+  int utf8_left_ = 0;
+  segment prev_;
+  segment cur_;
+  std::vector<std::pair<size_t, size_t>> seqs_;  // offset and size in out_
+};
+
+}  // namespace rterm
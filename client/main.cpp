@@ -1,112 +1,107 @@
 #include "../common/log.h"
-#include "tcp_client.hpp"
+#include "agent.hpp"
+#include "exec_channel.hpp"
+#include "file_channel.hpp"
+#include "forward_channel.hpp"
+#include "pty_channel.hpp"
+#include "sync_channel.hpp"
+#include "tree_channel.hpp"
 
-#define _XOPEN_SOURCE 600  // NOLINT
-#include <fcntl.h>
-#include <sys/ioctl.h>
 #include <unistd.h>
 
-#include <cerrno>
-#include <cstdio>
-#include <cstdlib>
-#include <cstring>
+#include <climits>
+#include <csignal>
 
-static void execNewTerm(int fds) {
-  winsize winSize{.ws_row = 24, .ws_col = 80};
-  ioctl(fds, TIOCSWINSZ, &winSize);
-
-  // The slave side of the PTY becomes the standard input and outputs of the
-  // child process
-  close(0);  // Close standard input (current terminal)
-  close(1);  // Close standard output (current terminal)
-  close(2);  // Close standard error (current terminal)
-
-  dup(fds);  // PTY becomes standard input (0)
-  dup(fds);  // PTY becomes standard output (1)
-  dup(fds);  // PTY becomes standard error (2)
-
-  // Now the original file descriptor is useless
-  close(fds);
-
-  // Make the current process a new session leader
-  setsid();
-
-  // As the child is a session leader, set the controlling terminal to be the
-  // slave side of the PTY (Mandatory for programs like the shell to make them
-  // manage correctly their outputs)
-  ioctl(0, TIOCSCTTY, 1);
-
-  // Execution of the program
-  int rc = execvp("bash", nullptr);
-  if (rc != 0) {
-    LOGE("execvp error: %d, %s", errno, strerror(errno));
-  }
-}
+using namespace rterm;
 
 int main(int argc, char *argv[]) {
-  int fdm = posix_openpt(O_RDWR);
-  if (fdm < 0) {
-    LOGE("posix_openpt error: %d, %s", errno, strerror(errno));
-    return 1;
+  char hostname[HOST_NAME_MAX + 1]{};
+  gethostname(hostname, sizeof(hostname) - 1);
+  // -u: io_uring for the hub connection and the PTYs
+  bool useUring = false;
+  // -t: only this transport, tcp, udp, unix or shm, instead of the hub's Unix socket if it is local and TCP
+  std::string transportName;
+  int opt;
+  while ((opt = getopt(argc, argv, "ut:")) != -1) {
+    switch (opt) {
+      case 'u':
+        useUring = true;
+        break;
+      case 't':
+        transportName = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-u] [-t tcp|udp|unix|shm] [name [hub_host[:port]]]\n", argv[0]);
+        return 2;
+    }
   }
-
-  if (grantpt(fdm) != 0) {
-    LOGE("grantpt error: %d, %s", errno, strerror(errno));
-    return 1;
+  std::string name = optind < argc ? argv[optind] : hostname;
+  // the hub, or a relay in front of it
+  std::string host = optind + 1 < argc ? argv[optind + 1] : "localhost";
+  uint16_t port = 6666;
+  size_t colon = host.rfind(':');
+  if (colon != std::string::npos) {
+    port = (uint16_t)atoi(host.c_str() + colon + 1);
+    host.resize(colon);
   }
 
-  if (unlockpt(fdm) != 0) {
-    LOGE("unlockpt error: %d, %s", errno, strerror(errno));
-    return 1;
-  }
-
-  // Open the slave side ot the PTY
-  int fds = open(ptsname(fdm), O_RDWR);
+  // a command which stops reading its stdin must not take the agent down
+  signal(SIGPIPE, SIG_IGN);
 
   asio::io_context io_context;
-  asio_net::tcp_client tcp_client(io_context);
-
-  asio::posix::stream_descriptor descriptor(io_context);
-  descriptor.assign(fdm);
-
-  std::function<void()> readFromFdm;
-  std::string buffer;
-  buffer.resize(1024);
-  readFromFdm = [&] {
-    descriptor.async_read_some(asio::buffer(buffer), [&](const std::error_code &ec, std::size_t length) {
-      if (ec) {
-        LOGE("descriptor: %s", ec.message().c_str());
-        io_context.stop();
-        return;
-      }
-      tcp_client.send(std::string(buffer.data(), length));
-      readFromFdm();
-    });
-  };
-  readFromFdm();
-
-  tcp_client.on_open = [fds, &io_context] {
-    LOGD("on_open");
-    io_context.notify_fork(asio::execution_context::fork_prepare);
-    if (!fork()) {
-      io_context.notify_fork(asio::execution_context::fork_child);
-      io_context.stop();
-      execNewTerm(fds);
-    } else {
-      io_context.notify_fork(asio::execution_context::fork_parent);
-    }
-  };
-  tcp_client.on_close = [] {
-    LOGD("on_close");
-  };
-  tcp_client.on_open_failed = [](std::error_code ec) {
-    LOGD("on_open_failed: %s", ec.message().c_str());
+  child_reaper reaper(io_context);
+  asio::thread_pool workers(4);  // file reads of tree transfers, delta sync hashing
+
+  agent agent(io_context, host, port, name);
+  if (transportName == "tcp") {
+    agent.use_transport(std::unique_ptr<transport>(new tcp_transport(io_context, host, port)));
+  } else if (transportName == "udp") {
+    agent.use_transport(std::unique_ptr<transport>(new udp_transport(io_context, host, port)));
+#ifdef __linux__
+  } else if (transportName == "unix" || transportName == "shm") {
+    agent.use_transport(std::unique_ptr<transport>(new unix_transport(io_context, shm_link_address(port), transportName == "shm")));
+#endif
+  } else if (!transportName.empty()) {
+    fprintf(stderr, "unknown transport: %s\n", transportName.c_str());
+    return 2;
+  }
+#ifdef __linux__
+  std::unique_ptr<uring> ring;
+  if (useUring) {
+    ring.reset(new uring(io_context));
+    agent.use_uring(*ring);
+  }
+#endif
+  agent.handle(msg::pty_open, [&](uint32_t id) {
+    return std::make_shared<pty_channel>(io_context, agent, reaper, id);
+  });
+  auto newExec = [&](uint32_t id) {
+    return std::make_shared<exec_channel>(io_context, agent, reaper, id);
   };
-  tcp_client.on_data = [fdm](const std::string &data) {
-    write(fdm, data.data(), data.size());
+  agent.handle(msg::exec, newExec);
+  agent.handle(msg::pipe, newExec);
+  auto newFile = [&](uint32_t id) {
+    return std::make_shared<file_channel>(agent, id);
   };
-  tcp_client.open("localhost", 6666);
-  LOGD("try open...");
+  agent.handle(msg::file_get, newFile);
+  agent.handle(msg::file_put, newFile);
+  agent.handle(msg::sync, [&](uint32_t id) {
+    return std::make_shared<sync_channel>(io_context, workers, agent, id);
+  });
+  agent.handle(msg::tree_get, [&](uint32_t id) {
+    return std::make_shared<tree_channel>(io_context, workers, agent, id);
+  });
+  forwarder forwards(io_context, agent);
+  agent.handle(msg::tcp_open, [&](uint32_t id) {
+    return forwards.stream(id);
+  });
+  agent.handle(msg::tcp_attach, [&](uint32_t id) {
+    return forwards.stream(id);
+  });
+  agent.handle(msg::tcp_listen, [&](uint32_t id) {
+    return forwards.listener(id);
+  });
+  agent.start();
 
   asio::io_context::work work(io_context);
   io_context.run();
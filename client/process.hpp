@@ -0,0 +1,78 @@
+#pragma once
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <functional>
+#include <map>
+
+#include "asio.hpp"
+#include "log.h"
+
+namespace rterm {
+
+/**
+ * Collect exit status of forked children without blocking the io_context.
+ */
+class child_reaper {
+ public:
+  explicit child_reaper(asio::io_context& io_context) : signals_(io_context, SIGCHLD) {
+    wait();
+  }
+
+  /// callback receives the shell style exit status: exit code, or 128 + signal
+  void watch(pid_t pid, std::function<void(int status)> cb) {
+    children_[pid] = std::move(cb);
+    reap();  // it may be gone already
+  }
+
+ private:
+  void wait() {
+    signals_.async_wait([this](const std::error_code& ec, int) {
+      if (ec) return;
+      reap();
+      wait();
+    });
+  }
+
+  void reap() {
+    for (auto it = children_.begin(); it != children_.end();) {
+      int status;
+      if (waitpid(it->first, &status, WNOHANG) != it->first) {
+        ++it;
+        continue;
+      }
+      int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      auto cb = std::move(it->second);
+      it = children_.erase(it);
+      cb(code);
+    }
+  }
+
+ private:
+  asio::signal_set signals_;
+  std::map<pid_t, std::function<void(int)>> children_;
+};
+
+/**
+ * fork() with the io_context notified, the child should exec right away.
+ * @return pid in the parent, never returns in the child
+ */
+inline pid_t fork_exec(asio::io_context& io_context, const std::function<void()>& in_child) {
+  io_context.notify_fork(asio::execution_context::fork_prepare);
+  pid_t pid = fork();
+  if (pid == 0) {
+    io_context.notify_fork(asio::execution_context::fork_child);
+    signal(SIGPIPE, SIG_DFL);  // ignored dispositions survive exec
+    in_child();
+    _exit(127);
+  }
+  io_context.notify_fork(asio::execution_context::fork_parent);
+  if (pid < 0) {
+    LOGE("fork error: %d, %s", errno, strerror(errno));
+  }
+  return pid;
+}
+
+}  // namespace rterm
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+#include "agent.hpp"
+#include "byte_scan.hpp"
+#include "line_collapser.hpp"
+#include "process.hpp"
+
+namespace rterm {
+
+inline void execNewTerm(int fds, unsigned short cols, unsigned short rows) {
+  winsize winSize{.ws_row = rows, .ws_col = cols};
+  ioctl(fds, TIOCSWINSZ, &winSize);
+
+  // The slave side of the PTY becomes the standard input and outputs of the
+  // child process
+  close(0);  // Close standard input (current terminal)
+  close(1);  // Close standard output (current terminal)
+  close(2);  // Close standard error (current terminal)
+
+  dup(fds);  // PTY becomes standard input (0)
+  dup(fds);  // PTY becomes standard output (1)
+  dup(fds);  // PTY becomes standard error (2)
+
+  // Now the original file descriptor is useless
+  close(fds);
+
+  // Make the current process a new session leader
+  setsid();
+
+  // As the child is a session leader, set the controlling terminal to be the
+  // slave side of the PTY (Mandatory for programs like the shell to make them
+  // manage correctly their outputs)
+  ioctl(0, TIOCSCTTY, 1);
+
+  // Execution of the program
+  char* const argv[] = {(char*)"bash", nullptr};
+  int rc = execvp("bash", argv);
+  if (rc != 0) {
+    LOGE("execvp error: %d, %s", errno, strerror(errno));
+  }
+}
+
+/**
+ * Interactive bash on a PTY, opened by msg::pty_open.
+ *
+ * When the hub asks for it and the connection is a Unix socket the PTY master
+ * is passed to the hub, msg::pty_fd, which reads and writes it directly from
+ * then on. The agent only waits for the shell to exit, and reports it.
+ *
+ * While the connection is backed up the output is held back instead of
+ * queued, and the states of a progress bar overwritten meanwhile are dropped,
+ * see line_collapser: a pip install over a slow link sends the bar as it is
+ * when the link has room, not every update of it. An interrupt typed, ^C, ^\ or
+ * ^Z, makes a reader paused for what is held read on: the tty driver drops the
+ * output not read yet, what comes after it, the prompt, is taken at once. What
+ * is held was written by the program and still goes out, the screen ends the
+ * same.
+ */
+class pty_channel : public channel, public std::enable_shared_from_this<pty_channel> {
+ public:
+  pty_channel(asio::io_context& io_context, agent& agent, child_reaper& reaper, uint32_t id)
+      : io_context_(io_context), agent_(agent), reaper_(reaper), id_(id), descriptor_(io_context), hold_timer_(io_context) {}
+
+  void on_frame(const frame& f) override {
+    switch (f.type) {
+      case msg::pty_open: {
+        std::string body = f.body();
+        bool pass = body.compare(0, 2, "fd") == 0;
+        int cols = 0, rows = 0;
+        if (sscanf(body.c_str() + (pass ? 2 : 0), "%dx%d", &cols, &rows) != 2 || cols <= 0 || rows <= 0) {
+          cols = pty_cols;
+          rows = pty_rows;
+        }
+        start(pass, (unsigned short)cols, (unsigned short)rows);
+        break;
+      }
+      case msg::pty_data:
+        if (!held_.empty()) interrupt(f.data, f.size);
+        input(f.data, f.size);
+        break;
+      case msg::pty_resize:
+        if (f.size >= 4) resize(get_u16(f.data), get_u16(f.data + 2));
+        break;
+      case msg::close:
+        close();
+        break;
+      default:
+        break;
+    }
+  }
+
+  void on_disconnect() override {
+    close();
+  }
+
+ private:
+  void start(bool pass, unsigned short cols, unsigned short rows) {
+    int fdm = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fdm < 0) {
+      LOGE("posix_openpt error: %d, %s", errno, strerror(errno));
+      finish();
+      return;
+    }
+    fcntl(fdm, F_SETFD, FD_CLOEXEC);
+
+    if (grantpt(fdm) != 0) {
+      LOGE("grantpt error: %d, %s", errno, strerror(errno));
+      ::close(fdm);
+      finish();
+      return;
+    }
+
+    if (unlockpt(fdm) != 0) {
+      LOGE("unlockpt error: %d, %s", errno, strerror(errno));
+      ::close(fdm);
+      finish();
+      return;
+    }
+
+    // Open the slave side ot the PTY
+    int fds = open(ptsname(fdm), O_RDWR | O_NOCTTY);
+    descriptor_.assign(fdm);
+    held_.set_cols(cols);
+
+    pid_ = fork_exec(io_context_, [fds, cols, rows] {
+      execNewTerm(fds, cols, rows);
+    });
+    ::close(fds);
+
+    auto self = shared_from_this();
+    if (pid_ > 0) {
+      reaper_.watch(pid_, [self](int) {
+        self->pid_ = -1;
+        if (self->passed_) return self->finish();
+#ifdef __linux__
+        // a multishot read is not woken by the hangup, the reactor reads the rest and sees it
+        if (self->read_token_) self->ring_->cancel(self->read_token_);
+#endif
+      });
+    }
+
+#ifdef __linux__
+    if (pass && pid_ > 0) {
+      int copy = fcntl(fdm, F_DUPFD_CLOEXEC, 0);
+      if (copy >= 0 && agent_.send_fd(msg::pty_fd, id_, copy)) {
+        LOGD("PTY passed to the hub");
+        passed_ = true;
+        close();
+        return;
+      }
+    }
+    if (agent_.ring()) return read_uring();
+#endif
+    buffer_.resize(1024);
+    read();
+  }
+
+#ifdef __linux__
+  /// one multishot read for the life of the PTY
+  void read_uring() {
+    auto self = shared_from_this();
+    ring_ = agent_.ring();
+    read_token_ = ring_->read(
+        descriptor_.native_handle(), false,
+        [self](const char* data, size_t size) {
+          self->output(data, size);
+        },
+        [self](int err) {
+          self->read_token_ = 0;
+          if ((err == EINVAL || err == ECANCELED) && !self->finished_ && self->descriptor_.is_open()) {
+            // the kernel has no multishot read (before 6.7), or the child has exited: use the reactor
+            self->buffer_.resize(1024);
+            return self->read();
+          }
+          LOGD("descriptor: %s", strerror(err));
+          self->finish();
+        });
+  }
+#endif
+
+  void read() {
+    auto self = shared_from_this();
+    descriptor_.async_read_some(asio::buffer(buffer_), [self](const std::error_code& ec, std::size_t length) {
+      if (ec) {
+        LOGD("descriptor: %s", ec.message().c_str());
+        self->finish();
+        return;
+      }
+      self->output(self->buffer_.data(), length);
+      // the reactor stops reading while much is held, the shell blocks then
+      if (self->held_.size() < max_held) return self->read();
+      self->paused_ = true;
+    });
+  }
+
+  /// the shell gets SIGWINCH
+  void resize(unsigned short cols, unsigned short rows) {
+    if (!descriptor_.is_open() || cols == 0 || rows == 0) return;
+    winsize winSize{.ws_row = rows, .ws_col = cols};
+    ioctl(descriptor_.native_handle(), TIOCSWINSZ, &winSize);
+    held_.set_cols(cols);
+  }
+
+  /// keys typed, what the tty does not take now, a paste, waits until it has room
+  void input(const char* data, size_t size) {
+    if (!descriptor_.is_open()) return;
+    if (!input_.empty()) {
+      input_.append(data, size);
+      return;
+    }
+    ssize_t n = write(descriptor_.native_handle(), data, size);
+    if (n < 0 && errno != EAGAIN && errno != EINTR) return;
+    size_t done = n > 0 ? (size_t)n : 0;
+    if (done == size) return;
+    input_.assign(data + done, size - done);
+    write_later();
+  }
+
+  void write_later() {
+    auto self = shared_from_this();
+    descriptor_.async_wait(asio::posix::descriptor_base::wait_write, [self](const std::error_code& ec) {
+      if (ec || !self->descriptor_.is_open()) return;
+      ssize_t n = write(self->descriptor_.native_handle(), self->input_.data(), self->input_.size());
+      if (n < 0 && errno != EAGAIN && errno != EINTR) return self->input_.clear();
+      if (n > 0) self->input_.erase(0, (size_t)n);
+      if (!self->input_.empty()) self->write_later();
+    });
+  }
+
+  void resume() {
+    if (!paused_ || finished_ || !descriptor_.is_open()) return;
+    paused_ = false;
+    read();
+  }
+
+  /// output of the shell, sent now or held back while the connection has a backlog
+  void output(const char* data, size_t size) {
+    if (held_.empty() && agent_.backlog() < max_backlog) {
+      agent_.send(msg::pty_data, id_, data, size);
+      return;
+    }
+    bool was_empty = held_.empty();
+    held_.append(data, size);
+    if (was_empty) hold();
+  }
+
+  void hold() {
+    auto self = shared_from_this();
+    hold_timer_.expires_after(std::chrono::milliseconds(20));
+    hold_timer_.async_wait([self](const std::error_code& ec) {
+      if (ec || self->held_.empty()) return;
+      if (self->agent_.connected() && self->agent_.backlog() >= max_backlog) return self->hold();
+      self->send_held();
+      self->resume();
+    });
+  }
+
+  /// keys typed while output is held, reads on after an interrupt, the tty driver has flushed its output then
+  void interrupt(const char* data, size_t size) {
+    size_t at = find_control(data, size);
+    if (at == size) return;
+    termios t;
+    if (tcgetattr(descriptor_.native_handle(), &t) != 0 || !(t.c_lflag & ISIG) || (t.c_lflag & NOFLSH)) return;
+    for (; at < size; at += 1 + find_control(data + at + 1, size - at - 1)) {
+      auto c = (cc_t)data[at];
+      if (c == _POSIX_VDISABLE || (c != t.c_cc[VINTR] && c != t.c_cc[VQUIT] && c != t.c_cc[VSUSP])) continue;
+      LOGD("interrupt, %zu bytes of output held", held_.size());
+      resume();
+      return;
+    }
+  }
+
+  void send_held() {
+    if (held_.empty()) return;
+    std::string out = held_.take();
+    agent_.send(msg::pty_data, id_, out.data(), out.size());
+  }
+
+  void close() {
+    std::error_code ec;
+#ifdef __linux__
+    if (read_token_) ring_->cancel(read_token_);
+    read_token_ = 0;
+#endif
+    descriptor_.close(ec);
+  }
+
+  void finish() {
+    if (finished_) return;
+    finished_ = true;
+    close();
+    hold_timer_.cancel();
+    send_held();
+    agent_.send(msg::close, id_);
+    agent_.remove(id_);
+  }
+
+ private:
+  static const size_t max_backlog = 16 * 1024;  // queued to the hub, output is held back from here on
+  static const size_t max_held = 256 * 1024;
+
+  asio::io_context& io_context_;
+  agent& agent_;
+  child_reaper& reaper_;
+  uint32_t id_;
+
+  pid_t pid_ = -1;
+  bool finished_ = false;
+  bool passed_ = false;  // the hub has the PTY
+  bool paused_ = false;  // the reactor does not read, much is held
+  asio::posix::stream_descriptor descriptor_;
+  std::string buffer_;
+  std::string input_;  // keys not written to the PTY yet
+  line_collapser held_;
+  asio::steady_timer hold_timer_;
+#ifdef __linux__
+  uring* ring_ = nullptr;
+  uint64_t read_token_ = 0;
+#endif
+};
+
+}  // namespace rterm
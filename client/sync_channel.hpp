@@ -0,0 +1,251 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <deque>
+
+#include "agent.hpp"
+#include "delta.hpp"
+
+namespace rterm {
+
+/**
+ * Receiving side of a delta sync (msg::sync), see delta.hpp.
+ *
+ * The current file is the basis: its block signatures go to the hub, which
+ * answers with sync_delta ops. The new version is assembled in "<path>.part"
+ * from basis blocks and literal data, checked against the hash in file_end
+ * and renamed over the basis.
+ *
+ * The reads, hashing and writes run on the workers, one signature frame and
+ * one delta at a time, so the PTYs on the io_context are not held up by a
+ * large file. The deltas are applied in the order they came.
+ */
+class sync_channel : public channel, public std::enable_shared_from_this<sync_channel> {
+ public:
+  sync_channel(asio::io_context& io_context, asio::thread_pool& workers, agent& agent, uint32_t id)
+      : io_context_(io_context), workers_(workers), agent_(agent), id_(id) {}
+
+  void on_frame(const frame& f) override {
+    if (done_) return;
+    switch (f.type) {
+      case msg::sync:
+        if (f.size < 12) return finish(EINVAL);
+        start(get_u64(f.data), get_u32(f.data + 8), std::string(f.data + 12, f.size - 12));
+        break;
+      case msg::sync_delta:
+        deltas_.emplace_back(f.data, f.size);
+        apply();
+        break;
+      case msg::file_end:
+        end_hash_ = f.size >= 8 ? get_u64(f.data) : 0;
+        ended_ = true;
+        apply();
+        break;
+      case msg::close:
+        done_ = true;
+        agent_.remove(id_);
+        break;
+      default:
+        break;
+    }
+  }
+
+  void on_disconnect() override {
+    done_ = true;
+  }
+
+ private:
+  void start(uint64_t size, uint32_t mode, const std::string& path) {
+    path_ = path;
+    size_ = size;
+    mode_ = mode & 07777;
+
+    // no basis is fine, everything comes as literal data then
+    struct stat st {};
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      basis_ = std::make_shared<file_handle>(fd);
+      if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return finish(EISDIR);
+      basis_size_ = (uint64_t)st.st_size;
+    }
+    block_size_ = sync_block_size(basis_size_);
+
+    fd = open(part().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return finish(errno);
+    part_ = std::make_shared<file_handle>(fd);
+
+    char v[12];
+    put_u64(v, basis_size_);
+    put_u32(v + 8, block_size_);
+    agent_.send(msg::file_info, id_, v, sizeof(v));
+    signatures();
+  }
+
+  /// one frame per call, read and hashed on a worker
+  void signatures() {
+    if (done_ || sig_offset_ >= basis_size_) return;
+    size_t blocks = std::max<size_t>(1, 4 * file_chunk_size / block_size_);
+    size_t n = (size_t)std::min<uint64_t>(blocks * block_size_, basis_size_ - sig_offset_);
+    uint64_t offset = sig_offset_;
+    sig_offset_ += n;
+
+    auto self = shared_from_this();
+    asio::post(workers_, [self, offset, n] {
+      std::string data(n, '\0');
+      std::string body;
+      errno = 0;
+      int err = self->read_basis(offset, &data[0], n) ? 0 : errno ? errno : EIO;
+      body.reserve((n / self->block_size_ + 1) * block_sig_size);
+      for (size_t i = 0; !err && i < n; i += self->block_size_) {
+        auto sig = block_signature(&data[i], std::min<size_t>(self->block_size_, n - i));
+        char v[block_sig_size];
+        put_u32(v, sig.weak);
+        put_u64(v + 4, sig.strong);
+        body.append(v, sizeof(v));
+      }
+      asio::post(self->io_context_, [self, err, body = std::move(body)] {
+        if (self->done_) return;
+        if (err) return self->finish(err);
+        self->agent_.send(msg::sync_sig, self->id_, body);
+        auto next = [self] {
+          self->signatures();
+        };
+        if (self->agent_.writable()) {
+          next();
+        } else {
+          self->agent_.when_writable(next);
+        }
+      });
+    });
+  }
+
+  /// the next delta on a worker, file_end once all are applied
+  void apply() {
+    if (applying_ || done_) return;
+    if (deltas_.empty()) {
+      if (ended_) end(end_hash_);
+      return;
+    }
+    auto delta = std::make_shared<std::string>(std::move(deltas_.front()));
+    deltas_.pop_front();
+    applying_ = true;
+    auto self = shared_from_this();
+    asio::post(workers_, [self, delta] {
+      errno = 0;
+      bool ok = parse_delta(
+          delta->data(), delta->size(),
+          [&self](uint32_t first, uint32_t count) {
+            return self->copy(first, count);
+          },
+          [&self](const char* data, size_t size) {
+            return self->store(data, size);
+          });
+      int err = ok ? 0 : errno ? errno : EINVAL;
+      asio::post(self->io_context_, [self, err, size = delta->size()] {
+        self->applying_ = false;
+        if (self->done_) return;
+        if (err) return self->finish(err);
+        self->ack(size);
+        self->apply();
+      });
+    });
+  }
+
+  bool copy(uint32_t first, uint32_t count) {
+    uint64_t offset = (uint64_t)first * block_size_;
+    if (!basis_ || offset > basis_size_) return false;
+    uint64_t length = std::min<uint64_t>((uint64_t)count * block_size_, basis_size_ - offset);
+    while (length > 0) {
+      size_t n = (size_t)std::min<uint64_t>(length, file_chunk_size);
+      buffer_.resize(n);
+      if (!read_basis(offset, &buffer_[0], n) || !store(buffer_.data(), n)) return false;
+      offset += n;
+      length -= n;
+    }
+    return true;
+  }
+
+  bool read_basis(uint64_t offset, char* data, size_t size) {
+    while (size > 0) {
+      ssize_t n = pread(basis_->fd, data, size, (off_t)offset);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;  // shrank under us
+      data += n;
+      size -= (size_t)n;
+      offset += (uint64_t)n;
+    }
+    return true;
+  }
+
+  bool store(const char* data, size_t size) {
+    hash_.update(data, size);
+    written_ += size;
+    while (size > 0) {
+      ssize_t n = write(part_->fd, data, size);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      data += n;
+      size -= (size_t)n;
+    }
+    return true;
+  }
+
+  void ack(size_t bytes) {
+    char v[4];
+    put_u32(v, (uint32_t)bytes);
+    agent_.send(msg::file_ack, id_, v, sizeof(v));
+  }
+
+  void end(uint64_t hash) {
+    if (!part_ || written_ != size_ || hash_.digest() != hash) return finish(EIO);
+    if (fchmod(part_->fd, mode_) != 0) return finish(errno);
+    if (rename(part().c_str(), path_.c_str()) != 0) return finish(errno);
+    finish(0);
+  }
+
+  void finish(int status) {
+    if (done_) return;
+    done_ = true;
+    if (status != 0 && part_) unlink(part().c_str());
+    agent_.send(pack_i32(msg::exit, id_, status));
+    agent_.remove(id_);
+  }
+
+  std::string part() const {
+    return path_ + ".part";
+  }
+
+ private:
+  asio::io_context& io_context_;
+  asio::thread_pool& workers_;
+  agent& agent_;
+  uint32_t id_;
+  bool done_ = false;
+
+  std::string path_;
+  uint64_t size_ = 0;
+  uint32_t mode_ = 0;
+
+  std::shared_ptr<file_handle> basis_;
+  uint64_t basis_size_ = 0;
+  uint32_t block_size_ = 0;
+  uint64_t sig_offset_ = 0;  // on the io_context, the signatures are read on the workers
+
+  // of the delta being applied, on a worker
+  std::shared_ptr<file_handle> part_;
+  hash64 hash_;
+  uint64_t written_ = 0;
+  std::string buffer_;
+
+  std::deque<std::string> deltas_;  // not applied yet
+  bool applying_ = false;
+  bool ended_ = false;
+  uint64_t end_hash_ = 0;
+};
+
+}  // namespace rterm
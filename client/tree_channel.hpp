@@ -0,0 +1,321 @@
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <deque>
+
+#include "agent.hpp"
+
+namespace rterm {
+
+/**
+ * Stream a directory tree as one archive (msg::tree_get), so thousands of
+ * small files cost no round trip each.
+ *
+ * The walk and the reads of small files run on a worker pool, reading ahead
+ * up to a memory budget, and the records are sent in the order the reads
+ * complete. Larger files are sent from the io_context with sendfile. At most
+ * pipe_window bytes are in flight, the hub returns credit with file_ack
+ * once it has written them.
+ *
+ * Files which can not be read are reported with exec_err, the exit status is
+ * 1 then.
+ */
+class tree_channel : public channel, public std::enable_shared_from_this<tree_channel> {
+ public:
+  /// files up to this size are read by the workers and sent in their tree_entry
+  static const size_t inline_max = 256 * 1024;
+  /// bytes read ahead but not sent yet
+  static const size_t read_ahead = 16 * 1024 * 1024;
+
+  tree_channel(asio::io_context& io_context, asio::thread_pool& workers, agent& agent, uint32_t id)
+      : io_context_(io_context), workers_(workers), agent_(agent), id_(id) {}
+
+  void on_frame(const frame& f) override {
+    if (done_) return;
+    switch (f.type) {
+      case msg::tree_get:
+        walk(f.body());
+        break;
+      case msg::file_ack:
+        if (f.size < 4) return;
+        // for a file which shrank the hub returns all of its size, more than was taken
+        in_flight_ -= std::min<uint64_t>(get_u32(f.data), in_flight_);
+        pump();
+        break;
+      case msg::close:
+        done_ = true;
+        agent_.remove(id_);
+        break;
+      default:
+        break;
+    }
+  }
+
+  void on_disconnect() override {
+    done_ = true;
+  }
+
+ private:
+  struct entry {
+    std::string path;  // relative
+    struct stat st;
+    std::string link;
+  };
+
+  struct item {
+    std::string record;                 // ready to send
+    size_t reserved = 0;                // of the read ahead budget, released when sent
+    std::string path;                   // a large file, opened when its turn comes
+    std::shared_ptr<file_handle> file;  // open large file
+    uint64_t offset = 0;
+    uint64_t size = 0;
+  };
+
+  static std::string record(char kind, const struct stat& st, uint64_t size, const std::string& path) {
+    std::string r(25, '\0');
+    r[0] = kind;
+    put_u32(&r[1], st.st_mode & 07777);
+    put_u64(&r[5], size);
+    put_u64(&r[13], (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec);
+    put_u32(&r[21], (uint32_t)path.size());
+    r += path;
+    return r;
+  }
+
+  void walk(const std::string& root) {
+    root_ = root;
+    auto self = shared_from_this();
+    asio::post(workers_, [self, root]() mutable {
+      auto entries = std::make_shared<std::vector<entry>>();
+      auto errors = std::make_shared<std::string>();
+      bool is_dir = false;
+      struct stat st {};
+      if (lstat(root.c_str(), &st) != 0) {
+        *errors += root + ": " + strerror(errno) + "\n";
+      } else if (S_ISDIR(st.st_mode)) {
+        is_dir = true;
+        scan(root, "", *entries, *errors);
+      } else {
+        size_t slash = root.rfind('/');
+        entries->push_back(entry{slash == std::string::npos ? root : root.substr(slash + 1), st, {}});
+      }
+      auto& io_context = self->io_context_;
+      asio::post(io_context, [self = std::move(self), entries, errors, is_dir] {
+        self->root_is_dir_ = is_dir;
+        self->walked(*entries, *errors);
+      });
+    });
+  }
+
+  /// on a worker, depth first, a directory before its content
+  static void scan(const std::string& root, const std::string& rel, std::vector<entry>& out, std::string& errors) {
+    std::string dir = rel.empty() ? root : root + "/" + rel;
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+      errors += dir + ": " + strerror(errno) + "\n";
+      return;
+    }
+    while (dirent* de = readdir(d)) {
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+      entry e;
+      e.path = rel.empty() ? de->d_name : rel + "/" + de->d_name;
+      if (fstatat(dirfd(d), de->d_name, &e.st, AT_SYMLINK_NOFOLLOW) != 0) {
+        errors += root + "/" + e.path + ": " + strerror(errno) + "\n";
+        continue;
+      }
+      if (S_ISLNK(e.st.st_mode)) {
+        char target[4096];
+        ssize_t n = readlinkat(dirfd(d), de->d_name, target, sizeof(target));
+        if (n < 0) continue;
+        e.link.assign(target, (size_t)n);
+      }
+      bool is_dir = S_ISDIR(e.st.st_mode);
+      std::string path = e.path;
+      out.push_back(std::move(e));
+      if (is_dir) scan(root, path, out, errors);
+    }
+    closedir(d);
+  }
+
+  void walked(std::vector<entry>& entries, const std::string& errors) {
+    if (done_) return;
+    report(errors);
+    for (auto& e : entries) {
+      if (S_ISDIR(e.st.st_mode)) {
+        queue_.push_back(item{record('d', e.st, 0, e.path)});
+      } else if (S_ISLNK(e.st.st_mode)) {
+        queue_.push_back(item{record('l', e.st, e.link.size(), e.path) + e.link});
+      } else if (!S_ISREG(e.st.st_mode)) {
+        report(source(e.path) + ": not a regular file, skipped\n");
+      } else if ((size_t)e.st.st_size <= inline_max) {
+        reads_.push_back(std::move(e));
+      } else {
+        item i;
+        i.path = e.path;
+        queue_.push_back(std::move(i));
+      }
+    }
+    walked_ = true;
+    read();
+    pump();
+  }
+
+  /// hand small files to the workers while the read ahead budget lasts
+  void read() {
+    while (!reads_.empty() && buffered_ < read_ahead) {
+      auto e = std::make_shared<entry>(std::move(reads_.front()));
+      reads_.pop_front();
+      buffered_ += (size_t)e->st.st_size + 64;
+      ++reading_;
+      auto self = shared_from_this();
+      std::string path = source(e->path);
+      asio::post(workers_, [self, e, path]() mutable {
+        std::string data;
+        int err = 0;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+          err = errno;
+        } else {
+          // it may have grown since the walk, send what fits
+          data.resize(inline_max);
+          size_t got = 0;
+          while (got < data.size()) {
+            ssize_t n = ::read(fd, &data[got], data.size() - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) err = errno;
+            if (n <= 0) break;
+            got += (size_t)n;
+          }
+          data.resize(got);
+          close(fd);
+        }
+        std::string r = err ? std::string() : record('f', e->st, data.size(), e->path) + data;
+        auto& io_context = self->io_context_;
+        asio::post(io_context, [self = std::move(self), e, path, err, r = std::move(r)]() mutable {
+          --self->reading_;
+          if (err) {
+            self->buffered_ -= (size_t)e->st.st_size + 64;
+            self->report(path + ": " + strerror(err) + "\n");
+          } else {
+            item i;
+            i.record = std::move(r);
+            i.reserved = (size_t)e->st.st_size + 64;
+            self->queue_.push_back(std::move(i));
+          }
+          self->read();
+          self->pump();
+        });
+      });
+    }
+  }
+
+  void pump() {
+    if (done_) return;
+    while (!queue_.empty()) {
+      auto& i = queue_.front();
+      if (!i.record.empty()) {
+        if (!take_credit(i.record.size())) return;
+        agent_.send(msg::tree_entry, id_, i.record);
+        buffered_ -= i.reserved;
+        queue_.pop_front();
+        read();
+        continue;
+      }
+      if (!i.file) {
+        if (!open_large(i)) {
+          queue_.pop_front();
+          continue;
+        }
+        continue;  // its record is sent first
+      }
+      struct stat st {};
+      if (i.offset < i.size && fstat(i.file->fd, &st) == 0 && (uint64_t)st.st_size < i.size) {
+        // it shrank (logrotate's copytruncate), the hub finds it short at the next entry
+        i.size = std::max((uint64_t)st.st_size, i.offset);
+      }
+      while (i.offset < i.size) {
+        size_t n = (size_t)std::min<uint64_t>(file_chunk_size, i.size - i.offset);
+        if (!take_credit(n)) return;
+        agent_.send_file(msg::file_data, id_, i.file, (off_t)i.offset, n);
+        i.offset += n;
+      }
+      queue_.pop_front();
+    }
+    if (walked_ && reads_.empty() && reading_ == 0) {
+      done_ = true;
+      agent_.send(pack_i32(msg::exit, id_, failed_ ? 1 : 0));
+      agent_.remove(id_);
+    }
+  }
+
+  /// open a large file, its record goes in front of its data
+  bool open_large(item& i) {
+    std::string path = source(i.path);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st {};
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      report(path + ": " + strerror(errno) + "\n");
+      if (fd >= 0) close(fd);
+      return false;
+    }
+    i.file = std::make_shared<file_handle>(fd);
+    i.size = (uint64_t)st.st_size;
+    item header;
+    header.record = record('f', st, i.size, i.path);
+    queue_.push_front(std::move(header));
+    return true;
+  }
+
+  /// take credit for a frame, false if the window or the connection is full
+  bool take_credit(size_t size) {
+    if (in_flight_ > 0 && in_flight_ + size > pipe_window) return false;
+    if (!agent_.writable()) {
+      if (!waiting_) {
+        waiting_ = true;
+        auto self = shared_from_this();
+        agent_.when_writable([self] {
+          self->waiting_ = false;
+          self->pump();
+        });
+      }
+      return false;
+    }
+    in_flight_ += size;
+    return true;
+  }
+
+  void report(const std::string& errors) {
+    if (errors.empty()) return;
+    failed_ = true;
+    agent_.send(msg::exec_err, id_, errors);
+  }
+
+  std::string source(const std::string& rel) const {
+    return root_is_dir_ ? root_ + "/" + rel : root_;
+  }
+
+ private:
+  asio::io_context& io_context_;
+  asio::thread_pool& workers_;
+  agent& agent_;
+  uint32_t id_;
+  bool done_ = false;
+
+  std::string root_;
+  bool root_is_dir_ = false;
+  bool walked_ = false;
+  std::deque<entry> reads_;
+  size_t reading_ = 0;
+  size_t buffered_ = 0;
+
+  std::deque<item> queue_;
+  uint64_t in_flight_ = 0;
+  bool waiting_ = false;
+  bool failed_ = false;
+};
+
+}  // namespace rterm
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define RTERM_SCAN_AVX2
+#endif
+
+namespace rterm {
+
+/**
+ * Finding the bytes of a terminal stream which are not simply printed: the C0
+ * controls (ESC, CR, LF, BEL, ^C, ...), DEL, and, for find_special(), the
+ * bytes of UTF-8 sequences. What lies between them is a run of printable
+ * ASCII which a parser may take as a whole.
+ *
+ * 32 bytes per step with AVX2 when the CPU has it, chosen at run time, 16 with
+ * SSE2, which every x86_64 has, and a byte at a time elsewhere. See
+ * bench/scan_bench.
+ */
+namespace scan {
+
+inline bool is_control(uint8_t b) {
+  return b < 0x20 || b == 0x7f;
+}
+
+inline bool is_special(uint8_t b) {
+  return b < 0x20 || b >= 0x7f;
+}
+
+/// utf8: UTF-8 bytes are special too
+template <bool utf8>
+inline size_t scalar(const char* data, size_t size) {
+  auto p = reinterpret_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    if (utf8 ? is_special(p[i]) : is_control(p[i])) return i;
+  }
+  return size;
+}
+
+#ifdef __SSE2__
+template <bool utf8>
+inline size_t sse2(const char* data, size_t size) {
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  const __m128i high = _mm_set1_epi8(0x1f);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    // signed, 0x80 and up are below 0x20 too; unsigned, v is at most 0x1f when min(v, 0x1f) is v
+    __m128i hit = utf8 ? _mm_cmplt_epi8(v, space) : _mm_cmpeq_epi8(_mm_min_epu8(v, high), v);
+    int mask = _mm_movemask_epi8(_mm_or_si128(hit, _mm_cmpeq_epi8(v, del)));
+    if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  return i + scalar<utf8>(data + i, size - i);
+}
+#endif
+
+#ifdef RTERM_SCAN_AVX2
+/// 0xff where the 32 bytes at data have what find() looks for
+template <bool utf8>
+__attribute__((target("avx2"))) inline __m256i hits(const char* data) {
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+  __m256i hit = utf8 ? _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v) : _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+  return _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+}
+
+template <bool utf8>
+__attribute__((target("avx2"))) inline size_t avx2(const char* data, size_t size) {
+  size_t i = 0;
+  // two vectors a step while nothing is found, long plain runs are what it is for
+  for (; i + 64 <= size; i += 64) {
+    __m256i a = hits<utf8>(data + i);
+    __m256i b = hits<utf8>(data + i + 32);
+    if (_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) continue;
+    auto mask = (uint64_t)(uint32_t)_mm256_movemask_epi8(a) | (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+    return i + (size_t)__builtin_ctzll(mask);
+  }
+  for (; i + 32 <= size; i += 32) {
+    int mask = _mm256_movemask_epi8(hits<utf8>(data + i));
+    if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  return i + scalar<utf8>(data + i, size - i);
+}
+
+inline bool has_avx2() {
+  static const bool has = __builtin_cpu_supports("avx2");
+  return has;
+}
+#endif
+
+template <bool utf8>
+inline size_t find(const char* data, size_t size) {
+  // most runs between controls are short, a vector only pays off beyond
+  if (size < 16) return scalar<utf8>(data, size);
+#ifdef RTERM_SCAN_AVX2
+  if (size >= 64 && has_avx2()) return avx2<utf8>(data, size);
+#endif
+#ifdef __SSE2__
+  return sse2<utf8>(data, size);
+#else
+  return scalar<utf8>(data, size);
+#endif
+}
+
+}  // namespace scan
+
+/// the first C0 control or DEL in data, size if none
+inline size_t find_control(const char* data, size_t size) {
+  return scan::find<false>(data, size);
+}
+
+/// the first byte which is not printable ASCII, a C0 control, DEL or part of a UTF-8 sequence, size if none
+inline size_t find_special(const char* data, size_t size) {
+  return scan::find<true>(data, size);
+}
+
+}  // namespace rterm
@@ -0,0 +1,385 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "asio.hpp"
+#include "proto.hpp"
+#include "uring.hpp"
+
+namespace rterm {
+
+/**
+ * Immutable payload which may be queued on many connections at once.
+ */
+using shared_buffer = std::shared_ptr<const std::string>;
+
+inline shared_buffer make_shared_buffer(std::string data) {
+  return std::make_shared<const std::string>(std::move(data));
+}
+
+/**
+ * Owns a file descriptor, shared by the queued segments of the file.
+ */
+struct file_handle {
+  explicit file_handle(int fd) : fd(fd) {}
+  ~file_handle() {
+    if (fd >= 0) ::close(fd);
+  }
+  file_handle(const file_handle&) = delete;
+  file_handle& operator=(const file_handle&) = delete;
+
+  int fd;
+};
+
+/**
+ * What a connection has yet to send, in order. File segments and bytes in a
+ * pipe stay in their descriptor until a stream sends them, see connection.
+ */
+struct send_queue {
+  struct item {
+    shared_buffer buffer;
+    std::shared_ptr<file_handle> file;
+    off_t offset;  // -1 for a pipe
+    size_t length;
+    std::shared_ptr<file_handle> attached;  // goes with the first byte of buffer, see connection::send_fd()
+    std::string header;                     // of the frame of a file segment, see frame_file()
+  };
+
+  /**
+   * A file segment at the front gets its frame header in front of it, with
+   * the length of what the file has of it now.
+   */
+  void frame_file() {
+    auto& i = items.front();
+    if (!i.file || i.header.empty()) return;
+    struct stat st {};
+    if (fstat(i.file->fd, &st) == 0) {
+      size_t have = st.st_size > i.offset ? (size_t)std::min<uint64_t>(i.length, (uint64_t)(st.st_size - i.offset)) : 0;
+      bytes -= i.length - have;
+      i.length = have;
+    }
+    std::string header = std::move(i.header);
+    i.header.clear();
+    put_u32(&header[0], (uint32_t)i.length);
+    if (i.length == 0) items.pop_front();
+    items.push_front(item{make_shared_buffer(std::move(header)), nullptr, 0, 0});
+  }
+
+  /// the file shrank between frame_file() and reading it: zeros complete the frame, not to lose the stream
+  static void pad_file(item& i) {
+    i.buffer = make_shared_buffer(std::string(i.length, '\0'));
+    i.file = nullptr;
+  }
+
+  /// files and pipes are read into buffers, for the streams which copy anyway. false if a pipe failed
+  bool materialize() {
+    for (auto& i : items) {
+      if (!materialize(i)) return false;
+    }
+    return true;
+  }
+
+  bool materialize(item& i) {
+    if (!i.file) return true;
+    // a file segment not framed yet is read with its header, as long as what the file has
+    std::string data = std::move(i.header);
+    size_t start = data.size();
+    data.resize(start + i.length);
+    size_t got = 0;
+    while (got < i.length) {
+      char* p = &data[start + got];
+      ssize_t n = i.offset < 0 ? ::read(i.file->fd, p, i.length - got) : ::pread(i.file->fd, p, i.length - got, i.offset + (off_t)got);
+      if (n < 0 && errno == EINTR) continue;
+      if (n > 0) {
+        got += (size_t)n;
+      } else if (start > 0) {
+        break;
+      } else if (i.offset >= 0) {
+        got = i.length;  // framed already, see pad_file()
+      } else {
+        // the pipe failed, the frame can not be completed
+        return false;
+      }
+    }
+    if (start > 0) {
+      put_u32(&data[0], (uint32_t)got);
+      data.resize(start + got);
+      bytes -= i.length - got;
+    }
+    i.buffer = make_shared_buffer(std::move(data));
+    i.file = nullptr;
+    i.header.clear();
+    return true;
+  }
+
+  std::deque<item> items;
+  std::atomic<size_t> bytes{0};  // read by other threads, see sharded_hub
+  size_t sent = 0;               // of the front buffer, by the streams which copy it in pieces
+};
+
+class connection;
+
+/**
+ * The I/O of one kind of transport under a connection: it hands what it
+ * reads to on_data, writes the send_queue as far as it can, and closes the
+ * connection when it fails or the peer goes away. The kinds are in
+ * streams.hpp, a new transport is a new stream and its dialer, see
+ * transport.hpp, and the connection does not change.
+ *
+ * Owned by its connection, its handlers keep the connection alive with
+ * self(). On the executor, like the connection.
+ */
+class stream {
+ public:
+  virtual ~stream() = default;
+
+  virtual void start() = 0;
+
+  /// the queue is not empty and no write is in flight, see writing()
+  virtual void write() = 0;
+
+  /// let go of the descriptors, the handlers still pending find is_open() false
+  virtual void close() = 0;
+
+  virtual bool is_open() const = 0;
+
+  /// where its handlers run
+  virtual asio::any_io_executor executor() = 0;
+
+  /// bytes the kernel has taken but not sent yet, see connection::backlog()
+  virtual size_t unsent() {
+    return 0;
+  }
+
+#ifdef __linux__
+  /// before start(), read and write with the ring where the stream can
+  virtual void use_uring(uring&) {}
+
+  /// queue the frame with fd attached, see connection::send_fd(), false where descriptors can not go
+  virtual bool send_fd(std::string, std::shared_ptr<file_handle>) {
+    return false;
+  }
+
+  virtual int take_fd() {
+    return -1;
+  }
+#endif
+
+  bool writing() const {
+    return writing_;
+  }
+
+ protected:
+  connection& conn() {
+    return *conn_;
+  }
+
+  std::shared_ptr<connection> self();
+  send_queue& queue();
+  void received(const char* data, size_t size);
+  void enqueue(send_queue::item i);
+
+  /// a write completed, the next one if there is more
+  void written();
+
+  /// on_writable if the queue has drained
+  void drained();
+
+  /// the stream failed or the peer went away
+  void fail();
+
+  bool writing_ = false;
+
+ private:
+  friend class connection;
+  connection* conn_ = nullptr;
+};
+
+/**
+ * Stream connection with a queue of shared buffers, the same buffer can be
+ * sent to any number of connections without a copy. Each connection writes
+ * at its own pace, a slow peer only grows its own queue, see queued_bytes().
+ * What is under it, a socket, shared memory, datagrams or a peer in this
+ * process, is its stream, see streams.hpp.
+ *
+ * File segments may be queued too, the socket streams send them from the
+ * page cache with sendfile(2) and they never pass through user space, and so
+ * are bytes already in a pipe, with splice(2). The frame header of a file
+ * segment is made when the segment is sent, with the length the file still
+ * has then: a file which shrank meanwhile (logrotate's copytruncate) goes out
+ * as shorter frames and the peer sees the file short, the stream stays whole.
+ *
+ * Where the stream is a Unix socket a descriptor can go along with a frame,
+ * send_fd(), and the peer takes it with take_fd() when the frame is parsed.
+ *
+ * Not thread safe, use it on its executor() (a strand for a threaded hub).
+ */
+class connection : public std::enable_shared_from_this<connection> {
+ public:
+  explicit connection(std::unique_ptr<stream> io) : stream_(std::move(io)) {
+    stream_->conn_ = this;
+  }
+
+  /// a connection over a new S made of args
+  template <typename S, typename... Args>
+  static std::shared_ptr<connection> make(Args&&... args) {
+    return std::make_shared<connection>(std::unique_ptr<stream>(new S(std::forward<Args>(args)...)));
+  }
+
+  void start() {
+    stream_->start();
+  }
+
+#ifdef __linux__
+  /// before start(), see stream::use_uring()
+  void use_uring(uring& ring) {
+    if (ring.ok()) stream_->use_uring(ring);
+  }
+
+  /// queue the frame with fd attached, which is closed here. false if it can not go, the frame is not sent then
+  bool send_fd(std::string packed, int fd) {
+    auto attached = std::make_shared<file_handle>(fd);
+    if (!stream_->is_open()) return false;
+    return stream_->send_fd(std::move(packed), std::move(attached));
+  }
+
+  /// the descriptor which came with the frame just parsed, the caller owns it. -1 if none came
+  int take_fd() {
+    return stream_->take_fd();
+  }
+#endif
+
+  void send(shared_buffer buffer) {
+    if (!stream_->is_open() || buffer->empty()) return;
+    enqueue(send_queue::item{std::move(buffer), nullptr, 0, 0});
+  }
+
+  void send(std::string data) {
+    send(make_shared_buffer(std::move(data)));
+  }
+
+  /// queue a frame whose body is length bytes of the file from offset, at most
+  void send_file(msg type, uint32_t channel, std::shared_ptr<file_handle> file, off_t offset, size_t length) {
+    if (!stream_->is_open() || length == 0) return;
+#ifdef __linux__
+    enqueue(send_queue::item{nullptr, std::move(file), offset, length, nullptr, pack_header(type, channel, length)});
+#else
+    std::string data(length, '\0');
+    ssize_t n = pread(file->fd, &data[0], length, offset);
+    data.resize(n > 0 ? (size_t)n : 0);
+    send(pack_header(type, channel, data.size()) + data);
+#endif
+  }
+
+#ifdef __linux__
+  /// queue length bytes which are in the pipe, they are spliced out in queue order
+  void send_pipe(std::shared_ptr<file_handle> pipe, size_t length) {
+    if (!stream_->is_open() || length == 0) return;
+    enqueue(send_queue::item{nullptr, std::move(pipe), -1, length});
+  }
+#endif
+
+  void close() {
+    if (!stream_->is_open()) return;
+    stream_->close();
+    // a write in flight still refers to the queue, it is dropped with the connection
+    auto cb = std::move(on_close);
+    on_close = nullptr;
+    on_data = nullptr;
+    on_writable = nullptr;
+    if (cb) cb();
+  }
+
+  /// bytes accepted by send() but not yet written to the stream
+  size_t queued_bytes() const {
+    return queue_.bytes;
+  }
+
+  /// queued_bytes() and what the kernel has of a TCP stream but has not sent yet, what new bytes wait behind
+  size_t backlog() {
+    return queue_.bytes + stream_->unsent();
+  }
+
+  /// producers should hold off while this is false, see on_writable
+  bool writable() const {
+    return queue_.bytes < high_watermark;
+  }
+
+  /// where it is used, post to it from other threads
+  asio::any_io_executor executor() {
+    return stream_->executor();
+  }
+
+ public:
+  std::function<void(const char* data, size_t size)> on_data;
+  std::function<void()> on_close;
+
+  /// the queue went above high_watermark and has drained to half of it
+  std::function<void()> on_writable;
+
+  size_t read_buffer_size = 64 * 1024;
+  size_t high_watermark = 4 * 1024 * 1024;
+
+ private:
+  friend class stream;
+
+  void enqueue(send_queue::item i) {
+    queue_.bytes += (i.buffer ? i.buffer->size() : 0) + i.header.size() + i.length;
+    queue_.items.push_back(std::move(i));
+    if (!writable()) was_full_ = true;
+    if (!stream_->writing()) stream_->write();
+  }
+
+  void drained() {
+    if (was_full_ && queue_.bytes <= high_watermark / 2) {
+      was_full_ = false;
+      if (on_writable) on_writable();
+    }
+  }
+
+ private:
+  send_queue queue_;
+  bool was_full_ = false;
+  std::unique_ptr<stream> stream_;
+};
+
+inline std::shared_ptr<connection> stream::self() {
+  return conn_->shared_from_this();
+}
+
+inline send_queue& stream::queue() {
+  return conn_->queue_;
+}
+
+inline void stream::received(const char* data, size_t size) {
+  if (conn_->on_data) conn_->on_data(data, size);
+}
+
+inline void stream::enqueue(send_queue::item i) {
+  conn_->enqueue(std::move(i));
+}
+
+inline void stream::written() {
+  if (!conn_->queue_.items.empty()) write();
+  drained();
+}
+
+inline void stream::drained() {
+  conn_->drained();
+}
+
+inline void stream::fail() {
+  conn_->close();
+}
+
+}  // namespace rterm
@@ -0,0 +1,405 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "proto.hpp"
+
+namespace rterm {
+
+/**
+ * rsync style delta transfer.
+ *
+ * The side which has an old version of the file (the basis) cuts it into
+ * blocks and sends a signature of each: a weak rolling checksum and a strong
+ * hash. The side with the new version slides a window over it, the weak
+ * checksum is updated per byte in O(1), and emits copy ops for windows which
+ * match a basis block and literal ops for everything else.
+ */
+
+/// 64 bit strong hash, XXH64 with seed 0, streaming
+class hash64 {
+ public:
+  void update(const void* input, size_t size) {
+    auto p = static_cast<const uint8_t*>(input);
+    total_ += size;
+    if (buffered_ + size < 32) {
+      memcpy(buffer_ + buffered_, p, size);
+      buffered_ += size;
+      return;
+    }
+    if (buffered_) {
+      size_t n = 32 - buffered_;
+      memcpy(buffer_ + buffered_, p, n);
+      stripe(buffer_);
+      p += n;
+      size -= n;
+      buffered_ = 0;
+    }
+    for (; size >= 32; p += 32, size -= 32) {
+      stripe(p);
+    }
+    memcpy(buffer_, p, size);
+    buffered_ = size;
+  }
+
+  uint64_t digest() const {
+    uint64_t h;
+    if (total_ >= 32) {
+      h = rotl(v_[0], 1) + rotl(v_[1], 7) + rotl(v_[2], 12) + rotl(v_[3], 18);
+      for (uint64_t v : v_) {
+        h = (h ^ round(0, v)) * p1 + p4;
+      }
+    } else {
+      h = p5;
+    }
+    h += total_;
+
+    const uint8_t* p = buffer_;
+    size_t size = buffered_;
+    for (; size >= 8; p += 8, size -= 8) {
+      h ^= round(0, read64(p));
+      h = rotl(h, 27) * p1 + p4;
+    }
+    if (size >= 4) {
+      h ^= (uint64_t)read32(p) * p1;
+      h = rotl(h, 23) * p2 + p3;
+      p += 4;
+      size -= 4;
+    }
+    for (; size > 0; ++p, --size) {
+      h ^= *p * p5;
+      h = rotl(h, 11) * p1;
+    }
+
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  static uint64_t of(const void* input, size_t size) {
+    hash64 h;
+    h.update(input, size);
+    return h.digest();
+  }
+
+ private:
+  static const uint64_t p1 = 0x9E3779B185EBCA87ULL;
+  static const uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+  static const uint64_t p3 = 0x165667B19E3779F9ULL;
+  static const uint64_t p4 = 0x85EBCA77C2B2AE63ULL;
+  static const uint64_t p5 = 0x27D4EB2F165667C5ULL;
+
+  static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  static uint64_t round(uint64_t acc, uint64_t input) {
+    return rotl(acc + input * p2, 31) * p1;
+  }
+
+  // the frame format is little endian too, so is every host this runs on
+  static uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+  }
+
+  static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+  }
+
+  void stripe(const uint8_t* p) {
+    for (int i = 0; i < 4; ++i) {
+      v_[i] = round(v_[i], read64(p + i * 8));
+    }
+  }
+
+ private:
+  uint64_t v_[4] = {p1 + p2, p2, 0, 0 - p1};
+  uint8_t buffer_[32]{};
+  size_t buffered_ = 0;
+  uint64_t total_ = 0;
+};
+
+/**
+ * Weak checksum of a window of n bytes, as in rsync:
+ * s1 = sum(x[i]), s2 = sum((n - i) * x[i]), value = s1 | s2 << 16 (both mod 2^16)
+ */
+struct rolling_sum {
+  uint32_t s1 = 0;
+  uint32_t s2 = 0;
+  uint32_t n = 0;
+
+  uint32_t value() const {
+    return (s1 & 0xffff) | (s2 << 16);
+  }
+
+  /// slide the window by one byte
+  void roll(uint8_t out, uint8_t in) {
+    s1 += (uint32_t)in - out;
+    s2 += s1 - n * out;
+  }
+};
+
+inline rolling_sum weak_sum_scalar(const char* data, size_t size) {
+  auto p = reinterpret_cast<const uint8_t*>(data);
+  rolling_sum r;
+  r.n = (uint32_t)size;
+  // s2 is the sum of the prefix sums
+  for (size_t i = 0; i < size; ++i) {
+    r.s1 += p[i];
+    r.s2 += r.s1;
+  }
+  return r;
+}
+
+/**
+ * Checksum of a whole window, needed for every basis block and again after
+ * each match, so it is what a mostly unchanged file spends its time on.
+ * 16 bytes per step with SSE2, which every x86_64 has.
+ */
+inline rolling_sum weak_sum(const char* data, size_t size) {
+#ifdef __SSE2__
+  auto p = reinterpret_cast<const uint8_t*>(data);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+  const __m128i w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+  __m128i vs1 = zero;  // byte sums
+  __m128i vps = zero;  // sum of vs1 before each step, each counts 16 times in s2
+  __m128i vs2 = zero;  // the position weighted sums inside the steps
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    vps = _mm_add_epi32(vps, vs1);
+    vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+    vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), w_lo));
+    vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), w_hi));
+  }
+  auto hsum = [](__m128i v) {
+    uint32_t l[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(l), v);
+    return l[0] + l[1] + l[2] + l[3];
+  };
+  rolling_sum r;
+  r.n = (uint32_t)size;
+  r.s1 = hsum(vs1);
+  r.s2 = 16 * hsum(vps) + hsum(vs2);
+  for (; i < size; ++i) {
+    r.s1 += p[i];
+    r.s2 += r.s1;
+  }
+  return r;
+#else
+  return weak_sum_scalar(data, size);
+#endif
+}
+
+struct block_sig {
+  uint32_t weak;
+  uint64_t strong;
+};
+
+/// bytes of one block_sig in sync_sig frames
+static const size_t block_sig_size = 12;
+
+/// like rsync: about sqrt(size), so signatures and per block losses stay balanced
+inline uint32_t sync_block_size(uint64_t size) {
+  auto b = (uint64_t)std::sqrt((double)size) & ~(uint64_t)1023;
+  return (uint32_t)std::max<uint64_t>(2048, std::min<uint64_t>(b, 128 * 1024));
+}
+
+inline block_sig block_signature(const char* data, size_t size) {
+  return block_sig{weak_sum(data, size).value(), hash64::of(data, size)};
+}
+
+/**
+ * Delta ops, a sequence of:
+ * 'c' u32 first block, u32 block count: copy from the basis
+ * 'l' u32 size, bytes: literal data
+ */
+class delta_encoder {
+ public:
+  /// the last block may be short, all others are block_size
+  delta_encoder(uint32_t block_size, uint64_t basis_size, std::vector<block_sig> sigs)
+      : block_size_(block_size), sigs_(std::move(sigs)) {
+    full_blocks_ = (uint32_t)std::min<uint64_t>(basis_size / block_size, sigs_.size());
+    last_size_ = sigs_.size() > full_blocks_ ? (size_t)(basis_size - (uint64_t)full_blocks_ * block_size) : 0;
+
+    size_t buckets = 1;
+    while (buckets < full_blocks_) buckets <<= 1;
+    mask_ = (uint32_t)buckets - 1;
+    head_.assign(buckets, (uint32_t)none);
+    next_.assign(full_blocks_, (uint32_t)none);
+    // reversed, so chains list the earlier blocks first
+    for (uint32_t i = full_blocks_; i-- > 0;) {
+      auto& h = head_[bucket(sigs_[i].weak)];
+      next_[i] = h;
+      h = i;
+    }
+  }
+
+  /**
+   * Append ops for data[pos, ...) to out, stop once out has out_limit bytes
+   * or in_limit bytes of data were consumed, so a large file can be encoded
+   * piecewise without blocking the io_context.
+   * @return the position to continue from, size when done
+   */
+  size_t encode(const char* data, size_t size, size_t pos, std::string& out, size_t out_limit, size_t in_limit) const {
+    const size_t bs = block_size_;
+    const size_t in_end = size - pos > in_limit ? pos + in_limit : size;
+    size_t lit = pos;
+    size_t copy_at = std::string::npos;  // last copy op in out, extended by the following blocks
+    uint32_t want = none;
+
+    auto flush = [&](size_t to) {
+      while (lit < to) {
+        size_t n = std::min(to - lit, (size_t)max_literal);
+        char h[5] = {'l'};
+        put_u32(h + 1, (uint32_t)n);
+        out.append(h, sizeof(h));
+        out.append(data + lit, n);
+        lit += n;
+        copy_at = std::string::npos;
+      }
+    };
+    auto copy = [&](uint32_t index) {
+      flush(pos);
+      if (copy_at != std::string::npos && index == want) {
+        put_u32(&out[copy_at + 5], get_u32(&out[copy_at + 5]) + 1);
+      } else {
+        char op[9] = {'c'};
+        put_u32(op + 1, index);
+        put_u32(op + 5, 1);
+        copy_at = out.size();
+        out.append(op, sizeof(op));
+      }
+      want = index + 1;
+    };
+
+    if (full_blocks_ > 0) {
+      rolling_sum rs;
+      bool fresh = true;
+      while (pos + bs <= size) {
+        if (fresh) {
+          rs = weak_sum(data + pos, bs);
+          fresh = false;
+        }
+        uint32_t index = find(rs.value(), data + pos, want);
+        if (index != none) {
+          copy(index);
+          pos += bs;
+          lit = pos;
+          fresh = true;
+          if (out.size() >= out_limit || pos >= in_end) return pos;
+          continue;
+        }
+        if (pos - lit >= max_literal) {
+          flush(pos);
+          if (out.size() >= out_limit || pos >= in_end) return pos;
+        }
+        // data[size] is not there, past the end of a mapping of the file
+        if (pos + bs == size) break;
+        rs.roll((uint8_t)data[pos], (uint8_t)data[pos + bs]);
+        ++pos;
+      }
+    }
+
+    // the tail may still be the short last block of the basis
+    pos = size;
+    if (last_size_ > 0 && size - lit == last_size_) {
+      const auto& sig = sigs_[full_blocks_];
+      const char* p = data + lit;
+      if (weak_sum(p, last_size_).value() == sig.weak && hash64::of(p, last_size_) == sig.strong) {
+        pos = lit;
+        copy(full_blocks_);
+        lit = size;
+        return size;
+      }
+    }
+    while (lit < size) {
+      flush(size - lit > max_literal ? lit + max_literal : size);
+      if (out.size() >= out_limit && lit < size) return lit;
+    }
+    return size;
+  }
+
+ private:
+  static const uint32_t none = 0xffffffff;
+  static const size_t max_literal = 1024 * 1024;
+
+  uint32_t bucket(uint32_t weak) const {
+    return (weak * 0x9E3779B1u >> 7) & mask_;
+  }
+
+  /// @param want the block after the previous match, preferred so copies merge
+  uint32_t find(uint32_t weak, const char* p, uint32_t want) const {
+    uint32_t i = head_[bucket(weak)];
+    if (i == none) return none;
+    uint64_t strong = 0;
+    bool hashed = false;
+    auto same = [&](uint32_t index) {
+      if (sigs_[index].weak != weak) return false;
+      if (!hashed) {
+        strong = hash64::of(p, block_size_);
+        hashed = true;
+      }
+      return sigs_[index].strong == strong;
+    };
+    if (want < full_blocks_ && same(want)) return want;
+    for (; i != none; i = next_[i]) {
+      if (same(i)) return i;
+    }
+    return none;
+  }
+
+ private:
+  uint32_t block_size_;
+  std::vector<block_sig> sigs_;
+  uint32_t full_blocks_;
+  size_t last_size_;
+  uint32_t mask_;
+  std::vector<uint32_t> head_;
+  std::vector<uint32_t> next_;
+};
+
+/**
+ * Walk the ops of a delta, see delta_encoder.
+ * @return false if they are malformed or a callback fails
+ */
+inline bool parse_delta(const char* data, size_t size, const std::function<bool(uint32_t first, uint32_t count)>& copy,
+                        const std::function<bool(const char* data, size_t size)>& literal) {
+  size_t pos = 0;
+  while (pos < size) {
+    if (size - pos < 5) return false;
+    char op = data[pos];
+    uint32_t v = get_u32(data + pos + 1);
+    if (op == 'c') {
+      if (size - pos < 9) return false;
+      if (!copy(v, get_u32(data + pos + 5))) return false;
+      pos += 9;
+    } else if (op == 'l') {
+      if (size - pos - 5 < v) return false;
+      if (!literal(data + pos + 5, v)) return false;
+      pos += 5 + v;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace rterm
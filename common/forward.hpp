@@ -0,0 +1,255 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <deque>
+
+#include "connection.hpp"
+#include "log.h"
+#include "proto.hpp"
+
+namespace rterm {
+
+/**
+ * One forwarded TCP connection, the same on both ends of a channel: bytes
+ * read from the socket go out as tcp_data, tcp_data from the peer is written
+ * to the socket.
+ *
+ * Each direction has its own window of tcp_window bytes, returned by tcp_ack
+ * once the peer wrote them, so one slow connection never stalls the others
+ * sharing the agent connection.
+ *
+ * On Linux the socket is spliced into a pipe and the pipe into the agent
+ * connection, the bytes do not pass through user space on the way out.
+ * Incoming frames are parsed, so that direction takes one copy.
+ *
+ * Ends gracefully once tcp_eof went both ways and everything was written,
+ * otherwise msg::close aborts it on both ends.
+ */
+class tcp_stream : public std::enable_shared_from_this<tcp_stream> {
+ public:
+  tcp_stream(asio::ip::tcp::socket socket, std::weak_ptr<connection> conn, uint32_t channel)
+      : socket_(std::move(socket)), resolver_(socket_.get_executor()), conn_(std::move(conn)), channel_(channel), pipe_in_(socket_.get_executor()) {}
+
+  ~tcp_stream() {
+    std::error_code ec;
+    pipe_in_.close(ec);
+  }
+
+  /// the socket is connected
+  void start() {
+    connected_ = true;
+#ifdef __linux__
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+      LOGE("pipe2: %s", strerror(errno));
+      return abort();
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, 256 * 1024);  // best effort, the default is 64 KiB
+    pipe_out_ = std::make_shared<file_handle>(fds[0]);
+    pipe_in_.assign(fds[1]);
+    pipe_size_ = (size_t)std::max(4096, fcntl(fds[1], F_GETPIPE_SZ));
+    std::error_code ec;
+    socket_.native_non_blocking(true, ec);
+#endif
+    read();
+    write();
+  }
+
+  /// resolve and connect the socket first, tcp_data from the peer waits meanwhile
+  void connect(const std::string& host, const std::string& port) {
+    auto self = shared_from_this();
+    resolver_.async_resolve(host, port, [self](const std::error_code& ec, const asio::ip::tcp::resolver::results_type& endpoints) {
+      if (ec) {
+        LOGW("resolve: %s", ec.message().c_str());
+        return self->abort();
+      }
+      if (self->done_) return;
+      asio::async_connect(self->socket_, endpoints, [self](const std::error_code& ec, const asio::ip::tcp::endpoint&) {
+        if (ec) {
+          LOGW("connect: %s", ec.message().c_str());
+          return self->abort();
+        }
+        if (self->done_) return;
+        self->socket_.set_option(asio::ip::tcp::no_delay(true));
+        self->start();
+      });
+    });
+  }
+
+  void on_frame(const frame& f) {
+    if (done_) return;
+    switch (f.type) {
+      case msg::tcp_data:
+        writes_.emplace_back(f.data, f.size);
+        write();
+        break;
+      case msg::tcp_ack:
+        if (f.size < 4) return;
+        in_flight_ -= std::min<size_t>(get_u32(f.data), in_flight_);
+        if (paused_) {
+          paused_ = false;
+          read();
+        }
+        break;
+      case msg::tcp_eof:
+        peer_eof_ = true;
+        write();
+        break;
+      case msg::close:
+        finish(false);
+        break;
+      default:
+        break;
+    }
+  }
+
+  /// tell the peer and close, e.g. the agent connection is going away
+  void abort() {
+    if (done_) return;
+    send(pack(msg::close, channel_));
+    finish(false);
+  }
+
+ public:
+  /// closed, true if both directions ended gracefully
+  std::function<void(bool graceful)> on_done;
+
+ private:
+  void read() {
+    if (done_ || !connected_ || read_done_) return;
+    if (in_flight_ >= tcp_window) {
+      paused_ = true;
+      return;
+    }
+    auto self = shared_from_this();
+    socket_.async_wait(asio::socket_base::wait_read, [self](const std::error_code& ec) {
+      if (self->done_) return;
+      if (ec) return self->abort();
+      self->pump_in();
+    });
+  }
+
+  void pump_in() {
+    size_t want = tcp_window - in_flight_;
+#ifdef __linux__
+    int queued = 0;
+    ioctl(pipe_out_->fd, FIONREAD, &queued);
+    size_t room = pipe_size_ - std::min(pipe_size_, (size_t)queued);
+    if (room == 0) return wait_pipe();
+    ssize_t n = ::splice(socket_.native_handle(), nullptr, pipe_in_.native_handle(), nullptr, std::min(want, room),
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      // the pipe may be out of slots before it is out of bytes, tell that from an empty socket
+      return queued > 0 ? wait_pipe() : read();
+    }
+    if (n < 0) return abort();
+    if (n > 0) {
+      auto conn = conn_.lock();
+      if (!conn) return finish(false);
+      conn->send(pack_header(msg::tcp_data, channel_, (size_t)n));
+      conn->send_pipe(pipe_out_, (size_t)n);
+    }
+#else
+    buffer_.resize(std::min<size_t>(want, 64 * 1024));
+    std::error_code ec;
+    size_t n = socket_.read_some(asio::buffer(buffer_), ec);
+    if (ec == asio::error::would_block) return read();
+    if (ec && ec != asio::error::eof) return abort();
+    if (n > 0) send(pack(msg::tcp_data, channel_, buffer_.data(), n));
+#endif
+    if (n == 0) {
+      read_done_ = true;
+      send(pack(msg::tcp_eof, channel_));
+      return check_done();
+    }
+    in_flight_ += (size_t)n;
+    read();
+  }
+
+#ifdef __linux__
+  /// the pipe is full of bytes the agent connection has not taken yet
+  void wait_pipe() {
+    auto self = shared_from_this();
+    pipe_in_.async_wait(asio::posix::descriptor_base::wait_write, [self](const std::error_code& ec) {
+      if (self->done_) return;
+      if (ec) return self->abort();
+      self->read();
+    });
+  }
+#endif
+
+  void write() {
+    if (done_ || !connected_ || writing_) return;
+    if (writes_.empty()) {
+      if (peer_eof_ && !shutdown_) {
+        shutdown_ = true;
+        std::error_code ec;
+        socket_.shutdown(asio::ip::tcp::socket::shutdown_send, ec);
+        check_done();
+      }
+      return;
+    }
+    writing_ = true;
+    auto self = shared_from_this();
+    asio::async_write(socket_, asio::buffer(writes_.front()), [self](const std::error_code& ec, std::size_t length) {
+      self->writing_ = false;
+      if (self->done_) return;
+      if (ec) return self->abort();
+      self->writes_.pop_front();
+      char v[4];
+      put_u32(v, (uint32_t)length);
+      self->send(pack(msg::tcp_ack, self->channel_, v, sizeof(v)));
+      self->write();
+    });
+  }
+
+  void check_done() {
+    if (read_done_ && shutdown_) finish(true);
+  }
+
+  void finish(bool graceful) {
+    if (done_) return;
+    done_ = true;
+    std::error_code ec;
+    resolver_.cancel();
+    socket_.close(ec);
+    pipe_in_.close(ec);
+    writes_.clear();
+    auto cb = std::move(on_done);
+    on_done = nullptr;
+    if (cb) cb(graceful);
+  }
+
+  void send(std::string packed) {
+    auto conn = conn_.lock();
+    if (conn) conn->send(std::move(packed));
+  }
+
+ private:
+  asio::ip::tcp::socket socket_;
+  asio::ip::tcp::resolver resolver_;
+  std::weak_ptr<connection> conn_;
+  uint32_t channel_;
+  bool connected_ = false;
+  bool done_ = false;
+
+  // socket -> peer
+  asio::posix::stream_descriptor pipe_in_;  // write end of the splice pipe
+  std::shared_ptr<file_handle> pipe_out_;   // read end, queued on the connection
+  size_t pipe_size_ = 0;
+  std::string buffer_;  // without splice
+  size_t in_flight_ = 0;
+  bool paused_ = false;
+  bool read_done_ = false;
+
+  // peer -> socket
+  std::deque<std::string> writes_;
+  bool writing_ = false;
+  bool peer_eof_ = false;
+  bool shutdown_ = false;
+};
+
+}  // namespace rterm
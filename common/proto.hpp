@@ -0,0 +1,200 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+
+namespace rterm {
+
+/**
+ * Message types carried between hub (terminal_server) and agent (terminal_client).
+ * Every message belongs to a channel, channel 0 is the connection itself.
+ */
+enum class msg : uint8_t {
+  hello = 1,  // agent -> hub: agent name
+  pty_open,   // hub -> agent: start an interactive shell on the channel, body "fd" to take its PTY over, see pty_fd,
+              // and "COLSxROWS" for its size, e.g. "fd 120x40"
+  pty_data,   // both: terminal bytes
+  exec,       // hub -> agent: run a non-interactive command, body is the command line
+  exec_out,   // agent -> hub: command stdout
+  exit,       // agent -> hub: channel finished, body is int32 exit status
+  close,      // both: channel closed
+  view,       // viewer -> hub: watch the PTY of the named agent, empty for the primary one
+  exec_err,   // agent -> hub: command stderr
+  pipe,       // hub -> agent: like exec, but the command stdin is fed by exec_in
+  exec_in,    // hub -> agent: command stdin
+  exec_eof,   // hub -> agent: close command stdin
+  exec_ack,   // agent -> hub: u32 count of stdin bytes written to the command, returns send credit
+  file_get,   // hub -> agent: u64 offset, path. answered by file_info, file_data..., exit
+  file_put,   // hub -> agent: u64 size, u32 mode, path. answered by file_info, then file_data... from the hub
+  file_info,  // agent -> hub: u64 size, u32 mode. for file_put the size already received, resume from there
+  file_data,  // both: file content, in order
+  file_end,   // hub -> agent: all file_data of file_put sent
+  file_ack,   // receiver -> sender: u32 count of bytes stored, returns send credit
+  sync,        // hub -> agent: u64 size, u32 mode, path. the agent answers file_info with u64 size of its
+               // version of the file and u32 block size, then sync_sig of all blocks
+  sync_sig,    // agent -> hub: block signatures, u32 weak checksum and u64 strong hash each
+  sync_delta,  // hub -> agent: delta ops against the blocks, acked by file_ack. then file_end with u64 hash of the file
+  tree_get,    // hub -> agent: path of a directory. answered by tree_entry and file_data..., then exit
+  tree_entry,  // agent -> hub: u8 kind ('d', 'f' or 'l'), u32 mode, u64 size, u64 mtime in ns, u32 path size, path
+               // relative to the requested one, then the content if it fits, else size bytes of file_data follow
+  tcp_open,    // hub -> agent: "host:port", connect to it and forward the channel
+  tcp_listen,  // hub -> agent: "[address:]port", listen there, every connection is announced by tcp_accept
+  tcp_accept,  // agent -> hub: u32 token of an accepted connection on the tcp_listen channel
+  tcp_attach,  // hub -> agent: u32 token, forward the accepted connection on this channel
+  tcp_data,    // both: stream bytes
+  tcp_ack,     // both: u32 count of tcp_data bytes written to the socket, returns send credit
+  tcp_eof,     // both: the socket read side ended, shut down the write side of the other socket
+  ping,        // hub -> agent or viewer, channel 0: u64 hub time, answered by pong with the same body
+  pong,        // agent or viewer -> hub: the body of the ping
+  pty_fd,      // agent -> hub, on a Unix socket: the PTY master of the channel comes along with SCM_RIGHTS, the hub
+               // reads and writes it from now on. the handler gets its i32 descriptor as the body, -1 if none came
+  pty_resize,  // hub -> agent: u16 cols, u16 rows, the terminal of the PTY of the channel changed size
+};
+
+/// PTY size the agent starts shells with when the hub does not give one
+static const int pty_cols = 80;
+static const int pty_rows = 24;
+
+/// exec_in bytes the hub may have in flight before it waits for exec_ack
+static const uint32_t pipe_window = 8 * 1024 * 1024;
+
+/// tcp_data bytes a forwarded connection may have in flight in each direction
+static const uint32_t tcp_window = 1024 * 1024;
+
+/// file_data frame size, and the amount file_ack is sent for
+static const size_t file_chunk_size = 1024 * 1024;
+
+/// the hub pings every connection this often, a hub silent for agent_dead_after_ms is given up by the agent
+static const uint32_t heartbeat_interval_ms = 2000;
+static const uint32_t agent_dead_after_ms = 10000;
+
+/**
+ * Frame layout, little endian:
+ * | u32 body size | u8 type | u32 channel | body |
+ */
+static const size_t frame_header_size = 9;
+static const uint32_t frame_max_body_size = 16 * 1024 * 1024;
+
+struct frame {
+  msg type;
+  uint32_t channel;
+  const char* data;
+  uint32_t size;
+
+  std::string body() const {
+    return std::string(data, size);
+  }
+};
+
+inline void put_u16(char* p, uint16_t v) {
+  p[0] = (char)(v & 0xff);
+  p[1] = (char)((v >> 8) & 0xff);
+}
+
+inline uint16_t get_u16(const char* p) {
+  auto u = reinterpret_cast<const uint8_t*>(p);
+  return (uint16_t)(u[0] | (u[1] << 8));
+}
+
+inline void put_u32(char* p, uint32_t v) {
+  p[0] = (char)(v & 0xff);
+  p[1] = (char)((v >> 8) & 0xff);
+  p[2] = (char)((v >> 16) & 0xff);
+  p[3] = (char)((v >> 24) & 0xff);
+}
+
+inline uint32_t get_u32(const char* p) {
+  auto u = reinterpret_cast<const uint8_t*>(p);
+  return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+inline void put_u64(char* p, uint64_t v) {
+  put_u32(p, (uint32_t)v);
+  put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+inline uint64_t get_u64(const char* p) {
+  return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/// only the header, the body of size bytes follows separately, e.g. by sendfile
+inline std::string pack_header(msg type, uint32_t channel, size_t size) {
+  std::string out;
+  out.resize(frame_header_size);
+  put_u32(&out[0], (uint32_t)size);
+  out[4] = (char)type;
+  put_u32(&out[5], channel);
+  return out;
+}
+
+inline std::string pack(msg type, uint32_t channel, const void* data, size_t size) {
+  std::string out;
+  out.resize(frame_header_size + size);
+  put_u32(&out[0], (uint32_t)size);
+  out[4] = (char)type;
+  put_u32(&out[5], channel);
+  if (size) memcpy(&out[frame_header_size], data, size);
+  return out;
+}
+
+inline std::string pack(msg type, uint32_t channel, const std::string& body = std::string()) {
+  return pack(type, channel, body.data(), body.size());
+}
+
+inline std::string pack_i32(msg type, uint32_t channel, int32_t value) {
+  char v[4];
+  put_u32(v, (uint32_t)value);
+  return pack(type, channel, v, sizeof(v));
+}
+
+/**
+ * Reassemble frames from a byte stream which may split or merge them arbitrarily.
+ */
+class frame_parser {
+ public:
+  /**
+   * @return false on protocol error, the connection should be dropped
+   */
+  bool feed(const char* data, size_t size) {
+    if (buffer_.empty()) {
+      // fast path: parse straight from the input, keep only the tail
+      size_t used = parse(data, size);
+      if (used == (size_t)-1) return false;
+      buffer_.assign(data + used, size - used);
+      return true;
+    }
+    buffer_.append(data, size);
+    size_t used = parse(buffer_.data(), buffer_.size());
+    if (used == (size_t)-1) return false;
+    buffer_.erase(0, used);
+    return true;
+  }
+
+  bool feed(const std::string& data) {
+    return feed(data.data(), data.size());
+  }
+
+ public:
+  std::function<void(const frame&)> on_frame;
+
+ private:
+  size_t parse(const char* data, size_t size) {
+    size_t pos = 0;
+    while (size - pos >= frame_header_size) {
+      uint32_t body_size = get_u32(data + pos);
+      if (body_size > frame_max_body_size) return (size_t)-1;
+      if (size - pos < frame_header_size + body_size) break;
+      frame f{(msg)data[pos + 4], get_u32(data + pos + 5), data + pos + frame_header_size, body_size};
+      pos += frame_header_size + body_size;
+      if (on_frame) on_frame(f);
+    }
+    return pos;
+  }
+
+ private:
+  std::string buffer_;
+};
+
+}  // namespace rterm
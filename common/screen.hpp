@@ -0,0 +1,783 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace rterm {
+
+enum attr_flag : uint16_t {
+  attr_bold = 1 << 0,
+  attr_dim = 1 << 1,
+  attr_italic = 1 << 2,
+  attr_underline = 1 << 3,
+  attr_blink = 1 << 4,
+  attr_inverse = 1 << 5,
+  attr_hidden = 1 << 6,
+  attr_strike = 1 << 7,
+};
+
+struct cell_attr {
+  uint32_t fg = 0;  // 0: default, 1 + index: 256 color palette, color_rgb | rgb: true color
+  uint32_t bg = 0;
+  uint16_t flags = 0;
+
+  static const uint32_t color_rgb = 0x1000000;
+
+  bool operator==(const cell_attr& o) const {
+    return fg == o.fg && bg == o.bg && flags == o.flags;
+  }
+  bool operator!=(const cell_attr& o) const {
+    return !(*this == o);
+  }
+};
+
+struct cell {
+  uint32_t ch = ' ';  // unicode code point, 0 for the right half of a wide char
+  cell_attr attr;
+
+  bool operator==(const cell& o) const {
+    return ch == o.ch && attr == o.attr;
+  }
+  bool operator!=(const cell& o) const {
+    return !(*this == o);
+  }
+};
+
+/// columns taken by a code point on a terminal, 0 for combining marks
+inline int char_width(uint32_t cp) {
+  if (cp >= 0x300 && cp <= 0x36f) return 0;
+  if (cp == 0x200b || (cp >= 0x200c && cp <= 0x200f) || (cp >= 0xfe00 && cp <= 0xfe0f)) return 0;
+  if ((cp >= 0x1100 && cp <= 0x115f) || (cp >= 0x2e80 && cp <= 0x303e) || (cp >= 0x3041 && cp <= 0x33ff) ||
+      (cp >= 0x3400 && cp <= 0x4dbf) || (cp >= 0x4e00 && cp <= 0x9fff) || (cp >= 0xa000 && cp <= 0xa4cf) ||
+      (cp >= 0xac00 && cp <= 0xd7a3) || (cp >= 0xf900 && cp <= 0xfaff) || (cp >= 0xfe30 && cp <= 0xfe4f) ||
+      (cp >= 0xff00 && cp <= 0xff60) || (cp >= 0xffe0 && cp <= 0xffe6) || (cp >= 0x1f300 && cp <= 0x1f64f) ||
+      (cp >= 0x1f900 && cp <= 0x1f9ff) || (cp >= 0x20000 && cp <= 0x3fffd)) {
+    return 2;
+  }
+  return 1;
+}
+
+inline void append_utf8(std::string& out, uint32_t cp) {
+  if (cp < 0x80) {
+    out += (char)cp;
+  } else if (cp < 0x800) {
+    out += (char)(0xc0 | (cp >> 6));
+    out += (char)(0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    out += (char)(0xe0 | (cp >> 12));
+    out += (char)(0x80 | ((cp >> 6) & 0x3f));
+    out += (char)(0x80 | (cp & 0x3f));
+  } else {
+    out += (char)(0xf0 | (cp >> 18));
+    out += (char)(0x80 | ((cp >> 12) & 0x3f));
+    out += (char)(0x80 | ((cp >> 6) & 0x3f));
+    out += (char)(0x80 | (cp & 0x3f));
+  }
+}
+
+/// SGR sequence which switches a terminal from any state to attr
+inline void append_sgr(std::string& out, const cell_attr& a) {
+  out += "\x1b[0";
+  static const char* codes[] = {";1", ";2", ";3", ";4", ";5", ";7", ";8", ";9"};
+  for (int i = 0; i < 8; ++i) {
+    if (a.flags & (1 << i)) out += codes[i];
+  }
+  auto color = [&](uint32_t c, int base) {
+    if (c == 0) return;
+    if (c & cell_attr::color_rgb) {
+      out += ';' + std::to_string(base + 8) + ";2;" + std::to_string((c >> 16) & 0xff) + ';' + std::to_string((c >> 8) & 0xff) + ';' +
+             std::to_string(c & 0xff);
+    } else if (c <= 8) {
+      out += ';' + std::to_string(base + (int)c - 1);
+    } else {
+      out += ';' + std::to_string(base + 8) + ";5;" + std::to_string(c - 1);
+    }
+  };
+  color(a.fg, 30);
+  color(a.bg, 40);
+  out += 'm';
+}
+
+/// DEC private modes which change what a terminal sends for keys and the mouse, bit i of screen::modes() is input_modes[i]
+static const int input_modes[] = {1, 1000, 1002, 1003, 1004, 1005, 1006, 1015, 2004};
+/// application keypad, ESC = and ESC >, the bit after them
+static const uint32_t mode_app_keypad = 1u << (sizeof(input_modes) / sizeof(input_modes[0]));
+
+/// sequences which switch the input modes of a terminal from one set to another
+inline void append_modes(std::string& out, uint32_t from, uint32_t to) {
+  for (size_t i = 0; i < sizeof(input_modes) / sizeof(input_modes[0]); ++i) {
+    uint32_t bit = 1u << i;
+    if ((from & bit) != (to & bit)) out += "\x1b[?" + std::to_string(input_modes[i]) + (to & bit ? 'h' : 'l');
+  }
+  if ((from & mode_app_keypad) != (to & mode_app_keypad)) out += to & mode_app_keypad ? "\x1b=" : "\x1b>";
+}
+
+/**
+ * Model of a VT100/xterm screen fed with the bytes a program writes to its
+ * terminal. Covers what shells and full screen programs commonly use: cursor
+ * motion, erase, scroll region, insert/delete, SGR colors, alternate screen
+ * and UTF-8 with wide chars. Unknown sequences are parsed and ignored.
+ */
+class screen {
+ public:
+  screen(int cols, int rows) {
+    resize(cols, rows);
+  }
+
+  /**
+   * Keeps what fits of both grids and the cursor where it was, like a
+   * terminal does. When rows go away from under the cursor the top lines
+   * scroll off instead, so the line being typed on stays.
+   */
+  void resize(int cols, int rows) {
+    cols = std::max(cols, 1);
+    rows = std::max(rows, 1);
+    int shift = std::max(0, cy_ - (rows - 1));
+    refit(main_, cols, rows, shift);
+    refit(alt_, cols, rows, shift);
+    cols_ = cols;
+    rows_ = rows;
+    cx_ = std::min(cx_, cols_ - 1);
+    cy_ -= shift;
+    saved_x_ = std::min(saved_x_, cols_ - 1);
+    saved_y_ = std::max(0, std::min(saved_y_ - shift, rows_ - 1));
+    top_ = 0;
+    bottom_ = rows_ - 1;
+    wrap_pending_ = false;
+  }
+
+  int cols() const {
+    return cols_;
+  }
+  int rows() const {
+    return rows_;
+  }
+  int cursor_x() const {
+    return cx_;
+  }
+  int cursor_y() const {
+    return cy_;
+  }
+  bool cursor_visible() const {
+    return cursor_visible_;
+  }
+  bool alt_screen() const {
+    return alt_active_;
+  }
+  /// times the alternate screen was entered or left
+  uint32_t alt_switches() const {
+    return alt_switches_;
+  }
+  bool autowrap() const {
+    return autowrap_;
+  }
+  int scroll_top() const {
+    return top_;
+  }
+  int scroll_bottom() const {
+    return bottom_;
+  }
+  /// cursor and pen saved by DECSC or 1049h
+  int saved_x() const {
+    return saved_x_;
+  }
+  int saved_y() const {
+    return saved_y_;
+  }
+  const cell_attr& saved_pen() const {
+    return saved_pen_;
+  }
+  /// input modes set, see input_modes
+  uint32_t modes() const {
+    return modes_;
+  }
+  const cell_attr& pen() const {
+    return pen_;
+  }
+  /// the next char goes to the start of the next line, moving the cursor would lose that
+  bool wrap_pending() const {
+    return wrap_pending_;
+  }
+  /// not in the middle of an escape sequence or a UTF-8 char, bytes of our own may go in
+  bool idle() const {
+    return state_ == state::ground && utf8_left_ == 0;
+  }
+
+  const cell& at(int x, int y) const {
+    return grid()[(size_t)(y * cols_ + x)];
+  }
+
+  void feed(const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      feed_byte((uint8_t)data[i]);
+    }
+  }
+
+  void feed(const std::string& data) {
+    feed(data.data(), data.size());
+  }
+
+  /**
+   * Escape sequences which make a terminal in any state show this screen.
+   */
+  std::string snapshot() const {
+    std::string out;
+    out += alt_active_ ? "\x1b[?1049h" : "\x1b[?1049l";
+    out += "\x1b[r\x1b[0m\x1b[H\x1b[2J";
+    cell_attr cur;
+    for (int y = 0; y < rows_; ++y) {
+      // skip the blank tail, the screen is cleared already
+      int end = cols_;
+      while (end > 0 && at(end - 1, y) == cell()) --end;
+      if (end == 0) continue;
+      out += "\x1b[" + std::to_string(y + 1) + "H";
+      for (int x = 0; x < end; ++x) {
+        const cell& c = at(x, y);
+        if (c.ch == 0 && x > 0 && char_width(at(x - 1, y).ch) == 2) continue;
+        if (c.attr != cur) {
+          append_sgr(out, c.attr);
+          cur = c.attr;
+        }
+        append_utf8(out, c.ch ? c.ch : ' ');
+      }
+    }
+    if (top_ != 0 || bottom_ != rows_ - 1) {
+      out += "\x1b[" + std::to_string(top_ + 1) + ';' + std::to_string(bottom_ + 1) + 'r';
+    }
+    out += "\x1b[" + std::to_string(cy_ + 1) + ';' + std::to_string(cx_ + 1) + 'H';
+    append_sgr(out, pen_);
+    out += cursor_visible_ ? "\x1b[?25h" : "\x1b[?25l";
+    if (!autowrap_) out += "\x1b[?7l";
+    return out;
+  }
+
+ private:
+  enum class state { ground, esc, csi, osc, osc_esc, charset };
+
+  std::vector<cell>& grid() {
+    return alt_active_ ? alt_ : main_;
+  }
+  const std::vector<cell>& grid() const {
+    return alt_active_ ? alt_ : main_;
+  }
+  cell& cell_at(int x, int y) {
+    return grid()[(size_t)(y * cols_ + x)];
+  }
+
+  /// g of cols_ x rows_ to cols x rows, its rows from shift on at the top
+  void refit(std::vector<cell>& g, int cols, int rows, int shift) const {
+    std::vector<cell> out((size_t)(cols * rows), cell());
+    int width = std::min(cols, cols_);
+    for (int y = 0; y < rows && y + shift < rows_; ++y) {
+      auto from = g.begin() + (y + shift) * cols_;
+      std::copy(from, from + width, out.begin() + y * cols);
+      // half of a wide char cut off at the edge
+      cell& last = out[(size_t)(y * cols + width - 1)];
+      if (width < cols_ && char_width(last.ch) == 2) last = cell();
+    }
+    g.swap(out);
+  }
+
+  cell blank() const {
+    cell c;
+    c.attr.bg = pen_.bg;  // erase with the current background, like xterm
+    return c;
+  }
+
+  void feed_byte(uint8_t b) {
+    switch (state_) {
+      case state::ground:
+        if (utf8_left_) {
+          if ((b & 0xc0) == 0x80) {
+            utf8_cp_ = (utf8_cp_ << 6) | (b & 0x3f);
+            if (--utf8_left_ == 0) print(utf8_cp_);
+            return;
+          }
+          utf8_left_ = 0;
+          print(0xfffd);
+        }
+        if (b < 0x20 || b == 0x7f) {
+          control(b);
+        } else if (b < 0x80) {
+          print(b);
+        } else if ((b & 0xe0) == 0xc0) {
+          utf8_cp_ = b & 0x1f;
+          utf8_left_ = 1;
+        } else if ((b & 0xf0) == 0xe0) {
+          utf8_cp_ = b & 0x0f;
+          utf8_left_ = 2;
+        } else if ((b & 0xf8) == 0xf0) {
+          utf8_cp_ = b & 0x07;
+          utf8_left_ = 3;
+        } else {
+          print(0xfffd);
+        }
+        break;
+      case state::esc:
+        esc(b);
+        break;
+      case state::csi:
+        if (b >= 0x40 && b <= 0x7e) {
+          csi(b);
+          state_ = state::ground;
+        } else if (b == 0x1b) {
+          state_ = state::esc;
+        } else if (b < 0x20) {
+          control(b);
+        } else if (params_.size() < 64) {
+          params_ += (char)b;
+        }
+        break;
+      case state::osc:
+        if (b == 0x07) {
+          state_ = state::ground;
+        } else if (b == 0x1b) {
+          state_ = state::osc_esc;
+        }
+        break;
+      case state::osc_esc:
+        state_ = b == '\\' ? state::ground : state::osc;
+        break;
+      case state::charset:
+        state_ = state::ground;
+        break;
+    }
+  }
+
+  void control(uint8_t b) {
+    switch (b) {
+      case '\r':
+        cx_ = 0;
+        wrap_pending_ = false;
+        break;
+      case '\n':
+      case '\v':
+      case '\f':
+        linefeed();
+        break;
+      case '\b':
+        if (cx_ > 0) --cx_;
+        wrap_pending_ = false;
+        break;
+      case '\t':
+        cx_ = std::min(cols_ - 1, (cx_ / 8 + 1) * 8);
+        wrap_pending_ = false;
+        break;
+      case 0x1b:
+        state_ = state::esc;
+        break;
+      default:
+        break;
+    }
+  }
+
+  void esc(uint8_t b) {
+    state_ = state::ground;
+    switch (b) {
+      case '[':
+        params_.clear();
+        state_ = state::csi;
+        break;
+      case ']':
+      case 'P':  // DCS, skipped like OSC
+      case '_':
+      case '^':
+        state_ = state::osc;
+        break;
+      case '(':
+      case ')':
+      case '*':
+      case '+':
+      case '#':
+        state_ = state::charset;
+        break;
+      case '7':
+        save_cursor();
+        break;
+      case '8':
+        restore_cursor();
+        break;
+      case 'D':
+        linefeed();
+        break;
+      case 'E':
+        cx_ = 0;
+        linefeed();
+        break;
+      case 'M':
+        reverse_index();
+        break;
+      case 'c':
+        reset();
+        break;
+      case '=':
+        modes_ |= mode_app_keypad;
+        break;
+      case '>':
+        modes_ &= ~mode_app_keypad;
+        break;
+      default:
+        break;
+    }
+  }
+
+  void print(uint32_t cp) {
+    int w = char_width(cp);
+    if (w == 0) return;
+    if (wrap_pending_) {
+      cx_ = 0;
+      linefeed();
+      wrap_pending_ = false;
+    }
+    if (w == 2 && cx_ == cols_ - 1) {
+      if (!autowrap_) return;
+      cell_at(cx_, cy_) = blank();
+      cx_ = 0;
+      linefeed();
+    }
+    split_wide(cx_);
+    if (w == 2) split_wide(cx_ + 1);
+    cell& c = cell_at(cx_, cy_);
+    c.ch = cp;
+    c.attr = pen_;
+    if (w == 2) {
+      cell& right = cell_at(cx_ + 1, cy_);
+      right.ch = 0;
+      right.attr = pen_;
+    }
+    cx_ += w;
+    if (cx_ >= cols_) {
+      cx_ = cols_ - 1;
+      wrap_pending_ = autowrap_;
+    }
+  }
+
+  /// cell x is about to be overwritten, do not leave half of a wide char behind
+  void split_wide(int x) {
+    if (cell_at(x, cy_).ch == 0 && x > 0) {
+      cell_at(x - 1, cy_).ch = ' ';
+    } else if (x + 1 < cols_ && cell_at(x + 1, cy_).ch == 0) {
+      cell_at(x + 1, cy_).ch = ' ';
+    }
+  }
+
+  void linefeed() {
+    if (cy_ == bottom_) {
+      scroll_up(1);
+    } else if (cy_ < rows_ - 1) {
+      ++cy_;
+    }
+  }
+
+  void reverse_index() {
+    if (cy_ == top_) {
+      scroll_down(1);
+    } else if (cy_ > 0) {
+      --cy_;
+    }
+  }
+
+  void scroll_up(int n, int top = -1) {
+    if (top < 0) top = top_;
+    n = std::min(n, bottom_ - top + 1);
+    auto& g = grid();
+    auto first = g.begin() + top * cols_;
+    std::move(first + n * cols_, g.begin() + (bottom_ + 1) * cols_, first);
+    std::fill(g.begin() + (bottom_ + 1 - n) * cols_, g.begin() + (bottom_ + 1) * cols_, blank());
+  }
+
+  void scroll_down(int n, int top = -1) {
+    if (top < 0) top = top_;
+    n = std::min(n, bottom_ - top + 1);
+    auto& g = grid();
+    auto first = g.begin() + top * cols_;
+    std::move_backward(first, g.begin() + (bottom_ + 1 - n) * cols_, g.begin() + (bottom_ + 1) * cols_);
+    std::fill(first, first + n * cols_, blank());
+  }
+
+  void erase(int x0, int y0, int x1, int y1) {  // inclusive begin, exclusive end, in reading order
+    auto& g = grid();
+    std::fill(g.begin() + y0 * cols_ + x0, g.begin() + y1 * cols_ + x1, blank());
+  }
+
+  void save_cursor() {
+    saved_x_ = cx_;
+    saved_y_ = cy_;
+    saved_pen_ = pen_;
+  }
+
+  void restore_cursor() {
+    cx_ = std::min(saved_x_, cols_ - 1);
+    cy_ = std::min(saved_y_, rows_ - 1);
+    pen_ = saved_pen_;
+    wrap_pending_ = false;
+  }
+
+  void reset() {
+    pen_ = cell_attr();
+    alt_active_ = false;
+    autowrap_ = true;
+    cursor_visible_ = true;
+    modes_ = 0;
+    main_.assign(main_.size(), cell());
+    alt_.assign(alt_.size(), cell());
+    cx_ = cy_ = 0;
+    saved_x_ = saved_y_ = 0;
+    top_ = 0;
+    bottom_ = rows_ - 1;
+    wrap_pending_ = false;
+  }
+
+  void move_to(int x, int y) {
+    cx_ = std::max(0, std::min(x, cols_ - 1));
+    cy_ = std::max(0, std::min(y, rows_ - 1));
+    wrap_pending_ = false;
+  }
+
+  void csi(uint8_t final) {
+    char priv = 0;
+    size_t p = 0;
+    if (!params_.empty() && (params_[0] == '?' || params_[0] == '>' || params_[0] == '=' || params_[0] == '<')) {
+      priv = params_[0];
+      p = 1;
+    }
+    int args[16];
+    int n = 0;
+    args[0] = 0;
+    bool any = false;
+    for (; p < params_.size(); ++p) {
+      char c = params_[p];
+      if (c >= '0' && c <= '9') {
+        args[n] = std::min(args[n] * 10 + (c - '0'), 65535);
+        any = true;
+      } else if (c == ';' || c == ':') {
+        if (n < 15) args[++n] = 0;
+      } else {
+        return;  // intermediate bytes, none of those are modeled
+      }
+    }
+    if (any || n > 0) ++n;
+    auto arg = [&](int i, int def) {
+      return (i < n && args[i] != 0) ? args[i] : def;
+    };
+
+    if (priv == '?') {
+      if (final == 'h' || final == 'l') {
+        for (int i = 0; i < n; ++i) set_mode(args[i], final == 'h');
+      }
+      return;
+    }
+    if (priv) return;
+
+    switch (final) {
+      case 'A':
+        move_to(cx_, std::max(cy_ - arg(0, 1), cy_ >= top_ ? top_ : 0));
+        break;
+      case 'B':
+        move_to(cx_, std::min(cy_ + arg(0, 1), cy_ <= bottom_ ? bottom_ : rows_ - 1));
+        break;
+      case 'C':
+        move_to(cx_ + arg(0, 1), cy_);
+        break;
+      case 'D':
+        move_to(cx_ - arg(0, 1), cy_);
+        break;
+      case 'E':
+        move_to(0, cy_ + arg(0, 1));
+        break;
+      case 'F':
+        move_to(0, cy_ - arg(0, 1));
+        break;
+      case 'G':
+      case '`':
+        move_to(arg(0, 1) - 1, cy_);
+        break;
+      case 'd':
+        move_to(cx_, arg(0, 1) - 1);
+        break;
+      case 'H':
+      case 'f':
+        move_to(arg(1, 1) - 1, arg(0, 1) - 1);
+        break;
+      case 'J':
+        switch (arg(0, 0)) {
+          case 0:
+            erase(cx_, cy_, 0, rows_);
+            break;
+          case 1:
+            erase(0, 0, std::min(cx_ + 1, cols_), cy_);
+            break;
+          default:
+            erase(0, 0, 0, rows_);
+            break;
+        }
+        break;
+      case 'K':
+        switch (arg(0, 0)) {
+          case 0:
+            erase(cx_, cy_, cols_, cy_);
+            break;
+          case 1:
+            erase(0, cy_, std::min(cx_ + 1, cols_), cy_);
+            break;
+          default:
+            erase(0, cy_, cols_, cy_);
+            break;
+        }
+        break;
+      case 'X':
+        erase(cx_, cy_, std::min(cx_ + arg(0, 1), cols_), cy_);
+        break;
+      case '@': {
+        int k = std::min(arg(0, 1), cols_ - cx_);
+        auto row = grid().begin() + cy_ * cols_;
+        std::move_backward(row + cx_, row + cols_ - k, row + cols_);
+        std::fill(row + cx_, row + cx_ + k, blank());
+        break;
+      }
+      case 'P': {
+        int k = std::min(arg(0, 1), cols_ - cx_);
+        auto row = grid().begin() + cy_ * cols_;
+        std::move(row + cx_ + k, row + cols_, row + cx_);
+        std::fill(row + cols_ - k, row + cols_, blank());
+        break;
+      }
+      case 'L':
+        if (cy_ >= top_ && cy_ <= bottom_) scroll_down(arg(0, 1), cy_);
+        break;
+      case 'M':
+        if (cy_ >= top_ && cy_ <= bottom_) scroll_up(arg(0, 1), cy_);
+        break;
+      case 'S':
+        scroll_up(arg(0, 1));
+        break;
+      case 'T':
+        scroll_down(arg(0, 1));
+        break;
+      case 'r': {
+        int t = arg(0, 1) - 1;
+        int b = arg(1, rows_) - 1;
+        if (t < b && b < rows_) {
+          top_ = t;
+          bottom_ = b;
+          move_to(0, 0);
+        }
+        break;
+      }
+      case 's':
+        save_cursor();
+        break;
+      case 'u':
+        restore_cursor();
+        break;
+      case 'm':
+        sgr(args, n);
+        break;
+      default:
+        break;
+    }
+  }
+
+  void set_mode(int mode, bool on) {
+    switch (mode) {
+      case 7:
+        autowrap_ = on;
+        break;
+      case 25:
+        cursor_visible_ = on;
+        break;
+      case 47:
+      case 1047:
+      case 1049:
+        if (on == alt_active_) break;
+        if (mode == 1049 && on) save_cursor();
+        alt_active_ = on;
+        ++alt_switches_;
+        if (on) std::fill(alt_.begin(), alt_.end(), cell());
+        if (mode == 1049 && !on) restore_cursor();
+        break;
+      default:
+        for (size_t i = 0; i < sizeof(input_modes) / sizeof(input_modes[0]); ++i) {
+          if (input_modes[i] != mode) continue;
+          modes_ = on ? modes_ | 1u << i : modes_ & ~(1u << i);
+        }
+        break;
+    }
+  }
+
+  void sgr(const int* args, int n) {
+    if (n == 0) {
+      pen_ = cell_attr();
+      return;
+    }
+    for (int i = 0; i < n; ++i) {
+      int a = args[i];
+      if (a == 0) {
+        pen_ = cell_attr();
+      } else if (a >= 1 && a <= 9 && a != 6) {
+        static const uint16_t flags[] = {0, attr_bold, attr_dim, attr_italic, attr_underline, attr_blink, 0, attr_inverse, attr_hidden, attr_strike};
+        pen_.flags |= flags[a];
+      } else if (a == 22) {
+        pen_.flags &= ~(attr_bold | attr_dim);
+      } else if (a >= 23 && a <= 29 && a != 26) {
+        static const uint16_t flags[] = {attr_italic, attr_underline, attr_blink, 0, attr_inverse, attr_hidden, attr_strike};
+        pen_.flags &= ~flags[a - 23];
+      } else if (a >= 30 && a <= 37) {
+        pen_.fg = (uint32_t)(a - 30 + 1);
+      } else if (a >= 40 && a <= 47) {
+        pen_.bg = (uint32_t)(a - 40 + 1);
+      } else if (a >= 90 && a <= 97) {
+        pen_.fg = (uint32_t)(a - 90 + 8 + 1);
+      } else if (a >= 100 && a <= 107) {
+        pen_.bg = (uint32_t)(a - 100 + 8 + 1);
+      } else if (a == 39) {
+        pen_.fg = 0;
+      } else if (a == 49) {
+        pen_.bg = 0;
+      } else if (a == 38 || a == 48) {
+        uint32_t& target = a == 38 ? pen_.fg : pen_.bg;
+        if (i + 2 < n && args[i + 1] == 5) {
+          target = (uint32_t)(args[i + 2] & 0xff) + 1;
+          i += 2;
+        } else if (i + 4 < n && args[i + 1] == 2) {
+          target = cell_attr::color_rgb | (uint32_t)((args[i + 2] & 0xff) << 16) | (uint32_t)((args[i + 3] & 0xff) << 8) |
+                   (uint32_t)(args[i + 4] & 0xff);
+          i += 4;
+        } else {
+          return;
+        }
+      }
+    }
+  }
+
+ private:
+  int cols_ = 0;
+  int rows_ = 0;
+  std::vector<cell> main_;
+  std::vector<cell> alt_;
+  bool alt_active_ = false;
+  uint32_t alt_switches_ = 0;
+
+  int cx_ = 0;
+  int cy_ = 0;
+  bool wrap_pending_ = false;
+  cell_attr pen_;
+  int saved_x_ = 0;
+  int saved_y_ = 0;
+  cell_attr saved_pen_;
+
+  int top_ = 0;
+  int bottom_ = 0;
+  bool autowrap_ = true;
+  bool cursor_visible_ = true;
+  uint32_t modes_ = 0;
+
+  state state_ = state::ground;
+  std::string params_;
+  uint32_t utf8_cp_ = 0;
+  int utf8_left_ = 0;
+};
+
+}  // namespace rterm
@@ -0,0 +1,257 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "log.h"
+
+namespace rterm {
+
+/**
+ * Single producer, single consumer byte ring in memory shared by two
+ * processes. Positions only grow, the capacity is a power of 2.
+ *
+ * Either side sets its waiting flag before it sleeps on its eventfd and
+ * checks the ring once more, the other side wakes it after publishing only
+ * when the flag is set, so a busy stream costs no syscall at all.
+ */
+class shm_ring {
+ public:
+  struct header {
+    alignas(64) std::atomic<uint64_t> head;  // consumed
+    alignas(64) std::atomic<uint64_t> tail;  // produced
+    alignas(64) std::atomic<uint32_t> reader_waiting;
+    std::atomic<uint32_t> writer_waiting;
+  };
+
+  shm_ring() = default;
+  shm_ring(void* memory, size_t capacity) : header_((header*)memory), data_((char*)memory + sizeof(header)), capacity_(capacity) {}
+
+  static size_t footprint(size_t capacity) {
+    return sizeof(header) + capacity;
+  }
+
+  /// producer: contiguous free space at the tail, 0 if full
+  size_t write_span(char** p) const {
+    uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    uint64_t head = header_->head.load(std::memory_order_acquire);
+    size_t offset = (size_t)(tail & (capacity_ - 1));
+    *p = data_ + offset;
+    return std::min(capacity_ - (size_t)(tail - head), capacity_ - offset);
+  }
+
+  void produce(size_t n) {
+    header_->tail.store(header_->tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+  }
+
+  /// consumer: contiguous data at the head, 0 if empty
+  size_t read_span(const char** p) const {
+    uint64_t head = header_->head.load(std::memory_order_relaxed);
+    uint64_t tail = header_->tail.load(std::memory_order_acquire);
+    size_t offset = (size_t)(head & (capacity_ - 1));
+    *p = data_ + offset;
+    return std::min((size_t)(tail - head), capacity_ - offset);
+  }
+
+  void consume(size_t n) {
+    header_->head.store(header_->head.load(std::memory_order_relaxed) + n, std::memory_order_release);
+  }
+
+  bool empty() const {
+    return header_->head.load(std::memory_order_acquire) == header_->tail.load(std::memory_order_acquire);
+  }
+
+  bool full() const {
+    return header_->tail.load(std::memory_order_acquire) - header_->head.load(std::memory_order_acquire) == capacity_;
+  }
+
+  /// consumer about to sleep, false if data came in meanwhile and it should not
+  bool reader_sleep() {
+    header_->reader_waiting.store(1, std::memory_order_seq_cst);
+    if (empty()) return true;
+    header_->reader_waiting.store(0, std::memory_order_relaxed);
+    return false;
+  }
+
+  /// producer about to sleep on a full ring, false if space came up meanwhile
+  bool writer_sleep() {
+    header_->writer_waiting.store(1, std::memory_order_seq_cst);
+    if (full()) return true;
+    header_->writer_waiting.store(0, std::memory_order_relaxed);
+    return false;
+  }
+
+  /// after produce(): the consumer sleeps and has to be woken
+  bool take_reader_waiting() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return header_->reader_waiting.load(std::memory_order_relaxed) && header_->reader_waiting.exchange(0);
+  }
+
+  /// after consume(): the producer sleeps and has to be woken
+  bool take_writer_waiting() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return header_->writer_waiting.load(std::memory_order_relaxed) && header_->writer_waiting.exchange(0);
+  }
+
+ private:
+  header* header_ = nullptr;
+  char* data_ = nullptr;
+  size_t capacity_ = 0;
+};
+
+/**
+ * Two shm_rings, one per direction, and an eventfd per side to wake it, for
+ * a hub and an agent on the same host. The hub creates it and passes the
+ * memfd and both eventfds to the agent with SCM_RIGHTS over a Unix socket,
+ * which stays open so either side sees the other go away.
+ */
+class shm_link {
+ public:
+  static const size_t default_ring_size = 4 * 1024 * 1024;
+
+  ~shm_link() {
+    if (memory_ != MAP_FAILED) munmap(memory_, size_);
+    for (int fd : fds_) {
+      if (fd >= 0) ::close(fd);
+    }
+  }
+
+  /// the hub side, nullptr on failure
+  static std::unique_ptr<shm_link> create(size_t ring_size = default_ring_size) {
+    std::unique_ptr<shm_link> link(new shm_link);
+    link->fds_[0] = memfd_create("rterm-link", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    link->fds_[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    link->fds_[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (link->fds_[0] < 0 || link->fds_[1] < 0 || link->fds_[2] < 0) {
+      LOGW("shm_link: %s", strerror(errno));
+      return nullptr;
+    }
+    size_t size = 2 * shm_ring::footprint(ring_size);
+    // sealed, the agent can not shrink it under the hub
+    if (ftruncate(link->fds_[0], (off_t)size) != 0 || fcntl(link->fds_[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+        !link->map(ring_size, 0)) {
+      LOGW("shm_link: %s", strerror(errno));
+      return nullptr;
+    }
+    return link;
+  }
+
+  /// pass it to the peer on the Unix socket, which is still blocking or empty
+  bool send_to(int socket) const {
+    char byte = 's';
+    uint32_t ring = (uint32_t)ring_size_;
+    iovec parts[2] = {{&byte, 1}, {&ring, sizeof(ring)}};
+    char control[CMSG_SPACE(sizeof(fds_))] = {};
+    msghdr mh{};
+    mh.msg_iov = parts;
+    mh.msg_iovlen = 2;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds_));
+    memcpy(CMSG_DATA(cm), fds_, sizeof(fds_));
+    return sendmsg(socket, &mh, MSG_NOSIGNAL) == (ssize_t)(1 + sizeof(ring));
+  }
+
+  /// the agent side, once the socket is readable, nullptr if it is not a link
+  static std::unique_ptr<shm_link> receive_from(int socket) {
+    std::unique_ptr<shm_link> link(new shm_link);
+    char byte = 0;
+    uint32_t ring = 0;
+    iovec parts[2] = {{&byte, 1}, {&ring, sizeof(ring)}};
+    char control[CMSG_SPACE(sizeof(link->fds_))] = {};
+    msghdr mh{};
+    mh.msg_iov = parts;
+    mh.msg_iovlen = 2;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(socket, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+      size_t count = std::min((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int), (size_t)3);
+      memcpy(link->fds_, CMSG_DATA(cm), count * sizeof(int));
+    }
+    bool valid = n == (ssize_t)(1 + sizeof(ring)) && byte == 's' && ring && !(ring & (ring - 1));
+    struct stat st {};
+    if (!valid || link->fds_[2] < 0 || fstat(link->fds_[0], &st) != 0 || (size_t)st.st_size < 2 * shm_ring::footprint(ring)) return nullptr;
+    if (!link->map(ring, 1)) return nullptr;
+    return link;
+  }
+
+  shm_ring& rx() {
+    return rx_;
+  }
+
+  shm_ring& tx() {
+    return tx_;
+  }
+
+  /// this side sleeps on it
+  int wake_fd() const {
+    return fds_[1 + side_];
+  }
+
+  void wake_peer() const {
+    uint64_t one = 1;
+    ssize_t n = ::write(fds_[2 - side_], &one, sizeof(one));
+    (void)n;
+  }
+
+  /// reset wake_fd() after it fired
+  void woken() const {
+    uint64_t count;
+    ssize_t n = ::read(wake_fd(), &count, sizeof(count));
+    (void)n;
+  }
+
+ private:
+  shm_link() = default;
+
+  bool map(size_t ring_size, int side) {
+    if (ring_size < 4096 || (ring_size & (ring_size - 1))) return false;
+    size_ = 2 * shm_ring::footprint(ring_size);
+    memory_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fds_[0], 0);
+    if (memory_ == MAP_FAILED) return false;
+    ring_size_ = ring_size;
+    side_ = side;
+    // ring 0 goes from the hub to the agent, ring 1 the other way
+    shm_ring first((char*)memory_, ring_size);
+    shm_ring second((char*)memory_ + shm_ring::footprint(ring_size), ring_size);
+    tx_ = side == 0 ? first : second;
+    rx_ = side == 0 ? second : first;
+    return true;
+  }
+
+ private:
+  int fds_[3] = {-1, -1, -1};  // memfd, eventfd of the hub, eventfd of the agent
+  void* memory_ = MAP_FAILED;
+  size_t size_ = 0;
+  size_t ring_size_ = 0;
+  int side_ = 0;  // 0 for the hub
+  shm_ring tx_;
+  shm_ring rx_;
+};
+
+/// the abstract Unix socket a hub offers shm_links on, one per TCP port
+inline std::string shm_link_address(uint16_t port) {
+  return std::string(1, '\0') + "rterm-hub-" + std::to_string(port);
+}
+
+}  // namespace rterm
+
+#endif  // __linux__
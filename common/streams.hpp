@@ -0,0 +1,815 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#ifndef SIOCOUTNSQ
+#define SIOCOUTNSQ 0x894B  // linux 2.6.38, missing from some headers
+#endif
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "connection.hpp"
+#include "shm_link.hpp"
+#include "udp_link.hpp"
+#include "uring.hpp"
+
+namespace rterm {
+
+/**
+ * A TCP or Unix stream socket. Buffers are gathered into one writev, file
+ * segments go with sendfile(2) and pipes with splice(2). With use_uring()
+ * the reads and the buffer writes go through io_uring instead of the
+ * reactor, files and pipes are still sent as above.
+ */
+class socket_stream : public stream {
+ public:
+  using socket_type = asio::generic::stream_protocol::socket;
+
+  explicit socket_stream(socket_type socket) : socket_(std::move(socket)) {}
+
+  void start() override {
+#ifdef __linux__
+    if (uring_) return read_uring();
+#endif
+    buffer_.resize(conn().read_buffer_size);
+    read();
+  }
+
+  void write() override {
+    auto& q = queue();
+    q.frame_file();
+    if (q.items.front().file) {
+      write_file();
+      return;
+    }
+
+    // gather the queued buffers into one writev, bounded to keep the iovec small
+    static const size_t max_gather = 64;
+    writing_count_ = 0;
+    std::vector<asio::const_buffer> buffers;
+    for (auto& i : q.items) {
+      if (i.file || i.attached || writing_count_ == max_gather) break;
+      buffers.emplace_back(asio::buffer(*i.buffer));
+      ++writing_count_;
+    }
+
+    writing_ = true;
+#ifdef __linux__
+    if (uring_) return write_uring(std::move(buffers));
+#endif
+    auto self = this->self();
+    asio::async_write(socket_, buffers, [this, self](const std::error_code& ec, std::size_t length) {
+      writing_ = false;
+      if (ec) return fail();
+      gathered(length);
+    });
+  }
+
+  void close() override {
+    std::error_code ec;
+#ifdef __linux__
+    // the ring holds its own reference to the socket, it has to let go for the close to happen
+    if (uring_ && read_token_) uring_->cancel(read_token_);
+    read_token_ = 0;
+#endif
+    socket_.close(ec);
+  }
+
+  bool is_open() const override {
+    return socket_.is_open();
+  }
+
+  asio::any_io_executor executor() override {
+    return socket_.get_executor();
+  }
+
+  size_t unsent() override {
+#ifdef __linux__
+    int unsent = 0;
+    if (ioctl(socket_.native_handle(), SIOCOUTNSQ, &unsent) == 0 && unsent > 0) return (size_t)unsent;
+#endif
+    return 0;
+  }
+
+#ifdef __linux__
+  void use_uring(uring& ring) override {
+    uring_ = &ring;
+  }
+#endif
+
+ protected:
+  void read() {
+    auto self = this->self();
+    socket_.async_read_some(asio::buffer(buffer_), [this, self](const std::error_code& ec, std::size_t length) {
+      if (ec) return fail();
+      received(buffer_.data(), length);
+      if (socket_.is_open()) read();
+    });
+  }
+
+  /// the writev of the first writing_count_ buffers is done
+  void gathered(size_t length) {
+    auto& q = queue();
+    q.bytes -= length;
+    q.items.erase(q.items.begin(), q.items.begin() + (long)writing_count_);
+    written();
+  }
+
+  void write_file() {
+#ifdef __linux__
+    auto& q = queue();
+    auto& i = q.items.front();
+    std::error_code ec;
+    socket_.native_non_blocking(true, ec);
+    while (i.length > 0) {
+      ssize_t n = i.offset < 0 ? ::splice(i.file->fd, nullptr, socket_.native_handle(), nullptr, i.length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+                               : ::sendfile(socket_.native_handle(), i.file->fd, &i.offset, i.length);
+      if (n > 0) {
+        i.length -= (size_t)n;
+        q.bytes -= (size_t)n;
+        continue;
+      }
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        writing_ = true;
+        auto self = this->self();
+        socket_.async_wait(asio::socket_base::wait_write, [this, self](const std::error_code& ec) {
+          writing_ = false;
+          if (ec) return fail();
+          write_file();
+        });
+        return;
+      }
+      if (i.offset >= 0) {
+        send_queue::pad_file(i);
+        return write();
+      }
+      // the pipe failed, the frame can not be completed
+      return fail();
+    }
+    q.items.pop_front();
+    written();
+#endif
+  }
+
+#ifdef __linux__
+  void read_uring() {
+    auto self = this->self();
+    read_token_ = uring_->read(
+        socket_.native_handle(), true,
+        [this, self](const char* data, size_t size) {
+          received(data, size);
+        },
+        [this, self](int) {
+          read_token_ = 0;
+          fail();
+        });
+  }
+
+  void write_uring(std::vector<asio::const_buffer> buffers) {
+    iov_.clear();
+    size_t total = 0;
+    for (auto& b : buffers) {
+      iov_.push_back(iovec{const_cast<void*>(b.data()), b.size()});
+      total += b.size();
+    }
+    auto self = this->self();
+    uring_->writev(socket_.native_handle(), iov_.data(), (unsigned)iov_.size(), [this, self, buffers, total](int res) mutable {
+      if (!socket_.is_open()) {
+        writing_ = false;
+        return;
+      }
+      if (res < 0 && res != -EAGAIN && res != -EINTR) {
+        writing_ = false;
+        return fail();
+      }
+      size_t written = res > 0 ? (size_t)res : 0;
+      if (written == total) {
+        writing_ = false;
+        return gathered(total);
+      }
+      // the socket buffer is full: let the reactor finish this batch
+      asio::const_buffer* first = buffers.data();
+      while (written >= first->size()) {
+        written -= first->size();
+        ++first;
+      }
+      *first += written;
+      std::vector<asio::const_buffer> rest(first, buffers.data() + buffers.size());
+      asio::async_write(socket_, rest, [this, self, total](const std::error_code& ec, std::size_t) {
+        writing_ = false;
+        if (ec) return fail();
+        gathered(total);
+      });
+    });
+  }
+#endif
+
+  socket_type socket_;
+  std::string buffer_;
+  size_t writing_count_ = 0;
+
+#ifdef __linux__
+  uring* uring_ = nullptr;
+  uint64_t read_token_ = 0;
+  std::vector<iovec> iov_;  // of the write in the ring
+#endif
+};
+
+#ifdef __linux__
+/**
+ * A Unix socket which passes descriptors along with frames: one sent with
+ * send_fd() is attached to the first byte of its frame, one received is kept
+ * until take_fd() when the frame is parsed. Not with io_uring, the reads are
+ * recvmsg() for the descriptors.
+ */
+class passing_stream : public socket_stream {
+ public:
+  explicit passing_stream(socket_type socket) : socket_stream(std::move(socket)) {}
+
+  ~passing_stream() override {
+    for (int fd : passed_) {
+      ::close(fd);
+    }
+  }
+
+  void start() override {
+    buffer_.resize(conn().read_buffer_size);
+    read_passing();
+  }
+
+  void write() override {
+    queue().frame_file();
+    if (queue().items.front().attached) return write_attached();
+    socket_stream::write();
+  }
+
+  void use_uring(uring&) override {}
+
+  bool send_fd(std::string packed, std::shared_ptr<file_handle> fd) override {
+    enqueue(send_queue::item{make_shared_buffer(std::move(packed)), nullptr, 0, 0, std::move(fd)});
+    return true;
+  }
+
+  int take_fd() override {
+    if (passed_.empty()) return -1;
+    int fd = passed_.front();
+    passed_.pop_front();
+    return fd;
+  }
+
+ protected:
+  /// the bytes on the socket, and the descriptors which came with them into passed_
+  ssize_t receive(char* data, size_t size) {
+    iovec iov{data, size};
+    char control[CMSG_SPACE(max_passed * sizeof(int))];
+    msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(socket_.native_handle(), &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    for (cmsghdr* cm = CMSG_FIRSTHDR(&mh); n >= 0 && cm; cm = CMSG_NXTHDR(&mh, cm)) {
+      if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+      size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t k = 0; k < count; ++k) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(cm) + k * sizeof(int), sizeof(int));
+        passed_.push_back(fd);
+      }
+    }
+    return n;
+  }
+
+  ssize_t send_attached(const char* data, size_t size, int fd) {
+    iovec iov{const_cast<char*>(data), size};
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    return sendmsg(socket_.native_handle(), &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+
+  /// the reactor only tells when there is something, recvmsg() takes it with the descriptors
+  void read_passing() {
+    auto self = this->self();
+    socket_.async_wait(asio::socket_base::wait_read, [this, self](const std::error_code& ec) {
+      if (ec) return fail();
+      ssize_t n = receive(&buffer_[0], buffer_.size());
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) return fail();
+      if (n > 0) received(buffer_.data(), (size_t)n);
+      if (socket_.is_open()) read_passing();
+    });
+  }
+
+  /// the front buffer has a descriptor attached, it goes by itself with sendmsg()
+  void write_attached() {
+    writing_ = true;
+    auto self = this->self();
+    socket_.async_wait(asio::socket_base::wait_write, [this, self](const std::error_code& ec) {
+      writing_ = false;
+      if (ec) return fail();
+      auto& q = queue();
+      auto& i = q.items.front();
+      ssize_t n = send_attached(i.buffer->data(), i.buffer->size(), i.attached->fd);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) return write_attached();
+      if (n <= 0) return fail();
+      // the descriptor went with the first byte, the rest is plain
+      i.attached.reset();
+      q.bytes -= (size_t)n;
+      if ((size_t)n < i.buffer->size()) {
+        i.buffer = make_shared_buffer(i.buffer->substr((size_t)n));
+      } else {
+        q.items.pop_front();
+      }
+      written();
+    });
+  }
+
+  std::deque<int> passed_;  // descriptors received, not taken yet
+  static const size_t max_passed = 16;
+};
+
+/**
+ * The shared memory rings of an shm_link, over the Unix socket the link came
+ * on. The socket is only watched for the peer going away and carries the
+ * descriptors of send_fd(), each sent before its frame goes into the ring.
+ */
+class shm_stream : public passing_stream {
+ public:
+  shm_stream(socket_type socket, std::unique_ptr<shm_link> link)
+      : passing_stream(std::move(socket)), link_(std::move(link)), wake_(socket_.get_executor(), ::dup(link_->wake_fd())) {}
+
+  void start() override {
+    watch_socket();
+    wait_shm();
+  }
+
+  /// copy the queue into the send ring until it is empty or the ring is full
+  void write() override {
+    auto& q = queue();
+    auto& tx = link_->tx();
+    bool produced = false;
+    while (!q.items.empty()) {
+      q.frame_file();
+      auto& i = q.items.front();
+      char* p;
+      size_t room = tx.write_span(&p);
+      if (room == 0) {
+        if (!tx.writer_sleep()) continue;
+        // woken by the peer once it has made room, see poll_shm()
+        writing_ = true;
+        break;
+      }
+      size_t n;
+      if (i.buffer) {
+        n = std::min(room, i.buffer->size() - q.sent);
+        memcpy(p, i.buffer->data() + q.sent, n);
+      } else {
+        ssize_t r = i.offset < 0 ? ::read(i.file->fd, p, std::min(room, i.length)) : ::pread(i.file->fd, p, std::min(room, i.length), i.offset);
+        if (r <= 0 && i.offset >= 0) {
+          send_queue::pad_file(i);
+          q.sent = 0;
+          continue;
+        }
+        // the pipe failed, the frame can not be completed
+        if (r <= 0) return fail();
+        n = (size_t)r;
+        if (i.offset >= 0) i.offset += r;
+        i.length -= n;
+      }
+      tx.produce(n);
+      produced = true;
+      q.bytes -= n;
+      q.sent += n;
+      if (i.buffer ? q.sent == i.buffer->size() : i.length == 0) {
+        q.items.pop_front();
+        q.sent = 0;
+      }
+    }
+    if (produced && tx.take_reader_waiting()) link_->wake_peer();
+    drained();
+  }
+
+  void close() override {
+    std::error_code ec;
+    wake_.close(ec);
+    passing_stream::close();
+  }
+
+  size_t unsent() override {
+    return 0;
+  }
+
+  bool send_fd(std::string packed, std::shared_ptr<file_handle> fd) override {
+    // the ring does not carry descriptors, the socket does, and before the frame is in the ring
+    char carrier = 'f';
+    if (send_attached(&carrier, 1, fd->fd) != 1) return false;
+    conn().send(std::move(packed));
+    return true;
+  }
+
+  int take_fd() override {
+    // it may be still in the socket, it was sent before the frame
+    if (passed_.empty() && socket_.is_open()) {
+      char carrier[16];
+      receive(carrier, sizeof(carrier));
+    }
+    return passing_stream::take_fd();
+  }
+
+ private:
+  /// only descriptors come on the socket, see send_fd(), and the end when the peer goes away
+  void watch_socket() {
+    auto self = this->self();
+    socket_.async_wait(asio::socket_base::wait_read, [this, self](const std::error_code& ec) {
+      if (ec) return fail();
+      char carrier[16];
+      ssize_t n = receive(carrier, sizeof(carrier));
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) return fail();
+      watch_socket();
+    });
+  }
+
+  void wait_shm() {
+    poll_shm();
+    if (!socket_.is_open()) return;
+    auto self = this->self();
+    wake_.async_wait(asio::posix::descriptor_base::wait_read, [this, self](const std::error_code& ec) {
+      if (ec) return;
+      link_->woken();
+      wait_shm();
+    });
+  }
+
+  /// take what is in the receive ring, and go on writing if that was waiting for room
+  void poll_shm() {
+    auto& rx = link_->rx();
+    for (;;) {
+      const char* data;
+      size_t size;
+      bool consumed = false;
+      while ((size = rx.read_span(&data)) > 0) {
+        received(data, size);
+        if (!socket_.is_open()) return;
+        rx.consume(size);
+        consumed = true;
+      }
+      if (consumed && rx.take_writer_waiting()) link_->wake_peer();
+      if (writing_ && !link_->tx().full()) {
+        writing_ = false;
+        write();
+      }
+      if (rx.reader_sleep()) return;
+    }
+  }
+
+  std::unique_ptr<shm_link> link_;
+  asio::posix::stream_descriptor wake_;  // wake_fd() of the link
+};
+#endif
+
+/**
+ * The stream over a connected UDP socket, cut into datagrams of up to
+ * datagram_size bytes which a udp_link numbers, acknowledges, resends and
+ * paces. The queue is taken into packets as the window allows, so a producer
+ * sees a slow path as a full queue like on TCP.
+ *
+ * The side which roams, the agent, sends keepalives when it has been quiet
+ * and moves to a new socket when the peer seems out of reach, its own address
+ * or the path may have changed. The hub follows it, see follow().
+ */
+class udp_stream : public stream {
+ public:
+  /// at most this much in a datagram
+  static const size_t datagram_size = 1400;
+
+  udp_stream(asio::ip::udp::socket socket, uint64_t session, bool roams)
+      : socket_(std::move(socket)), link_(session, datagram_size), timer_(socket_.get_executor()), roams_(roams) {}
+
+  void start() override {
+    buffer_.resize(conn().read_buffer_size);
+    read_datagrams();
+    write();
+  }
+
+  /// lost packets first, then new ones from the queue, as the window and the pacing allow
+  void write() override {
+    auto now = udp_link::clock::now();
+    for (size_t burst = 0; socket_.is_open(); ++burst) {
+      if (burst == max_burst / 4) {
+        // let a reader on this io_context have its turn
+        writing_ = true;
+        auto self = this->self();
+        asio::post(socket_.get_executor(), [this, self] {
+          writing_ = false;
+          if (socket_.is_open()) write();
+        });
+        return;
+      }
+      if ((!link_.has_lost() && queue().items.empty()) || now < link_.send_at()) break;
+      const std::string* packet = link_.resend(now);
+      if (!packet) packet = &link_.sent(take_payload(), now);
+      send_datagram(*packet);
+      now = udp_link::clock::now();
+    }
+    if (!socket_.is_open()) return;
+    schedule(now);
+    drained();
+  }
+
+  void close() override {
+    // tell the peer, else it only finds out by its heartbeats
+    auto fin = udp_link::fin_packet(link_.session());
+    ::send(socket_.native_handle(), fin.data(), fin.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    timer_.cancel();
+    std::error_code ec;
+    socket_.close(ec);
+  }
+
+  bool is_open() const override {
+    return socket_.is_open();
+  }
+
+  asio::any_io_executor executor() override {
+    return socket_.get_executor();
+  }
+
+  /// a datagram of the session which came on another socket, e.g. on the hub's before this one was there
+  void datagram(const char* data, size_t size) {
+    if (!socket_.is_open()) return;
+    received_datagram(data, size);
+    if (socket_.is_open()) datagrams_read();
+  }
+
+  /// the peer sends from this address now
+  void follow(const sockaddr* address, socklen_t size) {
+    if (socket_.is_open()) ::connect(socket_.native_handle(), address, size);
+  }
+
+ private:
+  /// what is there in one go, then one ack for all of it
+  void read_datagrams() {
+    auto self = this->self();
+    unsigned socket = sockets_;
+    socket_.async_wait(asio::socket_base::wait_read, [this, self, socket](const std::error_code& ec) {
+      // the socket was replaced, see roam()
+      if (socket != sockets_) return;
+      if (ec) return fail();
+      for (size_t i = 0; i < max_burst; ++i) {
+        ssize_t n = ::recv(socket_.native_handle(), &buffer_[0], buffer_.size(), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0 && errno == EINTR) continue;
+        // the port of the peer is unreachable: a hub which does not serve UDP, else the peer moved or comes back
+        if (n < 0 && errno == ECONNREFUSED && roams_ && !link_.heard_any()) return fail();
+        if (n < 0) break;
+        received_datagram(buffer_.data(), (size_t)n);
+        if (!socket_.is_open()) return;
+      }
+      datagrams_read();
+      if (socket_.is_open()) read_datagrams();
+    });
+  }
+
+  void received_datagram(const char* data, size_t size) {
+    auto deliver = [this](const char* data, size_t size) {
+      received(data, size);
+    };
+    if (!link_.received(data, size, udp_link::clock::now(), deliver)) return;
+    if (link_.finished()) fail();
+  }
+
+  /// acks go out, and the packets they make room for
+  void datagrams_read() {
+    if (link_.ack_due()) send_datagram(link_.take_ack());
+    if (!writing_) write();
+  }
+
+  /// the next packet from the queue, the stream is cut anywhere
+  std::string take_payload() {
+    auto& q = queue();
+    std::string packet = link_.new_packet();
+    size_t room = link_.payload_size();
+    while (room > 0 && !q.items.empty()) {
+      auto& front = q.items.front();
+      if (!q.materialize(front)) {
+        // the pipe failed, the frame can not be completed
+        fail();
+        break;
+      }
+      size_t take = std::min(room, front.buffer->size() - q.sent);
+      packet.append(front.buffer->data() + q.sent, take);
+      room -= take;
+      q.sent += take;
+      q.bytes -= take;
+      if (q.sent == front.buffer->size()) {
+        q.sent = 0;
+        q.items.pop_front();
+      }
+    }
+    return packet;
+  }
+
+  /// one try, a datagram the socket can not take now is lost and sent again like any other
+  void send_datagram(const std::string& packet) {
+    link_.spoken(udp_link::clock::now());
+    while (::send(socket_.native_handle(), packet.data(), packet.size(), MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+      if (errno == EINTR) continue;
+      // no route from here any more, e.g. the address of this host has gone
+      if (roams_ && udp_link::clock::now() - roamed_at_ >= keepalive_interval() && (errno == ENETUNREACH || errno == EHOSTUNREACH || errno == EADDRNOTAVAIL || errno == ENETDOWN)) roam();
+      return;
+    }
+  }
+
+  /// the earliest of the retransmission timeout, the next paced packet and a keepalive
+  void schedule(udp_link::clock::time_point now) {
+    auto at = link_.deadline();
+    if (link_.has_lost() || !queue().items.empty()) at = std::min(at, link_.send_at());
+    if (roams_) at = std::min({at, link_.spoke() + keepalive_interval(), link_.heard() + roam_after_silence()});
+    if (at == udp_link::clock::time_point::max() || (timer_at_ <= at && timer_at_ > now)) return;
+    timer_at_ = at;
+    timer_.expires_at(at);
+    auto self = this->self();
+    timer_.async_wait([this, self](const std::error_code& ec) {
+      if (ec || !socket_.is_open()) return;
+      timer_at_ = udp_link::clock::time_point::max();
+      timed();
+    });
+  }
+
+  void timed() {
+    auto now = udp_link::clock::now();
+    if (now >= link_.deadline()) {
+      link_.timed_out(now);
+      // twice in a row without an ack: a new socket, the path from the old one may be gone
+      if (roams_ && link_.timeouts() >= 2) roam();
+    }
+    if (roams_ && now - link_.heard() >= roam_after_silence() && now - roamed_at_ >= roam_after_silence()) roam();
+    if (roams_ && now - link_.spoke() >= keepalive_interval()) send_datagram(link_.take_ack());
+    if (socket_.is_open() && !writing_) write();
+  }
+
+  /**
+   * The agent moves to a new socket, with a new port and the source address
+   * the routes pick now. The session goes on from there, the hub follows the
+   * address its datagrams come from.
+   */
+  void roam() {
+    auto now = udp_link::clock::now();
+    sockaddr_storage peer{};
+    socklen_t size = sizeof(peer);
+    if (getpeername(socket_.native_handle(), (sockaddr*)&peer, &size) != 0) return;
+    int fd = udp_socket(nullptr, (sockaddr*)&peer, size);
+    if (fd < 0) return;
+    roamed_at_ = now;
+    ++sockets_;
+    std::error_code ec;
+    socket_.close(ec);
+    socket_.assign(peer.ss_family == AF_INET6 ? asio::ip::udp::v6() : asio::ip::udp::v4(), fd, ec);
+    read_datagrams();
+    // tells the hub where it is now
+    send_datagram(link_.take_ack());
+  }
+
+  static udp_link::clock::duration keepalive_interval() {
+    return std::chrono::seconds(1);
+  }
+
+  /// longer than the heartbeat interval of the hub
+  static udp_link::clock::duration roam_after_silence() {
+    return std::chrono::milliseconds(3 * heartbeat_interval_ms / 2);
+  }
+
+  asio::ip::udp::socket socket_;
+  std::string buffer_;
+  udp_link link_;
+  asio::steady_timer timer_;
+  udp_link::clock::time_point timer_at_ = udp_link::clock::time_point::max();
+  bool roams_;
+  udp_link::clock::time_point roamed_at_;
+  unsigned sockets_ = 0;                // replaced by roam()
+  static const size_t max_burst = 256;  // datagrams read at once
+};
+
+/**
+ * One end of a pair() of connections in this process, the bytes are handed
+ * over on the executors and never go through the kernel. Only the end of
+ * either goes through their socketpair.
+ */
+class loopback_stream : public stream {
+ public:
+  using socket_type = asio::generic::stream_protocol::socket;
+
+  explicit loopback_stream(socket_type socket) : socket_(std::move(socket)) {}
+
+  /// two connected ends, first on executor a and second on b
+  static std::pair<std::shared_ptr<connection>, std::shared_ptr<connection>> pair(const asio::any_io_executor& a, const asio::any_io_executor& b) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) return {};
+    asio::generic::stream_protocol protocol(AF_UNIX, 0);
+    auto* sa = new loopback_stream(socket_type(a, protocol, sv[0]));
+    auto* sb = new loopback_stream(socket_type(b, protocol, sv[1]));
+    auto first = std::make_shared<connection>(std::unique_ptr<stream>(sa));
+    auto second = std::make_shared<connection>(std::unique_ptr<stream>(sb));
+    sa->peer_ = second;
+    sa->peer_stream_ = sb;
+    sb->peer_ = first;
+    sb->peer_stream_ = sa;
+    return {first, second};
+  }
+
+  /// nothing comes on the socket, it only ends when the peer goes away
+  void start() override {
+    auto self = this->self();
+    socket_.async_wait(asio::socket_base::wait_read, [this, self](const std::error_code&) {
+      fail();
+    });
+    started_ = true;
+    if (early_.empty()) return;
+    auto early = std::move(early_);
+    early_.clear();
+    received(early.data(), early.size());
+  }
+
+  /// the queue as it is goes to the peer's executor, and what it took comes back here
+  void write() override {
+    auto peer = peer_.lock();
+    if (!peer) return fail();
+    auto& q = queue();
+    if (!q.materialize()) return fail();
+    auto batch = std::make_shared<std::vector<shared_buffer>>();
+    size_t total = 0;
+    for (auto& i : q.items) {
+      batch->push_back(std::move(i.buffer));
+      total += batch->back()->size();
+    }
+    q.items.clear();
+    writing_ = true;
+    auto self = this->self();
+    auto* other = peer_stream_;
+    asio::post(other->executor(), [this, self, peer, other, batch, total] {
+      for (auto& b : *batch) {
+        if (!other->arrived(*b)) break;
+      }
+      asio::post(socket_.get_executor(), [this, self, total] {
+        writing_ = false;
+        if (!socket_.is_open()) return;
+        queue().bytes -= total;
+        written();
+      });
+    });
+  }
+
+  void close() override {
+    std::error_code ec;
+    socket_.close(ec);
+  }
+
+  bool is_open() const override {
+    return socket_.is_open();
+  }
+
+  asio::any_io_executor executor() override {
+    return socket_.get_executor();
+  }
+
+ private:
+  /// on this end's executor, false once it is closed
+  bool arrived(const std::string& data) {
+    if (!socket_.is_open()) return false;
+    if (!started_) {
+      early_.append(data);
+    } else {
+      received(data.data(), data.size());
+    }
+    return true;
+  }
+
+  socket_type socket_;
+  std::weak_ptr<connection> peer_;
+  loopback_stream* peer_stream_ = nullptr;  // owned by peer_
+  bool started_ = false;
+  std::string early_;  // from the peer before start()
+};
+
+}  // namespace rterm
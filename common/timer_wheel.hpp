@@ -0,0 +1,138 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "asio.hpp"
+
+namespace rterm {
+
+/**
+ * Hierarchical timer wheel for many coarse timeouts, e.g. one per agent.
+ * Scheduling and cancelling are O(1), and so is a tick apart from the timers
+ * it fires: there is one asio timer for the whole wheel, not one per entry.
+ *
+ * Four levels of 64 slots. A timer lands in the lowest level its deadline
+ * fits in, and moves down a level whenever the level below wraps around, so
+ * with 100 ms ticks it spans about 19 days, later deadlines are clamped.
+ *
+ * Not thread safe, use it on its executor (a strand for a threaded hub).
+ */
+class timer_wheel {
+ public:
+  using clock = std::chrono::steady_clock;
+  using id = uint64_t;
+
+  timer_wheel(const asio::any_io_executor& executor, clock::duration tick)
+      : timer_(executor), tick_(tick), slots_(levels * slot_count), start_(clock::now()) {}
+
+  /// cb runs once after delay, rounded up to the tick, unless cancelled first
+  id schedule(clock::duration delay, std::function<void()> cb) {
+    // an idle wheel does not tick, catch up with the time first (nothing is due as it is empty)
+    if (!running_) now_ = (uint64_t)((clock::now() - start_) / tick_);
+    uint64_t ticks = (uint64_t)((delay + tick_ - clock::duration(1)) / tick_);
+    id i = next_id_++;
+    place(entry{i, now_ + std::max<uint64_t>(1, ticks), std::move(cb)});
+    if (!running_) run();
+    return i;
+  }
+
+  /// a timer which is due already in the current tick still runs
+  void cancel(id i) {
+    auto it = index_.find(i);
+    if (it == index_.end()) return;
+    slots_[it->second.first].erase(it->second.second);
+    index_.erase(it);
+  }
+
+  size_t size() const {
+    return index_.size();
+  }
+
+ private:
+  static const unsigned levels = 4;
+  static const unsigned slot_bits = 6;
+  static const unsigned slot_count = 1u << slot_bits;
+
+  struct entry {
+    id i;
+    uint64_t deadline;  // in ticks
+    std::function<void()> cb;
+  };
+
+  void place(entry e) {
+    uint64_t delta = e.deadline > now_ ? e.deadline - now_ : 0;
+    unsigned level = 0;
+    while (level + 1 < levels && delta >= (1ull << (slot_bits * (level + 1)))) {
+      ++level;
+    }
+    if (level + 1 == levels && delta >= (1ull << (slot_bits * levels))) {
+      e.deadline = now_ + (1ull << (slot_bits * levels)) - 1;
+    }
+    size_t slot = level * slot_count + ((e.deadline >> (slot_bits * level)) & (slot_count - 1));
+    auto& list = slots_[slot];
+    id i = e.i;
+    list.push_back(std::move(e));
+    index_[i] = {slot, std::prev(list.end())};
+  }
+
+  void run() {
+    running_ = true;
+    timer_.expires_at(start_ + tick_ * (now_ + 1));
+    timer_.async_wait([this](const std::error_code& ec) {
+      if (ec) return;
+      // catch up with the ticks the io_context was too busy for
+      auto target = (uint64_t)((clock::now() - start_) / tick_);
+      while (now_ < target) {
+        advance();
+      }
+      if (index_.empty()) {
+        running_ = false;
+        return;
+      }
+      run();
+    });
+  }
+
+  void advance() {
+    ++now_;
+    // entering a new round of a level: its current slot moves down
+    for (unsigned level = 1; level < levels; ++level) {
+      if (now_ & ((1ull << (slot_bits * level)) - 1)) break;
+      cascade(level * slot_count + ((now_ >> (slot_bits * level)) & (slot_count - 1)));
+    }
+    auto due = std::move(slots_[now_ & (slot_count - 1)]);
+    slots_[now_ & (slot_count - 1)].clear();
+    for (auto& e : due) {
+      index_.erase(e.i);
+    }
+    // a callback may schedule or cancel, only what was due now runs
+    for (auto& e : due) {
+      e.cb();
+    }
+  }
+
+  void cascade(size_t slot) {
+    auto moving = std::move(slots_[slot]);
+    slots_[slot].clear();
+    for (auto& e : moving) {
+      index_.erase(e.i);
+      place(std::move(e));
+    }
+  }
+
+ private:
+  asio::steady_timer timer_;
+  clock::duration tick_;
+  std::vector<std::list<entry>> slots_;
+  std::unordered_map<id, std::pair<size_t, std::list<entry>::iterator>> index_;
+  clock::time_point start_;
+  uint64_t now_ = 0;  // ticks since start_
+  id next_id_ = 1;
+  bool running_ = false;
+};
+
+}  // namespace rterm
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+namespace rterm {
+
+/**
+ * Rate limit: rate tokens a second, up to burst of them saved up for a
+ * quiet period. A rate of 0 is no limit.
+ */
+class token_bucket {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  explicit token_bucket(double rate = 0, double burst = 1) {
+    reset(rate, burst);
+  }
+
+  void reset(double rate, double burst) {
+    rate_ = rate;
+    burst_ = std::max(1.0, burst);
+    tokens_ = burst_;
+    last_ = clock::now();
+  }
+
+  /// a token is there to take
+  bool ready() {
+    if (rate_ <= 0) return true;
+    refill();
+    return tokens_ >= 1;
+  }
+
+  void take() {
+    if (rate_ > 0) tokens_ -= 1;
+  }
+
+  /// until the next token, after ready() said no
+  clock::duration wait() const {
+    if (rate_ <= 0) return clock::duration::zero();
+    auto seconds = std::max(0.0, (1 - tokens_) / rate_);
+    return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds)) + std::chrono::milliseconds(1);
+  }
+
+ private:
+  void refill() {
+    auto now = clock::now();
+    tokens_ = std::min(burst_, tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+    last_ = now;
+  }
+
+ private:
+  double rate_;
+  double burst_;
+  double tokens_;
+  clock::time_point last_;
+};
+
+}  // namespace rterm
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+
+#include "connection.hpp"
+#include "log.h"
+#include "streams.hpp"
+
+namespace rterm {
+
+/**
+ * How an agent reaches its hub. A transport dials and hands over a connection
+ * which is not started yet, over the stream of its kind, see streams.hpp. The
+ * session logic above does not know what is under it: TCP, the Unix socket of
+ * a hub on this host with or without an shm_link, UDP, or a loopback in this
+ * process for tests and benchmarks.
+ */
+class transport {
+ public:
+  /// conn is nullptr when it failed
+  using connected = std::function<void(std::shared_ptr<connection> conn)>;
+
+  virtual ~transport() = default;
+
+  virtual void connect(connected cb) = 0;
+};
+
+class tcp_transport : public transport {
+ public:
+  tcp_transport(asio::io_context& io_context, std::string host, uint16_t port) : io_context_(io_context), host_(std::move(host)), port_(port), resolver_(io_context) {}
+
+  void connect(connected cb) override {
+    auto socket = std::make_shared<asio::ip::tcp::socket>(io_context_);
+    resolver_.async_resolve(host_, std::to_string(port_), [socket, cb](const std::error_code& ec, const asio::ip::tcp::resolver::results_type& r) {
+      if (ec) {
+        LOGD("on_open_failed: %s", ec.message().c_str());
+        return cb(nullptr);
+      }
+      asio::async_connect(*socket, r, [socket, cb](const std::error_code& ec, const asio::ip::tcp::endpoint&) {
+        if (ec) {
+          LOGD("on_open_failed: %s", ec.message().c_str());
+          return cb(nullptr);
+        }
+        socket->set_option(asio::ip::tcp::no_delay(true));
+        cb(connection::make<socket_stream>(socket_stream::socket_type(std::move(*socket))));
+      });
+    });
+    LOGD("try open...");
+  }
+
+ private:
+  asio::io_context& io_context_;
+  std::string host_;
+  uint16_t port_;
+  asio::ip::tcp::resolver resolver_;
+};
+
+#ifdef __linux__
+/**
+ * The Unix socket of a hub on this host, see shm_link_address(). The first
+ * byte asks for an shm_link, or for the socket itself as the stream.
+ */
+class unix_transport : public transport {
+ public:
+  unix_transport(asio::io_context& io_context, std::string address, bool shm) : io_context_(io_context), address_(std::move(address)), shm_(shm) {}
+
+  void connect(connected cb) override {
+    auto socket = std::make_shared<asio::local::stream_protocol::socket>(io_context_);
+    bool shm = shm_;
+    socket->async_connect(asio::local::stream_protocol::endpoint(address_), [socket, shm, cb](const std::error_code& ec) {
+      // no hub here, or one which does not offer it
+      if (ec) return cb(nullptr);
+      char want = shm ? 's' : 'u';
+      if (::send(socket->native_handle(), &want, 1, MSG_NOSIGNAL) != 1) return cb(nullptr);
+      if (!shm) return cb(connection::make<passing_stream>(socket_stream::socket_type(std::move(*socket))));
+      socket->async_wait(asio::socket_base::wait_read, [socket, cb](const std::error_code& ec) {
+        auto link = ec ? nullptr : shm_link::receive_from(socket->native_handle());
+        if (!link) {
+          LOGD("no shm_link from the hub");
+          return cb(nullptr);
+        }
+        cb(connection::make<shm_stream>(socket_stream::socket_type(std::move(*socket)), std::move(link)));
+      });
+    });
+  }
+
+ private:
+  asio::io_context& io_context_;
+  std::string address_;
+  bool shm_;
+};
+#endif
+
+/**
+ * The stream over UDP in a udp_link, see udp_stream: lost datagrams are sent
+ * again, and the session survives a change of the agent's address. The hub has to serve_udp(), a hub which does not answers
+ * with port unreachable and the connection ends. A new session id for each
+ * connection, the hub tells an agent whose session it does not know to end
+ * it.
+ */
+class udp_transport : public transport {
+ public:
+  udp_transport(asio::io_context& io_context, std::string host, uint16_t port) : io_context_(io_context), host_(std::move(host)), port_(port), resolver_(io_context) {}
+
+  void connect(connected cb) override {
+    auto& io_context = io_context_;
+    resolver_.async_resolve(host_, std::to_string(port_), [&io_context, cb](const std::error_code& ec, const asio::ip::udp::resolver::results_type& r) {
+      if (ec || r.empty()) {
+        LOGD("on_open_failed: %s", ec.message().c_str());
+        return cb(nullptr);
+      }
+      auto endpoint = r.begin()->endpoint();
+      int fd = udp_socket(nullptr, endpoint.data(), (socklen_t)endpoint.size());
+      if (fd < 0) {
+        LOGD("on_open_failed: %s", strerror(errno));
+        return cb(nullptr);
+      }
+      std::random_device random;
+      uint64_t session = ((uint64_t)random() << 32 | random()) | 1;  // never 0, which is none
+      cb(connection::make<udp_stream>(asio::ip::udp::socket(io_context, endpoint.protocol(), fd), session, true));
+    });
+    LOGD("try open...");
+  }
+
+ private:
+  asio::io_context& io_context_;
+  std::string host_;
+  uint16_t port_;
+  asio::ip::udp::resolver resolver_;
+};
+
+/**
+ * A hub in this process, dial returns the agent's end of a
+ * loopback_stream::pair(), e.g. from hub::connect_loopback().
+ */
+class loopback_transport : public transport {
+ public:
+  explicit loopback_transport(std::function<std::shared_ptr<connection>()> dial) : dial_(std::move(dial)) {}
+
+  void connect(connected cb) override {
+    cb(dial_());
+  }
+
+ private:
+  std::function<std::shared_ptr<connection>()> dial_;
+};
+
+}  // namespace rterm
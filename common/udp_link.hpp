@@ -0,0 +1,425 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+
+#include "proto.hpp"
+
+namespace rterm {
+
+/**
+ * A reliable, ordered byte stream over UDP datagrams: the protocol state of
+ * one end without the I/O, udp_stream drives it.
+ *
+ * Every datagram starts with its kind and the session id the agent picked,
+ * so the hub knows the session whatever address it comes from. An agent
+ * whose address changes (another network, a NAT rebinding) keeps its
+ * session, the hub follows the address the last datagram came from.
+ *
+ * Data packets are numbered. The receiver acknowledges the next one it
+ * expects and up to max_ranges ranges it has beyond that (selective acks),
+ * so only what is lost is sent again and what came after a loss is not: it
+ * is delivered as soon as the gap is filled, one lost datagram does not hold
+ * back the rest of the window like a lost TCP segment. A packet is taken for
+ * lost when one sent reorder_threshold packets later is acked, or when
+ * nothing is acked for the retransmission timeout.
+ *
+ * The window is counted in packets, Reno-like: doubled each RTT up to the
+ * first loss, then one more per RTT, halved once per loss episode. The
+ * packets of a window are paced over the smoothed RTT rather than sent at
+ * once, a burst would overflow the queue of a slow link or a receive buffer.
+ */
+class udp_link {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  enum kind : uint8_t {
+    data = 1,  // u32 seq, u32 stamp of the sender, payload
+    ack,       // u32 next seq expected, u32 stamp of the last data packet, u8 n, n * (u32 begin, u32 end) received beyond
+    fin,       // the session is over
+  };
+
+  static const size_t header_size = 9;                     // u8 kind, u64 session
+  static const size_t data_header_size = header_size + 8;  // seq, stamp
+  static const size_t ack_header_size = header_size + 9;
+  static const size_t max_window = 4096;  // packets in flight, and held for reordering
+  static const size_t initial_window = 16;
+  static const size_t min_window = 4;
+  static const uint64_t reorder_threshold = 3;
+  static const size_t max_ranges = 32;
+  static const int64_t min_rto_us = 20000;
+  static const int64_t max_rto_us = 2000000;
+  static const int64_t initial_rto_us = 1000000;  // RFC 6298, a satellite link takes 600 ms
+
+  udp_link(uint64_t session, size_t datagram_size) : session_(session), datagram_size_(datagram_size), epoch_(clock::now()) {
+    spoke_ = heard_ = epoch_;
+  }
+
+  /// the session of a datagram, 0 if it is not one
+  static uint64_t session_of(const char* p, size_t size) {
+    if (size < header_size || (uint8_t)p[0] < data || (uint8_t)p[0] > fin) return 0;
+    return get_u64(p + 1);
+  }
+
+  /// a datagram an unknown session may start with, the first packets of a stream
+  static bool opens(const char* p, size_t size) {
+    return size >= data_header_size && (uint8_t)p[0] == data && get_u32(p + header_size) < initial_window;
+  }
+
+  /// tells the peer of an unknown or ended session to give it up
+  static std::string fin_packet(uint64_t session) {
+    std::string out(header_size, '\0');
+    out[0] = (char)fin;
+    put_u64(&out[1], session);
+    return out;
+  }
+
+  uint64_t session() const {
+    return session_;
+  }
+
+  size_t payload_size() const {
+    return datagram_size_ - data_header_size;
+  }
+
+  /// when the next data packet may go, a pacing quantum early as timers are not finer, max() while the window is full
+  clock::time_point send_at() const {
+    if (flight_ >= (size_t)cwnd_ || next_ - una_ >= max_window) return clock::time_point::max();
+    return next_send_ - pace_quantum();
+  }
+
+  bool has_lost() const {
+    return !lost_.empty();
+  }
+
+  /// a lost packet to send again, counted as sent, nullptr if there is none
+  const std::string* resend(clock::time_point now) {
+    while (!lost_.empty()) {
+      uint64_t seq = lost_.front();
+      lost_.pop_front();
+      if (seq < una_) continue;
+      auto& p = inflight_[(size_t)(seq - una_)];
+      if (p.acked || !p.lost) continue;
+      p.lost = false;
+      stamp(p.datagram, now);
+      sending(now);
+      return &p.datagram;
+    }
+    return nullptr;
+  }
+
+  /// a data packet with its header, the payload is to be appended and the packet passed to sent()
+  std::string new_packet() const {
+    std::string out;
+    out.reserve(datagram_size_);
+    out.resize(data_header_size);
+    out[0] = (char)data;
+    put_u64(&out[1], session_);
+    put_u32(&out[header_size], (uint32_t)next_);
+    return out;
+  }
+
+  /// the packet from new_packet() goes out now, the reference is valid until the next ack
+  const std::string& sent(std::string packet, clock::time_point now) {
+    stamp(packet, now);
+    sending(now);
+    inflight_.push_back(packet_state{std::move(packet), false, false});
+    ++next_;
+    return inflight_.back().datagram;
+  }
+
+  /// the retransmission timeout runs out then, max() if nothing waits for an ack
+  clock::time_point deadline() const {
+    if (una_ == next_) return clock::time_point::max();
+    return last_progress_ + std::chrono::microseconds(rto_us_);
+  }
+
+  /// after deadline(): everything not acked is lost, the window starts over
+  void timed_out(clock::time_point now) {
+    for (size_t i = 0; i < inflight_.size(); ++i) {
+      lose(i);
+    }
+    ssthresh_ = std::max(cwnd_ / 2, (double)min_window);
+    cwnd_ = min_window;
+    recovery_end_ = next_;
+    rto_us_ = std::min(rto_us_ * 2, (int64_t)max_rto_us);
+    last_progress_ = now;
+    ++timeouts_;
+  }
+
+  /// in a row, without an ack in between
+  unsigned timeouts() const {
+    return timeouts_;
+  }
+
+  /**
+   * A datagram from the peer. The payload of data in order goes to deliver,
+   * which may end the connection. false if it is not of this session.
+   */
+  bool received(const char* p, size_t size, clock::time_point now, const std::function<void(const char*, size_t)>& deliver) {
+    if (session_of(p, size) != session_) return false;
+    heard_ = now;
+    heard_any_ = true;
+    switch ((uint8_t)p[0]) {
+      case data:
+        if (size < data_header_size) return false;
+        received_data(get_u32(p + header_size), get_u32(p + header_size + 4), p + data_header_size, size - data_header_size, deliver);
+        return true;
+      case ack:
+        return received_ack(p, size, now);
+      default:
+        finished_ = true;
+        return true;
+    }
+  }
+
+  /// data came since the last ack
+  bool ack_due() const {
+    return ack_due_;
+  }
+
+  std::string take_ack() {
+    std::string out(ack_header_size, '\0');
+    out[0] = (char)ack;
+    put_u64(&out[1], session_);
+    put_u32(&out[header_size], (uint32_t)rcv_next_);
+    put_u32(&out[header_size + 4], echo_);
+    uint8_t n = 0;
+    for (auto it = out_of_order_.begin(); it != out_of_order_.end() && n < max_ranges; ++n) {
+      uint64_t begin = it->first;
+      uint64_t end = begin;
+      while (it != out_of_order_.end() && it->first == end) {
+        ++it;
+        ++end;
+      }
+      char range[8];
+      put_u32(range, (uint32_t)begin);
+      put_u32(range + 4, (uint32_t)end);
+      out.append(range, sizeof(range));
+    }
+    out[ack_header_size - 1] = (char)n;
+    ack_due_ = false;
+    return out;
+  }
+
+  /// the peer sent fin
+  bool finished() const {
+    return finished_;
+  }
+
+  bool heard_any() const {
+    return heard_any_;
+  }
+
+  clock::time_point heard() const {
+    return heard_;
+  }
+
+  /// the last time anything went out, for keepalives
+  clock::time_point spoke() const {
+    return spoke_;
+  }
+
+  void spoken(clock::time_point now) {
+    spoke_ = now;
+  }
+
+  /// 0 before the first sample
+  int64_t srtt_us() const {
+    return (int64_t)srtt_us_;
+  }
+
+  size_t window() const {
+    return (size_t)cwnd_;
+  }
+
+ private:
+  struct packet_state {
+    std::string datagram;
+    bool acked;
+    bool lost;  // and not sent again yet
+  };
+
+  static clock::duration pace_quantum() {
+    return std::chrono::microseconds(250);
+  }
+
+  void stamp(std::string& packet, clock::time_point now) const {
+    put_u32(&packet[header_size + 4], (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - epoch_).count());
+  }
+
+  /// a data packet goes into flight: the timeout counts from here if nothing else is waiting, and the next one is paced
+  void sending(clock::time_point now) {
+    if (flight_ == 0) last_progress_ = now;
+    ++flight_;
+    spoke_ = now;
+    if (srtt_us_ <= 0) return;
+    double gain = cwnd_ < ssthresh_ ? 2 : 1.25;
+    auto interval = std::chrono::duration<double, std::micro>(srtt_us_ / (cwnd_ * gain));
+    next_send_ = std::max(next_send_, now) + std::chrono::duration_cast<clock::duration>(interval);
+  }
+
+  /// a 32 bit sequence number from the wire, near base
+  static uint64_t widen(uint64_t base, uint32_t seq) {
+    return base + (uint64_t)(int64_t)(int32_t)(seq - (uint32_t)base);
+  }
+
+  void received_data(uint32_t wire_seq, uint32_t stamp, const char* payload, size_t size, const std::function<void(const char*, size_t)>& deliver) {
+    uint64_t seq = widen(rcv_next_, wire_seq);
+    echo_ = stamp;
+    ack_due_ = true;
+    // a duplicate only gets acked again, one beyond the window is dropped
+    if (seq < rcv_next_ || seq - rcv_next_ >= max_window) return;
+    if (seq != rcv_next_) {
+      out_of_order_.emplace(seq, std::string(payload, size));
+      return;
+    }
+    ++rcv_next_;
+    deliver(payload, size);
+    while (!out_of_order_.empty() && out_of_order_.begin()->first == rcv_next_) {
+      std::string next = std::move(out_of_order_.begin()->second);
+      out_of_order_.erase(out_of_order_.begin());
+      ++rcv_next_;
+      deliver(next.data(), next.size());
+    }
+  }
+
+  bool received_ack(const char* p, size_t size, clock::time_point now) {
+    if (size < ack_header_size) return false;
+    size_t n = (uint8_t)p[ack_header_size - 1];
+    if (size < ack_header_size + n * 8) return false;
+    uint64_t next = widen(una_, get_u32(p + header_size));
+    if (next > next_) return false;
+    size_t newly = 0;
+    while (una_ < next) {
+      newly += acked(0);
+      inflight_.pop_front();
+      ++una_;
+      highest_acked_ = std::max(highest_acked_, una_ - 1);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      const char* range = p + ack_header_size + i * 8;
+      uint64_t begin = std::max(widen(una_, get_u32(range)), una_);
+      uint64_t end = std::min(widen(una_, get_u32(range + 4)), next_);
+      for (uint64_t seq = begin; seq < end; ++seq) {
+        newly += acked((size_t)(seq - una_));
+      }
+      if (begin < end) highest_acked_ = std::max(highest_acked_, end - 1);
+    }
+    if (newly == 0) return true;
+
+    timeouts_ = 0;
+    last_progress_ = now;
+    sample_rtt((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - epoch_).count() - get_u32(p + header_size + 4));
+
+    // lost: not acked while one sent reorder_threshold later is, each packet is looked at once
+    bool loss = false;
+    scan_ = std::max(scan_, una_);
+    for (; scan_ + reorder_threshold <= highest_acked_; ++scan_) {
+      loss |= lose((size_t)(scan_ - una_));
+    }
+    if (loss) {
+      if (una_ >= recovery_end_) {
+        ssthresh_ = std::max(cwnd_ / 2, (double)min_window);
+        cwnd_ = ssthresh_;
+        recovery_end_ = next_;
+      }
+    } else if (una_ >= recovery_end_) {
+      cwnd_ += cwnd_ < ssthresh_ ? (double)newly : (double)newly / cwnd_;
+      cwnd_ = std::min(cwnd_, (double)max_window);
+    }
+    return true;
+  }
+
+  /// 1 if the packet at index i was not acked before
+  size_t acked(size_t i) {
+    auto& p = inflight_[i];
+    if (p.acked) return 0;
+    p.acked = true;
+    if (!p.lost) --flight_;
+    return 1;
+  }
+
+  /// true if the packet at index i is newly taken for lost
+  bool lose(size_t i) {
+    auto& p = inflight_[i];
+    if (p.acked || p.lost) return false;
+    p.lost = true;
+    --flight_;
+    lost_.push_back(una_ + i);
+    return true;
+  }
+
+  void sample_rtt(uint32_t rtt) {
+    double sample = rtt;
+    if (srtt_us_ <= 0) {
+      srtt_us_ = sample;
+      rttvar_us_ = sample / 2;
+    } else {
+      rttvar_us_ = 0.75 * rttvar_us_ + 0.25 * std::abs(srtt_us_ - sample);
+      srtt_us_ = 0.875 * srtt_us_ + 0.125 * sample;
+    }
+    rto_us_ = std::min(std::max((int64_t)(srtt_us_ + std::max(4 * rttvar_us_, 1000.0)), (int64_t)min_rto_us), (int64_t)max_rto_us);
+  }
+
+ private:
+  uint64_t session_;
+  size_t datagram_size_;
+  clock::time_point epoch_;  // of the stamps
+
+  // sending
+  std::deque<packet_state> inflight_;  // from una_ to next_
+  uint64_t una_ = 0;                   // the first not acked in order
+  uint64_t next_ = 0;
+  uint64_t highest_acked_ = 0;
+  uint64_t scan_ = 0;  // looked at for loss up to here
+  std::deque<uint64_t> lost_;
+  size_t flight_ = 0;  // sent, neither acked nor lost
+  double cwnd_ = initial_window;
+  double ssthresh_ = max_window;
+  uint64_t recovery_end_ = 0;  // no more halving for losses before it
+  double srtt_us_ = 0;
+  double rttvar_us_ = 0;
+  int64_t rto_us_ = initial_rto_us;
+  unsigned timeouts_ = 0;
+  clock::time_point last_progress_;
+  clock::time_point next_send_;
+  clock::time_point spoke_;
+
+  // receiving
+  uint64_t rcv_next_ = 0;
+  std::map<uint64_t, std::string> out_of_order_;
+  uint32_t echo_ = 0;
+  bool ack_due_ = false;
+  bool finished_ = false;
+  bool heard_any_ = false;
+  clock::time_point heard_;
+};
+
+/// a connected UDP socket for a udp_stream, -1 on failure
+inline int udp_socket(const sockaddr* local, const sockaddr* peer, socklen_t size) {
+  int fd = ::socket(peer->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  int on = 1;
+  // the hub has one for each agent on its port, next to the one which takes new agents
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+  // a window of datagrams may come in at once
+  int buffer = 4 * 1024 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+  if ((local && ::bind(fd, local, size) != 0) || ::connect(fd, peer, size) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+}  // namespace rterm
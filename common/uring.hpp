@@ -0,0 +1,349 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+
+#include "asio.hpp"
+#include "log.h"
+
+#ifndef IORING_OP_READ_MULTISHOT
+#define IORING_OP_READ_MULTISHOT 49  // linux 6.7, newer than some headers
+#endif
+
+namespace rterm {
+
+/**
+ * io_uring for the reads and writes of one io_context thread, on the raw
+ * syscalls, no liburing needed.
+ *
+ * Reads are multishot: one submission keeps delivering data until the
+ * descriptor ends, into buffers the kernel picks from a ring registered up
+ * front (provided buffers), so a read costs no syscall of its own. The ring
+ * descriptor is waited on by the io_context like any other, one wakeup drains
+ * every completion, and the submissions made meanwhile go to the kernel in
+ * one io_uring_enter at the end.
+ *
+ * Not thread safe. ok() is false where io_uring is not available, e.g.
+ * disabled by sysctl or seccomp, the callers then use the reactor.
+ */
+class uring {
+ public:
+  /// a read delivers at most buffer_size bytes, buffers is a power of 2
+  explicit uring(asio::io_context& io_context, unsigned entries = 4096, unsigned buffers = 1024, size_t buffer_size = 16 * 1024)
+      : io_context_(io_context), ring_(io_context), buffer_count_(buffers), buffer_size_(buffer_size) {
+    io_uring_params p{};
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;  // multishot reads post many completions per submission
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+      LOGW("io_uring_setup: %s", strerror(errno));
+      return;
+    }
+    ring_.assign(fd);
+    if (!map(fd, p) || !provide_buffers(fd)) {
+      LOGW("io_uring: %s", strerror(errno));
+      std::error_code ec;
+      ring_.close(ec);
+      return;
+    }
+    ok_ = true;
+    wait();
+  }
+
+  ~uring() {
+    std::error_code ec;
+    ring_.close(ec);
+    if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+    if (buf_ring_ != MAP_FAILED) munmap(buf_ring_, buf_ring_size_);
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+
+  /**
+   * Read fd until it ends. data is valid during on_data only. on_end gets 0
+   * at EOF or the errno, EINVAL if the kernel has no multishot read for fd.
+   * @param socket recv for sockets, read for other descriptors such as a PTY
+   * @return token for cancel()
+   */
+  uint64_t read(int fd, bool socket, std::function<void(const char* data, size_t size)> on_data, std::function<void(int err)> on_end) {
+    uint64_t token = next_token_++;
+    op& o = ops_[token];
+    o.fd = fd;
+    o.opcode = socket ? IORING_OP_RECV : IORING_OP_READ_MULTISHOT;
+    o.on_data = std::move(on_data);
+    o.on_end = std::move(on_end);
+    arm(token, o);
+    return token;
+  }
+
+  /// write the iovecs, which have to stay valid until done gets the result, bytes or -errno
+  void writev(int fd, const iovec* iov, unsigned count, std::function<void(int res)> done) {
+    uint64_t token = next_token_++;
+    op& o = ops_[token];
+    o.fd = fd;
+    o.opcode = IORING_OP_WRITEV;
+    o.on_write = std::move(done);
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = count;
+    sqe->user_data = token;
+  }
+
+  /// stop a read, its on_end still comes, with ECANCELED
+  void cancel(uint64_t token) {
+    auto it = ops_.find(token);
+    if (it == ops_.end() || it->second.cancelled) return;
+    it->second.cancelled = true;
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = token;
+    sqe->user_data = 0;
+  }
+
+ public:
+  // for benchmarks
+  uint64_t enters = 0;       // io_uring_enter calls
+  uint64_t wakeups = 0;      // times the ring woke the io_context
+  uint64_t completions = 0;  // completions handled
+
+ private:
+  struct op {
+    int fd;
+    uint8_t opcode;
+    bool cancelled = false;
+    std::function<void(const char* data, size_t size)> on_data;
+    std::function<void(int err)> on_end;
+    std::function<void(int res)> on_write;
+  };
+
+  bool map(int fd, const io_uring_params& p) {
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) return false;
+    cq_ring_ = single ? sq_ring_ : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) return false;
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) return false;
+
+    auto* sq = (char*)sq_ring_;
+    sq_head_ = (unsigned*)(sq + p.sq_off.head);
+    sq_tail_ = (unsigned*)(sq + p.sq_off.tail);
+    sq_flags_ = (unsigned*)(sq + p.sq_off.flags);
+    sq_mask_ = *(unsigned*)(sq + p.sq_off.ring_mask);
+    sq_entries_ = p.sq_entries;
+    auto* array = (unsigned*)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; ++i) {
+      array[i] = i;  // sqes are used in ring order
+    }
+    auto* cq = (char*)cq_ring_;
+    cq_head_ = (unsigned*)(cq + p.cq_off.head);
+    cq_tail_ = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask_ = *(unsigned*)(cq + p.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    tail_ = submitted_ = *sq_tail_;
+    return true;
+  }
+
+  /// register the buffer ring the multishot reads take their buffers from
+  bool provide_buffers(int fd) {
+    buf_ring_size_ = buffer_count_ * sizeof(io_uring_buf);
+    buf_ring_ = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (buf_ring_ == MAP_FAILED) return false;
+    io_uring_buf_reg reg{};
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring_;
+    reg.ring_entries = buffer_count_;
+    reg.bgid = buffer_group;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) return false;
+    buffers_.resize(buffer_count_ * buffer_size_);
+    for (unsigned i = 0; i < buffer_count_; ++i) {
+      recycle((uint16_t)i);
+    }
+    return true;
+  }
+
+  void recycle(uint16_t bid) {
+    // not io_uring_buf_ring::bufs, the flexible array of the header is off by 8 bytes in C++
+    auto* ring = (io_uring_buf*)buf_ring_;
+    io_uring_buf& b = ring[buf_tail_ & (buffer_count_ - 1)];
+    b.addr = (uint64_t)(uintptr_t)&buffers_[bid * buffer_size_];
+    b.len = (uint32_t)buffer_size_;
+    b.bid = bid;
+    // the tail overlays resv of the first entry
+    __atomic_store_n(&ring[0].resv, ++buf_tail_, __ATOMIC_RELEASE);
+  }
+
+  void arm(uint64_t token, const op& o) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = o.opcode;
+    sqe->fd = o.fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffer_group;
+    sqe->user_data = token;
+    if (o.opcode == IORING_OP_RECV) sqe->ioprio = IORING_RECV_MULTISHOT;
+  }
+
+  io_uring_sqe* get_sqe() {
+    if (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) flush();
+    auto* sqe = &((io_uring_sqe*)sqes_)[tail_ & sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    ++tail_;
+    if (!flush_posted_) {
+      // everything submitted by this round of handlers goes in one syscall
+      flush_posted_ = true;
+      asio::post(io_context_, [this] {
+        flush_posted_ = false;
+        flush();
+      });
+    }
+    return sqe;
+  }
+
+  void flush(unsigned flags = 0) {
+    unsigned count = tail_ - submitted_;
+    if (count == 0 && flags == 0) return;
+    __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+    for (;;) {
+      ++enters;
+      int n = (int)syscall(__NR_io_uring_enter, ring_.native_handle(), count, 0, flags, nullptr, 0);
+      if (n >= 0) {
+        submitted_ += (unsigned)n;
+        if ((unsigned)n == count) return;
+        count -= (unsigned)n;
+        continue;
+      }
+      if (errno == EINTR) continue;
+      // EBUSY/EAGAIN: the completion queue is full, reap and try again
+      if (errno == EBUSY || errno == EAGAIN) {
+        reap();
+        continue;
+      }
+      LOGE("io_uring_enter: %s", strerror(errno));
+      return;
+    }
+  }
+
+  void wait() {
+    ring_.async_wait(asio::posix::descriptor_base::wait_read, [this](const std::error_code& ec) {
+      if (ec) return;
+      ++wakeups;
+      reap();
+      flush();
+      wait();
+    });
+  }
+
+  void reap() {
+    for (;;) {
+      unsigned head = *cq_head_;
+      unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      if (head == tail) {
+        // completions which did not fit are kept by the kernel, ask for them
+        if (!(__atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) return;
+        flush(IORING_ENTER_GETEVENTS);
+        continue;
+      }
+      for (; head != tail; ++head) {
+        io_uring_cqe cqe = cqes_[head & cq_mask_];
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        ++completions;
+        complete(cqe);
+      }
+    }
+  }
+
+  void complete(const io_uring_cqe& cqe) {
+    if (cqe.user_data == 0) return;  // a cancel
+    auto it = ops_.find(cqe.user_data);
+    if (it == ops_.end()) return;
+    op& o = it->second;
+
+    if (o.opcode == IORING_OP_WRITEV) {
+      auto done = std::move(o.on_write);
+      ops_.erase(it);
+      done(cqe.res);
+      return;
+    }
+
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+      auto bid = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      if (!o.cancelled && o.on_data) o.on_data(&buffers_[bid * buffer_size_], (size_t)cqe.res);
+      recycle(bid);
+      // the handler may have cancelled and the map may have grown, look again
+      it = ops_.find(cqe.user_data);
+      if (it == ops_.end()) return;
+    }
+    if (more) return;
+
+    // multishot ended: out of buffers or a full queue rearm, otherwise it is over
+    op& current = it->second;
+    if (!current.cancelled && (cqe.res > 0 || cqe.res == -ENOBUFS)) {
+      arm(cqe.user_data, current);
+      return;
+    }
+    auto on_end = std::move(current.on_end);
+    ops_.erase(it);
+    if (on_end) on_end(cqe.res < 0 ? -cqe.res : 0);
+  }
+
+ private:
+  static const uint16_t buffer_group = 0;
+
+  asio::io_context& io_context_;
+  asio::posix::stream_descriptor ring_;
+  bool ok_ = false;
+
+  void* sq_ring_ = MAP_FAILED;
+  void* cq_ring_ = MAP_FAILED;
+  void* sqes_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_flags_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+  unsigned tail_ = 0;       // sqes filled
+  unsigned submitted_ = 0;  // sqes handed to the kernel
+  bool flush_posted_ = false;
+
+  void* buf_ring_ = MAP_FAILED;
+  size_t buf_ring_size_ = 0;
+  unsigned buffer_count_;
+  size_t buffer_size_;
+  uint16_t buf_tail_ = 0;
+  std::string buffers_;
+
+  uint64_t next_token_ = 1;
+  std::unordered_map<uint64_t, op> ops_;
+};
+
+}  // namespace rterm
+
+#endif  // __linux__
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include "hub.hpp"
+
+namespace rterm {
+
+/**
+ * The same channel opened on many agents. A frame is encoded once and the
+ * same buffer is queued on every member, each connection drains it at its own
+ * pace. A member whose backlog grows past max_backlog is sent nothing more for
+ * a while: its frames are held here, still shared, and go out once its queue
+ * has drained. So a slow agent does not hold back the others, does not grow
+ * its socket queue without bound, and still gets every key, in order.
+ * on_lag tells when a member falls behind and when it has caught up.
+ *
+ * Runs on the strand given, the user strand of the hub.
+ */
+class broadcast_group {
+ public:
+  broadcast_group(const strand& executor, uint32_t channel, size_t max_backlog = 256 * 1024)
+      : channel_(channel), max_backlog_(max_backlog), timer_(executor) {}
+
+  uint32_t channel() const {
+    return channel_;
+  }
+
+  void add(std::shared_ptr<agent_session> as) {
+    members_.push_back(member{std::move(as), {}});
+  }
+
+  void remove(const agent_session* as) {
+    for (auto it = members_.begin(); it != members_.end(); ++it) {
+      if (it->as.get() == as) {
+        members_.erase(it);
+        return;
+      }
+    }
+  }
+
+  size_t size() const {
+    return members_.size();
+  }
+
+  void send(msg type, const char* data, size_t size) {
+    if (members_.empty()) return;
+    auto buffer = make_shared_buffer(pack(type, channel_, data, size));
+    for (auto it = members_.begin(); it != members_.end();) {
+      auto& m = *it;
+      if (!m.as->alive()) {
+        it = members_.erase(it);
+        continue;
+      }
+      if (m.held.empty() && m.as->queued_bytes() > max_backlog_) {
+        LOGW("%s lags behind, its input is held", m.as->name().c_str());
+        if (on_lag) on_lag(m.as, true);
+      }
+      if (m.held.empty() && m.as->queued_bytes() <= max_backlog_) {
+        m.as->send(buffer);
+      } else {
+        m.held.push_back(buffer);
+        catch_up_later();
+      }
+      ++it;
+    }
+  }
+
+ public:
+  /// lagging: the member is held back from now on, or has caught up
+  std::function<void(const std::shared_ptr<agent_session>& as, bool lagging)> on_lag;
+
+ private:
+  struct member {
+    std::shared_ptr<agent_session> as;
+    std::deque<shared_buffer> held;  // not sent while its queue drains
+  };
+
+  void catch_up_later() {
+    if (waiting_) return;
+    waiting_ = true;
+    timer_.expires_after(std::chrono::milliseconds(50));
+    timer_.async_wait([this](const std::error_code& ec) {
+      if (ec) return;
+      waiting_ = false;
+      catch_up();
+    });
+  }
+
+  void catch_up() {
+    bool again = false;
+    for (auto it = members_.begin(); it != members_.end();) {
+      auto& m = *it;
+      if (!m.as->alive()) {
+        it = members_.erase(it);
+        continue;
+      }
+      if (!m.held.empty()) {
+        if (m.as->queued_bytes() < max_backlog_ / 4) {
+          for (auto& b : m.held) m.as->send(b);
+          m.held.clear();
+          LOGW("%s has caught up", m.as->name().c_str());
+          if (on_lag) on_lag(m.as, false);
+        } else {
+          again = true;
+        }
+      }
+      ++it;
+    }
+    if (again) catch_up_later();
+  }
+
+  uint32_t channel_;
+  size_t max_backlog_;
+  std::vector<member> members_;
+  asio::steady_timer timer_;
+  bool waiting_ = false;
+};
+
+}  // namespace rterm
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include "byte_scan.hpp"
+#include "hub.hpp"
+#include "local_echo.hpp"
+#include "renderer.hpp"
+#include "screen.hpp"
+
+namespace rterm {
+
+/**
+ * The local terminal of the interactive shell. The output of the agent is
+ * passed on as it is while it is light, every byte the shell writes gets there
+ * at once. When more than a screenful comes each frame for a tenth of a second
+ * in a row, a build log or a cat of a big file, the bytes only go into the
+ * screen model, and the renderer draws the model once a frame, at most at the
+ * refresh rate of the terminal: what one would see of it anyway, for a small
+ * part of the bytes. The lines which scrolled by in between do not reach the
+ * scrollback of the terminal, a shorter burst is passed on whole. The terminal
+ * is cleared before the first frame, the model does not know where on it the
+ * shell started. After a light frame the terminal is where the model is and
+ * passing on resumes.
+ *
+ * Keys typed are shown before the shell echoes them from here too, see
+ * local_echo.
+ *
+ * What is written in one turn of the event loop, a burst of small chunks of
+ * output of a full screen program, goes to the terminal in one write. It is
+ * wrapped in a synchronized update (DEC private mode 2026) when the terminal
+ * has it, so the terminal shows the whole batch at once and not half of a
+ * redraw. What the terminal does not take at once is kept and written when it
+ * has room again. Everything runs on the strand given.
+ */
+class display {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  /// fps 0: no frames, everything is passed on
+  display(const strand& executor, int fd, int cols, int rows, local_echo::mode echo, int fps = 60)
+      : strand_(executor),
+        fd_(fd),
+        model_(cols, rows),
+        renderer_(cols, rows),
+        echo_(model_, echo),
+        frame_(std::chrono::microseconds(1000000 / std::max(fps, 1))),
+        flood_bytes_((size_t)(cols * rows)),
+        flood_frames_(fps > 0 ? std::max(fps / 10, 1) : 0),
+        frame_timer_(executor),
+        echo_timer_(executor),
+        answer_timer_(executor),
+        out_(executor, ::dup(fd)) {}
+
+  /// output of the shell
+  void output(const char* data, size_t size) {
+    total_ += size;
+    if (!rendering_) {
+      auto now = clock::now();
+      if (now >= frame_end_) {
+        // a frame without output between ends the run
+        heavy_frames_ = frame_bytes_ > flood_bytes_ && now < frame_end_ + frame_ ? heavy_frames_ + 1 : 0;
+        frame_end_ = now + frame_;
+        frame_bytes_ = 0;
+      }
+      frame_bytes_ += size;
+      bool flood = flood_frames_ > 0 && frame_bytes_ > flood_bytes_ && heavy_frames_ + 1 >= flood_frames_;
+      // the terminal has to be between sequences to take ours
+      if (!flood || !model_.idle()) {
+        write_out(echo_.hide());
+        model_.feed(data, size);
+        write_out(data, size);
+        terminal_idle_ = model_.idle();
+        write_out(echo_.update());
+        return;
+      }
+      write_out(echo_.suspend());
+      write_out(renderer_.reset(model_));
+      rendering_ = true;
+      frame_bytes_ = 0;
+      schedule_frame();
+    }
+    model_.feed(data, size);
+    frame_bytes_ += size;
+    echo_.update();
+  }
+
+  /// the terminal has a new size, the shell redraws what it needs after its SIGWINCH
+  void resize(int cols, int rows) {
+    if (cols == model_.cols() && rows == model_.rows()) return;
+    write_out(echo_.hide());
+    echo_.forget();
+    model_.resize(cols, rows);
+    flood_bytes_ = (size_t)(cols * rows);
+    // frames go on from a cleared terminal of the new size
+    if (rendering_) write_out(renderer_.reset(model_));
+  }
+
+  /// a message of the hub, on a line of its own between the output of the shell
+  void notice(const std::string& text) {
+    if (!model_.idle()) return;
+    std::string line = "\r\n[terminal_server: " + text + "]\r\n";
+    output(line.data(), line.size());
+  }
+
+  /// keys typed, rtt_us: round trip to the agent, -1 when not known
+  void typed(const char* data, size_t size, int64_t rtt_us) {
+    echo_.set_rtt(rtt_us);
+    write_out(echo_.typed(data, size, clock::now()));
+    expire_echo();
+  }
+
+  /**
+   * Asks the terminal whether it has synchronized updates, the answer comes
+   * with the keys typed, see keys(). One which does not answer within a
+   * second is taken for one without.
+   */
+  void ask_sync() {
+    static const char query[] = "\x1b[?2026$p";
+    asking_ = true;
+    write_out(query, sizeof(query) - 1);
+    answer_timer_.expires_after(std::chrono::seconds(1));
+    answer_timer_.async_wait([this](const std::error_code& ec) {
+      if (ec || !asking_) return;
+      LOGD("synchronized updates: no answer");
+      asking_ = false;
+      release(held_.size());
+    });
+  }
+
+  /**
+   * Keys read from the terminal, they go to on_keys without the answers of
+   * the terminal. An answer may come split over reads: while asking, what
+   * could be the start of one is held until the rest comes, or the wait ends.
+   */
+  void keys(const char* data, size_t size) {
+    if (!asking_ && held_.empty()) {
+      if (size > 0 && on_keys) on_keys(data, size);
+      return;
+    }
+    held_.append(data, size);
+    // at an ESC, keys typed have few controls
+    for (size_t at = find_control(held_.data(), held_.size()); at < held_.size();
+         at += 1 + find_control(held_.data() + at + 1, held_.size() - at - 1)) {
+      int found = answer_at(held_.data() + at, held_.size() - at);
+      if (found == 1) return release(at);
+      if (found == 0) continue;
+      asking_ = false;
+      answer_timer_.cancel();
+      sync_ = held_[at + 8] >= '1' && held_[at + 8] <= '3';
+      LOGD("synchronized updates: %s", sync_ ? "yes" : "no");
+      held_.erase(at, answer_size);
+      break;
+    }
+    release(held_.size());
+  }
+
+  /// writes what is pending now, the last frame of a flood included, before the end, waits for the terminal to take it
+  void flush() {
+    if (rendering_) {
+      frame_timer_.cancel();
+      rendering_ = false;
+      write_out(renderer_.render(model_));
+    }
+    write_pending(true);
+  }
+
+  /// the screen of the shell, fed with all of its output
+  const screen& model() const {
+    return model_;
+  }
+
+  /// bytes of output of the shell, and bytes written to the terminal
+  size_t total() const {
+    return total_;
+  }
+  size_t written() const {
+    return written_;
+  }
+
+ public:
+  /// keys typed, see keys()
+  std::function<void(const char* data, size_t size)> on_keys;
+
+ private:
+  static const size_t answer_size = 11;  // DECRPM, CSI ? 2026 ; Ps $ y
+
+  /// 2: the whole answer at data, 1: its start up to the end of data, 0: neither
+  static int answer_at(const char* data, size_t size) {
+    static const char answer[] = "\x1b[?2026;0$y";
+    for (size_t i = 0; i < answer_size; ++i) {
+      if (i == size) return 1;
+      if (i == 8 ? !isdigit((unsigned char)data[i]) : data[i] != answer[i]) return 0;
+    }
+    return 2;
+  }
+
+  /// passes on the first size bytes held
+  void release(size_t size) {
+    std::string keys = held_.substr(0, size);
+    held_.erase(0, size);
+    if (!keys.empty() && on_keys) on_keys(keys.data(), keys.size());
+  }
+
+  void schedule_frame() {
+    frame_timer_.expires_at(frame_end_);
+    frame_timer_.async_wait([this](const std::error_code& ec) {
+      if (ec) return;
+      if (waiting_) {
+        // the terminal has not taken the last frame yet, a later one replaces this one
+        frame_end_ = std::max(frame_end_ + frame_, clock::now());
+        return schedule_frame();
+      }
+      std::string out = renderer_.render(model_);
+      bool light = frame_bytes_ <= flood_bytes_;
+      frame_bytes_ = 0;
+      frame_end_ = std::max(frame_end_ + frame_, clock::now());
+      if (light && model_.idle() && renderer_.exact()) {
+        rendering_ = false;
+        out += echo_.resume();
+      } else {
+        schedule_frame();
+      }
+      write_out(out);
+    });
+  }
+
+  void expire_echo() {
+    auto due = echo_.deadline();
+    if (due == clock::time_point::max()) return;
+    echo_timer_.expires_at(due);
+    echo_timer_.async_wait([this](const std::error_code& ec) {
+      if (ec) return;
+      write_out(echo_.expire(clock::now()));
+      expire_echo();
+    });
+  }
+
+  void write_out(const std::string& out) {
+    write_out(out.data(), out.size());
+  }
+
+  /// queued for the end of this turn of the event loop
+  void write_out(const char* data, size_t size) {
+    if (size == 0) return;
+    if (pending_.empty()) {
+      whole_ = terminal_idle_;
+      asio::post(strand_, [this] {
+        write_pending();
+      });
+    }
+    pending_.append(data, size);
+  }
+
+  /// block: wait until the terminal has taken all, instead of waiting for it to have room
+  void write_pending(bool block = false) {
+    if (!pending_.empty()) {
+      // a batch which starts or ends in the middle of a sequence of the shell is not wrapped
+      if (sync_ && whole_ && terminal_idle_) {
+        pending_.insert(0, "\x1b[?2026h");
+        pending_ += "\x1b[?2026l";
+      }
+      written_ += pending_.size();
+      unwritten_ += pending_;
+      pending_.clear();
+    }
+    if (broken_) unwritten_.clear();
+    if (waiting_ && !block) return;
+    while (done_ < unwritten_.size()) {
+      ssize_t n = write(fd_, unwritten_.data() + done_, unwritten_.size() - done_);
+      if (n > 0) {
+        done_ += (size_t)n;
+        continue;
+      }
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (!block) return write_later();
+        pollfd p{fd_, POLLOUT, 0};
+        poll(&p, 1, -1);
+        continue;
+      }
+      LOGE("terminal: %s", strerror(errno));
+      broken_ = true;
+      break;
+    }
+    unwritten_.clear();
+    done_ = 0;
+  }
+
+  void write_later() {
+    waiting_ = true;
+    out_.async_wait(asio::posix::descriptor_base::wait_write, [this](const std::error_code& ec) {
+      waiting_ = false;
+      if (!ec) write_pending();
+    });
+  }
+
+  strand strand_;
+  int fd_;
+  screen model_;
+  renderer renderer_;
+  local_echo echo_;
+  clock::duration frame_;
+  size_t flood_bytes_;   // more than this in a frame is a heavy one
+  int flood_frames_;     // heavy frames in a row before the terminal gets frames, 0 for never
+  int heavy_frames_ = 0;  // before this one
+  asio::steady_timer frame_timer_;
+  asio::steady_timer echo_timer_;
+  asio::steady_timer answer_timer_;
+  asio::posix::stream_descriptor out_;  // a dup of fd_, to wait for room
+  bool rendering_ = false;
+  clock::time_point frame_end_;
+  size_t frame_bytes_ = 0;
+  std::string pending_;
+  std::string unwritten_;  // what the terminal did not take yet, from done_ on
+  size_t done_ = 0;
+  bool waiting_ = false;  // for room in the terminal
+  bool broken_ = false;   // the terminal is gone, nothing more is written
+  bool terminal_idle_ = true;  // what was written ends between sequences of the shell
+  bool whole_ = true;          // and what was written before pending_
+  bool asking_ = false;  // whether the terminal has synchronized updates
+  bool sync_ = false;
+  std::string held_;  // keys which may be the start of the answer
+  size_t total_ = 0;
+  size_t written_ = 0;
+};
+
+}  // namespace rterm
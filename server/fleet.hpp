@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "hub.hpp"
+
+namespace rterm {
+
+/**
+ * Fold host names into a compact set, like clush/nodeset:
+ * web1 web2 web3 web7 db01 db02 => db[01-02],web[1-3,7]
+ */
+inline std::string fold_names(const std::vector<std::string>& names) {
+  // key: prefix and the width of zero padded numbers, 0 for not padded
+  std::map<std::pair<std::string, size_t>, std::set<unsigned long>> groups;
+  std::set<std::string> plain;
+  for (const auto& n : names) {
+    size_t p = n.size();
+    while (p > 0 && isdigit((unsigned char)n[p - 1])) --p;
+    size_t digits = n.size() - p;
+    if (digits == 0 || digits > 9) {
+      plain.insert(n);
+      continue;
+    }
+    size_t width = (n[p] == '0' && digits > 1) ? digits : 0;
+    groups[{n.substr(0, p), width}].insert(std::stoul(n.substr(p)));
+  }
+
+  std::vector<std::string> out(plain.begin(), plain.end());
+  for (const auto& g : groups) {
+    auto fmt = [&](unsigned long v) {
+      std::string s = std::to_string(v);
+      if (s.size() < g.first.second) s.insert(0, g.first.second - s.size(), '0');
+      return s;
+    };
+    const auto& nums = g.second;
+    if (nums.size() == 1) {
+      out.push_back(g.first.first + fmt(*nums.begin()));
+      continue;
+    }
+    std::string ranges;
+    for (auto it = nums.begin(); it != nums.end();) {
+      unsigned long first = *it, last = *it;
+      for (++it; it != nums.end() && *it == last + 1; ++it) last = *it;
+      if (!ranges.empty()) ranges += ',';
+      ranges += fmt(first);
+      if (last != first) ranges += '-' + fmt(last);
+    }
+    out.push_back(g.first.first + '[' + ranges + ']');
+  }
+  std::sort(out.begin(), out.end());
+
+  std::string ret;
+  for (const auto& s : out) {
+    if (!ret.empty()) ret += ',';
+    ret += s;
+  }
+  return ret;
+}
+
+struct fleet_options {
+  std::string command;
+  size_t fanout = 64;  // commands in flight at once
+  bool gather = false;  // like `clush -b`: group identical outputs, print at the end
+};
+
+/**
+ * Run one command on many agents with a concurrency limit.
+ *
+ * Without gather every output line is printed as it arrives, prefixed by the
+ * agent name. With gather, identical outputs are merged as soon as an agent
+ * finishes, so memory grows with distinct outputs rather than with agents.
+ *
+ * The output of an agent is taken on the strand of its session, on a
+ * sharded_hub in the thread of its shard: only the exit of a job goes through
+ * the strand fleet_run runs on.
+ */
+class fleet_run {
+ public:
+  fleet_run(std::vector<std::shared_ptr<agent_session>> targets, fleet_options options, FILE* out = stdout)
+      : pending_(targets.begin(), targets.end()), options_(std::move(options)), out_(out) {
+    if (options_.fanout == 0) options_.fanout = 1;
+  }
+
+  void start() {
+    fill();
+    if (inflight_ == 0) finish();
+  }
+
+  /// max exit status over all agents, 255 for a lost agent
+  int status() const {
+    return status_;
+  }
+
+ public:
+  std::function<void()> on_done;
+
+ private:
+  struct job {
+    std::string name;
+    std::string output;
+    std::string error;  // partial stderr line, gather mode merges stderr into output
+  };
+
+  void fill() {
+    while (inflight_ < options_.fanout && !pending_.empty()) {
+      auto target = std::move(pending_.front());
+      pending_.pop_front();
+      if (!target->alive()) {
+        job j{target->name(), {}};
+        record(j, -1);
+        continue;
+      }
+      launch(target);
+    }
+  }
+
+  void launch(const std::shared_ptr<agent_session>& target) {
+    auto j = std::make_shared<job>();
+    j->name = target->name();
+    ++inflight_;
+    target->open(
+        msg::exec, options_.command,
+        [this, j](const frame& f) {
+          if (f.type == msg::exit) complete(*j, f.size >= 4 ? (int32_t)get_u32(f.data) : 255);
+          if (f.type == msg::close) complete(*j, -1);
+        },
+        0,
+        [this, j](const frame& f) {
+          // the job is only touched here until its exit is delivered
+          if (f.type == msg::exec_out) on_output(*j, j->output, out_, f.data, f.size);
+          if (f.type == msg::exec_err) on_output(*j, options_.gather ? j->output : j->error, stderr, f.data, f.size);
+          return f.type != msg::exit && f.type != msg::close;
+        });
+  }
+
+  void on_output(job& j, std::string& pending, FILE* out, const char* data, size_t size) {
+    pending.append(data, size);
+    if (options_.gather) return;
+    size_t begin = 0;
+    for (;;) {
+      size_t nl = pending.find('\n', begin);
+      if (nl == std::string::npos) break;
+      fprintf(out, "%s: %.*s\n", j.name.c_str(), (int)(nl - begin), pending.data() + begin);
+      begin = nl + 1;
+    }
+    if (begin == 0) return;
+    pending.erase(0, begin);
+    fflush(out);
+  }
+
+  void complete(job& j, int status) {
+    --inflight_;
+    record(j, status);
+    fill();
+    if (inflight_ == 0 && pending_.empty()) finish();
+  }
+
+  /// @param status exit status, -1 for a lost agent
+  void record(job& j, int status) {
+    status_ = std::max(status_, status < 0 ? 255 : status);
+    std::string reason = status < 0 ? "connection lost" : "exited with exit code " + std::to_string(status);
+    if (options_.gather) {
+      if (status != 0) failed_[reason].push_back(j.name);
+      groups_[std::move(j.output)].push_back(std::move(j.name));
+      return;
+    }
+    if (!j.output.empty()) {
+      fprintf(out_, "%s: %s\n", j.name.c_str(), j.output.c_str());
+    }
+    fflush(out_);
+    if (!j.error.empty()) fprintf(stderr, "%s: %s\n", j.name.c_str(), j.error.c_str());
+    if (status != 0) fprintf(stderr, "terminal_server: %s: %s\n", j.name.c_str(), reason.c_str());
+  }
+
+  void finish() {
+    if (options_.gather) {
+      // order groups by their node set, like clush
+      std::vector<std::pair<std::string, const std::string*>> sorted;
+      for (const auto& g : groups_) {
+        sorted.emplace_back(fold_names(g.second), &g.first);
+      }
+      std::sort(sorted.begin(), sorted.end());
+      for (const auto& s : sorted) {
+        fprintf(out_, "---------------\n%s\n---------------\n", s.first.c_str());
+        fwrite(s.second->data(), 1, s.second->size(), out_);
+        if (!s.second->empty() && s.second->back() != '\n') fputc('\n', out_);
+      }
+      for (const auto& f : failed_) {
+        fprintf(stderr, "terminal_server: %s: %s\n", fold_names(f.second).c_str(), f.first.c_str());
+      }
+      fflush(out_);
+    }
+    if (on_done) on_done();
+  }
+
+ private:
+  std::deque<std::shared_ptr<agent_session>> pending_;
+  fleet_options options_;
+  FILE* out_;
+
+  size_t inflight_ = 0;
+  int status_ = 0;
+  std::map<std::string, std::vector<std::string>> groups_;  // output => agents
+  std::map<std::string, std::vector<std::string>> failed_;  // reason => agents
+};
+
+}  // namespace rterm
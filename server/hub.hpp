@@ -0,0 +1,704 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <utility>
+
+#include "connection.hpp"
+#include "log.h"
+#include "proto.hpp"
+#include "streams.hpp"
+#include "timer_wheel.hpp"
+#include "token_bucket.hpp"
+#include "transport.hpp"
+
+namespace rterm {
+
+using strand = asio::strand<asio::io_context::executor_type>;
+
+/// monotonic clock of the hub, for heartbeats
+inline int64_t monotonic_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * An agent connected to the hub. Channels are allocated here, every frame of
+ * a channel goes to the handler given to open(). When the channel ends, or the
+ * connection is lost, the handler receives msg::close as the last frame.
+ *
+ * A threaded hub runs each session on a strand of its own, and the user code
+ * on a user strand: send(), open(), close_channel() and close() then post to
+ * the session, and the handlers run on the user strand with a copy of the
+ * frame. The rest is for the session's strand only.
+ *
+ * A filter given to open() sees the frames of the channel first, on the
+ * session's strand, as parsed: what it takes is neither copied nor posted.
+ * Per frame work which needs no shared state, e.g. splitting output into
+ * lines, then runs on the shard of the session, next to the others.
+ */
+class agent_session : public std::enable_shared_from_this<agent_session> {
+  friend class hub;
+
+ public:
+  using handler = std::function<void(const frame&)>;
+  /// true: the frame is taken, the handler does not get it
+  using filter = std::function<bool(const frame&)>;
+
+  agent_session(std::weak_ptr<connection> conn, std::atomic<uint32_t>& next_channel, strand home, strand user, bool threaded)
+      : conn_(std::move(conn)), next_channel_(next_channel), home_(std::move(home)), user_(std::move(user)), threaded_(threaded) {}
+
+  const std::string& name() const {
+    return name_;
+  }
+
+  bool alive() const {
+    return alive_;
+  }
+
+  void send(shared_buffer packed) {
+    if (foreign()) {
+      auto self = shared_from_this();
+      asio::post(home_, [self, packed = std::move(packed)]() mutable {
+        self->send(std::move(packed));
+      });
+      return;
+    }
+    auto conn = conn_.lock();
+    if (conn) conn->send(std::move(packed));
+  }
+
+  void send(std::string packed) {
+    send(make_shared_buffer(std::move(packed)));
+  }
+
+  void send(msg type, uint32_t channel, const std::string& body = std::string()) {
+    send(pack(type, channel, body));
+  }
+
+  /// a frame whose body is length bytes of the file, fewer if it shrank by then, sent with sendfile where possible
+  void send_file(msg type, uint32_t channel, std::shared_ptr<file_handle> file, off_t offset, size_t length) {
+    if (foreign()) {
+      auto self = shared_from_this();
+      asio::post(home_, [self, type, channel, file = std::move(file), offset, length]() mutable {
+        self->send_file(type, channel, std::move(file), offset, length);
+      });
+      return;
+    }
+    auto conn = conn_.lock();
+    if (conn) conn->send_file(type, channel, std::move(file), offset, length);
+  }
+
+  /// a channel id to pass to open(), when the handler needs to know it before
+  uint32_t new_channel() {
+    return next_channel_++;
+  }
+
+  /**
+   * Allocate a channel and send the message which opens it on the agent.
+   * Channel ids are unique in the hub, so one id got from hub::new_channel()
+   * may be opened on many agents and share encoded frames, see broadcast.
+   * @return channel id, 0 if the agent is gone
+   */
+  uint32_t open(msg type, const std::string& body, handler h, uint32_t id = 0, filter here = nullptr) {
+    if (!alive_) return 0;
+    if (id == 0) id = next_channel_++;
+    if (foreign()) {
+      auto self = shared_from_this();
+      asio::post(home_, [self, type, body, h = std::move(h), id, here = std::move(here)] {
+        // lost meanwhile, the handler still gets its close
+        if (!self->open(type, body, h, id, here)) self->route(listener{h, here}, frame{msg::close, id, nullptr, 0});
+      });
+      return id;
+    }
+    channels_[id] = listener{std::move(h), std::move(here)};
+    send(type, id, body);
+    return id;
+  }
+
+  /// stop delivering frames of the channel, and tell the agent
+  void close_channel(uint32_t id) {
+    if (foreign()) {
+      auto self = shared_from_this();
+      asio::post(home_, [self, id] {
+        self->close_channel(id);
+      });
+      return;
+    }
+    if (channels_.erase(id)) send(msg::close, id);
+  }
+
+  void close() {
+    if (foreign()) {
+      auto self = shared_from_this();
+      asio::post(home_, [self] {
+        self->close();
+      });
+      return;
+    }
+    auto conn = conn_.lock();
+    if (conn) conn->close();
+  }
+
+  /// for channels which write to the connection directly
+  const std::weak_ptr<connection>& conn() const {
+    return conn_;
+  }
+
+  /// bytes waiting to be written to this agent
+  size_t queued_bytes() const {
+    auto conn = conn_.lock();
+    return conn ? conn->queued_bytes() : 0;
+  }
+
+  /// round trip time of the last heartbeat, -1 before the first one is answered
+  int64_t rtt_us() const {
+    return rtt_us_;
+  }
+
+ public:
+  /// the connection is gone, after every channel got its close
+  std::function<void()> on_lost;
+
+ private:
+  void dispatch(const frame& f) {
+#ifdef __linux__
+    if (f.type == msg::pty_fd) return dispatch_fd(f);
+#endif
+    auto it = channels_.find(f.channel);
+    if (it == channels_.end()) return;
+    auto l = it->second;
+    bool last = f.type == msg::close || f.type == msg::exit;
+    if (last) channels_.erase(it);
+    route(l, f);
+  }
+
+#ifdef __linux__
+  /// the descriptor which came with the frame goes to the handler as the body
+  void dispatch_fd(const frame& f) {
+    auto conn = conn_.lock();
+    int fd = conn ? conn->take_fd() : -1;
+    auto it = channels_.find(f.channel);
+    if (it == channels_.end()) {
+      if (fd >= 0) ::close(fd);
+      return;
+    }
+    char body[4];
+    put_u32(body, (uint32_t)fd);
+    route(it->second, frame{f.type, f.channel, body, sizeof(body)});
+  }
+#endif
+
+  struct listener {
+    handler h;
+    filter here;
+  };
+
+  void route(const listener& l, const frame& f) {
+    if (l.here && l.here(f)) return;
+    deliver(l.h, f);
+  }
+
+  /// run h on the user strand, the frame is copied when that is not this one
+  void deliver(const handler& h, const frame& f) {
+    if (!threaded_) return h(f);
+    auto body = std::make_shared<std::string>(f.data, f.size);
+    msg type = f.type;
+    uint32_t channel = f.channel;
+    asio::post(user_, [h, body, type, channel] {
+      h(frame{type, channel, body->data(), (uint32_t)body->size()});
+    });
+  }
+
+  /// called from outside the strand of the session
+  bool foreign() const {
+    return threaded_ && !home_.running_in_this_thread();
+  }
+
+  void lost() {
+    alive_ = false;
+    auto channels = std::move(channels_);
+    channels_.clear();
+    for (auto& c : channels) {
+      route(c.second, frame{msg::close, c.first, nullptr, 0});
+    }
+    if (!on_lost) return;
+    if (!threaded_) return on_lost();
+    asio::post(user_, on_lost);
+  }
+
+ private:
+  std::weak_ptr<connection> conn_;
+  std::atomic<uint32_t>& next_channel_;
+  strand home_;  // runs the connection
+  strand user_;  // runs the handlers
+  bool threaded_;
+  std::string name_;
+  bool viewer_ = false;
+  bool announced_ = false;  // on_agent was called, on the user strand
+  std::atomic<bool> alive_{true};
+  std::atomic<int64_t> last_seen_us_{monotonic_us()};  // when data came in last
+  std::atomic<int64_t> rtt_us_{-1};
+  std::map<uint32_t, listener> channels_;
+  frame_parser parser_;
+};
+
+/**
+ * Accepts agent connections. Everything runs on one io_context, an agent costs
+ * a socket and some memory, no thread.
+ *
+ * A threaded hub may have its io_context run by many threads: every
+ * connection gets a strand of its own, so a busy agent does not hold up the
+ * others, and the callbacks and channel handlers run on the user strand, see
+ * agent_session.
+ *
+ * New connections are admitted at a bounded rate, see set_admission(), so a
+ * fleet reconnecting at once after a restart waits in the listen backlog
+ * instead of making the hub spike. What is in the backlog is accepted in
+ * batches without a round trip through the reactor for each.
+ *
+ * Every connection is pinged each heartbeat_interval_ms, the pong gives the
+ * round trip time, and one which has sent nothing for two and a half intervals is
+ * dropped: a half-dead TCP connection goes away in seconds, not when the
+ * kernel gives up. The heartbeats are driven by one timer wheel on a strand
+ * of its own, not by a timer per session.
+ *
+ * On Linux agents on the same host connect to an abstract Unix socket next
+ * to the port, see shm_link_address(). The first byte they send asks for an
+ * shm_link, their bytes then go through shared memory instead of the loopback
+ * TCP stack, or for a plain stream on the socket. Either way descriptors can
+ * be passed, e.g. the PTY master of a channel, see msg::pty_fd.
+ *
+ * Agents on other transports: UDP on the same port number, see serve_udp(),
+ * and agents in this process, see connect_loopback().
+ */
+class hub {
+ public:
+  static constexpr double default_admit_rate = 2000;
+  static constexpr double default_admit_burst = 500;
+  static const size_t max_accept_batch = 64;
+  static const int64_t dead_after_ms = 5 * heartbeat_interval_ms / 2;
+
+  hub(asio::io_context& io_context, uint16_t port)
+      : io_context_(io_context),
+        user_(asio::make_strand(io_context)),
+        threaded_(false),
+        acceptor_(io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)),
+        retry_timer_(io_context),
+        next_channel_(own_next_channel_) {}
+
+  /// threaded, the user code has to run on user too
+  hub(asio::io_context& io_context, uint16_t port, const strand& user)
+      : io_context_(io_context),
+        user_(user),
+        threaded_(true),
+        acceptor_(io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)),
+        retry_timer_(user),
+        next_channel_(own_next_channel_) {}
+
+  /**
+   * One shard of a sharded_hub, threaded: the port is shared with SO_REUSEPORT
+   * and channel ids come from next_channel. It does not serve_local() unless told.
+   */
+  hub(asio::io_context& io_context, uint16_t port, const strand& user, std::atomic<uint32_t>& next_channel)
+      : io_context_(io_context), user_(user), threaded_(true), acceptor_(io_context), retry_timer_(user), next_channel_(next_channel) {
+    using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+    asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+    acceptor_.set_option(reuse_port(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+#ifdef __linux__
+    serve_local_ = false;
+#endif
+  }
+
+  void start() {
+    accept();
+#ifdef __linux__
+    if (serve_local_) accept_local();
+#endif
+    if (serve_udp_) accept_udp();
+  }
+
+  /// agents which have said hello, in connection order
+  std::vector<std::shared_ptr<agent_session>> agents() const {
+    std::vector<std::shared_ptr<agent_session>> ret;
+    ret.reserve(agents_.size());
+    for (auto& a : agents_) {
+      if (a.second->announced_) ret.push_back(a.second);
+    }
+    return ret;
+  }
+
+  /// a channel id which is free on every agent
+  uint32_t new_channel() {
+    return next_channel_++;
+  }
+
+#ifdef __linux__
+  /// before start(), whether to offer shm_links to local agents, only one shard can
+  void serve_local(bool on) {
+    serve_local_ = on;
+  }
+#endif
+
+  /// before start(), whether to take agents over UDP too, see udp_transport
+  void serve_udp(bool on) {
+    serve_udp_ = on;
+  }
+
+  /**
+   * An agent in this process, for a loopback_transport: the hub's end of a
+   * loopback_stream::pair() is added, the other end on executor returned.
+   * On the user strand, like the callbacks.
+   */
+  std::shared_ptr<connection> connect_loopback(const asio::any_io_executor& executor) {
+    strand home = asio::make_strand(io_context_);
+    auto ends = loopback_stream::pair(home, executor);
+    if (!ends.first) return nullptr;
+    add(ends.first, home);
+    return ends.second;
+  }
+
+  /// before start(): at most rate new connections a second, burst at once after a quiet period, rate 0 for no limit
+  void set_admission(double rate, double burst) {
+    admission_.reset(rate, burst);
+  }
+
+#ifdef __linux__
+  /// read and write the agent connections with io_uring, not for a threaded hub
+  void use_uring(uring& ring) {
+    if (!threaded_ && ring.ok()) uring_ = &ring;
+  }
+#endif
+
+ public:
+  std::function<void(const std::shared_ptr<agent_session>&)> on_agent;
+  std::function<void(const std::shared_ptr<agent_session>&)> on_agent_close;
+
+  /// a read-only viewer asks for the PTY of the named agent, it gets pty_data on channel 0
+  std::function<void(const std::shared_ptr<agent_session>& viewer, const std::string& name)> on_viewer;
+
+ private:
+  void accept() {
+    if (!admission_.ready()) {
+      // over the rate, the next ones wait in the listen backlog
+      retry_later(admission_.wait());
+      return;
+    }
+    strand home = asio::make_strand(io_context_);
+    // the socket type depends on the executor it is accepted with
+    auto accepted = [this, home](const std::error_code& ec, auto socket) {
+      if (ec == asio::error::operation_aborted) return;
+      if (ec) {
+        // e.g. out of descriptors, give the others some time to go away
+        LOGE("accept: %s", ec.message().c_str());
+        retry_later(std::chrono::milliseconds(100));
+        return;
+      }
+      admit(socket, home);
+      accept_queued();
+      accept();
+    };
+    if (threaded_) {
+      acceptor_.async_accept(home, asio::bind_executor(user_, accepted));
+    } else {
+      acceptor_.async_accept(accepted);
+    }
+  }
+
+  /// take what else is in the backlog right away, as far as admission allows
+  void accept_queued() {
+    std::error_code ec;
+    acceptor_.non_blocking(true, ec);
+    for (size_t i = 1; i < max_accept_batch && admission_.ready(); ++i) {
+      strand home = asio::make_strand(io_context_);
+      if (threaded_) {
+        auto socket = acceptor_.accept(home, ec);
+        if (ec) return;
+        admit(socket, home);
+      } else {
+        auto socket = acceptor_.accept(ec);
+        if (ec) return;
+        admit(socket, home);
+      }
+    }
+  }
+
+  template <typename Socket>
+  void admit(Socket& socket, const strand& home) {
+    admission_.take();
+    std::error_code ec;
+    socket.set_option(asio::ip::tcp::no_delay(true), ec);
+    add(connection::make<socket_stream>(socket_stream::socket_type(std::move(socket))), home);
+  }
+
+#ifdef __linux__
+  void accept_local() {
+    std::error_code ec;
+    local_acceptor_.open(asio::local::stream_protocol(), ec);
+    if (!ec) local_acceptor_.bind(asio::local::stream_protocol::endpoint(shm_link_address(acceptor_.local_endpoint().port())), ec);
+    if (!ec) local_acceptor_.listen(asio::socket_base::max_listen_connections, ec);
+    if (ec) {
+      LOGW("no shared memory for local agents: %s", ec.message().c_str());
+      return;
+    }
+    accept_next_local();
+  }
+
+  void accept_next_local() {
+    strand home = asio::make_strand(io_context_);
+    auto accepted = [this, home](const std::error_code& ec, auto socket) {
+      if (ec == asio::error::operation_aborted) return;
+      if (!ec) {
+        auto s = std::make_shared<socket_stream::socket_type>(std::move(socket));
+        s->async_wait(asio::socket_base::wait_read, asio::bind_executor(user_, [this, s, home](const std::error_code& ec) {
+          if (!ec) hello_local(*s, home);
+        }));
+      }
+      accept_next_local();
+    };
+    if (threaded_) {
+      local_acceptor_.async_accept(home, asio::bind_executor(user_, accepted));
+    } else {
+      local_acceptor_.async_accept(accepted);
+    }
+  }
+
+  /// the agent has sent which transport it wants, 's' for an shm_link or 'u' for the socket itself
+  void hello_local(socket_stream::socket_type& socket, const strand& home) {
+    char want = 0;
+    if (::recv(socket.native_handle(), &want, 1, MSG_DONTWAIT) != 1) return;
+    if (want == 's') {
+      // a fresh socket, the few bytes fit in its buffer
+      auto link = shm_link::create();
+      if (!link || !link->send_to(socket.native_handle())) return;
+      add(connection::make<shm_stream>(std::move(socket), std::move(link)), home);
+    } else if (want == 'u') {
+      add(connection::make<passing_stream>(std::move(socket)), home);
+    }
+  }
+#endif
+
+  void accept_udp() {
+    std::error_code ec;
+    udp_socket_.open(asio::ip::udp::v4(), ec);
+    using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+    if (!ec) udp_socket_.set_option(asio::socket_base::reuse_address(true), ec);
+    if (!ec) udp_socket_.set_option(reuse_port(true), ec);
+    if (!ec) udp_socket_.bind(asio::ip::udp::endpoint(asio::ip::udp::v4(), acceptor_.local_endpoint().port()), ec);
+    if (ec) {
+      LOGW("no UDP: %s", ec.message().c_str());
+      return;
+    }
+    udp_buffer_.resize(64 * 1024);
+    receive_udp();
+  }
+
+  /**
+   * The first datagrams of an agent come here, it gets a socket of its own
+   * connected to it which the kernel prefers from then on. So do those of an
+   * agent whose address has changed, its socket follows the new one. A
+   * session is known by its id, whoever has it can take it over: roaming is
+   * for the paths of a network one trusts, like the rest of the protocol.
+   */
+  void receive_udp() {
+    auto received = [this](const std::error_code& ec, size_t length) {
+      if (ec == asio::error::operation_aborted) return;
+      if (!ec) received_udp(length);
+      receive_udp();
+    };
+    if (threaded_) {
+      udp_socket_.async_receive_from(asio::buffer(udp_buffer_), udp_from_, asio::bind_executor(user_, received));
+    } else {
+      udp_socket_.async_receive_from(asio::buffer(udp_buffer_), udp_from_, received);
+    }
+  }
+
+  /// on the user strand
+  void received_udp(size_t length) {
+    uint64_t session = udp_link::session_of(udp_buffer_.data(), length);
+    if (session == 0) return;
+    auto it = udp_agents_.find(session);
+    auto conn = it == udp_agents_.end() ? nullptr : it->second.conn.lock();
+    udp_stream* udp = conn ? it->second.udp : nullptr;
+    if (!conn) {
+      if (!udp_link::opens(udp_buffer_.data(), length)) {
+        // e.g. the hub was restarted, the agent starts over
+        std::error_code ec;
+        if ((uint8_t)udp_buffer_[0] != udp_link::fin) udp_socket_.send_to(asio::buffer(udp_link::fin_packet(session)), udp_from_, 0, ec);
+        return;
+      }
+      strand home = asio::make_strand(io_context_);
+      auto local = asio::ip::udp::endpoint(asio::ip::udp::v4(), udp_socket_.local_endpoint().port());
+      int fd = udp_socket(local.data(), udp_from_.data(), (socklen_t)udp_from_.size());
+      if (fd < 0) {
+        LOGE("udp: %s", strerror(errno));
+        return;
+      }
+      udp = new udp_stream(asio::ip::udp::socket(home, asio::ip::udp::v4(), fd), session, false);
+      conn = std::make_shared<connection>(std::unique_ptr<stream>(udp));
+      // forget the agents which are gone whenever the table has doubled
+      if (udp_agents_.size() >= udp_purge_at_) {
+        for (auto i = udp_agents_.begin(); i != udp_agents_.end();) {
+          i = i->second.conn.expired() ? udp_agents_.erase(i) : std::next(i);
+        }
+        udp_purge_at_ = std::max<size_t>(64, udp_agents_.size() * 2);
+      }
+      udp_agents_[session] = udp_agent{conn, udp, udp_from_};
+      add(conn, home);
+    } else if (it->second.from != udp_from_) {
+      LOGD("udp: agent moved to %s:%u", udp_from_.address().to_string().c_str(), udp_from_.port());
+      it->second.from = udp_from_;
+      auto from = udp_from_;
+      asio::post(conn->executor(), [conn, udp, from] {
+        udp->follow(from.data(), (socklen_t)from.size());
+      });
+    }
+    auto data = std::make_shared<std::string>(udp_buffer_.data(), length);
+    asio::post(conn->executor(), [conn, udp, data] {
+      udp->datagram(data->data(), data->size());
+    });
+  }
+
+  void retry_later(asio::steady_timer::duration delay) {
+    retry_timer_.expires_after(delay);
+    retry_timer_.async_wait([this](const std::error_code& ec) {
+      if (!ec) accept();
+    });
+  }
+
+  /// on the user strand
+  void add(const std::shared_ptr<connection>& conn, const strand& home) {
+    uint64_t key = next_key_++;
+    auto as = std::make_shared<agent_session>(conn, next_channel_, home, user_, threaded_);
+    agents_[key] = as;
+
+    // the parser belongs to the agent_session, do not let it own its owner
+    auto* raw = as.get();
+    as->parser_.on_frame = [this, raw](const frame& f) {
+      if (f.type == msg::pong && f.channel == 0) {
+        if (f.size == 8) raw->rtt_us_ = monotonic_us() - (int64_t)get_u64(f.data);
+        return;
+      }
+      if (raw->viewer_) return;  // read-only
+      if (f.type == msg::view && raw->name_.empty()) {
+        raw->viewer_ = true;
+        auto viewer = raw->shared_from_this();
+        std::string name = f.body();
+        to_user([this, viewer, name] {
+          if (on_viewer) {
+            on_viewer(viewer, name);
+          } else {
+            viewer->close();
+          }
+        });
+        return;
+      }
+      if (f.type == msg::hello && raw->name_.empty()) {
+        raw->name_ = f.body();
+        LOGD("agent: %s", raw->name_.c_str());
+        auto as = raw->shared_from_this();
+        to_user([this, as] {
+          if (!as->alive()) return;
+          as->announced_ = true;
+          if (on_agent) on_agent(as);
+        });
+        return;
+      }
+      raw->dispatch(f);
+    };
+    // agent_session only holds the connection weakly, no cycle here
+    conn->on_data = [as](const char* data, size_t size) {
+      as->last_seen_us_ = monotonic_us();
+      if (!as->parser_.feed(data, size)) {
+        LOGE("protocol error from %s, drop it", as->name_.c_str());
+        as->close();
+      }
+    };
+    conn->on_close = [this, key, as] {
+      LOGD("agent close: %s", as->name_.c_str());
+      as->lost();
+      to_user([this, key, as] {
+        agents_.erase(key);
+        if (as->announced_ && on_agent_close) on_agent_close(as);
+      });
+    };
+#ifdef __linux__
+    if (uring_) conn->use_uring(*uring_);
+#endif
+    conn->start();
+    watch(as);
+  }
+
+  void watch(const std::shared_ptr<agent_session>& as) {
+    std::weak_ptr<agent_session> weak = as;
+    asio::dispatch(wheel_strand_, [this, weak] {
+      wheel_.schedule(std::chrono::milliseconds(heartbeat_interval_ms), [this, weak] {
+        heartbeat(weak);
+      });
+    });
+  }
+
+  /// on the wheel strand, once an interval for every session
+  void heartbeat(const std::weak_ptr<agent_session>& weak) {
+    auto as = weak.lock();
+    if (!as || !as->alive()) return;
+    int64_t now = monotonic_us();
+    int64_t silent = now - as->last_seen_us_;
+    if (silent > dead_after_ms * 1000) {
+      LOGW("agent silent for %lld ms, drop it", (long long)silent / 1000);
+      as->close();
+      return;
+    }
+    char body[8];
+    put_u64(body, (uint64_t)now);
+    as->send(pack(msg::ping, 0, body, sizeof(body)));
+    wheel_.schedule(std::chrono::milliseconds(heartbeat_interval_ms), [this, weak] {
+      heartbeat(weak);
+    });
+  }
+
+  template <typename F>
+  void to_user(F&& f) {
+    if (threaded_) {
+      asio::post(user_, std::forward<F>(f));
+    } else {
+      f();
+    }
+  }
+
+ private:
+  asio::io_context& io_context_;
+  strand user_;
+  bool threaded_;
+  asio::ip::tcp::acceptor acceptor_;
+  asio::steady_timer retry_timer_;
+  token_bucket admission_{default_admit_rate, default_admit_burst};
+  uint64_t next_key_ = 1;
+  std::atomic<uint32_t> own_next_channel_{1};
+  std::atomic<uint32_t>& next_channel_;
+  std::map<uint64_t, std::shared_ptr<agent_session>> agents_;
+  strand wheel_strand_{asio::make_strand(io_context_)};  // runs the heartbeats
+  timer_wheel wheel_{wheel_strand_, std::chrono::milliseconds(100)};
+  bool serve_udp_ = false;
+  asio::ip::udp::socket udp_socket_{io_context_};
+  asio::ip::udp::endpoint udp_from_;
+  std::string udp_buffer_;
+  struct udp_agent {
+    std::weak_ptr<connection> conn;
+    udp_stream* udp;               // owned by conn
+    asio::ip::udp::endpoint from;  // where its socket is connected to
+  };
+  std::map<uint64_t, udp_agent> udp_agents_;  // by session
+  size_t udp_purge_at_ = 64;
+#ifdef __linux__
+  uring* uring_ = nullptr;
+  bool serve_local_ = true;
+  asio::local::stream_protocol::acceptor local_acceptor_{io_context_};
+#endif
+};
+
+}  // namespace rterm
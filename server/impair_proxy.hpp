@@ -0,0 +1,408 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "asio.hpp"
+#include "log.h"
+
+namespace rterm {
+
+/**
+ * How bad one direction of a network is. The delay of a packet is the time
+ * it waits for the link at rate (its serialization and the queue ahead of
+ * it), plus delay and a jitter uniform in +-jitter.
+ */
+struct impairment {
+  double delay_ms = 0;
+  double jitter_ms = 0;
+  double rate_kbit = 0;  // 0 for no limit
+  double loss = 0;       // of a datagram, or a TCP segment
+  double queue_ms = 200; // a datagram which would wait longer for the link is dropped
+};
+
+/**
+ * One direction of an impaired network: when a packet sent now arrives, or
+ * that it does not. Datagrams are lost, or dropped when the queue of the
+ * link is full. A TCP stream is cut by the proxy, so a lost segment is
+ * modeled as its retransmission, an RTO at the least, which whatever is
+ * behind it waits for too (head-of-line blocking). The window of the
+ * sender does not shrink for it like over a real lossy path, TCP numbers
+ * under loss are on the good side. The queue does not drop a stream, the
+ * proxy stops reading and the sender sees TCP flow control.
+ *
+ * The random numbers come from a seeded generator, a scenario makes the
+ * same decisions in every run for the same traffic.
+ */
+class impaired_path {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  static const size_t segment_size = 1448;
+
+  impaired_path(const impairment& how, uint32_t seed) : how_(how), random_(seed) {}
+
+  /// false if it is lost, else its arrival
+  bool pass(size_t size, clock::time_point now, bool stream, clock::time_point* arrival) {
+    auto ready = now;
+    if (how_.rate_kbit > 0) {
+      auto start = std::max(link_free_, now);
+      if (!stream && start - now > ms(how_.queue_ms)) {
+        ++dropped_;
+        return false;
+      }
+      link_free_ = start + ms((double)size * 8 / how_.rate_kbit);
+      ready = link_free_;
+    }
+    double delay = how_.delay_ms;
+    if (how_.jitter_ms > 0) delay = std::max(0.0, delay + std::uniform_real_distribution<double>(-how_.jitter_ms, how_.jitter_ms)(random_));
+    auto at = ready + ms(delay);
+    if (how_.loss > 0) {
+      // each segment of a chunk of the stream may be the one
+      double segments = stream ? std::ceil((double)size / segment_size) : 1;
+      if (std::uniform_real_distribution<double>(0, 1)(random_) < 1 - std::pow(1 - how_.loss, segments)) {
+        ++lost_;
+        if (!stream) return false;
+        at += ms(std::max(200.0, 2 * how_.delay_ms));  // the minimum RTO of Linux
+      }
+    }
+    // jitter does not reorder, the queues of a path are FIFO
+    at = std::max(at, last_arrival_);
+    last_arrival_ = at;
+    *arrival = at;
+    return true;
+  }
+
+  size_t lost() const {
+    return lost_;
+  }
+
+  size_t dropped() const {
+    return dropped_;
+  }
+
+ private:
+  static clock::duration ms(double ms) {
+    return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(ms));
+  }
+
+  impairment how_;
+  std::mt19937 random_;
+  clock::time_point link_free_;
+  clock::time_point last_arrival_;
+  size_t lost_ = 0;
+  size_t dropped_ = 0;
+};
+
+/**
+ * Proxy which makes the network between agents and the hub as bad as asked,
+ * for benchmarks and tests without root or tc: TCP connections and UDP
+ * datagrams to its port go on to the upstream hub through an
+ * impaired_path for each direction and peer, see impairment.
+ *
+ * With roam_every() the UDP flows move to a new source port now and then, to
+ * the hub that is a NAT rebinding of the agent.
+ */
+class impair_proxy {
+ public:
+  impair_proxy(asio::io_context& io_context, uint16_t port, std::string upstream_host, std::string upstream_port, impairment up, impairment down,
+               uint32_t seed = 1)
+      : io_context_(io_context),
+        acceptor_(io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)),
+        udp_socket_(io_context, asio::ip::udp::endpoint(asio::ip::udp::v4(), port)),
+        resolver_(io_context),
+        roam_timer_(io_context),
+        upstream_host_(std::move(upstream_host)),
+        upstream_port_(std::move(upstream_port)),
+        up_(up),
+        down_(down),
+        seed_(seed) {}
+
+  void start() {
+    accept();
+    udp_buffer_.resize(64 * 1024);
+    asio::ip::udp::resolver resolver(io_context_);
+    std::error_code ec;
+    auto r = resolver.resolve(asio::ip::udp::v4(), upstream_host_, upstream_port_, ec);
+    if (ec || r.empty()) {
+      LOGE("proxy: no upstream for UDP: %s", ec.message().c_str());
+      return;
+    }
+    udp_upstream_ = r.begin()->endpoint();
+    receive_udp();
+  }
+
+  /// before start(): a new source port for each UDP flow every period
+  void roam_every(std::chrono::milliseconds period) {
+    roam_period_ = period;
+    roam_later();
+  }
+
+  /// datagrams lost or dropped by a full queue, and TCP segments which had to be sent again
+  size_t impaired() const {
+    return impaired_;
+  }
+
+ private:
+  using clock = impaired_path::clock;
+
+  /// delivers what an impaired_path passes when it arrives
+  class delay_line {
+   public:
+    delay_line(asio::io_context& io_context, impaired_path path, size_t& impaired) : path_(path), timer_(io_context), impaired_(impaired) {}
+
+    void push(std::string data, bool stream, std::function<void(std::string&)> deliver) {
+      size_t before = path_.lost() + path_.dropped();
+      clock::time_point at;
+      bool passed = path_.pass(data.size(), clock::now(), stream, &at);
+      impaired_ += path_.lost() + path_.dropped() - before;
+      if (!passed) return;
+      queued_ += data.size();
+      bool earliest = pending_.empty() || at < pending_.begin()->first;
+      pending_.emplace(at, item{std::move(data), std::move(deliver)});
+      if (earliest) schedule();
+    }
+
+    size_t queued() const {
+      return queued_;
+    }
+
+    void stop() {
+      pending_.clear();
+      timer_.cancel();
+    }
+
+   private:
+    struct item {
+      std::string data;
+      std::function<void(std::string&)> deliver;
+    };
+
+    void schedule() {
+      timer_.expires_at(pending_.begin()->first);
+      timer_.async_wait([this](const std::error_code& ec) {
+        if (ec) return;
+        auto now = clock::now();
+        std::vector<item> due;
+        while (!pending_.empty() && pending_.begin()->first <= now) {
+          due.push_back(std::move(pending_.begin()->second));
+          pending_.erase(pending_.begin());
+          queued_ -= due.back().data.size();
+        }
+        if (!pending_.empty()) schedule();
+        // a delivery may end the session and this with it
+        for (auto& i : due) {
+          i.deliver(i.data);
+        }
+      });
+    }
+
+    impaired_path path_;
+    asio::steady_timer timer_;
+    std::multimap<clock::time_point, item> pending_;  // arrivals never go back in time, equal times keep their order
+    size_t queued_ = 0;
+    size_t& impaired_;
+  };
+
+  /// a TCP connection through the proxy, each direction reads while its line is not too full
+  struct tcp_session : std::enable_shared_from_this<tcp_session> {
+    tcp_session(impair_proxy& proxy, asio::ip::tcp::socket agent, uint32_t seed)
+        : proxy(proxy),
+          agent(std::move(agent)),
+          upstream(proxy.io_context_),
+          up(proxy.io_context_, impaired_path(proxy.up_, seed), proxy.impaired_),
+          down(proxy.io_context_, impaired_path(proxy.down_, seed + 1), proxy.impaired_) {}
+
+    /// what is read in one go, and what may be on the way before reading stops
+    static const size_t chunk_size = 16 * 1024;
+    static const size_t max_in_flight = 256 * 1024;
+
+    struct direction {
+      asio::ip::tcp::socket* from;
+      asio::ip::tcp::socket* to;
+      delay_line* line;
+      std::string buffer = std::string(chunk_size, '\0');
+      std::string out;  // arrived, being written
+      bool writing = false;
+      bool reading = false;
+      bool eof = false;
+    };
+
+    void start() {
+      read(a_to_b);
+      read(b_to_a);
+    }
+
+    void read(direction& d) {
+      if (d.reading || d.eof || d.line->queued() + d.out.size() >= max_in_flight) return;
+      d.reading = true;
+      auto self = shared_from_this();
+      d.from->async_read_some(asio::buffer(d.buffer), [self, &d](const std::error_code& ec, size_t length) {
+        d.reading = false;
+        if (ec) {
+          if (ec != asio::error::eof) return self->close();
+          // after what is still on the way
+          d.eof = true;
+          if (d.line->queued() == 0 && d.out.empty() && !d.writing) self->shutdown(d);
+          return;
+        }
+        d.line->push(d.buffer.substr(0, length), true, [self, &d](std::string& data) {
+          d.out += data;
+          self->write(d);
+        });
+        self->read(d);
+      });
+    }
+
+    void write(direction& d) {
+      if (d.writing || d.out.empty()) return;
+      d.writing = true;
+      auto data = std::make_shared<std::string>(std::move(d.out));
+      d.out.clear();
+      auto self = shared_from_this();
+      asio::async_write(*d.to, asio::buffer(*data), [self, &d, data](const std::error_code& ec, size_t) {
+        d.writing = false;
+        if (ec) return self->close();
+        if (!d.out.empty()) return self->write(d);
+        if (d.eof && d.line->queued() == 0) return self->shutdown(d);
+        self->read(d);
+      });
+    }
+
+    void shutdown(direction& d) {
+      std::error_code ec;
+      d.to->shutdown(asio::ip::tcp::socket::shutdown_send, ec);
+      if (a_to_b.eof && b_to_a.eof) close();
+    }
+
+    void close() {
+      std::error_code ec;
+      agent.close(ec);
+      upstream.close(ec);
+      up.stop();
+      down.stop();
+      proxy.tcp_sessions_.erase(shared_from_this());
+    }
+
+    impair_proxy& proxy;
+    asio::ip::tcp::socket agent;
+    asio::ip::tcp::socket upstream;
+    delay_line up;
+    delay_line down;
+    direction a_to_b{&agent, &upstream, &up};
+    direction b_to_a{&upstream, &agent, &down};
+  };
+
+  /// the datagrams of one agent address, sent on from a socket of their own
+  struct udp_flow {
+    udp_flow(impair_proxy& proxy, uint32_t seed)
+        : socket(std::make_shared<asio::ip::udp::socket>(proxy.io_context_, asio::ip::udp::v4())),
+          up(proxy.io_context_, impaired_path(proxy.up_, seed), proxy.impaired_),
+          down(proxy.io_context_, impaired_path(proxy.down_, seed + 1), proxy.impaired_) {}
+
+    std::shared_ptr<asio::ip::udp::socket> socket;
+    delay_line up;
+    delay_line down;
+    std::string buffer = std::string(64 * 1024, '\0');
+  };
+
+  void accept() {
+    acceptor_.async_accept([this](const std::error_code& ec, asio::ip::tcp::socket socket) {
+      if (ec == asio::error::operation_aborted) return;
+      if (ec) {
+        LOGE("accept: %s", ec.message().c_str());
+        return;
+      }
+      socket.set_option(asio::ip::tcp::no_delay(true));
+      auto s = std::make_shared<tcp_session>(*this, std::move(socket), seed_ + 2 * (uint32_t)++flows_);
+      tcp_sessions_.insert(s);
+      resolver_.async_resolve(upstream_host_, upstream_port_, [this, s](const std::error_code& ec, const asio::ip::tcp::resolver::results_type& r) {
+        if (ec) return s->close();
+        asio::async_connect(s->upstream, r, [s](const std::error_code& ec, const asio::ip::tcp::endpoint&) {
+          if (ec) return s->close();
+          s->upstream.set_option(asio::ip::tcp::no_delay(true));
+          s->start();
+        });
+      });
+      accept();
+    });
+  }
+
+  void receive_udp() {
+    udp_socket_.async_receive_from(asio::buffer(udp_buffer_), udp_from_, [this](const std::error_code& ec, size_t length) {
+      if (ec == asio::error::operation_aborted) return;
+      if (!ec) {
+        auto it = udp_flows_.find(udp_from_);
+        if (it == udp_flows_.end()) {
+          it = udp_flows_.emplace(udp_from_, std::unique_ptr<udp_flow>(new udp_flow(*this, seed_ + 2 * (uint32_t)++flows_))).first;
+          receive_upstream(udp_from_, *it->second);
+        }
+        auto& flow = *it->second;
+        auto socket = flow.socket;
+        auto to = udp_upstream_;
+        flow.up.push(std::string(udp_buffer_.data(), length), false, [socket, to](std::string& data) {
+          std::error_code ec;
+          socket->send_to(asio::buffer(data), to, 0, ec);
+        });
+      }
+      receive_udp();
+    });
+  }
+
+  /// what the hub answers goes back to the agent's address
+  void receive_upstream(asio::ip::udp::endpoint agent, udp_flow& flow) {
+    auto socket = flow.socket;
+    socket->async_receive(asio::buffer(flow.buffer), [this, agent, &flow, socket](const std::error_code& ec, size_t length) {
+      // closed by roaming, a new socket has its own receive
+      if (ec == asio::error::operation_aborted || socket != flow.socket) return;
+      if (!ec) {
+        flow.down.push(std::string(flow.buffer.data(), length), false, [this, agent](std::string& data) {
+          std::error_code ec;
+          udp_socket_.send_to(asio::buffer(data), agent, 0, ec);
+        });
+      }
+      receive_upstream(agent, flow);
+    });
+  }
+
+  void roam_later() {
+    roam_timer_.expires_after(roam_period_);
+    roam_timer_.async_wait([this](const std::error_code& ec) {
+      if (ec) return;
+      for (auto& f : udp_flows_) {
+        std::error_code ignored;
+        f.second->socket->close(ignored);
+        f.second->socket = std::make_shared<asio::ip::udp::socket>(io_context_, asio::ip::udp::v4());
+        receive_upstream(f.first, *f.second);
+      }
+      LOGD("proxy: %zu UDP flows moved", udp_flows_.size());
+      roam_later();
+    });
+  }
+
+ private:
+  asio::io_context& io_context_;
+  asio::ip::tcp::acceptor acceptor_;
+  asio::ip::udp::socket udp_socket_;
+  asio::ip::tcp::resolver resolver_;
+  asio::steady_timer roam_timer_;
+  std::string upstream_host_;
+  std::string upstream_port_;
+  impairment up_;    // from the agents to the hub
+  impairment down_;  // the other way
+  uint32_t seed_;
+  size_t flows_ = 0;
+  size_t impaired_ = 0;
+  std::chrono::milliseconds roam_period_{0};
+  std::set<std::shared_ptr<tcp_session>> tcp_sessions_;
+  asio::ip::udp::endpoint udp_upstream_;
+  asio::ip::udp::endpoint udp_from_;
+  std::string udp_buffer_;
+  std::map<asio::ip::udp::endpoint, std::unique_ptr<udp_flow>> udp_flows_;
+};
+
+}  // namespace rterm
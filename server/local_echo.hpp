@@ -0,0 +1,248 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <string>
+
+#include "screen.hpp"
+
+namespace rterm {
+
+/**
+ * Speculative local echo for the interactive shell, like mosh: a printable key
+ * typed at the end of the cursor line is shown at once, underlined, instead of
+ * a round trip later. The guesses are checked against the model of the remote
+ * screen each time output of the agent went into it: a guess the shell has
+ * echoed at its place is confirmed, one overwritten with something else or not
+ * echoed in time is wrong, and all of them are taken back then.
+ *
+ * Guesses after a key which is not predicted (Enter, arrows, ^C, ...) or after
+ * a wrong one start a new epoch and stay hidden until the first of them is
+ * confirmed. So the password typed after the Enter of a sudo never shows up,
+ * and a program which does not echo where the cursor is gets no garbage.
+ *
+ * Adaptive by default: shown when the round trip is over 30 ms, until it drops
+ * below 20 ms again. On a fast link the echo is there before one would notice.
+ *
+ * The cursor is only moved relative to where it is, and to columns from a CR:
+ * the model and the terminal may be some lines apart, the model starts at the
+ * top while the terminal had the shell started further down.
+ */
+class local_echo {
+ public:
+  enum mode { adaptive, always, never };
+  using clock = std::chrono::steady_clock;
+
+  /// model: what the terminal shows, without the guesses
+  local_echo(const screen& model, mode m = adaptive) : screen_(model), mode_(m) {}
+
+  /// round trip to the agent, -1 when not known yet
+  void set_rtt(int64_t us) {
+    if (us < 0) return;
+    rtt_us_ = us;
+    if (us >= 30000) {
+      slow_ = true;
+    } else if (us < 20000) {
+      slow_ = false;
+    }
+  }
+
+  bool active() const {
+    return mode_ == always || (mode_ == adaptive && slow_);
+  }
+
+  /// keys typed, returns what to write to the terminal to show the guesses
+  std::string typed(const char* data, size_t size, clock::time_point now) {
+    if (!active()) return std::string();
+    std::string out = hide();
+    for (size_t i = 0; i < size; ++i) {
+      auto b = (uint8_t)data[i];
+      if (b >= 0x20 && b < 0x7f && guess_at(b, now)) continue;
+      if ((b == 0x7f || b == '\b') && !unknown_ && !guesses_.empty()) {
+        guesses_.pop_back();
+        continue;
+      }
+      // where the cursor goes is up to the shell now, e.g. the rest of an escape sequence
+      unknown_ = true;
+      ++epoch_;
+    }
+    out += show();
+    return out;
+  }
+
+  /// puts the screen of the shell back where guesses are shown, and the cursor and pen,
+  /// before output of the shell goes into the model and to the terminal
+  std::string hide() {
+    std::string out;
+    if (!shown_) return out;
+    shown_ = false;
+    int x = shown_x_;
+    int y = shown_y_;
+    bool first = true;
+    cell_attr pen;
+    for (auto& g : guesses_) {
+      if (g.epoch > confirmed_epoch_) break;
+      move_cursor(out, x, y, g.x, g.y);
+      const cell& c = screen_.at(g.x, g.y);
+      if (first || c.attr != pen) append_sgr(out, c.attr);
+      append_utf8(out, c.ch ? c.ch : ' ');
+      x = g.x + 1;
+      y = g.y;
+      pen = c.attr;
+      first = false;
+    }
+    move_cursor(out, x, y, screen_.cursor_x(), screen_.cursor_y());
+    append_sgr(out, screen_.pen());
+    return out;
+  }
+
+  /// output of the shell went into the model, checks the guesses, returns what to write after it
+  std::string update() {
+    unknown_ = false;
+    check();
+    return show();
+  }
+
+  /// the terminal is drawn from the model for a while, the guesses are not shown meanwhile
+  std::string suspend() {
+    std::string out = hide();
+    suspended_ = true;
+    return out;
+  }
+
+  /// the terminal shows the model again
+  std::string resume() {
+    suspended_ = false;
+    return show();
+  }
+
+  /// when the oldest guess not confirmed yet is due, max() without one
+  clock::time_point deadline() const {
+    return guesses_.empty() ? clock::time_point::max() : guesses_.front().due;
+  }
+
+  /// takes the guesses back when one is overdue, returns what to write
+  std::string expire(clock::time_point now) {
+    if (guesses_.empty() || guesses_.front().due > now) return std::string();
+    std::string out = hide();
+    wrong();
+    return out;
+  }
+
+  /// the model was cleared, e.g. resized: the guesses are dropped, none until the shell has written again
+  void forget() {
+    guesses_.clear();
+    ++epoch_;
+    shown_ = false;
+    unknown_ = true;
+  }
+
+  size_t mispredicted() const {
+    return mispredicted_;
+  }
+
+ private:
+  struct guess {
+    int x;
+    int y;
+    uint8_t ch;
+    cell_attr attr;
+    uint64_t epoch;
+    clock::time_point due;
+  };
+
+  bool guess_at(uint8_t ch, clock::time_point now) {
+    if (unknown_ || screen_.alt_screen() || !screen_.cursor_visible()) return false;
+    int x = screen_.cursor_x();
+    int y = screen_.cursor_y();
+    if (!guesses_.empty()) {
+      x = guesses_.back().x + 1;
+      y = guesses_.back().y;
+    } else if (screen_.wrap_pending()) {
+      return false;
+    }
+    // at the end of the line only, a shell inserts in the middle and moves the rest
+    if (x >= screen_.cols() - 1) return false;
+    for (int i = x; i < screen_.cols(); ++i) {
+      if (screen_.at(i, y).ch != ' ') return false;
+    }
+    cell_attr attr = screen_.pen();
+    attr.flags |= attr_underline;
+    guesses_.push_back({x, y, ch, attr, epoch_, now + std::chrono::microseconds(2 * rtt_us_) + std::chrono::milliseconds(250)});
+    return true;
+  }
+
+  void check() {
+    if (screen_.alt_screen()) return wrong();
+    for (auto it = guesses_.begin(); it != guesses_.end();) {
+      uint32_t ch = screen_.at(it->x, it->y).ch;
+      if (ch != it->ch && ch != ' ') return wrong();
+      bool echoed;
+      if (it->ch == ' ') {
+        // a blank shows nothing, it is there once the cursor has passed it
+        echoed = screen_.cursor_y() == it->y && screen_.cursor_x() > it->x;
+      } else {
+        echoed = ch == it->ch;
+        if (echoed && it->epoch > confirmed_epoch_) confirmed_epoch_ = it->epoch;
+      }
+      it = echoed ? guesses_.erase(it) : it + 1;
+    }
+  }
+
+  void wrong() {
+    if (!guesses_.empty() && guesses_.front().epoch <= confirmed_epoch_) ++mispredicted_;
+    guesses_.clear();
+    ++epoch_;
+  }
+
+  /// the guesses are written only between complete sequences of the shell
+  bool can_show() const {
+    return !suspended_ && screen_.idle() && !screen_.wrap_pending() && !screen_.alt_screen();
+  }
+
+  std::string show() {
+    std::string out;
+    if (!can_show()) return out;
+    int x = screen_.cursor_x();
+    int y = screen_.cursor_y();
+    cell_attr pen = screen_.pen();
+    for (auto& g : guesses_) {
+      if (g.epoch > confirmed_epoch_) break;
+      move_cursor(out, x, y, g.x, g.y);
+      if (g.attr != pen) append_sgr(out, g.attr);
+      out += (char)g.ch;
+      x = g.x + 1;
+      y = g.y;
+      pen = g.attr;
+      shown_ = true;
+    }
+    shown_x_ = x;
+    shown_y_ = y;
+    if (pen != screen_.pen()) append_sgr(out, screen_.pen());
+    return out;
+  }
+
+  /// from where the cursor is to x, y, in the coordinates of the model
+  static void move_cursor(std::string& out, int from_x, int from_y, int x, int y) {
+    if (y != from_y) out += "\x1b[" + std::to_string(y < from_y ? from_y - y : y - from_y) + (y < from_y ? 'A' : 'B');
+    if (x == from_x) return;
+    out += '\r';
+    if (x > 0) out += "\x1b[" + std::to_string(x) + 'C';
+  }
+
+  const screen& screen_;
+  mode mode_;
+  int64_t rtt_us_ = 0;
+  bool slow_ = false;
+  std::deque<guess> guesses_;
+  uint64_t epoch_ = 1;
+  uint64_t confirmed_epoch_ = 0;  // guesses of this epoch and before are shown
+  bool unknown_ = false;          // a key not predicted went out, no output since
+  bool shown_ = false;
+  int shown_x_ = 0;  // where show() left the cursor
+  int shown_y_ = 0;
+  bool suspended_ = false;
+  size_t mispredicted_ = 0;
+};
+
+}  // namespace rterm
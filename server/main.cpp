@@ -1,13 +1,603 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <termios.h>
 #include <unistd.h>
 
+#include <csignal>
+#include <cstdarg>
 #include <cstdio>
+#include <set>
+#include <thread>
 
+#include "broadcast.hpp"
+#include "display.hpp"
+#include "fleet.hpp"
+#include "hub.hpp"
 #include "log.h"
-#include "tcp_server.hpp"
+#include "mirror.hpp"
+#include "pipe.hpp"
+#include "port_forward.hpp"
+#include "relay.hpp"
+#include "shard.hpp"
+#include "tcp_client.hpp"
+#include "transfer.hpp"
+#include "tree.hpp"
 
+using namespace rterm;
+
+int logPrintf(const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int ret = vfprintf(stderr, fmt, args);
+  va_end(args);
+  return ret;
+}
+
+static std::set<std::string> splitNames(const std::string& list) {
+  std::set<std::string> names;
+  size_t begin = 0;
+  while (begin <= list.size()) {
+    size_t end = list.find(',', begin);
+    if (end == std::string::npos) end = list.size();
+    if (end > begin) names.insert(list.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  return names;
+}
+
+// terminal_server run [-f fanout] [-w name,...] [-n count] [-t wait_ms] [-s shards] [-a admit_rate] [-u] [-b] command...
+static int runFleet(int argc, char* argv[]) {
+  fleet_options options;
+  std::set<std::string> names;
+  size_t waitCount = 0;
+  long waitMs = 3000;
+  size_t shards = 1;
+  double admitRate = hub::default_admit_rate;
+  bool useUring = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "+f:w:n:t:s:a:ub")) != -1) {
+    switch (opt) {
+      case 'f':
+        options.fanout = strtoul(optarg, nullptr, 10);
+        break;
+      case 'w':
+        names = splitNames(optarg);
+        break;
+      case 'n':
+        waitCount = strtoul(optarg, nullptr, 10);
+        break;
+      case 't':
+        waitMs = strtol(optarg, nullptr, 10);
+        break;
+      case 's':
+        shards = strtoul(optarg, nullptr, 10);
+        break;
+      case 'a':
+        admitRate = strtod(optarg, nullptr);
+        break;
+      case 'u':
+        useUring = true;
+        break;
+      case 'b':
+        options.gather = true;
+        break;
+      default:
+        return 2;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s run [-f fanout] [-w name,...] [-n count] [-t wait_ms] [-s shards] [-a admit_rate] [-u] [-b] command...\n", argv[0]);
+    return 2;
+  }
+  for (int i = optind; i < argc; ++i) {
+    if (i > optind) options.command += ' ';
+    options.command += argv[i];
+  }
+  if (waitCount == 0) waitCount = names.size();
+
+  asio::io_context io_context;
+  sharded_hub server(io_context, 6666, shards);
+  server.set_admission(admitRate, admitRate / 4);
+#ifdef __linux__
+  std::unique_ptr<uring> ring;
+  if (useUring) {
+    ring.reset(new uring(io_context));
+    server.use_uring(*ring);
+  }
+#endif
+
+  // agents dial in, wait for the expected ones or until the deadline
+  auto selected = [&](const std::shared_ptr<agent_session>& as) {
+    return names.empty() || names.count(as->name());
+  };
+  size_t ready = 0;
+  std::unique_ptr<fleet_run> run;
+  int status = 0;
+  asio::steady_timer deadline(io_context);
+
+  auto go = [&] {
+    if (run) return;
+    deadline.cancel();
+    std::vector<std::shared_ptr<agent_session>> targets;
+    for (auto& as : server.agents()) {
+      if (selected(as)) targets.push_back(as);
+    }
+    if (targets.empty()) {
+      fprintf(stderr, "terminal_server: no agent\n");
+      status = 1;
+      io_context.stop();
+      return;
+    }
+    run = std::make_unique<fleet_run>(std::move(targets), options);
+    run->on_done = [&] {
+      status = run->status();
+      io_context.stop();
+    };
+    run->start();
+  };
+
+  server.on_agent = [&](const std::shared_ptr<agent_session>& as) {
+    if (!selected(as)) return;
+    if (++ready == waitCount) go();
+  };
+  server.on_agent_close = [&](const std::shared_ptr<agent_session>& as) {
+    if (selected(as)) --ready;
+  };
+  deadline.expires_after(std::chrono::milliseconds(waitMs));
+  deadline.async_wait([&](const std::error_code& ec) {
+    if (!ec) go();
+  });
+
+  server.start();
+  io_context.run();
+  return status;
+}
+
+/**
+ * Listen for agents until the named one dials in, then hand it to fn.
+ * fn sets status and stops the io_context when it is done.
+ */
+static int withAgent(const std::string& name, long waitMs,
+                     const std::function<void(asio::io_context&, const std::shared_ptr<agent_session>&, int& status)>& fn) {
+  asio::io_context io_context;
+  hub server(io_context, 6666);
+  asio::steady_timer deadline(io_context);
+  int status = 0;
+  bool found = false;
+
+  server.on_agent = [&](const std::shared_ptr<agent_session>& as) {
+    if (found || as->name() != name) return;
+    found = true;
+    deadline.cancel();
+    fn(io_context, as, status);
+  };
+  deadline.expires_after(std::chrono::milliseconds(waitMs));
+  deadline.async_wait([&](const std::error_code& ec) {
+    if (ec) return;
+    fprintf(stderr, "terminal_server: %s: no such agent\n", name.c_str());
+    status = 255;
+    io_context.stop();
+  });
+
+  server.start();
+  io_context.run();
+  return status;
+}
+
+/// the size of the terminal on fd, cols and rows are left as they are when it has none
+static void terminalSize(int fd, int& cols, int& rows) {
+  winsize ws{};
+  if (ioctl(fd, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0 || ws.ws_row == 0) return;
+  cols = ws.ws_col;
+  rows = ws.ws_row;
+}
+
+static bool writeAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += n;
+    size -= (size_t)n;
+  }
+  return true;
+}
+
+// terminal_server exec [-t wait_ms] name command...
+static int runExec(int argc, char* argv[]) {
+  long waitMs = 3000;
+  int opt;
+  while ((opt = getopt(argc, argv, "+t:")) != -1) {
+    if (opt != 't') return 2;
+    waitMs = strtol(optarg, nullptr, 10);
+  }
+  if (argc - optind < 2) {
+    fprintf(stderr, "Usage: %s exec [-t wait_ms] name command...\n", argv[0]);
+    return 2;
+  }
+  std::string name = argv[optind];
+  std::string command;
+  for (int i = optind + 1; i < argc; ++i) {
+    if (i > optind + 1) command += ' ';
+    command += argv[i];
+  }
+
+  return withAgent(name, waitMs, [&](asio::io_context& io_context, const std::shared_ptr<agent_session>& as, int& status) {
+    as->open(msg::exec, command, [&](const frame& f) {
+      switch (f.type) {
+        case msg::exec_out:
+          writeAll(STDOUT_FILENO, f.data, f.size);
+          break;
+        case msg::exec_err:
+          writeAll(STDERR_FILENO, f.data, f.size);
+          break;
+        case msg::exit:
+          status = f.size >= 4 ? (int32_t)get_u32(f.data) : 255;
+          io_context.stop();
+          break;
+        case msg::close:
+          fprintf(stderr, "terminal_server: %s: connection lost\n", name.c_str());
+          status = 255;
+          io_context.stop();
+          break;
+        default:
+          break;
+      }
+    });
+  });
+}
+
+// terminal_server pipe [-t wait_ms] name command...
+static int runPipe(int argc, char* argv[]) {
+  long waitMs = 3000;
+  int opt;
+  while ((opt = getopt(argc, argv, "+t:")) != -1) {
+    if (opt != 't') return 2;
+    waitMs = strtol(optarg, nullptr, 10);
+  }
+  if (argc - optind < 2) {
+    fprintf(stderr, "Usage: %s pipe [-t wait_ms] name command...\n", argv[0]);
+    return 2;
+  }
+  std::string name = argv[optind];
+  std::string command;
+  for (int i = optind + 1; i < argc; ++i) {
+    if (i > optind + 1) command += ' ';
+    command += argv[i];
+  }
+
+  std::unique_ptr<pipe_sender> sender;
+  return withAgent(name, waitMs, [&](asio::io_context& io_context, const std::shared_ptr<agent_session>& as, int& status) {
+    uint32_t channel = as->open(msg::pipe, command, [&](const frame& f) {
+      switch (f.type) {
+        case msg::exec_out:
+          writeAll(STDOUT_FILENO, f.data, f.size);
+          break;
+        case msg::exec_err:
+          writeAll(STDERR_FILENO, f.data, f.size);
+          break;
+        case msg::exec_ack:
+          if (f.size >= 4) sender->on_ack(get_u32(f.data));
+          break;
+        case msg::exit:
+          status = f.size >= 4 ? (int32_t)get_u32(f.data) : 255;
+          io_context.stop();
+          break;
+        case msg::close:
+          fprintf(stderr, "terminal_server: %s: connection lost\n", name.c_str());
+          status = 255;
+          io_context.stop();
+          break;
+        default:
+          break;
+      }
+    });
+    sender = std::make_unique<pipe_sender>(io_context, as, channel, STDIN_FILENO);
+    sender->start();
+  });
+}
+
+// terminal_server download [-t wait_ms] name remote [local]
+// terminal_server upload [-t wait_ms] name local remote
+// terminal_server sync [-t wait_ms] name local remote
+static int runTransfer(int argc, char* argv[], const std::string& mode) {
+  long waitMs = 3000;
+  int opt;
+  while ((opt = getopt(argc, argv, "+t:")) != -1) {
+    if (opt != 't') return 2;
+    waitMs = strtol(optarg, nullptr, 10);
+  }
+  bool download = mode == "download";
+  int args = argc - optind;
+  if (download ? (args < 2 || args > 3) : args != 3) {
+    if (download) {
+      fprintf(stderr, "Usage: %s download [-t wait_ms] name remote [local]\n", argv[0]);
+    } else {
+      fprintf(stderr, "Usage: %s %s [-t wait_ms] name local remote\n", argv[0], mode.c_str());
+    }
+    return 2;
+  }
+  std::string name = argv[optind];
+  std::string first = argv[optind + 1];
+  std::string second;
+  if (args == 3) {
+    second = argv[optind + 2];
+  } else {
+    size_t slash = first.rfind('/');
+    second = slash == std::string::npos ? first : first.substr(slash + 1);
+  }
+
+  std::unique_ptr<file_transfer> transfer;
+  return withAgent(name, waitMs, [&](asio::io_context& io_context, const std::shared_ptr<agent_session>& as, int& status) {
+    if (download) {
+      transfer = std::make_unique<file_download>(as, first, second);
+    } else if (mode == "upload") {
+      transfer = std::make_unique<file_upload>(as, first, second);
+    } else {
+      transfer = std::make_unique<file_sync>(io_context, as, first, second);
+    }
+    transfer->on_done = [&] {
+      status = transfer->status();
+      io_context.stop();
+    };
+    transfer->start();
+  });
+}
+
+// terminal_server pull [-t wait_ms] [-j writers] name remote_dir [local_dir]
+static int runPull(int argc, char* argv[]) {
+  long waitMs = 3000;
+  size_t writers = 4;
+  int opt;
+  while ((opt = getopt(argc, argv, "+t:j:")) != -1) {
+    switch (opt) {
+      case 't':
+        waitMs = strtol(optarg, nullptr, 10);
+        break;
+      case 'j':
+        writers = std::max(1ul, strtoul(optarg, nullptr, 10));
+        break;
+      default:
+        return 2;
+    }
+  }
+  int args = argc - optind;
+  if (args < 2 || args > 3) {
+    fprintf(stderr, "Usage: %s pull [-t wait_ms] [-j writers] name remote_dir [local_dir]\n", argv[0]);
+    return 2;
+  }
+  std::string name = argv[optind];
+  std::string remote = argv[optind + 1];
+  while (remote.size() > 1 && remote.back() == '/') remote.pop_back();
+  std::string local;
+  if (args == 3) {
+    local = argv[optind + 2];
+  } else {
+    size_t slash = remote.rfind('/');
+    local = slash == std::string::npos ? remote : remote.substr(slash + 1);
+  }
+
+  asio::thread_pool pool(writers);
+  std::unique_ptr<tree_pull> pull;
+  int status = withAgent(name, waitMs, [&](asio::io_context& io_context, const std::shared_ptr<agent_session>& as, int& status) {
+    pull = std::make_unique<tree_pull>(io_context, pool, as, remote, local);
+    pull->on_done = [&] {
+      status = pull->status();
+      // writes still queued after a failure post to the io_context, let them finish before it goes
+      pool.join();
+      io_context.stop();
+    };
+    pull->start();
+  });
+  return status;
+}
+
+// terminal_server forward [-t wait_ms] [-L [bind:]port:host:hostport]... [-R [bind:]port:host:hostport]... name
+static int runForward(int argc, char* argv[]) {
+  long waitMs = 3000;
+  std::vector<forward_spec> locals, remotes;
+  int opt;
+  while ((opt = getopt(argc, argv, "+t:L:R:")) != -1) {
+    forward_spec spec;
+    switch (opt) {
+      case 't':
+        waitMs = strtol(optarg, nullptr, 10);
+        break;
+      case 'L':
+      case 'R':
+        if (!forward_spec::parse(optarg, spec)) {
+          fprintf(stderr, "terminal_server: bad forward: %s\n", optarg);
+          return 2;
+        }
+        (opt == 'L' ? locals : remotes).push_back(spec);
+        break;
+      default:
+        return 2;
+    }
+  }
+  if (argc - optind != 1 || (locals.empty() && remotes.empty())) {
+    fprintf(stderr, "Usage: %s forward [-t wait_ms] [-L [bind:]port:host:hostport]... [-R [bind:]port:host:hostport]... name\n", argv[0]);
+    return 2;
+  }
+  std::string name = argv[optind];
+
+  std::unique_ptr<port_forward> forward;
+  return withAgent(name, waitMs, [&](asio::io_context& io_context, const std::shared_ptr<agent_session>& as, int& status) {
+    forward = std::make_unique<port_forward>(io_context, as);
+    for (auto& spec : locals) {
+      if (!forward->local(spec)) {
+        status = 1;
+        io_context.stop();
+        return;
+      }
+    }
+    for (auto& spec : remotes) {
+      forward->remote(spec);
+    }
+    // runs until interrupted, or the agent goes away
+    as->on_lost = [&] {
+      fprintf(stderr, "terminal_server: %s: connection lost\n", name.c_str());
+      status = 255;
+      io_context.stop();
+    };
+  });
+}
+
+// terminal_server relay [-p port] upstream_host[:port]
+static int runRelay(int argc, char* argv[]) {
+  uint16_t port = 6666;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:")) != -1) {
+    if (opt != 'p') return 2;
+    port = (uint16_t)atoi(optarg);
+  }
+  if (optind >= argc || port == 0) {
+    fprintf(stderr, "Usage: %s relay [-p port] upstream_host[:port]\n", argv[0]);
+    return 2;
+  }
+  std::string upstream = argv[optind];
+  std::string upstreamPort = "6666";
+  size_t colon = upstream.rfind(':');
+  if (colon != std::string::npos) {
+    upstreamPort = upstream.substr(colon + 1);
+    upstream.resize(colon);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  asio::io_context io_context;
+  relay relay(io_context, port, upstream, upstreamPort);
+  relay.start();
+  io_context.run();
+  return 0;
+}
+
+// terminal_server view [-h hub_host] [name]
+static int runViewer(int argc, char* argv[]) {
+  std::string host = "localhost";
+  int opt;
+  while ((opt = getopt(argc, argv, "h:")) != -1) {
+    if (opt != 'h') return 2;
+    host = optarg;
+  }
+  std::string name = optind < argc ? argv[optind] : "";
+
+  // keep the keyboard cooked so ^C quits, but pass the output through untouched
+  termios orig{};
+  bool isTty = tcgetattr(STDOUT_FILENO, &orig) == 0;
+  if (isTty) {
+    termios raw = orig;
+    raw.c_oflag &= ~OPOST;
+    tcsetattr(STDOUT_FILENO, TCSANOW, &raw);
+  }
+
+  asio::io_context io_context;
+  asio_net::tcp_client client(io_context);
+  frame_parser parser;
+  parser.on_frame = [&](const frame& f) {
+    if (f.type == msg::pty_data) write(STDOUT_FILENO, f.data, f.size);
+    if (f.type == msg::ping) client.send(pack(msg::pong, 0, f.data, f.size));
+  };
+  client.on_open = [&] {
+    client.send(pack(msg::view, 0, name));
+  };
+  client.on_open_failed = [&](std::error_code ec) {
+    LOGE("open failed: %s", ec.message().c_str());
+    io_context.stop();
+  };
+  client.on_close = [&] {
+    io_context.stop();
+  };
+  client.on_data = [&](const std::string& data) {
+    if (!parser.feed(data)) client.close();
+  };
+  client.open(host, 6666);
+  io_context.run();
+
+  if (isTty) tcsetattr(STDOUT_FILENO, TCSANOW, &orig);
+  const char reset[] = "\x1b[0m\x1b[?25h\r\n";
+  write(STDOUT_FILENO, reset, sizeof(reset) - 1);
+  return 0;
+}
+
+// terminal_server [-b] [-w name,...] [-j threads] [-u]
 int main(int argc, char* argv[]) {
+  if (argc > 1 && strcmp(argv[1], "run") == 0) {
+    return runFleet(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "exec") == 0) {
+    return runExec(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "pipe") == 0) {
+    return runPipe(argc - 1, argv + 1);
+  }
+  if (argc > 1 && (strcmp(argv[1], "download") == 0 || strcmp(argv[1], "upload") == 0 || strcmp(argv[1], "sync") == 0)) {
+    return runTransfer(argc - 1, argv + 1, argv[1]);
+  }
+  if (argc > 1 && strcmp(argv[1], "pull") == 0) {
+    return runPull(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "forward") == 0) {
+    return runForward(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "relay") == 0) {
+    return runRelay(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "view") == 0) {
+    return runViewer(argc - 1, argv + 1);
+  }
+
+  // -b: keyboard input goes to every selected agent, the first one is displayed
+  bool broadcast = false;
+  std::set<std::string> names;
+  size_t threads = 1;
+  bool useUring = false;
+  bool serveUdp = false;
+  local_echo::mode echoMode = local_echo::adaptive;
+  int fps = 60;
+  auto usage = [&] {
+    fprintf(stderr, "Usage: %s [-b] [-w name,...] [-j threads] [-u] [-d] [-e adaptive|always|never] [-f fps]\n", argv[0]);
+    return 2;
+  };
+  int opt;
+  while ((opt = getopt(argc, argv, "bw:j:ude:f:")) != -1) {
+    switch (opt) {
+      case 'b':
+        broadcast = true;
+        break;
+      case 'w':
+        names = splitNames(optarg);
+        break;
+      case 'j':
+        threads = std::max(1ul, strtoul(optarg, nullptr, 10));
+        break;
+      case 'u':
+        useUring = true;
+        break;
+      case 'd':
+        serveUdp = true;
+        break;
+      case 'e':
+        if (strcmp(optarg, "adaptive") == 0) {
+          echoMode = local_echo::adaptive;
+        } else if (strcmp(optarg, "always") == 0) {
+          echoMode = local_echo::always;
+        } else if (strcmp(optarg, "never") == 0) {
+          echoMode = local_echo::never;
+        } else {
+          return usage();
+        }
+        break;
+      case 'f':
+        fps = atoi(optarg);
+        break;
+      default:
+        return usage();
+    }
+  }
+
   // 根据"man 2 setsid"的说明
   // 调用setsid的进程不能是进程组组长（从bash中运行的命令是组长），故fork出一个子进程，让组长结束，子进程脱离进程组成为新的会话组长
   if (fork()) {
@@ -30,33 +620,179 @@ int main(int argc, char* argv[]) {
     perror("setsid");        // 显示setsid是否成功
     ioctl(0, TIOCSCTTY, 0);  // 这时可以设置新的控制终端了，设置控制终端为stdin
 
-    asio::io_context io_context;
+    // -j: the io_context runs on that many threads, each agent connection and
+    // each screen model on a strand, the code below on the user strand
+    asio::io_context io_context((int)threads);
+    strand user = asio::make_strand(io_context);
 
-    asio::posix::stream_descriptor descriptor(io_context);
+    asio::posix::stream_descriptor descriptor(user);
     descriptor.assign(STDIN_FILENO);
 
-    asio_net::tcp_server tcp_server(io_context, 6666);
+    std::unique_ptr<hub> hubPtr(threads > 1 ? new hub(io_context, 6666, user) : new hub(io_context, 6666));
+    hub& server = *hubPtr;
+    // -d: agents may come over UDP too, see udp_transport
+    server.serve_udp(serveUdp);
+#ifdef __linux__
+    std::unique_ptr<uring> ring;
+    if (useUring && threads == 1) {
+      ring.reset(new uring(io_context));
+      server.use_uring(*ring);
+    }
+#endif
 
-    std::weak_ptr<asio_net::tcp_session> tcp_session;
-    tcp_server.on_session = [&tcp_session, &io_context](const std::weak_ptr<asio_net::tcp_session>& ws) {
-      if (!tcp_session.expired()) {
-        LOGD("tcp_session already have, close it");
-        ws.lock()->close();
+    // -b: the keys go to every agent of the group, one held back does not hold back the others
+    broadcast_group group(user, server.new_channel());
+    std::shared_ptr<agent_session> primary;
+    // the shells get the size of this terminal, and its changes
+    int cols = pty_cols;
+    int rows = pty_rows;
+    terminalSize(STDOUT_FILENO, cols, rows);
+    // floods of output are drawn a frame at a time, -e: keys shown before the shell echoes them
+    display local(user, STDOUT_FILENO, cols, rows, echoMode, fps);
+    local.ask_sync();
+    group.on_lag = [&](const std::shared_ptr<agent_session>& as, bool lagging) {
+      local.notice(as->name() + (lagging ? " lags behind, its input is held" : " has caught up"));
+    };
+    // the PTY master of the primary agent when it has passed it, a local agent does, no relay then
+    asio::posix::stream_descriptor direct(user);
+    std::string directBuffer;
+    std::function<void(std::shared_ptr<pty_mirror>)> readDirect = [&](std::shared_ptr<pty_mirror> m) {
+      direct.async_read_some(asio::buffer(directBuffer), [&, m](const std::error_code& ec, std::size_t length) {
+        // the end is reported by the agent, which waits for the shell
+        if (ec) return;
+        local.output(directBuffer.data(), length);
+        m->feed(directBuffer.data(), length);
+        readDirect(m);
+      });
+    };
+    std::map<std::string, std::shared_ptr<pty_mirror>> mirrors;  // agent name => viewers of its PTY
+    server.on_agent = [&](const std::shared_ptr<agent_session>& as) {
+      if (!names.empty() && !names.count(as->name())) return;
+      if (primary && !broadcast) {
+        LOGD("agent already have, ignore: %s", as->name().c_str());
         return;
       }
-      LOGD("on_session");
+      LOGD("on_agent: %s", as->name().c_str());
 
-      tcp_session = ws;
-      auto session = ws.lock();
-      session->on_close = [&io_context] {
-        LOGD("on_close");
-        io_context.stop();
-      };
-      session->on_data = [](const std::string& data) {
-        write(STDOUT_FILENO, data.data(), data.size());
-      };
+      bool isPrimary = !primary;
+      if (isPrimary) primary = as;
+      auto* raw = as.get();
+      auto& mirror = mirrors[as->name()];
+      // the display models the screen of the primary already, on the user strand
+      if (isPrimary) {
+        mirror = std::make_shared<pty_mirror>(user, local.model());
+      } else {
+        mirror = std::make_shared<pty_mirror>(asio::make_strand(io_context), cols, rows);
+      }
+      as->open(
+          msg::pty_open, (broadcast ? "" : "fd ") + std::to_string(cols) + 'x' + std::to_string(rows),
+          [&, raw, isPrimary, m = mirror](const frame& f) {
+            switch (f.type) {
+              case msg::pty_data:
+                if (isPrimary) local.output(f.data, f.size);
+                m->feed(f.data, f.size);
+                break;
+              case msg::pty_fd: {
+                int fd = (int)get_u32(f.data);
+                if (fd < 0) break;
+                LOGD("PTY passed by %s", raw->name().c_str());
+                direct.assign(fd);
+                direct.non_blocking(true);
+                directBuffer.resize(64 * 1024);
+                readDirect(m);
+                break;
+              }
+              case msg::close:
+                if (isPrimary) {
+                  LOGD("on_close");
+                  local.flush();
+                  LOGD("%zu bytes of output, %zu written", local.total(), local.written());
+                  io_context.stop();
+                } else {
+                  group.remove(raw);
+                }
+                break;
+              default:
+                break;
+            }
+          },
+          group.channel());
+      if (broadcast) group.add(as);
+    };
+    server.on_viewer = [&](const std::shared_ptr<agent_session>& viewer, const std::string& name) {
+      auto it = mirrors.find(name.empty() && primary ? primary->name() : name);
+      if (it == mirrors.end()) {
+        LOGD("no such session to view: %s", name.c_str());
+        viewer->close();
+        return;
+      }
+      LOGD("viewer of %s", it->first.c_str());
+      it->second->attach(viewer);
     };
 
+    // keys for the passed PTY: what it does not take now waits for room, its output is read meanwhile
+    std::string directInput;
+    std::function<void()> writeDirect = [&] {
+      std::error_code error;
+      size_t n = direct.write_some(asio::buffer(directInput), error);
+      directInput.erase(0, n);
+      if (error && error != asio::error::would_block && error != asio::error::interrupted) {
+        LOGE("PTY: %s", error.message().c_str());
+        directInput.clear();
+        return;
+      }
+      if (directInput.empty()) return;
+      direct.async_wait(asio::posix::descriptor_base::wait_write, [&](const std::error_code& ec) {
+        if (!ec && direct.is_open()) writeDirect();
+      });
+    };
+    local.on_keys = [&](const char* data, size_t length) {
+      if (direct.is_open()) {
+        bool idle = directInput.empty();
+        directInput.append(data, length);
+        if (idle) writeDirect();
+        return;
+      }
+      local.typed(data, length, primary ? primary->rtt_us() : -1);
+      if (broadcast) {
+        group.send(msg::pty_data, data, length);
+      } else if (primary) {
+        primary->send(pack(msg::pty_data, group.channel(), data, length));
+      }
+    };
+    asio::signal_set winch(user, SIGWINCH);
+    std::function<void()> onResize = [&] {
+      winch.async_wait([&](const std::error_code& ec, int) {
+        if (ec) return;
+        int oldCols = cols;
+        int oldRows = rows;
+        terminalSize(STDOUT_FILENO, cols, rows);
+        onResize();
+        if (cols == oldCols && rows == oldRows) return;
+        LOGD("terminal size: %dx%d", cols, rows);
+        local.resize(cols, rows);
+        for (auto& m : mirrors) {
+          m.second->resize(cols, rows);
+        }
+        if (direct.is_open()) {
+          winsize ws{};
+          ws.ws_col = (unsigned short)cols;
+          ws.ws_row = (unsigned short)rows;
+          ioctl(direct.native_handle(), TIOCSWINSZ, &ws);
+          return;
+        }
+        char body[4];
+        put_u16(body, (uint16_t)cols);
+        put_u16(body + 2, (uint16_t)rows);
+        if (broadcast) {
+          group.send(msg::pty_resize, body, sizeof(body));
+        } else if (primary) {
+          primary->send(pack(msg::pty_resize, group.channel(), body, sizeof(body)));
+        }
+      });
+    };
+    onResize();
+
     std::function<void()> readFromFdm;
     std::string buffer;
     buffer.resize(1024);
@@ -66,16 +802,23 @@ int main(int argc, char* argv[]) {
           LOGE("descriptor: %s", ec.message().c_str());
           return;
         }
-        auto ts = tcp_session.lock();
-        if (ts) {
-          ts->send(std::string(buffer.data(), length));
-        }
+        local.keys(buffer.data(), length);
         readFromFdm();
       });
     };
     readFromFdm();
 
-    tcp_server.start(true);
+    server.start();
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; ++i) {
+      pool.emplace_back([&] {
+        io_context.run();
+      });
+    }
+    io_context.run();
+    for (auto& t : pool) {
+      t.join();
+    }
   }
   return 0;
 }
@@ -0,0 +1,77 @@
+#include <unistd.h>
+
+#include <csignal>
+#include <cstdio>
+
+#include "impair_proxy.hpp"
+#include "log.h"
+
+using namespace rterm;
+
+// terminal_proxy [-p port] [-d delay_ms] [-j jitter_ms] [-r rate_kbit] [-l loss_percent] [-q queue_ms] [-s seed] [-m roam_ms] upstream_host[:port]
+int main(int argc, char* argv[]) {
+  uint16_t port = 6667;
+  impairment how;
+  uint32_t seed = 1;
+  int roamMs = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:d:j:r:l:q:s:m:")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = (uint16_t)atoi(optarg);
+        break;
+      case 'd':
+        how.delay_ms = atof(optarg);
+        break;
+      case 'j':
+        how.jitter_ms = atof(optarg);
+        break;
+      case 'r':
+        how.rate_kbit = atof(optarg);
+        break;
+      case 'l':
+        how.loss = atof(optarg) / 100;
+        break;
+      case 'q':
+        how.queue_ms = atof(optarg);
+        break;
+      case 's':
+        seed = (uint32_t)strtoul(optarg, nullptr, 10);
+        break;
+      case 'm':
+        roamMs = atoi(optarg);
+        break;
+      default:
+        optind = argc;
+        break;
+    }
+  }
+  if (optind >= argc || port == 0) {
+    fprintf(stderr,
+            "Usage: %s [-p port] [-d delay_ms] [-j jitter_ms] [-r rate_kbit] [-l loss_percent] [-q queue_ms] [-s seed] [-m roam_ms] "
+            "upstream_host[:port]\n",
+            argv[0]);
+    return 2;
+  }
+  std::string upstream = argv[optind];
+  std::string upstreamPort = "6666";
+  size_t colon = upstream.rfind(':');
+  if (colon != std::string::npos) {
+    upstreamPort = upstream.substr(colon + 1);
+    upstream.resize(colon);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  asio::io_context io_context;
+  // the same in both directions, the delay is one way
+  impair_proxy proxy(io_context, port, upstream, upstreamPort, how, how, seed);
+  if (roamMs > 0) proxy.roam_every(std::chrono::milliseconds(roamMs));
+  proxy.start();
+  asio::signal_set signals(io_context, SIGINT, SIGTERM);
+  signals.async_wait([&](const std::error_code&, int) {
+    printf("%zu lost or dropped\n", proxy.impaired());
+    io_context.stop();
+  });
+  io_context.run();
+  return 0;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "hub.hpp"
+#include "screen.hpp"
+
+namespace rterm {
+
+/**
+ * Read-only viewers of one PTY channel. Each output chunk is framed once into
+ * a shared buffer and queued on every viewer, no copy per viewer.
+ *
+ * The screen is modeled here too: a viewer joining late starts from a
+ * snapshot, and a viewer falling more than max_backlog behind stops getting
+ * the live stream. When its queue has drained it gets a fresh snapshot and
+ * follows live again, so it never holds back the operator or other viewers.
+ *
+ * It runs on a strand of its own, feed() and attach() from elsewhere are
+ * posted there, so with a threaded hub modeling the screen of one agent does
+ * not hold up the others. Or it borrows a screen modeled on its strand
+ * already, the one of the display of the primary agent, which is fed before
+ * feed() here: the bytes are not parsed twice.
+ */
+class pty_mirror : public std::enable_shared_from_this<pty_mirror> {
+ public:
+  pty_mirror(const strand& executor, int cols, int rows, size_t max_backlog = 256 * 1024)
+      : strand_(executor), own_(new screen(cols, rows)), screen_(own_.get()), max_backlog_(max_backlog), timer_(executor) {}
+
+  /// shared is fed and resized by its owner, on executor
+  pty_mirror(const strand& executor, const screen& shared, size_t max_backlog = 256 * 1024)
+      : strand_(executor), screen_(&shared), max_backlog_(max_backlog), timer_(executor) {}
+
+  void feed(const char* data, size_t size) {
+    if (!strand_.running_in_this_thread()) {
+      auto self = shared_from_this();
+      auto chunk = std::make_shared<std::string>(data, size);
+      asio::post(strand_, [self, chunk] {
+        self->feed(chunk->data(), chunk->size());
+      });
+      return;
+    }
+    if (own_) own_->feed(data, size);
+    if (viewers_.empty()) return;
+
+    auto chunk = make_shared_buffer(pack(msg::pty_data, 0, data, size));
+    for (auto it = viewers_.begin(); it != viewers_.end();) {
+      if (!it->peer->alive()) {
+        it = viewers_.erase(it);
+        continue;
+      }
+      if (!it->lagging && it->peer->queued_bytes() > max_backlog_) {
+        LOGD("viewer lags behind, switch to snapshot");
+        it->lagging = true;
+        catch_up_later();
+      }
+      if (!it->lagging) it->peer->send(chunk);
+      ++it;
+    }
+  }
+
+  void attach(std::shared_ptr<agent_session> peer) {
+    if (!strand_.running_in_this_thread()) {
+      auto self = shared_from_this();
+      asio::post(strand_, [self, peer] {
+        self->attach(peer);
+      });
+      return;
+    }
+    peer->send(msg::pty_data, 0, screen_->snapshot());
+    viewers_.push_back(viewer{std::move(peer), false});
+  }
+
+  /// the PTY has a new size, the shell redraws after its SIGWINCH
+  void resize(int cols, int rows) {
+    if (!strand_.running_in_this_thread()) {
+      auto self = shared_from_this();
+      asio::post(strand_, [self, cols, rows] {
+        self->resize(cols, rows);
+      });
+      return;
+    }
+    if (own_) own_->resize(cols, rows);
+  }
+
+  /// on the strand
+  size_t viewers() const {
+    return viewers_.size();
+  }
+
+  const screen& model() const {
+    return *screen_;
+  }
+
+ private:
+  struct viewer {
+    std::shared_ptr<agent_session> peer;
+    bool lagging;
+  };
+
+  void catch_up_later() {
+    if (waiting_) return;
+    waiting_ = true;
+    timer_.expires_after(std::chrono::milliseconds(50));
+    auto self = shared_from_this();
+    timer_.async_wait([self](const std::error_code& ec) {
+      if (ec) return;
+      self->waiting_ = false;
+      self->catch_up();
+    });
+  }
+
+  void catch_up() {
+    bool again = false;
+    for (auto it = viewers_.begin(); it != viewers_.end();) {
+      if (!it->peer->alive()) {
+        it = viewers_.erase(it);
+        continue;
+      }
+      if (it->lagging) {
+        if (it->peer->queued_bytes() < max_backlog_ / 4) {
+          it->peer->send(msg::pty_data, 0, screen_->snapshot());
+          it->lagging = false;
+        } else {
+          again = true;
+        }
+      }
+      ++it;
+    }
+    if (again) catch_up_later();
+  }
+
+ private:
+  strand strand_;
+  std::unique_ptr<screen> own_;
+  const screen* screen_;
+  size_t max_backlog_;
+  std::vector<viewer> viewers_;
+  asio::steady_timer timer_;
+  bool waiting_ = false;
+};
+
+}  // namespace rterm
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hub.hpp"
+
+namespace rterm {
+
+/**
+ * Stream a local descriptor into the stdin of a remote command (msg::pipe).
+ *
+ * Reads are large and nothing is done to the bytes. At most pipe_window
+ * bytes are in flight, the rest waits for exec_ack from the agent. While
+ * waiting the descriptor is not read, so a slow remote command holds back
+ * the local producer through the pipe it writes to.
+ */
+class pipe_sender {
+ public:
+  /// read_size: bytes read at once, see bench/pipe_bench
+  pipe_sender(asio::io_context& io_context, std::shared_ptr<agent_session> as, uint32_t channel, int fd, size_t read_size = 256 * 1024)
+      : io_context_(io_context), as_(std::move(as)), channel_(channel), fd_(fd), descriptor_(io_context) {
+    buffer_.resize(read_size);
+    // regular files can not be polled, read them directly
+    struct stat st {};
+    pollable_ = fstat(fd_, &st) == 0 && !S_ISREG(st.st_mode);
+    if (pollable_) descriptor_.assign(dup(fd_));
+  }
+
+  ~pipe_sender() {
+    std::error_code ec;
+    descriptor_.close(ec);
+  }
+
+  void start() {
+    read();
+  }
+
+  /// exec_ack from the agent
+  void on_ack(uint32_t bytes) {
+    in_flight_ -= std::min<size_t>(bytes, in_flight_);
+    if (paused_ && has_credit()) {
+      paused_ = false;
+      read();
+    }
+  }
+
+ private:
+  bool has_credit() const {
+    return in_flight_ + buffer_.size() <= pipe_window;
+  }
+
+  void read() {
+    if (done_) return;
+    if (!has_credit()) {
+      paused_ = true;
+      return;
+    }
+    if (!pollable_) {
+      ssize_t n = ::read(fd_, &buffer_[0], buffer_.size());
+      on_read(n > 0 ? std::error_code() : asio::error::eof, n > 0 ? (size_t)n : 0);
+      return;
+    }
+    descriptor_.async_read_some(asio::buffer(buffer_), [this](const std::error_code& ec, std::size_t length) {
+      on_read(ec, length);
+    });
+  }
+
+  void on_read(const std::error_code& ec, size_t length) {
+    if (ec) {
+      done_ = true;
+      as_->send(msg::exec_eof, channel_);
+      return;
+    }
+    in_flight_ += length;
+    as_->send(pack(msg::exec_in, channel_, buffer_.data(), length));
+    // keep the io_context responsive to acks and output between file reads
+    if (pollable_) {
+      read();
+    } else {
+      asio::post(io_context_, [this] {
+        read();
+      });
+    }
+  }
+
+ private:
+  asio::io_context& io_context_;
+  std::shared_ptr<agent_session> as_;
+  uint32_t channel_;
+  int fd_;
+  bool pollable_ = false;
+  asio::posix::stream_descriptor descriptor_;
+  std::string buffer_;
+
+  size_t in_flight_ = 0;
+  bool paused_ = false;
+  bool done_ = false;
+};
+
+}  // namespace rterm
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <map>
+
+#include "forward.hpp"
+#include "hub.hpp"
+
+namespace rterm {
+
+/// [bind_address:]port:host:hostport, like ssh -L and -R
+struct forward_spec {
+  std::string bind;
+  uint16_t port = 0;
+  std::string host;
+  std::string host_port;
+
+  static bool parse(const std::string& spec, forward_spec& out) {
+    std::vector<std::string> parts;
+    size_t begin = 0;
+    for (;;) {
+      size_t colon = spec.find(':', begin);
+      parts.push_back(spec.substr(begin, colon - begin));
+      if (colon == std::string::npos) break;
+      begin = colon + 1;
+    }
+    if (parts.size() != 3 && parts.size() != 4) return false;
+    size_t i = 0;
+    out.bind = parts.size() == 4 ? parts[i++] : "127.0.0.1";
+    out.port = (uint16_t)strtoul(parts[i++].c_str(), nullptr, 10);
+    out.host = parts[i++];
+    out.host_port = parts[i];
+    return out.port != 0 && !out.host.empty() && !out.host_port.empty();
+  }
+};
+
+/**
+ * Hub end of port forwarding to and from one agent, see tcp_stream.
+ *
+ * local(): listen here, every connection is forwarded to host:hostport as
+ * seen from the agent, e.g. a database next to it (ssh -L).
+ * remote(): the agent listens, every connection is forwarded to host:hostport
+ * as seen from here (ssh -R).
+ */
+class port_forward {
+ public:
+  port_forward(asio::io_context& io_context, std::shared_ptr<agent_session> as) : io_context_(io_context), as_(std::move(as)) {}
+
+  bool local(const forward_spec& spec) {
+    std::error_code ec;
+    asio::ip::tcp::endpoint endpoint(asio::ip::make_address(spec.bind, ec), spec.port);
+    auto acceptor = std::make_shared<asio::ip::tcp::acceptor>(io_context_);
+    if (!ec) acceptor->open(endpoint.protocol(), ec);
+    if (!ec) acceptor->set_option(asio::ip::tcp::acceptor::reuse_address(true), ec);
+    if (!ec) acceptor->bind(endpoint, ec);
+    if (!ec) acceptor->listen(asio::socket_base::max_listen_connections, ec);
+    if (ec) {
+      fprintf(stderr, "terminal_server: listen %s:%u: %s\n", spec.bind.c_str(), spec.port, ec.message().c_str());
+      return false;
+    }
+    acceptors_.push_back(acceptor);
+    accept(acceptor.get(), spec.host + ":" + spec.host_port);
+    return true;
+  }
+
+  void remote(const forward_spec& spec) {
+    std::string bind = spec.bind + ":" + std::to_string(spec.port);
+    forward_spec target = spec;
+    as_->open(msg::tcp_listen, bind, [this, bind, target](const frame& f) {
+      switch (f.type) {
+        case msg::tcp_accept:
+          if (f.size >= 4) attach(get_u32(f.data), target);
+          break;
+        case msg::exit:
+          fprintf(stderr, "terminal_server: %s: listen %s: %s\n", as_->name().c_str(), bind.c_str(),
+                  strerror(f.size >= 4 ? (int32_t)get_u32(f.data) : EIO));
+          break;
+        default:
+          break;
+      }
+    });
+  }
+
+  /// forwarded connections open now
+  size_t streams() const {
+    return streams_.size();
+  }
+
+ private:
+  void accept(asio::ip::tcp::acceptor* acceptor, std::string target) {
+    acceptor->async_accept([this, acceptor, target](const std::error_code& ec, asio::ip::tcp::socket socket) {
+      if (ec == asio::error::operation_aborted) return;
+      if (!ec) {
+        socket.set_option(asio::ip::tcp::no_delay(true));
+        auto stream = add(std::move(socket));
+        stream.second->start();
+        as_->open(msg::tcp_open, target, handler(stream.first), stream.first);
+      }
+      accept(acceptor, target);
+    });
+  }
+
+  void attach(uint32_t token, const forward_spec& target) {
+    auto stream = add(asio::ip::tcp::socket(io_context_));
+    stream.second->connect(target.host, target.host_port);
+    char v[4];
+    put_u32(v, token);
+    as_->open(msg::tcp_attach, std::string(v, sizeof(v)), handler(stream.first), stream.first);
+  }
+
+  std::pair<uint32_t, std::shared_ptr<tcp_stream>> add(asio::ip::tcp::socket socket) {
+    uint32_t id = as_->new_channel();
+    auto stream = std::make_shared<tcp_stream>(std::move(socket), as_->conn(), id);
+    stream->on_done = [this, id](bool) {
+      streams_.erase(id);
+    };
+    streams_[id] = stream;
+    return {id, stream};
+  }
+
+  agent_session::handler handler(uint32_t id) {
+    return [this, id](const frame& f) {
+      auto it = streams_.find(id);
+      if (it == streams_.end()) return;
+      auto stream = it->second;
+      stream->on_frame(f);
+    };
+  }
+
+ private:
+  asio::io_context& io_context_;
+  std::shared_ptr<agent_session> as_;
+  std::vector<std::shared_ptr<asio::ip::tcp::acceptor>> acceptors_;
+  std::map<uint32_t, std::shared_ptr<tcp_stream>> streams_;
+};
+
+}  // namespace rterm
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <set>
+
+#include "asio.hpp"
+#include "log.h"
+
+namespace rterm {
+
+/**
+ * Relay (jump host) for networks where agents can not reach the hub: every
+ * accepted connection gets its own connection to the upstream hub, or to the
+ * next relay, and the bytes are passed through without looking at frames.
+ *
+ * On Linux each direction is spliced socket -> pipe -> socket, the payload
+ * stays in the kernel and a forwarded MB costs a few syscalls.
+ */
+class relay {
+ public:
+  relay(asio::io_context& io_context, uint16_t port, std::string upstream_host, std::string upstream_port)
+      : acceptor_(io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)),
+        resolver_(io_context),
+        retry_timer_(io_context),
+        upstream_host_(std::move(upstream_host)),
+        upstream_port_(std::move(upstream_port)) {}
+
+  void start() {
+    accept();
+  }
+
+  /// connections being relayed
+  size_t size() const {
+    return sessions_.size();
+  }
+
+ private:
+  /// one direction of a session
+  class pump {
+   public:
+    pump(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to) : from_(from), to_(to) {}
+
+    ~pump() {
+      if (pipe_[0] >= 0) close(pipe_[0]);
+      if (pipe_[1] >= 0) close(pipe_[1]);
+    }
+
+    /// @param done called once, with an error or at EOF after the other side was shut down
+    void start(std::function<void(const std::error_code&)> done) {
+      done_ = std::move(done);
+#ifdef __linux__
+      if (pipe2(pipe_, O_CLOEXEC | O_NONBLOCK) != 0) return finish(std::error_code(errno, std::generic_category()));
+      fcntl(pipe_[1], F_SETPIPE_SZ, 1024 * 1024);  // best effort, fewer round trips
+      std::error_code ec;
+      from_.native_non_blocking(true, ec);
+      to_.native_non_blocking(true, ec);
+      run();
+#else
+      buffer_.resize(64 * 1024);
+      read();
+#endif
+    }
+
+   private:
+#ifdef __linux__
+    void run() {
+      // bounded, so one busy session does not starve the others
+      for (int turn = 0; turn < 16; ++turn) {
+        if (in_pipe_ > 0) {
+          ssize_t n = ::splice(pipe_[0], nullptr, to_.native_handle(), nullptr, in_pipe_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+          if (n > 0) {
+            in_pipe_ -= (size_t)n;
+            continue;
+          }
+          if (n < 0 && errno == EINTR) continue;
+          if (n < 0 && errno == EAGAIN) return wait(to_, asio::socket_base::wait_write);
+          return finish(std::error_code(errno, std::generic_category()));
+        }
+        ssize_t n = ::splice(from_.native_handle(), nullptr, pipe_[1], nullptr, 1024 * 1024, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+          in_pipe_ = (size_t)n;
+          continue;
+        }
+        if (n == 0) return eof();
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN) return wait(from_, asio::socket_base::wait_read);
+        return finish(std::error_code(errno, std::generic_category()));
+      }
+      asio::post(from_.get_executor(), [this] {
+        run();
+      });
+    }
+
+    void wait(asio::ip::tcp::socket& socket, asio::socket_base::wait_type type) {
+      socket.async_wait(type, [this](const std::error_code& ec) {
+        if (ec) return finish(ec);
+        run();
+      });
+    }
+#else
+    void read() {
+      from_.async_read_some(asio::buffer(buffer_), [this](const std::error_code& ec, std::size_t length) {
+        if (ec == asio::error::eof) return eof();
+        if (ec) return finish(ec);
+        asio::async_write(to_, asio::buffer(buffer_.data(), length), [this](const std::error_code& ec, std::size_t) {
+          if (ec) return finish(ec);
+          read();
+        });
+      });
+    }
+#endif
+
+    void eof() {
+      std::error_code ec;
+      to_.shutdown(asio::ip::tcp::socket::shutdown_send, ec);
+      finish({});
+    }
+
+    void finish(const std::error_code& ec) {
+      auto done = std::move(done_);
+      done_ = nullptr;
+      if (done) done(ec);
+    }
+
+   private:
+    asio::ip::tcp::socket& from_;
+    asio::ip::tcp::socket& to_;
+    std::function<void(const std::error_code&)> done_;
+    int pipe_[2] = {-1, -1};
+    size_t in_pipe_ = 0;
+    std::string buffer_;  // without splice
+  };
+
+  /// an agent and its upstream connection
+  struct session {
+    explicit session(asio::ip::tcp::socket agent) : agent(std::move(agent)), upstream(this->agent.get_executor()) {}
+
+    asio::ip::tcp::socket agent;
+    asio::ip::tcp::socket upstream;
+    pump up{agent, upstream};
+    pump down{upstream, agent};
+    int open_directions = 2;
+  };
+
+  void accept() {
+    acceptor_.async_accept([this](const std::error_code& ec, asio::ip::tcp::socket socket) {
+      if (ec == asio::error::operation_aborted) return;
+      if (ec) {
+        LOGE("accept: %s", ec.message().c_str());
+        retry_timer_.expires_after(std::chrono::milliseconds(100));
+        retry_timer_.async_wait([this](const std::error_code& ec) {
+          if (!ec) accept();
+        });
+        return;
+      }
+      socket.set_option(asio::ip::tcp::no_delay(true));
+      connect(std::make_shared<session>(std::move(socket)));
+      accept();
+    });
+  }
+
+  void connect(const std::shared_ptr<session>& s) {
+    sessions_.insert(s);
+    resolver_.async_resolve(upstream_host_, upstream_port_,
+                            [this, s](const std::error_code& ec, const asio::ip::tcp::resolver::results_type& endpoints) {
+                              if (ec) return drop(s, ec);
+                              asio::async_connect(s->upstream, endpoints, [this, s](const std::error_code& ec, const asio::ip::tcp::endpoint&) {
+                                if (ec) return drop(s, ec);
+                                s->upstream.set_option(asio::ip::tcp::no_delay(true));
+                                auto done = [this, s](const std::error_code& ec) {
+                                  if (ec || --s->open_directions == 0) drop(s, ec);
+                                };
+                                s->up.start(done);
+                                s->down.start(done);
+                              });
+                            });
+  }
+
+  /// close both sockets, the agent will dial in again
+  void drop(const std::shared_ptr<session>& s, const std::error_code& ec) {
+    if (!sessions_.erase(s)) return;
+    if (ec) LOGD("relay: %s", ec.message().c_str());
+    std::error_code ignored;
+    s->agent.close(ignored);
+    s->upstream.close(ignored);
+    // a pump still waiting holds the session through its callback until it sees the close
+  }
+
+ private:
+  asio::ip::tcp::acceptor acceptor_;
+  asio::ip::tcp::resolver resolver_;
+  asio::steady_timer retry_timer_;
+  std::string upstream_host_;
+  std::string upstream_port_;
+  std::set<std::shared_ptr<session>> sessions_;
+};
+
+}  // namespace rterm
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "screen.hpp"
+
+namespace rterm {
+
+/**
+ * Draws a screen model on a terminal with few bytes, like the doupdate() of
+ * ncurses: it keeps what the terminal shows, compares that with the model cell
+ * by cell and writes only what differs. Content which moved up is scrolled
+ * with one SU instead of drawn again, a run of changed cells is reached with
+ * the shortest cursor motion, short unchanged gaps are written over, a blank
+ * rest of a line is erased with EL, and SGR goes out only when the attributes
+ * change.
+ *
+ * After a frame the terminal is in the state of the model, cursor, pen, saved
+ * cursor, scroll region and input modes included, so the bytes of the shell may be
+ * passed on as they are from there.
+ */
+class renderer {
+ public:
+  renderer(int cols, int rows) : cols_(cols), rows_(rows), cells_((size_t)(cols * rows)) {}
+
+  /// the terminal shows s now, e.g. it got the same bytes
+  void assume(const screen& s) {
+    for (int y = 0; y < rows_; ++y) {
+      for (int x = 0; x < cols_; ++x) at(x, y) = s.at(x, y);
+    }
+    x_ = s.wrap_pending() ? -1 : s.cursor_x();
+    y_ = s.cursor_y();
+    pen_ = s.pen();
+    saved_x_ = s.saved_x();
+    saved_y_ = s.saved_y();
+    saved_pen_ = s.saved_pen();
+    alt_ = s.alt_screen();
+    autowrap_ = s.autowrap();
+    cursor_visible_ = s.cursor_visible();
+    top_ = s.scroll_top();
+    bottom_ = s.scroll_bottom();
+    modes_ = s.modes();
+    alt_switches_ = s.alt_switches();
+    main_stale_ = false;
+  }
+
+  /**
+   * The terminal is in the modes of s, it got the same bytes, but what it shows
+   * where is not known: the shell did not start at its top left, or it was
+   * resized. Returns what clears it and homes the cursor, the next frame
+   * draws all of s.
+   */
+  std::string reset(const screen& s) {
+    if (s.cols() != cols_ || s.rows() != rows_) {
+      cols_ = s.cols();
+      rows_ = s.rows();
+      cells_.assign((size_t)(cols_ * rows_), cell());
+    }
+    assume(s);
+    std::fill(cells_.begin(), cells_.end(), cell());
+    x_ = 0;
+    y_ = 0;
+    pen_ = cell_attr();
+    saved_x_ = -1;
+    top_ = 0;
+    bottom_ = rows_ - 1;
+    main_stale_ = alt_;
+    // DECSTBM homes the cursor
+    return "\x1b[0m\x1b[r\x1b[2J";
+  }
+
+  /// the terminal has what s has, the main screen behind the alternate one included,
+  /// it may be given the bytes of the shell after the last frame
+  bool exact() const {
+    return !(alt_ && main_stale_);
+  }
+
+  /// what to write to take the terminal from what it shows to s
+  std::string render(const screen& s) {
+    std::string out;
+    if (s.alt_screen() != alt_) {
+      out += s.alt_screen() ? "\x1b[?1049h" : "\x1b[?1049l";
+      alt_ = s.alt_screen();
+      if (alt_) {
+        saved_x_ = x_;
+        saved_y_ = y_;
+        saved_pen_ = pen_;
+      }
+      // what the terminal has on the other screen is not known, start from a clear one,
+      // and 1049l restores the pen saved by 1049h
+      out += "\x1b[0m\x1b[2J";
+      pen_ = cell_attr();
+      std::fill(cells_.begin(), cells_.end(), cell());
+      x_ = -1;
+    }
+    // what the terminal keeps of the main screen is a frame, not what the model has, when
+    // the model went to the alternate screen, or there and back, since
+    if (s.alt_switches() != alt_switches_) {
+      main_stale_ = alt_;
+      alt_switches_ = s.alt_switches();
+    }
+    scroll(out, s);
+    for (int y = 0; y < rows_; ++y) draw_row(out, s, y);
+
+    if (s.scroll_top() != top_ || s.scroll_bottom() != bottom_) {
+      top_ = s.scroll_top();
+      bottom_ = s.scroll_bottom();
+      out += "\x1b[" + std::to_string(top_ + 1) + ';' + std::to_string(bottom_ + 1) + 'r';
+      x_ = -1;  // DECSTBM homes the cursor
+    }
+    if (s.saved_x() != saved_x_ || s.saved_y() != saved_y_ || s.saved_pen() != saved_pen_) {
+      move(out, s.saved_x(), s.saved_y());
+      set_pen(out, s.saved_pen());
+      out += "\x1b" "7";
+      saved_x_ = s.saved_x();
+      saved_y_ = s.saved_y();
+      saved_pen_ = s.saved_pen();
+    }
+    if (s.wrap_pending()) {
+      // only writing the last column leaves the terminal about to wrap, with autowrap on then
+      if (!autowrap_) {
+        autowrap_ = true;
+        out += "\x1b[?7h";
+      }
+      int x = cols_ - 1;
+      if (s.at(x, s.cursor_y()).ch == 0 && x > 0) --x;
+      move(out, x, s.cursor_y());
+      put(out, s, x, s.cursor_y());
+    } else {
+      move(out, s.cursor_x(), s.cursor_y());
+    }
+    if (s.autowrap() != autowrap_) {
+      autowrap_ = s.autowrap();
+      out += autowrap_ ? "\x1b[?7h" : "\x1b[?7l";
+    }
+    set_pen(out, s.pen());
+    if (s.cursor_visible() != cursor_visible_) {
+      cursor_visible_ = s.cursor_visible();
+      out += cursor_visible_ ? "\x1b[?25h" : "\x1b[?25l";
+    }
+    append_modes(out, modes_, s.modes());
+    modes_ = s.modes();
+    return out;
+  }
+
+ private:
+  static const int max_gap = 4;  // unchanged cells written over rather than skipped with a cursor motion
+
+  cell& at(int x, int y) {
+    return cells_[(size_t)(y * cols_ + x)];
+  }
+
+  static uint64_t row_hash(const cell* row, int cols) {
+    uint64_t h = 14695981039346656037ull;
+    for (int x = 0; x < cols; ++x) {
+      h = (h ^ row[x].ch) * 1099511628211ull;
+      h = (h ^ (row[x].attr.fg ^ (uint64_t)row[x].attr.bg << 25 ^ (uint64_t)row[x].attr.flags << 50)) * 1099511628211ull;
+    }
+    return h;
+  }
+
+  /// scrolls the terminal when the model looks like what it shows moved up
+  void scroll(std::string& out, const screen& s) {
+    if (top_ != 0 || bottom_ != rows_ - 1 || rows_ < 3) return;
+    std::vector<uint64_t> front((size_t)rows_), back((size_t)rows_);
+    std::vector<cell> row((size_t)cols_);
+    for (int y = 0; y < rows_; ++y) {
+      front[(size_t)y] = row_hash(&at(0, y), cols_);
+      for (int x = 0; x < cols_; ++x) row[(size_t)x] = s.at(x, y);
+      back[(size_t)y] = row_hash(row.data(), cols_);
+    }
+    int best = 0;
+    int bestMatches = 0;
+    for (int k = 0; k < rows_; ++k) {
+      int matches = 0;
+      for (int y = 0; y + k < rows_; ++y) matches += back[(size_t)y] == front[(size_t)(y + k)];
+      if (matches > bestMatches) {
+        best = k;
+        bestMatches = matches;
+      }
+    }
+    if (best == 0 || bestMatches < 2) return;
+    // the lines coming in take the background of the pen
+    set_pen(out, cell_attr());
+    out += "\x1b[" + std::to_string(best) + 'S';
+    std::move(cells_.begin() + best * cols_, cells_.end(), cells_.begin());
+    std::fill(cells_.end() - best * cols_, cells_.end(), cell());
+  }
+
+  void draw_row(std::string& out, const screen& s, int y) {
+    // from tail on the model has only the same blank, which EL can write
+    int tail = cols_;
+    const cell& last = s.at(cols_ - 1, y);
+    if (last.ch == ' ' && last.attr.fg == 0 && last.attr.flags == 0) {
+      while (tail > 0 && s.at(tail - 1, y) == last) --tail;
+    }
+    int x = 0;
+    while (x < cols_) {
+      if (at(x, y) == s.at(x, y)) {
+        ++x;
+        continue;
+      }
+      if (x >= tail && cols_ - x > 3) {
+        move(out, x, y);
+        set_pen(out, last.attr);
+        out += "\x1b[K";
+        std::fill(&at(x, y), &at(0, y) + cols_, last);
+        return;
+      }
+      // a right half is written with its left one
+      if (s.at(x, y).ch == 0 && x > 0) --x;
+      int end = x + 1;
+      for (int i = end, unchanged = 0; i < cols_ && unchanged <= max_gap && (i < tail || cols_ - i <= 3); ++i) {
+        if (at(i, y) == s.at(i, y)) {
+          ++unchanged;
+        } else {
+          unchanged = 0;
+          end = i + 1;
+        }
+      }
+      move(out, x, y);
+      while (x < end) x += put(out, s, x, y);
+    }
+  }
+
+  /// writes the cell x, y of s at the cursor, returns the columns taken
+  int put(std::string& out, const screen& s, int x, int y) {
+    const cell& c = s.at(x, y);
+    set_pen(out, c.attr);
+    int width = c.ch ? char_width(c.ch) : 1;
+    // half of a wide char cut off by an insert or erase, a blank on a terminal
+    bool whole = c.ch != 0 && (width == 1 || (x + 1 < cols_ && s.at(x + 1, y).ch == 0));
+    if (!whole) width = 1;
+    append_utf8(out, whole ? c.ch : ' ');
+    at(x, y) = c;
+    if (width == 2) at(x + 1, y) = s.at(x + 1, y);
+    x_ = x + width;
+    // the last column leaves the terminal about to wrap, only an absolute motion is sure then
+    if (x_ >= cols_) x_ = -1;
+    return width;
+  }
+
+  void move(std::string& out, int x, int y) {
+    if (x_ == x && y_ == y) return;
+    if (x_ >= 0 && y_ == y) {
+      int n = x - x_;
+      if (x == 0) {
+        out += '\r';
+      } else if (n < 0 && n >= -4) {
+        out.append((size_t)-n, '\b');
+      } else {
+        out += "\x1b[" + (n == 1 || n == -1 ? std::string() : std::to_string(n < 0 ? -n : n)) + (n > 0 ? 'C' : 'D');
+      }
+    } else {
+      out += "\x1b[" + std::to_string(y + 1);
+      if (x > 0) out += ';' + std::to_string(x + 1);
+      out += 'H';
+    }
+    x_ = x;
+    y_ = y;
+  }
+
+  void set_pen(std::string& out, const cell_attr& a) {
+    if (a == pen_) return;
+    append_sgr(out, a);
+    pen_ = a;
+  }
+
+  int cols_;
+  int rows_;
+  std::vector<cell> cells_;
+  int x_ = -1;  // where the cursor is, -1 when not known
+  int y_ = 0;
+  cell_attr pen_;
+  int saved_x_ = 0;  // -1 when not known
+  int saved_y_ = 0;
+  cell_attr saved_pen_;
+  bool alt_ = false;
+  bool autowrap_ = true;
+  bool cursor_visible_ = true;
+  int top_ = 0;
+  int bottom_ = 0;
+  uint32_t modes_ = 0;
+  uint32_t alt_switches_ = 0;
+  bool main_stale_ = false;
+};
+
+}  // namespace rterm
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <thread>
+#include <vector>
+
+#include "hub.hpp"
+
+namespace rterm {
+
+/**
+ * A hub spread over threads for large fleets: every shard has its own
+ * io_context on a thread pinned to a core and its own acceptor on the same
+ * port (SO_REUSEPORT), the kernel spreads the connections. A session stays
+ * on the shard which accepted it, reading, parsing and writing its
+ * connection happen there.
+ *
+ * The rest talks to the shards by message passing only. The callbacks, and
+ * the handlers of channels, run on a strand of the user io_context, what it
+ * sends is posted to the shard of the session. So fleet_run and
+ * broadcast_group work on top unchanged, as long as the user io_context has
+ * one thread. That strand is one thread for the whole fleet: the bulk of the
+ * frames, e.g. output, should be taken by a filter on the shard, see
+ * agent_session::open(), as fleet_run does.
+ *
+ * With one shard this is a plain hub on the user io_context.
+ */
+class sharded_hub {
+ public:
+  sharded_hub(asio::io_context& user, uint16_t port, size_t shards) : user_(asio::make_strand(user)) {
+    if (shards <= 1) {
+      single_.reset(new hub(user, port));
+      single_->on_agent = [this](const std::shared_ptr<agent_session>& as) {
+        added(as);
+      };
+      single_->on_agent_close = [this](const std::shared_ptr<agent_session>& as) {
+        removed(as);
+      };
+      return;
+    }
+    user_work_.reset(new asio::io_context::work(user));
+    for (size_t i = 0; i < shards; ++i) {
+      std::unique_ptr<shard> s(new shard);
+      s->server.reset(new hub(s->io_context, port, user_, next_channel_));
+      s->server->on_agent = [this](const std::shared_ptr<agent_session>& as) {
+        added(as);
+      };
+      s->server->on_agent_close = [this](const std::shared_ptr<agent_session>& as) {
+        removed(as);
+      };
+      shards_.push_back(std::move(s));
+    }
+#ifdef __linux__
+    shards_[0]->server->serve_local(true);
+#endif
+  }
+
+  ~sharded_hub() {
+    stop();
+  }
+
+  void start() {
+    if (single_) return single_->start();
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      auto* s = shards_[i].get();
+      s->server->start();
+      s->thread = std::thread([s] {
+        s->io_context.run();
+      });
+#ifdef __linux__
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(i % cores, &cpus);
+      pthread_setaffinity_np(s->thread.native_handle(), sizeof(cpus), &cpus);
+#endif
+    }
+  }
+
+  /// stop and join the shards, their sessions go away with them
+  void stop() {
+    for (auto& s : shards_) {
+      s->io_context.stop();
+    }
+    for (auto& s : shards_) {
+      if (s->thread.joinable()) s->thread.join();
+    }
+    user_work_.reset();
+    agents_.clear();
+  }
+
+  /// agents which have said hello, in the order the user io_context heard of them
+  std::vector<std::shared_ptr<agent_session>> agents() const {
+    std::vector<std::shared_ptr<agent_session>> ret;
+    ret.reserve(agents_.size());
+    for (auto& a : agents_) {
+      if (a.second->alive()) ret.push_back(a.second);
+    }
+    return ret;
+  }
+
+  /// a channel id which is free on every agent of every shard
+  uint32_t new_channel() {
+    return single_ ? single_->new_channel() : next_channel_++;
+  }
+
+  /// see hub::set_admission(), the shards share the rate
+  void set_admission(double rate, double burst) {
+    if (single_) return single_->set_admission(rate, burst);
+    for (auto& s : shards_) {
+      s->server->set_admission(rate / shards_.size(), burst / shards_.size());
+    }
+  }
+
+#ifdef __linux__
+  /// with one shard only, the ring runs on the user io_context
+  void use_uring(uring& ring) {
+    if (single_) single_->use_uring(ring);
+  }
+#endif
+
+  size_t shards() const {
+    return single_ ? 1 : shards_.size();
+  }
+
+ public:
+  /// on the user io_context
+  std::function<void(const std::shared_ptr<agent_session>&)> on_agent;
+  std::function<void(const std::shared_ptr<agent_session>&)> on_agent_close;
+
+ private:
+  struct shard {
+    asio::io_context io_context{1};
+    asio::executor_work_guard<asio::io_context::executor_type> work{io_context.get_executor()};
+    std::unique_ptr<hub> server;
+    std::thread thread;
+  };
+
+  void added(const std::shared_ptr<agent_session>& as) {
+    uint64_t key = next_key_++;
+    keys_[as.get()] = key;
+    agents_[key] = as;
+    if (on_agent) on_agent(as);
+  }
+
+  void removed(const std::shared_ptr<agent_session>& as) {
+    auto it = keys_.find(as.get());
+    if (it == keys_.end()) return;
+    agents_.erase(it->second);
+    keys_.erase(it);
+    if (on_agent_close) on_agent_close(as);
+  }
+
+ private:
+  strand user_;
+  std::unique_ptr<asio::io_context::work> user_work_;  // shards may post at any time
+  std::unique_ptr<hub> single_;
+  std::vector<std::unique_ptr<shard>> shards_;
+  std::atomic<uint32_t> next_channel_{1};
+  uint64_t next_key_ = 1;
+  std::map<uint64_t, std::shared_ptr<agent_session>> agents_;
+  std::map<const agent_session*, uint64_t> keys_;
+};
+
+}  // namespace rterm
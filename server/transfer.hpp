@@ -0,0 +1,390 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+
+#include "delta.hpp"
+#include "hub.hpp"
+
+namespace rterm {
+
+/**
+ * Common part of the transfers: the result and a summary line.
+ */
+class file_transfer {
+ public:
+  virtual ~file_transfer() = default;
+
+  virtual void start() = 0;
+
+  /// 0 on success, an errno value from either side, 255 if the agent is lost
+  int status() const {
+    return status_;
+  }
+
+ public:
+  std::function<void()> on_done;
+
+ protected:
+  file_transfer(std::shared_ptr<agent_session> as, std::string remote, std::string local)
+      : as_(std::move(as)), remote_(std::move(remote)), local_(std::move(local)), begin_(std::chrono::steady_clock::now()) {}
+
+  /// @param what names the failed thing for the message, nullptr if it was reported already
+  void finish(int status, const char* what) {
+    if (done_) return;
+    done_ = true;
+    status_ = status;
+    if (status == 0) {
+      double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin_).count();
+      fprintf(stderr, "terminal_server: %s: %s\n", local_.c_str(), summary(s).c_str());
+    } else if (status == 255) {
+      fprintf(stderr, "terminal_server: %s: connection lost, run again to resume\n", as_->name().c_str());
+    } else if (what) {
+      fprintf(stderr, "terminal_server: %s: %s\n", what, strerror(status));
+    }
+    if (on_done) on_done();
+  }
+
+  virtual std::string summary(double seconds) const {
+    char line[128];
+    snprintf(line, sizeof(line), "%llu bytes in %.3f s, %.1f MB/s", (unsigned long long)transferred_, seconds,
+             seconds > 0 ? transferred_ / seconds / 1e6 : 0.0);
+    return line;
+  }
+
+  static int exit_status(const frame& f) {
+    return f.size >= 4 ? (int32_t)get_u32(f.data) : 255;
+  }
+
+ protected:
+  std::shared_ptr<agent_session> as_;
+  std::string remote_;
+  std::string local_;
+  std::chrono::steady_clock::time_point begin_;
+  uint64_t transferred_ = 0;  // this run only, without the resumed part
+  bool done_ = false;
+  int status_ = 0;
+};
+
+/**
+ * Fetch a remote file. It is written to "<local>.part" and renamed when
+ * complete, an existing part file is resumed from its size.
+ */
+class file_download : public file_transfer {
+ public:
+  file_download(std::shared_ptr<agent_session> as, std::string remote, std::string local)
+      : file_transfer(std::move(as), std::move(remote), std::move(local)) {}
+
+  void start() override {
+    int fd = open(part().c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return finish(errno, part().c_str());
+    file_ = std::make_shared<file_handle>(fd);
+    struct stat st {};
+    if (fstat(fd, &st) != 0) return finish(errno, part().c_str());
+    request((uint64_t)st.st_size);
+  }
+
+ private:
+  void request(uint64_t offset) {
+    offset_ = offset;
+    info_ = false;
+    std::string body(8, '\0');
+    put_u64(&body[0], offset);
+    body += remote_;
+    channel_ = as_->open(msg::file_get, body, [this](const frame& f) {
+      on_frame(f);
+    });
+    if (channel_ == 0) finish(255, "");
+  }
+
+  void on_frame(const frame& f) {
+    switch (f.type) {
+      case msg::file_info:
+        if (f.size < 12) return;
+        size_ = get_u64(f.data);
+        mode_ = get_u32(f.data + 8);
+        info_ = true;
+        if (offset_ > size_) {
+          // the part file is not a prefix of this file, start over
+          as_->close_channel(channel_);
+          if (ftruncate(file_->fd, 0) != 0) return finish(errno, part().c_str());
+          request(0);
+        }
+        break;
+      case msg::file_data:
+        if (!store(f.data, f.size)) {
+          as_->close_channel(channel_);
+          finish(errno, part().c_str());
+        }
+        break;
+      case msg::exit: {
+        int status = exit_status(f);
+        if (status != 0) {
+          if (offset_ == 0) unlink(part().c_str());  // nothing worth resuming
+          return finish(status, remote_.c_str());
+        }
+        if (!info_ || offset_ != size_) return finish(EIO, remote_.c_str());
+        if (fchmod(file_->fd, mode_) != 0) return finish(errno, part().c_str());
+        if (rename(part().c_str(), local_.c_str()) != 0) return finish(errno, local_.c_str());
+        finish(0, "");
+        break;
+      }
+      case msg::close:
+        finish(255, "");
+        break;
+      default:
+        break;
+    }
+  }
+
+  bool store(const char* data, size_t size) {
+    while (size > 0) {
+      ssize_t n = pwrite(file_->fd, data, size, (off_t)offset_);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      data += n;
+      size -= (size_t)n;
+      offset_ += (uint64_t)n;
+      transferred_ += (uint64_t)n;
+    }
+    return true;
+  }
+
+  std::string part() const {
+    return local_ + ".part";
+  }
+
+ private:
+  std::shared_ptr<file_handle> file_;
+  uint32_t channel_ = 0;
+  bool info_ = false;
+  uint64_t size_ = 0;
+  uint32_t mode_ = 0;
+  uint64_t offset_ = 0;
+};
+
+/**
+ * Send a local file. The agent reports how much of it it already has, the
+ * rest goes out in chunks straight from the page cache (sendfile), at most
+ * pipe_window bytes ahead of file_ack.
+ */
+class file_upload : public file_transfer {
+ public:
+  file_upload(std::shared_ptr<agent_session> as, std::string local, std::string remote)
+      : file_transfer(std::move(as), std::move(remote), std::move(local)) {}
+
+  void start() override {
+    int fd = open(local_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return finish(errno, local_.c_str());
+    file_ = std::make_shared<file_handle>(fd);
+    struct stat st {};
+    if (fstat(fd, &st) != 0) return finish(errno, local_.c_str());
+    if (!S_ISREG(st.st_mode)) return finish(EISDIR, local_.c_str());
+    size_ = (uint64_t)st.st_size;
+
+    std::string body(12, '\0');
+    put_u64(&body[0], size_);
+    put_u32(&body[8], st.st_mode & 07777);
+    body += remote_;
+    channel_ = as_->open(msg::file_put, body, [this](const frame& f) {
+      on_frame(f);
+    });
+    if (channel_ == 0) finish(255, "");
+  }
+
+ private:
+  void on_frame(const frame& f) {
+    switch (f.type) {
+      case msg::file_info:
+        if (f.size < 8) return;
+        offset_ = std::min(get_u64(f.data), size_);
+        pump();
+        break;
+      case msg::file_ack:
+        if (f.size < 4) return;
+        in_flight_ -= std::min<uint64_t>(get_u32(f.data), in_flight_);
+        pump();
+        break;
+      case msg::exit:
+        finish(exit_status(f), remote_.c_str());
+        break;
+      case msg::close:
+        finish(255, "");
+        break;
+      default:
+        break;
+    }
+  }
+
+  void pump() {
+    struct stat st {};
+    if (offset_ < size_ && fstat(file_->fd, &st) == 0 && (uint64_t)st.st_size < size_) {
+      // it shrank (logrotate's copytruncate), the agent finds it short at file_end
+      size_ = std::max((uint64_t)st.st_size, offset_);
+    }
+    while (offset_ < size_ && in_flight_ + file_chunk_size <= pipe_window) {
+      size_t n = (size_t)std::min<uint64_t>(file_chunk_size, size_ - offset_);
+      as_->send_file(msg::file_data, channel_, file_, (off_t)offset_, n);
+      offset_ += n;
+      in_flight_ += n;
+      transferred_ += n;
+    }
+    if (offset_ == size_ && !ended_) {
+      ended_ = true;
+      as_->send(msg::file_end, channel_);
+    }
+  }
+
+ private:
+  std::shared_ptr<file_handle> file_;
+  uint32_t channel_ = 0;
+  uint64_t size_ = 0;
+  uint64_t offset_ = 0;
+  uint64_t in_flight_ = 0;
+  bool ended_ = false;
+};
+
+/**
+ * Push a local file over an older version on the agent, only the parts which
+ * differ are sent, see delta.hpp. The delta is encoded piecewise, at most
+ * pipe_window bytes ahead of file_ack, with the io_context getting a turn
+ * between pieces.
+ */
+class file_sync : public file_transfer {
+ public:
+  file_sync(asio::io_context& io_context, std::shared_ptr<agent_session> as, std::string local, std::string remote)
+      : file_transfer(std::move(as), std::move(remote), std::move(local)), io_context_(io_context) {}
+
+  ~file_sync() override {
+    if (data_) munmap(data_, size_);
+  }
+
+  void start() override {
+    int fd = open(local_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return finish(errno, local_.c_str());
+    file_handle file(fd);
+    struct stat st {};
+    if (fstat(fd, &st) != 0) return finish(errno, local_.c_str());
+    if (!S_ISREG(st.st_mode)) return finish(EISDIR, local_.c_str());
+    size_ = (size_t)st.st_size;
+    if (size_ > 0) {
+      void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) return finish(errno, local_.c_str());
+      data_ = static_cast<char*>(p);
+      madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+
+    std::string body(12, '\0');
+    put_u64(&body[0], size_);
+    put_u32(&body[8], st.st_mode & 07777);
+    body += remote_;
+    channel_ = as_->open(msg::sync, body, [this](const frame& f) {
+      on_frame(f);
+    });
+    if (channel_ == 0) finish(255, "");
+  }
+
+ private:
+  void on_frame(const frame& f) {
+    switch (f.type) {
+      case msg::file_info:
+        if (f.size < 12) return;
+        received_ += frame_header_size + f.size;
+        basis_size_ = get_u64(f.data);
+        block_size_ = get_u32(f.data + 8);
+        if (block_size_ == 0) return finish(EINVAL, remote_.c_str());
+        blocks_ = (size_t)((basis_size_ + block_size_ - 1) / block_size_);
+        sigs_.reserve(blocks_);
+        signed_();
+        break;
+      case msg::sync_sig:
+        received_ += frame_header_size + f.size;
+        for (size_t i = 0; i + block_sig_size <= f.size; i += block_sig_size) {
+          sigs_.push_back(block_sig{get_u32(f.data + i), get_u64(f.data + i + 4)});
+        }
+        signed_();
+        break;
+      case msg::file_ack:
+        if (f.size < 4) return;
+        in_flight_ -= std::min<uint64_t>(get_u32(f.data), in_flight_);
+        pump();
+        break;
+      case msg::exit:
+        finish(exit_status(f), remote_.c_str());
+        break;
+      case msg::close:
+        finish(255, "");
+        break;
+      default:
+        break;
+    }
+  }
+
+  /// start the delta once all block signatures are in
+  void signed_() {
+    if (encoder_ || sigs_.size() < blocks_) return;
+    encoder_.reset(new delta_encoder(block_size_, basis_size_, std::move(sigs_)));
+    pump();
+  }
+
+  void pump() {
+    if (scheduled_ || done_ || !encoder_) return;
+    if (pos_ < size_ && in_flight_ < pipe_window) {
+      std::string ops;
+      pos_ = encoder_->encode(data_, size_, pos_, ops, file_chunk_size, 16 * file_chunk_size);
+      if (!ops.empty()) {
+        as_->send(pack(msg::sync_delta, channel_, ops));
+        in_flight_ += ops.size();
+        sent_ += frame_header_size + ops.size();
+      }
+      scheduled_ = true;
+      asio::post(io_context_, [this] {
+        scheduled_ = false;
+        pump();
+      });
+      return;
+    }
+    if (pos_ == size_ && !ended_) {
+      ended_ = true;
+      char v[8];
+      put_u64(v, hash64::of(data_, size_));
+      as_->send(pack(msg::file_end, channel_, v, sizeof(v)));
+      sent_ += frame_header_size + sizeof(v);
+    }
+  }
+
+  std::string summary(double seconds) const override {
+    char line[160];
+    snprintf(line, sizeof(line), "%llu bytes, sent %llu, received %llu, %.2f%% of the file in %.3f s", (unsigned long long)size_,
+             (unsigned long long)sent_, (unsigned long long)received_, size_ ? 100.0 * (sent_ + received_) / size_ : 0.0, seconds);
+    return line;
+  }
+
+ private:
+  asio::io_context& io_context_;
+  uint32_t channel_ = 0;
+  char* data_ = nullptr;
+  size_t size_ = 0;
+
+  uint64_t basis_size_ = 0;
+  uint32_t block_size_ = 0;
+  size_t blocks_ = 0;
+  std::vector<block_sig> sigs_;
+  std::unique_ptr<delta_encoder> encoder_;
+
+  size_t pos_ = 0;
+  uint64_t in_flight_ = 0;
+  bool scheduled_ = false;
+  bool ended_ = false;
+  uint64_t sent_ = 0;
+  uint64_t received_ = 0;
+};
+
+}  // namespace rterm
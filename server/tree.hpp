@@ -0,0 +1,372 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "transfer.hpp"
+
+namespace rterm {
+
+/// like mkdir -p, safe to race with itself
+inline bool make_dirs(const std::string& path) {
+  for (size_t p = path.find('/', 1);; p = path.find('/', p + 1)) {
+    std::string dir = path.substr(0, p);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    if (p == std::string::npos) return true;
+  }
+}
+
+/**
+ * The directory rel beneath dir, made if missing, never through a symlink:
+ * what an agent names stays inside dir, whatever links it made before.
+ * -1 and errno if not.
+ */
+inline int open_beneath(int dir, const std::string& rel) {
+  int fd = fcntl(dir, F_DUPFD_CLOEXEC, 0);
+  for (size_t begin = 0; fd >= 0 && begin < rel.size();) {
+    size_t end = std::min(rel.find('/', begin), rel.size());
+    std::string name = rel.substr(begin, end - begin);
+    begin = end + 1;
+    if (name.empty()) continue;
+    int next = openat(fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (next < 0 && errno == ENOENT && (mkdirat(fd, name.c_str(), 0755) == 0 || errno == EEXIST)) {
+      next = openat(fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    int err = errno;
+    close(fd);
+    fd = next;
+    errno = err;
+  }
+  return fd;
+}
+
+/// the directory of the file rel beneath dir as open_beneath, leaf: the name of the file in it
+inline int open_parent_beneath(int dir, const std::string& rel, std::string& leaf) {
+  size_t slash = rel.rfind('/');
+  if (slash == std::string::npos) {
+    leaf = rel;
+    return fcntl(dir, F_DUPFD_CLOEXEC, 0);
+  }
+  leaf = rel.substr(slash + 1);
+  return open_beneath(dir, rel.substr(0, slash));
+}
+
+/// the file rel beneath dir, truncated, for writing; a symlink in its place is not followed either
+inline int create_beneath(int dir, const std::string& rel) {
+  std::string leaf;
+  int parent = open_parent_beneath(dir, rel, leaf);
+  if (parent < 0) return -1;
+  int fd = openat(parent, leaf.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+  int err = errno;
+  close(parent);
+  errno = err;
+  return fd;
+}
+
+/**
+ * Pull a directory tree from an agent (msg::tree_get) into a local directory.
+ *
+ * Small files arrive whole in their tree_entry and are written by a pool of
+ * writers, large ones arrive as file_data and every chunk becomes a pwrite on
+ * the pool. Credit goes back with file_ack once the bytes are on disk, so
+ * slow disks slow down the agent instead of growing memory here. Directory
+ * modes and times are applied at the end, like tar.
+ *
+ * Every path is resolved beneath the local directory one name at a time,
+ * without following symlinks: a link the agent sent (l x -> /home) is made
+ * as it is, but a later entry through it (f x/.ssh/authorized_keys) fails.
+ */
+class tree_pull : public file_transfer {
+ public:
+  tree_pull(asio::io_context& io_context, asio::thread_pool& writers, std::shared_ptr<agent_session> as, std::string remote,
+            std::string local)
+      : file_transfer(std::move(as), std::move(remote), std::move(local)), io_context_(io_context), writers_(writers) {}
+
+  void start() override {
+    if (!make_dirs(local_)) return finish(errno, local_.c_str());
+    int root = open(local_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root < 0) return finish(errno, local_.c_str());
+    root_ = std::make_shared<file_handle>(root);
+    channel_ = as_->open(msg::tree_get, remote_, [this](const frame& f) {
+      on_frame(f);
+    });
+    if (channel_ == 0) finish(255, "");
+  }
+
+ private:
+  struct dir_entry {
+    std::string rel;
+    uint32_t mode;
+    uint64_t mtime;
+  };
+
+  /// a large file while its file_data arrives
+  struct open_file {
+    std::shared_ptr<file_handle> file;
+    std::string path;
+    uint32_t mode;
+    uint64_t mtime;
+    uint64_t remaining;  // bytes still to arrive
+    size_t writing = 0;  // writes queued on the pool
+    int error = 0;
+  };
+
+  void on_frame(const frame& f) {
+    switch (f.type) {
+      case msg::tree_entry:
+        entry(f);
+        break;
+      case msg::file_data:
+        data(f);
+        break;
+      case msg::exec_err:
+        fwrite(f.data, 1, f.size, stderr);
+        break;
+      case msg::exit:
+        cut_short();
+        exit_status_ = exit_status(f);
+        exited_ = true;
+        settle();
+        break;
+      case msg::close:
+        finish(255, "");
+        break;
+      default:
+        break;
+    }
+  }
+
+  void entry(const frame& f) {
+    if (f.size < 25) return protocol_error();
+    cut_short();
+    char kind = f.data[0];
+    uint32_t mode = get_u32(f.data + 1) & 07777;
+    uint64_t size = get_u64(f.data + 5);
+    uint64_t mtime = get_u64(f.data + 13);
+    uint32_t path_size = get_u32(f.data + 21);
+    if (f.size - 25 < path_size) return protocol_error();
+    std::string rel(f.data + 25, path_size);
+    if (!safe(rel)) return protocol_error();
+    std::string path = local_ + "/" + rel;
+    const char* content = f.data + 25 + path_size;
+    size_t inline_size = f.size - 25 - path_size;
+
+    auto root = root_;
+    switch (kind) {
+      case 'd': {
+        int fd = open_beneath(root->fd, rel);
+        if (fd < 0) {
+          failed(path, errno);
+        } else {
+          close(fd);
+          dirs_.push_back(dir_entry{rel, mode, mtime});
+        }
+        ack(f.size);
+        break;
+      }
+      case 'l': {
+        std::string target(content, inline_size);
+        write(f.size, path, [root, rel, target] {
+          std::string leaf;
+          int dir = open_parent_beneath(root->fd, rel, leaf);
+          if (dir < 0) return errno;
+          file_handle parent(dir);
+          unlinkat(dir, leaf.c_str(), 0);
+          return symlinkat(target.c_str(), dir, leaf.c_str()) == 0 ? 0 : errno;
+        });
+        break;
+      }
+      case 'f':
+        ++files_;
+        transferred_ += size;
+        if (inline_size == size) {
+          auto body = std::make_shared<std::string>(content, inline_size);
+          write(f.size, path, [root, rel, body, mode, mtime] {
+            int fd = create_beneath(root->fd, rel);
+            if (fd < 0) return errno;
+            file_handle file(fd);
+            int err = write_all(fd, body->data(), body->size(), 0) ? 0 : errno;
+            return err ? err : finish_file(fd, mode, mtime);
+          });
+          break;
+        }
+        if (inline_size != 0) return protocol_error();
+        // large: open here, the chunks are written at their offsets in parallel
+        {
+          int fd = create_beneath(root->fd, rel);
+          auto of = std::make_shared<open_file>();
+          of->path = path;
+          of->mode = mode;
+          of->mtime = mtime;
+          of->remaining = size;
+          if (fd < 0) {
+            of->error = errno;
+          } else {
+            of->file = std::make_shared<file_handle>(fd);
+          }
+          current_ = of;
+          offset_ = 0;
+        }
+        ack(f.size);
+        break;
+      default:
+        return protocol_error();
+    }
+  }
+
+  void data(const frame& f) {
+    if (!current_ || f.size > current_->remaining) return protocol_error();
+    auto of = current_;
+    of->remaining -= f.size;
+    uint64_t offset = offset_;
+    offset_ += f.size;
+    if (of->remaining == 0) current_ = nullptr;
+
+    if (of->error || !of->file) {
+      ack(f.size);
+      if (of->remaining == 0) failed(of->path, of->error);
+      return;
+    }
+    auto body = std::make_shared<std::string>(f.data, f.size);
+    ++of->writing;
+    write(
+        f.size, of->path,
+        [of, body, offset] {
+          return write_all(of->file->fd, body->data(), body->size(), offset) ? 0 : errno;
+        },
+        [of](int err) {
+          --of->writing;
+          if (err && !of->error) of->error = err;
+          if (of->writing > 0 || of->remaining > 0) return 0;
+          if (of->error) return of->error;
+          return finish_file(of->file->fd, of->mode, of->mtime);
+        });
+  }
+
+  /// the large file came in shorter frames than its entry said: it shrank on the agent while it was sent
+  void cut_short() {
+    if (!current_) return;
+    auto of = std::move(current_);
+    current_ = nullptr;
+    // the agent took credit for all of it
+    ack((size_t)of->remaining);
+    of->remaining = 0;
+    if (!of->error) of->error = EIO;
+    // else the last write to finish reports it
+    if (of->writing == 0) failed(of->path, of->error);
+  }
+
+  /**
+   * Run job on a writer, then done on the io_context, then return the credit.
+   * @param job returns 0 or an errno value, so does done, which gets the one of job
+   */
+  void write(size_t credit, std::string path, std::function<int()> job, std::function<int(int)> done = nullptr) {
+    ++writing_;
+    auto& io_context = io_context_;
+    asio::post(writers_, [this, &io_context, credit, path = std::move(path), job = std::move(job), done = std::move(done)]() mutable {
+      int err = job();
+      asio::post(io_context, [this, credit, err, path = std::move(path), done = std::move(done)] {
+        --writing_;
+        int e = done ? done(err) : err;
+        if (e) failed(path, e);
+        ack(credit);
+        settle();
+      });
+    });
+  }
+
+  void ack(size_t bytes) {
+    if (done_) return;
+    char v[4];
+    put_u32(v, (uint32_t)bytes);
+    as_->send(pack(msg::file_ack, channel_, v, sizeof(v)));
+  }
+
+  /// all written after the agent is done: fix up the directories
+  void settle() {
+    if (!exited_ || writing_ > 0 || done_) return;
+    for (auto it = dirs_.rbegin(); it != dirs_.rend(); ++it) {
+      int fd = open_beneath(root_->fd, it->rel);
+      if (fd < 0) continue;
+      file_handle dir(fd);
+      finish_file(fd, it->mode, it->mtime);
+    }
+    int status = exit_status_;
+    if (status == 0 && failures_ > 0) status = 1;
+    if (status != 0 && status != 255) {
+      fprintf(stderr, "terminal_server: %s: some files were not copied\n", remote_.c_str());
+    }
+    finish(status, nullptr);
+  }
+
+  void failed(const std::string& path, int err) {
+    ++failures_;
+    fprintf(stderr, "terminal_server: %s: %s\n", path.c_str(), strerror(err));
+  }
+
+  void protocol_error() {
+    as_->close_channel(channel_);
+    finish(EPROTO, remote_.c_str());
+  }
+
+  std::string summary(double seconds) const override {
+    char line[128];
+    snprintf(line, sizeof(line), "%zu files, %llu bytes in %.3f s, %.1f MB/s", files_, (unsigned long long)transferred_, seconds,
+             seconds > 0 ? transferred_ / seconds / 1e6 : 0.0);
+    return line;
+  }
+
+  /// on a writer
+  static bool write_all(int fd, const char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+      ssize_t n = pwrite(fd, data, size, (off_t)offset);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      data += n;
+      size -= (size_t)n;
+      offset += (uint64_t)n;
+    }
+    return true;
+  }
+
+  static int finish_file(int fd, uint32_t mode, uint64_t mtime) {
+    timespec times[2] = {{0, UTIME_OMIT}, {(time_t)(mtime / 1000000000), (long)(mtime % 1000000000)}};
+    if (futimens(fd, times) != 0 || fchmod(fd, mode) != 0) return errno;
+    return 0;
+  }
+
+  /// relative, and never above the destination
+  static bool safe(const std::string& rel) {
+    if (rel.empty() || rel[0] == '/') return false;
+    size_t begin = 0;
+    while (begin <= rel.size()) {
+      size_t end = rel.find('/', begin);
+      if (end == std::string::npos) end = rel.size();
+      if (rel.compare(begin, end - begin, "..") == 0) return false;
+      begin = end + 1;
+    }
+    return true;
+  }
+
+ private:
+  asio::io_context& io_context_;
+  asio::thread_pool& writers_;
+  uint32_t channel_ = 0;
+  std::shared_ptr<file_handle> root_;  // the local directory, every path is opened beneath it
+
+  std::shared_ptr<open_file> current_;
+  uint64_t offset_ = 0;
+  std::vector<dir_entry> dirs_;
+  size_t writing_ = 0;
+  size_t files_ = 0;
+  size_t failures_ = 0;
+  bool exited_ = false;
+  int exit_status_ = 0;
+};
+
+}  // namespace rterm